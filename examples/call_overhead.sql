@@ -0,0 +1,83 @@
+-- ----------------------------------------------------------------------
+-- call_overhead.sql
+--
+--	Microbenchmark for the per call overhead of the plprofiler.
+--
+--	Runs a driver that performs :calls invocations of a tiny PL/pgSQL
+--	function, which itself calls two other tiny functions, once with
+--	the profiler disabled and once with local profiling enabled. The
+--	result is the average cost per profiled PL/pgSQL function call.
+--
+--	Run it against two builds of the extension to compare them:
+--
+--		psql -v calls=1000000 -f call_overhead.sql
+--
+--	Results: none recorded yet. The baseline is the build before the
+--	local linestats entry was cached per invocation and call graph
+--	frame, the other one the build with that cache. Until both runs
+--	are listed here, no reduction of the per call overhead is claimed.
+-- ----------------------------------------------------------------------
+
+\if :{?calls}
+\else
+\set calls 200000
+\endif
+
+CREATE EXTENSION IF NOT EXISTS plprofiler;
+
+CREATE OR REPLACE FUNCTION
+bench_leaf(par_i integer)
+RETURNS integer AS
+$$
+BEGIN
+	RETURN par_i + 1;
+END;
+$$
+LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION
+bench_outer(par_i integer)
+RETURNS integer AS
+$$
+BEGIN
+	RETURN bench_leaf(par_i) + bench_leaf(par_i);
+END;
+$$
+LANGUAGE plpgsql;
+
+-- ----
+-- Returns the average time in microseconds per PL/pgSQL function call.
+-- Every bench_outer() invocation accounts for three calls.
+-- ----
+CREATE OR REPLACE FUNCTION
+bench_run(par_calls integer)
+RETURNS float8 AS
+$$
+DECLARE
+	var_start	timestamptz;
+	var_end		timestamptz;
+BEGIN
+	var_start = clock_timestamp();
+	PERFORM sum(bench_outer(g)) FROM generate_series(1, par_calls) g;
+	var_end = clock_timestamp();
+	RETURN extract(epoch FROM var_end - var_start) * 1000000.0
+		   / (par_calls * 3);
+END;
+$$
+LANGUAGE plpgsql;
+
+-- Warm up the PL/pgSQL function cache and the buffer cache.
+SELECT pl_profiler_set_enabled_local(false);
+SELECT bench_run(1000);
+
+-- The profiler state is evaluated at transaction start, so every
+-- step below must run in its own transaction.
+SELECT bench_run(:calls) AS us_off \gset
+SELECT pl_profiler_set_enabled_local(true);
+SELECT bench_run(:calls) AS us_on \gset
+SELECT pl_profiler_set_enabled_local(false);
+SELECT pl_profiler_reset_local();
+
+SELECT round(:us_off::numeric, 3) AS us_per_call_disabled,
+	   round(:us_on::numeric, 3) AS us_per_call_enabled,
+	   round((:us_on - :us_off)::numeric, 3) AS us_profiler_overhead;
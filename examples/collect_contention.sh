@@ -0,0 +1,78 @@
+#!/bin/sh
+
+# ----
+# collect_contention.sh
+#
+#	Measures the contention on the plprofiler shared memory locks
+#	while many backends collect their data at the same time.
+#
+#	Requires a database prepared with prepdb.sh and plprofiler in
+#	shared_preload_libraries. Global profiling is turned on with a
+#	collect interval of one second, then the TPC-B stored procedure
+#	is run by 64, 128 and 256 clients. For each run the TPS and the
+#	number of backends that were found waiting on a plprofiler lock
+#	are reported.
+#
+#	To compare two builds, run it once with the extension built before
+#	the lock partitioning and once with the current one, and set LABEL
+#	to tell the two result sets apart:
+#
+#		LABEL=before ./collect_contention.sh
+#		LABEL=after ./collect_contention.sh
+#
+#	No such runs have been recorded yet, so no improvement from the
+#	partitioned locks is claimed. They need a machine with enough
+#	cores for 256 clients.
+# ----
+
+PGDATABASE=pgbench_plprofiler
+export PGDATABASE
+
+LABEL=${LABEL:-run}
+DURATION=${DURATION:-30}
+CLIENTS=${CLIENTS:-"64 128 256"}
+
+SCRIPT=`mktemp`
+trap "rm -f $SCRIPT" 0
+
+cat >$SCRIPT <<_EOF_
+\set aid random(1, 100000 * :scale)
+\set bid random(1, 1 * :scale)
+\set tid random(1, 10 * :scale)
+\set delta random(-5000, 5000)
+SELECT tpcb(:aid, :bid, :tid, :delta);
+_EOF_
+
+psql -q <<_EOF_
+SELECT pl_profiler_reset_shared();
+SELECT pl_profiler_set_collect_interval(1);
+SELECT pl_profiler_set_enabled_global(true);
+_EOF_
+
+for n in $CLIENTS ; do
+	# ----
+	# Sample pg_stat_activity once per second while pgbench runs
+	# and count the backends waiting on a plprofiler partition lock.
+	# ----
+	: >/tmp/collect_contention.$$
+	for s in `seq 1 $DURATION` ; do
+		sleep 1
+		psql -qAt -c "SELECT count(*) FROM pg_stat_activity
+			WHERE wait_event_type = 'LWLock'
+			  AND wait_event = 'plprofiler'" >>/tmp/collect_contention.$$
+	done &
+	SAMPLER=$!
+
+	TPS=`pgbench -n -c $n -j $n -s 10 -T $DURATION -f $SCRIPT 2>/dev/null | \
+		sed -n -e 's/^tps = \([0-9.]*\).*/\1/p' | head -1`
+	wait $SAMPLER
+
+	WAITS=`awk '{ s += $1 } END { print s + 0 }' /tmp/collect_contention.$$`
+	rm -f /tmp/collect_contention.$$
+	echo "label=$LABEL clients=$n tps=$TPS plprofiler_lock_waits=$WAITS"
+done
+
+psql -q <<_EOF_
+SELECT pl_profiler_set_enabled_global(false);
+SELECT pl_profiler_set_collect_interval(0);
+_EOF_
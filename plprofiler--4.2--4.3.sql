@@ -0,0 +1,465 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION plprofiler UPDATE TO '4.3'" to load this file. \quit
+
+-- Replace pl_profiler_version()
+CREATE OR REPLACE FUNCTION pl_profiler_version()
+RETURNS integer
+AS $$
+BEGIN
+	RETURN 40300;
+END;
+$$ STRICT LANGUAGE plpgsql;
+ALTER FUNCTION pl_profiler_version() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_version() TO public;
+
+CREATE OR REPLACE FUNCTION pl_profiler_versionstr()
+RETURNS text
+AS $$
+BEGIN
+	RETURN '4.3';
+END;
+$$ STRICT LANGUAGE plpgsql;
+ALTER FUNCTION pl_profiler_versionstr() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_versionstr() TO public;
+
+-- Per statement counters for plprofiler.statement_slots
+CREATE FUNCTION pl_profiler_stmtstats_local(
+    OUT func_oid oid,
+    OUT stmt_id int8,
+    OUT line_number int8,
+    OUT exec_count int8,
+    OUT total_time int8,
+    OUT longest_time int8,
+    OUT total_time_ns int8,
+    OUT longest_time_ns int8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_stmtstats_local() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_stmtstats_local() TO public;
+
+CREATE FUNCTION pl_profiler_stmtstats_shared(
+    OUT func_oid oid,
+    OUT stmt_id int8,
+    OUT line_number int8,
+    OUT exec_count int8,
+    OUT total_time int8,
+    OUT longest_time int8,
+    OUT total_time_ns int8,
+    OUT longest_time_ns int8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_stmtstats_shared() OWNER TO plprofiler;
+
+-- Timings are kept in nanoseconds now. The result sets of the
+-- linestats and callgraph functions get additional nanosecond columns.
+DROP FUNCTION pl_profiler_linestats_local();
+CREATE FUNCTION pl_profiler_linestats_local(
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT exec_count int8,
+    OUT total_time int8,
+    OUT longest_time int8,
+    OUT total_time_ns int8,
+    OUT longest_time_ns int8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_linestats_local() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_linestats_local() TO public;
+
+DROP FUNCTION pl_profiler_linestats_shared();
+CREATE FUNCTION pl_profiler_linestats_shared(
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT exec_count int8,
+    OUT total_time int8,
+    OUT longest_time int8,
+    OUT total_time_ns int8,
+    OUT longest_time_ns int8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_linestats_shared() OWNER TO plprofiler;
+
+DROP FUNCTION pl_profiler_callgraph_local();
+CREATE FUNCTION pl_profiler_callgraph_local(
+    OUT stack oid[],
+    OUT call_count int8,
+    OUT us_total int8,
+    OUT us_children int8,
+    OUT us_self int8,
+    OUT ns_total int8,
+    OUT ns_children int8,
+    OUT ns_self int8,
+    OUT ns_total_error int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_callgraph_local() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_callgraph_local() TO public;
+
+DROP FUNCTION pl_profiler_callgraph_shared();
+CREATE FUNCTION pl_profiler_callgraph_shared(
+    OUT stack oid[],
+    OUT call_count int8,
+    OUT us_total int8,
+    OUT us_children int8,
+    OUT us_self int8,
+    OUT ns_total int8,
+    OUT ns_children int8,
+    OUT ns_self int8,
+    OUT ns_total_error int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_callgraph_shared() OWNER TO plprofiler;
+
+-- Sampling of top level calls (plprofiler.sample_rate)
+CREATE FUNCTION pl_profiler_sampling_local(
+    OUT total_calls int8,
+    OUT sampled_calls int8,
+    OUT sampling_interval int4
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_sampling_local() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_sampling_local() TO public;
+
+CREATE FUNCTION pl_profiler_sampling_shared(
+    OUT total_calls int8,
+    OUT sampled_calls int8,
+    OUT sampling_interval int4
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_sampling_shared() OWNER TO plprofiler;
+
+ALTER TABLE pl_profiler_saved ADD COLUMN s_total_calls int8;
+ALTER TABLE pl_profiler_saved ADD COLUMN s_sampled_calls int8;
+ALTER TABLE pl_profiler_saved ADD COLUMN s_sampling_interval int4;
+
+-- Latency percentiles (plprofiler.histograms)
+CREATE FUNCTION pl_profiler_linestats_percentiles_local(
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT p50 float8,
+    OUT p90 float8,
+    OUT p99 float8,
+    OUT p999 float8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_linestats_percentiles_local() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_linestats_percentiles_local() TO public;
+
+CREATE FUNCTION pl_profiler_linestats_percentiles_shared(
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT p50 float8,
+    OUT p90 float8,
+    OUT p99 float8,
+    OUT p999 float8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_linestats_percentiles_shared() OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_callgraph_percentiles_local(
+    OUT stack oid[],
+    OUT p50 float8,
+    OUT p90 float8,
+    OUT p99 float8,
+    OUT p999 float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_callgraph_percentiles_local() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_callgraph_percentiles_local() TO public;
+
+CREATE FUNCTION pl_profiler_callgraph_percentiles_shared(
+    OUT stack oid[],
+    OUT p50 float8,
+    OUT p90 float8,
+    OUT p99 float8,
+    OUT p999 float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_callgraph_percentiles_shared() OWNER TO plprofiler;
+
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_p50 float8;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_p90 float8;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_p99 float8;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_p999 float8;
+
+-- Buffer and WAL usage per source line (plprofiler.track_io)
+CREATE FUNCTION pl_profiler_linestats_io_local(
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT shared_blks_hit int8,
+    OUT shared_blks_read int8,
+    OUT shared_blks_dirtied int8,
+    OUT shared_blks_written int8,
+    OUT temp_blks_read int8,
+    OUT temp_blks_written int8,
+    OUT wal_records int8,
+    OUT wal_bytes int8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_linestats_io_local() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_linestats_io_local() TO public;
+
+CREATE FUNCTION pl_profiler_linestats_io_shared(
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT shared_blks_hit int8,
+    OUT shared_blks_read int8,
+    OUT shared_blks_dirtied int8,
+    OUT shared_blks_written int8,
+    OUT temp_blks_read int8,
+    OUT temp_blks_written int8,
+    OUT wal_records int8,
+    OUT wal_bytes int8,
+    OUT func_version xid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_linestats_io_shared() OWNER TO plprofiler;
+
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_shared_blks_hit bigint;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_shared_blks_read bigint;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_shared_blks_dirtied bigint;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_shared_blks_written bigint;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_temp_blks_read bigint;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_temp_blks_written bigint;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_wal_records bigint;
+ALTER TABLE pl_profiler_saved_linestats ADD COLUMN l_wal_bytes bigint;
+
+-- Collect worker (plprofiler.collect_worker)
+CREATE FUNCTION pl_profiler_collect_worker_stats(
+    OUT worker_pid int4,
+    OUT rings_in_use int4,
+    OUT records_queued int8,
+    OUT records_merged int8,
+    OUT records_dropped int8,
+    OUT collects_deferred int8,
+    OUT collects_direct int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_collect_worker_stats() OWNER TO plprofiler;
+
+-- Usage of the shared storage (plprofiler.shared_storage)
+CREATE FUNCTION pl_profiler_shared_usage(
+    OUT storage text,
+    OUT functions int8,
+    OUT callgraphs int8,
+    OUT lines int8,
+    OUT histograms int8,
+    OUT io_lines int8,
+    OUT bytes_used int8,
+    OUT bytes_limit int8,
+    OUT callgraphs_evicted int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_shared_usage() OWNER TO plprofiler;
+
+-- Remove the shared stats of replaced or dropped function versions
+CREATE FUNCTION pl_profiler_retire_versions()
+RETURNS int8
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_retire_versions() OWNER TO plprofiler;
+
+-- Compact the fixed shared counter pools
+CREATE FUNCTION pl_profiler_compact_shared()
+RETURNS int8
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_compact_shared() OWNER TO plprofiler;
+
+-- Interval history kept by the collect worker (plprofiler.collect_worker)
+CREATE FUNCTION pl_profiler_history_linestats(
+    from_time timestamptz DEFAULT '-infinity',
+    to_time timestamptz DEFAULT 'infinity',
+    OUT interval_start timestamptz,
+    OUT interval_end timestamptz,
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT exec_count int8,
+    OUT total_time int8,
+    OUT longest_time int8,
+    OUT func_version xid)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_history_linestats(timestamptz, timestamptz)
+    OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_history_callgraph(
+    from_time timestamptz DEFAULT '-infinity',
+    to_time timestamptz DEFAULT 'infinity',
+    OUT interval_start timestamptz,
+    OUT interval_end timestamptz,
+    OUT stack oid[],
+    OUT call_count int8,
+    OUT us_total int8,
+    OUT us_self int8,
+    OUT us_max int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_history_callgraph(timestamptz, timestamptz)
+    OWNER TO plprofiler;
+
+-- Reset the shared data of the current database only
+CREATE FUNCTION pl_profiler_reset_shared_database()
+RETURNS void
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_reset_shared_database() OWNER TO plprofiler;
+
+-- The shared data of all databases, in one pass over the shared tables
+CREATE FUNCTION pl_profiler_linestats_all_databases(
+    OUT db_oid oid,
+    OUT func_oid oid,
+    OUT line_number int8,
+    OUT exec_count int8,
+    OUT total_time int8,
+    OUT longest_time int8,
+    OUT total_time_ns int8,
+    OUT longest_time_ns int8,
+    OUT func_version xid,
+    OUT func_schema name,
+    OUT func_name name)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_linestats_all_databases() OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_callgraph_all_databases(
+    OUT db_oid oid,
+    OUT stack oid[],
+    OUT stack_names text[],
+    OUT call_count int8,
+    OUT us_total int8,
+    OUT us_children int8,
+    OUT us_self int8,
+    OUT ns_total int8,
+    OUT ns_children int8,
+    OUT ns_self int8,
+    OUT ns_total_error int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C ROWS 1000000;
+ALTER FUNCTION pl_profiler_callgraph_all_databases() OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_func_oids_all_databases(
+    OUT db_oid oid,
+    OUT func_oid oid,
+    OUT func_schema name,
+    OUT func_name name)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_func_oids_all_databases() OWNER TO plprofiler;
+
+-- The highest profiling level of all backends
+CREATE FUNCTION pl_profiler_set_level_global(level text)
+RETURNS text
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_set_level_global(text) OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_get_level_global()
+RETURNS text
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_get_level_global() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_get_level_global() TO public;
+
+-- Include/exclude filters on functions, schemas and roles
+CREATE FUNCTION pl_profiler_add_filter(kind text, target oid,
+                                       exclude bool DEFAULT false)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_add_filter(text, oid, bool) OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_remove_filter(kind text, target oid)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_remove_filter(text, oid) OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_clear_filters()
+RETURNS void
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_clear_filters() OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_filters(
+    OUT kind text,
+    OUT db_oid oid,
+    OUT target oid,
+    OUT exclude bool)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_filters() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_filters() TO public;
+
+-- Enable profiling for sets of PIDs, roles, databases and applications
+CREATE FUNCTION pl_profiler_enable_target(kind text, value text)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_enable_target(text, text) OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_disable_target(kind text, value text)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_disable_target(text, text) OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_clear_targets()
+RETURNS void
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_clear_targets() OWNER TO plprofiler;
+
+CREATE FUNCTION pl_profiler_targets(
+    OUT kind text,
+    OUT value text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+STRICT LANGUAGE C;
+ALTER FUNCTION pl_profiler_targets() OWNER TO plprofiler;
+GRANT EXECUTE ON FUNCTION pl_profiler_targets() TO public;
@@ -38,51 +38,441 @@ static void profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt);
 /**********************************************************************
  * Local function prototypes
  **********************************************************************/
+static Size profiler_state_size(void);
 static Size profiler_shmem_size(void);
 static void profiler_shmem_startup(void);
 #if PG_VERSION_NUM >= 150000
 static void profiler_shmem_request(void);
 #endif
+static void profiler_shared_init(void *ptr);
+static void profiler_shared_reset(void);
+static void profiler_reset_database(Oid db_oid);
+static uint64 profiler_reset_generation(Oid db_oid);
+static bool profiler_entry_stale(Oid db_oid, uint64 generation);
+static int64 profiler_purge_stale(void);
+static bool profiler_purge_pending(void);
+static void callgraph_shared_reinit(callGraphEntry *cge2);
+static void linestats_shared_reinit(linestatsSharedEntry *lse2);
+static void profiler_shmem_shutdown(int code, Datum arg);
+static void profiler_state_save(void);
+static void profiler_state_scan_begin(profilerSharedScan *scan,
+									  bool callgraph, bool lock);
+static bool profiler_state_save_functions(FILE *file, bool lock);
+static bool profiler_state_save_callgraphs(FILE *file, bool lock);
+static void profiler_state_load(void);
+static void profiler_history_snapshot(void);
+static void profiler_history_snap_lines(TimestampTz start, TimestampTz end,
+										bool first);
+static void profiler_history_snap_callgraphs(TimestampTz start,
+											 TimestampTz end, bool first);
+static int profiler_history_top_cmp(const void *a, const void *b);
+static void profiler_history_prune(void);
+static void profiler_history_put_line(const linestatsHashKey *key, int line,
+									  TimestampTz start, TimestampTz end,
+									  int64 exec_count, int64 ns_total,
+									  int64 ns_max);
+static void profiler_history_put_callgraph(profilerHistoryCallgraph *cg,
+										   TimestampTz start,
+										   TimestampTz end);
+static bool profiler_history_read(pg_atomic_uint64 *seq, const void *row,
+								  void *copy, Size size, uint64 n);
+static profilerSharedState *profiler_shared(void);
+#ifdef PL_HAVE_DYNAMIC
+static void profiler_dynamic_attach(profilerSharedState *plpss);
+static bool profiler_dynamic_room(Size size);
+static dsa_pointer profiler_dsa_alloc(Size size, bool *overflow,
+									  const char *what);
+static uint32 line_dsh_hash(const void *key, size_t keysize, void *arg);
+static int line_dsh_compare(const void *key1, const void *key2,
+							size_t keysize, void *arg);
+static uint32 callgraph_dsh_hash(const void *key, size_t keysize, void *arg);
+static int callgraph_dsh_compare(const void *key1, const void *key2,
+								 size_t keysize, void *arg);
+static bool callgraph_collect_dynamic(callGraphKey *cgkey, callGraphNode *cgn,
+									  double scale);
+static bool linestats_collect_dynamic(linestatsEntry *lse1, double scale);
+static void callgraph_dynamic_free(callGraphEntry *cge2);
+static void linestats_dynamic_free(linestatsSharedEntry *lse2);
+#endif
 static void init_hash_tables(void);
+static void linestats_local_grow(linestatsEntry *entry, int line_count);
+static linestatsEntry *linestats_local_entry(Oid func_oid,
+						TransactionId fn_version, int stmt_count);
+static linestatsEntry *profiler_info_entry(profilerInfo *profiler_info);
+static profilerInfo *profiler_info_alloc(Oid func_oid, int line_count,
+										 bool stmt_slots);
+static void profiler_info_release(profilerInfo *profiler_info);
+static void profiler_info_unwind(profilerInfo *profiler_info);
 static char *find_source(Oid oid, HeapTuple *tup, char **funcName);
 static int count_source_lines(const char *src);
 static uint32 line_hash_fn(const void *key, Size keysize);
 static int line_match_fn(const void *key1, const void *key2, Size keysize);
 static uint32 callgraph_hash_fn(const void *key, Size keysize);
 static int callgraph_match_fn(const void *key1, const void *key2, Size keysize);
-static void callgraph_push(Oid func_oid);
+static uint32 callgraph_node_hash_fn(const void *key, Size keysize);
+static int callgraph_node_match_fn(const void *key1, const void *key2,
+								   Size keysize);
+static callGraphNode *callgraph_intern(callGraphNode *parent, Oid func_oid);
+static void callgraph_reintern_stack(void);
+static void callgraph_node_key(callGraphNode *node, callGraphKey *key);
+static void callgraph_push(Oid func_oid, profilerInfo *profiler_info);
 static void callgraph_pop_one(void);
 static void callgraph_pop(Oid func_oid);
 static void callgraph_check(Oid func_oid);
-static void callgraph_collect(uint64 us_elapsed, uint64 us_self,
-							  uint64 us_children);
-static int32 profiler_collect_data(void);
+static int32 profiler_collect_data(bool direct);
+static bool callgraph_collect_one(callGraphKey *cgkey, callGraphNode *cgn,
+								  double scale, bool evict);
+static bool callgraph_collect_try(callGraphKey *cgkey, callGraphNode *cgn,
+								  double scale);
+static bool callgraph_evict(void);
+static bool callgraph_evict_scan(void);
+static void callgraph_evict_cleanup(int code, Datum arg);
+static int callgraph_weight_cmp(const void *a, const void *b);
+static bool linestats_collect_one(linestatsEntry *lse1, double scale);
+static void callgraph_merge(callGraphEntry *cge2, callGraphNode *cgn,
+							double scale);
+static void callgraph_node_clear(callGraphNode *cgn);
+static void linestats_merge(linestatsSharedEntry *lse2, linestatsEntry *lse1,
+							double scale);
+static void linestats_clear_dirty(linestatsEntry *lse1);
+static bool profiler_ring_attach(void);
+static void profiler_ring_detach(int code, Datum arg);
+static char *profiler_ring_reserve(Size len);
+static void profiler_ring_publish(int nrecords);
+static bool profiler_ring_put_callgraph(callGraphNode *cgn, double scale,
+										int *nrecords);
+static bool profiler_ring_put_linestats(linestatsEntry *lse1, double scale,
+										int *nrecords);
+static void profiler_worker_sigterm(SIGNAL_ARGS);
+static void profiler_worker_sighup(SIGNAL_ARGS);
+static void profiler_worker_exit(int code, Datum arg);
+static int profiler_worker_drain(MemoryContext mcxt);
+static bool profiler_worker_merge(profilerRingHeader *hdr);
+static void linestats_shared_copy(linestatsSharedEntry *sentry,
+								  linestatsEntry *copy);
+static void linestats_copy_free(linestatsEntry *copy);
+static void callgraph_shared_copy(callGraphEntry *cge2, callGraphCopy *copy);
+static linestatsEntry *linestats_shared_snapshot(bool all_databases,
+												 int *count);
+static linestatsEntry *linestats_scan_snapshot(profilerSharedScan *scan,
+											   bool all_databases,
+											   int *count);
+static void linestats_snapshot_free(linestatsEntry *entries, int count);
+static callGraphCopy *callgraph_shared_snapshot(bool all_databases,
+												int *count);
+static callGraphCopy *callgraph_scan_snapshot(profilerSharedScan *scan,
+											  bool all_databases,
+											  int *count);
+static HTAB *profiler_function_names(void);
+static int func_oids_unique(Datum *oids, int count);
+static int func_oids_cmp(const void *a, const void *b);
+static void profiler_lock_partitions(int base, LWLockMode mode);
+static void profiler_unlock_partitions(int base);
+static void profiler_scan_begin(profilerSharedScan *scan, bool callgraph,
+								bool exclusive);
+static void *profiler_scan_next(profilerSharedScan *scan);
+static void profiler_scan_remove(profilerSharedScan *scan, void *entry);
+static void profiler_scan_end(profilerSharedScan *scan);
+static int profiler_pool_alloc(profilerPoolFree *pool_free,
+							   pg_atomic_uint32 *used, int limit, int count);
+static void profiler_pool_free(profilerPoolFree *pool_free, int start,
+							   int count);
+static void profiler_pool_clear(profilerPoolFree *pool_free);
+static int profiler_pool_nfree(profilerPoolFree *pool_free);
+static int profiler_pool_class(int count);
+static void profiler_pool_link(profilerPoolFree *pool_free, int slot);
+static void profiler_compact_request(void);
+static int64 profiler_pool_compact(profilerPoolSlice *slices, int nslices,
+								   char *base, Size elem_size,
+								   profilerPoolFree *pool_free,
+								   pg_atomic_uint32 *used);
+static int profiler_slice_cmp(const void *a, const void *b);
+static void profiler_pool_add_slice(profilerPoolSlice **slices,
+									int *nslices, int *size, void **ref,
+									char *base, Size elem_size, int count);
+static int64 profiler_compact(void);
+static void linestats_fixed_free(linestatsSharedEntry *lse2);
+static void callgraph_fixed_free(callGraphEntry *cge2);
+static linestatsSharedLine *profiler_lines_alloc(int count);
+static void profiler_lines_init(linestatsSharedLine *line_info, int count);
+static void linestats_by_line(linestatsEntry *entry,
+							  linestatsLineInfo *by_line);
+static void linestats_put_lines(Tuplestorestate *tupstore, TupleDesc tupdesc,
+								const linestatsHashKey *key,
+								linestatsLineInfo *line_info,
+								int line_count, double scale);
+static void linestats_put_lines_all(Tuplestorestate *tupstore,
+									TupleDesc tupdesc, linestatsEntry *entry,
+									linestatsLineInfo *line_info,
+									int line_count);
+static void stmtstats_put_stmts(Tuplestorestate *tupstore, TupleDesc tupdesc,
+								const linestatsHashKey *key,
+								linestatsLineInfo *line_info,
+								int stmt_count, double scale);
 static void profiler_xact_callback(XactEvent event, void *arg);
+static bool profiler_tsc_usable(void);
+static bool profiler_sample(void);
+static void profiler_filter_refresh(profilerSharedState *plpss);
+static bool profiler_filter_function(Oid fn_oid);
+static int profiler_filter_kind(text *kind);
+static bool profiler_target_match(profilerSharedState *plpss);
+static void profiler_target_parse(text *kind, text *value,
+								  profilerEnableTarget *target);
+static void profiler_sample_timer(void);
+static void profiler_sample_fold(void);
+static pg_atomic_uint32 *profiler_hist_alloc(int count);
+static void profiler_hist_init(pg_atomic_uint32 *hist, int count);
+static uint64 profiler_hist_percentile(const uint32 *hist, double q,
+									   int64 ns_max);
+static void percentiles_put_lines(Tuplestorestate *tupstore,
+								  TupleDesc tupdesc,
+								  const linestatsHashKey *key,
+								  const uint32 *hist,
+								  const linestatsLineInfo *line_info,
+								  int line_count);
+static void percentiles_put_stack(Tuplestorestate *tupstore,
+								  TupleDesc tupdesc, Datum *funcdefs,
+								  int depth, const uint32 *hist);
+static void hist_by_line(linestatsEntry *entry, const uint32 *hist,
+						 uint32 *by_line_hist);
+static pg_atomic_uint64 *profiler_io_alloc(int count);
+static void profiler_io_init(pg_atomic_uint64 *io, int count);
+static void profiler_io_push(profilerLineInfo *line_info);
+static void io_by_line(linestatsEntry *entry, const linestatsIoInfo *io,
+					   linestatsIoInfo *by_line_io);
+static void io_put_lines(Tuplestorestate *tupstore, TupleDesc tupdesc,
+						 const linestatsHashKey *key,
+						 const linestatsIoInfo *io,
+						 const linestatsLineInfo *line_info, int line_count,
+						 double scale);
+static void profiler_sampling_start(void);
+static void profiler_sampling_stop(void);
+static double profiler_sample_scale(void);
+static void profiler_choose_clock(void);
 
 /**********************************************************************
  * Local variables
  **********************************************************************/
 
 static MemoryContext	profiler_mcxt = NULL;
+static MemoryContext	profiler_info_mcxt = NULL;
+static profilerInfo	   *profiler_info_free[PL_INFO_SIZE_CLASSES];
+static profilerInfo	   *profiler_info_live = NULL;
 static HTAB			   *functions_hash = NULL;
 static HTAB			   *callgraph_hash = NULL;
 static profilerSharedState *profiler_shared_state = NULL;
 static HTAB			   *functions_shared = NULL;
 static HTAB			   *callgraph_shared = NULL;
+static int				profiler_shared_storage = PL_STORAGE_FIXED;
+static int				profiler_dynamic_max_memory = 256;
+static bool				profiler_xact_registered = false;
 
 static bool				profiler_first_call_in_xact = true;
 static bool				profiler_active = false;
 static bool				profiler_enabled_local = false;
+static int				profiler_level = PL_LEVEL_STATEMENT;
+static bool				profiler_statements = false;
+
+/*
+ * The per backend copy of the include/exclude filters. filter_hash
+ * caches the decision per function until the filters change.
+ */
+static profilerFilter	filter_local[PL_MAX_FILTERS];
+static int				filter_count = 0;
+static uint32			filter_generation = 0;
+static bool				filter_functions = false;
+static bool				filter_role_ok = true;
+static HTAB			   *filter_hash = NULL;
+
+/*
+ * The result of matching this backend against the enable table and
+ * what it was evaluated for.
+ */
+static bool				target_match = false;
+static uint32			target_generation = 0;
+static Oid				target_user = InvalidOid;
+static char				target_appname[NAMEDATALEN];
 static int				profiler_max_functions = PL_MIN_FUNCTIONS;
 static int				profiler_max_lines = PL_MIN_LINES;
 static int				profiler_max_callgraph = PL_MIN_CALLGRAPH;
+static int				profiler_max_histograms = 0;
+static bool				profiler_histograms = false;
+static int				profiler_max_io_lines = 0;
+static bool				profiler_track_io = false;
+static bool				profiler_callgraph_evict = false;
+static bool				profiler_save = true;
+static int				profiler_save_interval = 0;
+static int				profiler_history_lines = 0;
+static int				profiler_history_callgraphs = 0;
+static int				profiler_history_top = 10;
+
+/* The counters at the last history snapshot, kept by the collect worker */
+static MemoryContext	history_mcxt = NULL;
+static HTAB			   *history_lines_base = NULL;
+static HTAB			   *history_cg_base = NULL;
+static uint32			history_generation = 0;
+static TimestampTz		history_last = 0;
+static bool				profiler_collect_worker = false;
+static int				profiler_collect_rings = 64;
+static int				profiler_ring_size = 64;
+static bool				profiler_stmt_slots = false;
+static int				profiler_clock_source = PL_CLOCK_SYSTEM;
+static bool				profiler_use_tsc = false;
+static bool				profiler_tsc_checked = false;
+static double			profiler_tsc_ns_per_tick = 0.0;
+static double			profiler_sample_rate = 1.0;
+static uint64			profiler_prng_state = 0;
+static int64			profiler_total_calls = 0;
+static int				profiler_sampled_interval = 0;
+static bool				profiler_sampling_mixed = false;
+static int64			profiler_sampled_calls = 0;
+
+/*
+ * Invocations in a call tree, that was not selected for sampling, get
+ * a pointer into this array as plugin_info. The offset is their depth
+ * in the unsampled call tree.
+ */
+static char				unsampled_frames[PL_MAX_STACK_DEPTH];
+static int				unsampled_depth = 0;
+static TimestampTz		unsampled_stmt_start = 0;
+
+/*
+ * Statistical sampling mode. The sample timer fires every
+ * plprofiler.sampling_interval milliseconds and only counts a tick.
+ * The hooks fold the ticks since the last hook into the call stack
+ * and current statements, which haven't changed in between.
+ */
+static int				profiler_sampling_interval = 0;
+static bool				profiler_sampling = false;
+static volatile sig_atomic_t sample_timer_armed = false;
+static TimeoutId		sample_timeout_id;
+static bool				sample_timeout_registered = false;
+static volatile sig_atomic_t sample_ticks = 0;
+static sig_atomic_t		sample_ticks_folded = 0;
+
+/*
+ * Buffer and WAL usage tracking (plprofiler.track_io). Statements nest,
+ * so the snapshots taken in stmt_beg are kept on a stack. A statement
+ * remembers its position there and truncates the stack in stmt_end,
+ * which also discards snapshots of statements left by an exception.
+ */
+static bool				profiler_io = false;
+static linestatsIoInfo *io_stack = NULL;
+static int				io_stack_size = 0;
+static int				io_stack_pt = 0;
+
+/*
+ * Collect pipeline (plprofiler.collect_worker). A backend takes one of
+ * the rings the first time it collects and keeps it until it exits.
+ * profiler_ring_head is the end of the records written, but not yet
+ * published to the worker.
+ */
+static profilerRing	   *profiler_ring = NULL;
+static uint64			profiler_ring_head = 0;
+static bool				profiler_ring_exit_registered = false;
+static volatile sig_atomic_t worker_got_sigterm = false;
+static volatile sig_atomic_t worker_got_sighup = false;
+
+/*
+ * Dynamic shared storage (plprofiler.shared_storage = dynamic). The
+ * shared tables are dshash tables in a DSA area, that is created by
+ * the first backend needing it and grows up to
+ * plprofiler.dynamic_max_memory. The entries hold dsa_pointers to
+ * their counter arrays instead of pointers into the fixed pools.
+ */
+#ifdef PL_HAVE_DYNAMIC
+static dsa_area		   *profiler_dsa = NULL;
+static dshash_table	   *functions_dsh = NULL;
+static dshash_table	   *callgraph_dsh = NULL;
+
+static dshash_parameters functions_dsh_params = {
+	.key_size = sizeof(linestatsHashKey),
+	.entry_size = sizeof(linestatsSharedEntry),
+	.compare_function = line_dsh_compare,
+	.hash_function = line_dsh_hash,
+#if PG_VERSION_NUM >= 170000
+	.copy_function = dshash_memcpy,
+#endif
+};
+
+static dshash_parameters callgraph_dsh_params = {
+	.key_size = sizeof(callGraphKey),
+	.entry_size = sizeof(callGraphEntry),
+	.compare_function = callgraph_dsh_compare,
+	.hash_function = callgraph_dsh_hash,
+#if PG_VERSION_NUM >= 170000
+	.copy_function = dshash_memcpy,
+#endif
+};
+
+#define PL_DYNAMIC	(profiler_shared_storage == PL_STORAGE_DYNAMIC)
+#define PL_SHARED_PTR(_e, _f) \
+	(PL_DYNAMIC ? dsa_get_address(profiler_dsa, (_e)->_f##_dp) : \
+				  (void *) (_e)->_f)
+#else
+#define PL_DYNAMIC	false
+#define PL_SHARED_PTR(_e, _f)	((void *) (_e)->_f)
+#endif
 
-static callGraphKey		graph_stack;
-static instr_time		graph_stack_entry[PL_MAX_STACK_DEPTH];
-static uint64			graph_stack_child_time[PL_MAX_STACK_DEPTH];
+/* Both kinds of shared entries carry their database and generation. */
+#define PL_ENTRY_STALE(_e) \
+	profiler_entry_stale((_e)->key.db_oid, (_e)->generation)
+
+/* The fixed counter pools are not allocated in dynamic mode. */
+#define PL_POOL_LINES		(PL_DYNAMIC ? 0 : profiler_max_lines)
+#define PL_POOL_HISTOGRAMS	(PL_DYNAMIC ? 0 : profiler_max_histograms)
+#define PL_POOL_IO_LINES	(PL_DYNAMIC ? 0 : profiler_max_io_lines)
+
+/*
+ * The shared histogram pool follows the shared per line counters,
+ * the pool of I/O counters follows the histograms and the collect
+ * rings follow the I/O counters.
+ */
+#define PL_HIST_POOL(_plpss) \
+	((pg_atomic_uint32 *) &((_plpss)->line_info[PL_POOL_LINES]))
+#define PL_IO_POOL(_plpss) \
+	((pg_atomic_uint64 *) (PL_HIST_POOL(_plpss) + \
+						   (Size) PL_POOL_HISTOGRAMS * PL_HIST_BUCKETS))
+#define PL_NUM_RINGS \
+	(profiler_collect_worker ? profiler_collect_rings : 0)
+#define PL_RING_BYTES		((Size) profiler_ring_size * 1024)
+#define PL_RING_STRIDE \
+	MAXALIGN(offsetof(profilerRing, data) + PL_RING_BYTES)
+#define PL_RING(_plpss, _i) \
+	((profilerRing *) ((char *) (PL_IO_POOL(_plpss) + \
+						(Size) PL_POOL_IO_LINES * PL_IO_COUNTERS) + \
+					   (Size) (_i) * PL_RING_STRIDE))
+
+/* The history rings follow the collect rings. The worker writes them. */
+#define PL_NUM_HISTORY_LINES \
+	(profiler_collect_worker ? profiler_history_lines : 0)
+#define PL_NUM_HISTORY_CALLGRAPHS \
+	(profiler_collect_worker ? profiler_history_callgraphs : 0)
+#define PL_HISTORY_LINES(_plpss) \
+	((profilerHistoryLine *) PL_RING(_plpss, PL_NUM_RINGS))
+#define PL_HISTORY_CALLGRAPHS(_plpss) \
+	((profilerHistoryCallgraph *) (PL_HISTORY_LINES(_plpss) + \
+								   PL_NUM_HISTORY_LINES))
+
+/* The partition locks of the shared hash table entries. */
+#define PL_FUNCTIONS_LOCK(_plpss, _hashcode) \
+	(&((_plpss)->locks[PL_FUNCTIONS_LOCK_BASE + \
+					   (_hashcode) % PL_NUM_LOCK_PARTITIONS].lock))
+#define PL_CALLGRAPH_LOCK(_plpss, _hashcode) \
+	(&((_plpss)->locks[PL_CALLGRAPH_LOCK_BASE + \
+					   (_hashcode) % PL_NUM_LOCK_PARTITIONS].lock))
+
+#define PL_IS_UNSAMPLED(_p) \
+	((char *) (_p) >= unsampled_frames && \
+	 (char *) (_p) < unsampled_frames + PL_MAX_STACK_DEPTH)
+
+static callGraphFrame	graph_stack[PL_MAX_STACK_DEPTH];
 static int				graph_stack_pt = 0;
+static int32			callgraph_next_node_id = 1;
+static uint32			local_hash_generation = 0;
 static time_t			last_collect_time = 0;
-static bool				have_new_local_data = false;
+static linestatsEntry  *functions_dirty = NULL;
+static callGraphNode   *callgraph_dirty = NULL;
 
 static PLpgSQL_plugin  *prev_plpgsql_plugin = NULL;
 static PLpgSQL_plugin  *prev_pltsql_plugin = NULL;
@@ -91,6 +481,42 @@ static shmem_startup_hook_type	prev_shmem_startup_hook = NULL;
 static shmem_request_hook_type	prev_shmem_request_hook = NULL;
 #endif
 
+static const struct config_enum_entry level_options[] = {
+	{"off", PL_LEVEL_OFF, false},
+	{"function", PL_LEVEL_FUNCTION, false},
+	{"statement", PL_LEVEL_STATEMENT, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry filter_kind_options[] = {
+	{"function", PL_FILTER_FUNCTION, false},
+	{"schema", PL_FILTER_SCHEMA, false},
+	{"role", PL_FILTER_ROLE, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry target_kind_options[] = {
+	{"pid", PL_TARGET_PID, false},
+	{"role", PL_TARGET_ROLE, false},
+	{"database", PL_TARGET_DATABASE, false},
+	{"application_name", PL_TARGET_APPNAME, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry clock_source_options[] = {
+	{"system", PL_CLOCK_SYSTEM, false},
+	{"tsc", PL_CLOCK_TSC, false},
+	{NULL, 0, false}
+};
+
+#ifdef PL_HAVE_DYNAMIC
+static const struct config_enum_entry shared_storage_options[] = {
+	{"fixed", PL_STORAGE_FIXED, false},
+	{"dynamic", PL_STORAGE_DYNAMIC, false},
+	{NULL, 0, false}
+};
+#endif
+
 static PLpgSQL_plugin	plugin_funcs = {
 		profiler_func_init,
 		profiler_func_beg,
@@ -101,6 +527,218 @@ static PLpgSQL_plugin	plugin_funcs = {
 		NULL
 	};
 
+/**********************************************************************
+ * Clock functions
+ **********************************************************************/
+
+/* -------------------------------------------------------------------
+ * profiler_clock_now()
+ *
+ *	Return the current time in ticks of the clock selected for this
+ *	transaction. Only differences of two ticks values are meaningful
+ *	and must be converted with profiler_clock_ns().
+ * -------------------------------------------------------------------
+ */
+static inline uint64
+profiler_clock_now(void)
+{
+	instr_time	now;
+
+#ifdef PL_HAVE_TSC
+	if (profiler_use_tsc)
+		return (uint64) __rdtsc();
+#endif
+
+	INSTR_TIME_SET_CURRENT(now);
+	return PL_INSTR_TIME_GET_NANOSEC(now);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_clock_ns()
+ *
+ *	Convert a difference of clock ticks into nanoseconds.
+ * -------------------------------------------------------------------
+ */
+static inline uint64
+profiler_clock_ns(uint64 ticks)
+{
+	if (profiler_use_tsc)
+		return (uint64) ((double) ticks * profiler_tsc_ns_per_tick);
+
+	return ticks;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_hist_bucket()
+ *
+ *	Return the latency histogram bucket for a time in nanoseconds.
+ * -------------------------------------------------------------------
+ */
+static inline int
+profiler_hist_bucket(uint64 ns)
+{
+	int		bucket;
+
+	if (ns < (UINT64CONST(1) << PL_HIST_MIN_SHIFT))
+		return 0;
+
+#if PG_VERSION_NUM >= 130000
+	bucket = pg_leftmost_one_pos64(ns) - PL_HIST_MIN_SHIFT + 1;
+#else
+	bucket = 1;
+	ns >>= PL_HIST_MIN_SHIFT + 1;
+	while (ns != 0)
+	{
+		bucket++;
+		ns >>= 1;
+	}
+#endif
+
+	return Min(bucket, PL_HIST_BUCKETS - 1);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_hist_count()
+ *
+ *	Return the number of values in a latency histogram.
+ * -------------------------------------------------------------------
+ */
+static inline uint64
+profiler_hist_count(const uint32 *hist)
+{
+	uint64	count = 0;
+	int		b;
+
+	for (b = 0; b < PL_HIST_BUCKETS; b++)
+		count += hist[b];
+
+	return count;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_io_snapshot()
+ *
+ *	Get the current buffer and WAL usage counters of this backend.
+ * -------------------------------------------------------------------
+ */
+static inline void
+profiler_io_snapshot(linestatsIoInfo *io)
+{
+	io->shared_blks_hit = pgBufferUsage.shared_blks_hit;
+	io->shared_blks_read = pgBufferUsage.shared_blks_read;
+	io->shared_blks_dirtied = pgBufferUsage.shared_blks_dirtied;
+	io->shared_blks_written = pgBufferUsage.shared_blks_written;
+	io->temp_blks_read = pgBufferUsage.temp_blks_read;
+	io->temp_blks_written = pgBufferUsage.temp_blks_written;
+#if PG_VERSION_NUM >= 130000
+	io->wal_records = pgWalUsage.wal_records;
+	io->wal_bytes = (int64) pgWalUsage.wal_bytes;
+#else
+	io->wal_records = 0;
+	io->wal_bytes = 0;
+#endif
+}
+
+/* -------------------------------------------------------------------
+ * profiler_io_accum()
+ *
+ *	Add the buffer and WAL usage since the snapshot start to io.
+ * -------------------------------------------------------------------
+ */
+static inline void
+profiler_io_accum(linestatsIoInfo *io, const linestatsIoInfo *start)
+{
+	linestatsIoInfo	now;
+
+	profiler_io_snapshot(&now);
+
+	io->shared_blks_hit += now.shared_blks_hit - start->shared_blks_hit;
+	io->shared_blks_read += now.shared_blks_read - start->shared_blks_read;
+	io->shared_blks_dirtied += now.shared_blks_dirtied -
+							   start->shared_blks_dirtied;
+	io->shared_blks_written += now.shared_blks_written -
+							   start->shared_blks_written;
+	io->temp_blks_read += now.temp_blks_read - start->temp_blks_read;
+	io->temp_blks_written += now.temp_blks_written - start->temp_blks_written;
+	io->wal_records += now.wal_records - start->wal_records;
+	io->wal_bytes += now.wal_bytes - start->wal_bytes;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_atomic_add()
+ *
+ *	Add to a shared counter. Adding zero is skipped, so that merging
+ *	idle lines does not dirty the cache lines other backends use.
+ * -------------------------------------------------------------------
+ */
+static inline void
+profiler_atomic_add(pg_atomic_uint64 *counter, int64 value)
+{
+	if (value != 0)
+		pg_atomic_fetch_add_u64(counter, value);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_atomic_max()
+ *
+ *	Raise a shared maximum to value, if that is larger.
+ * -------------------------------------------------------------------
+ */
+static inline void
+profiler_atomic_max(pg_atomic_uint64 *counter, uint64 value)
+{
+	uint64	cur = pg_atomic_read_u64(counter);
+
+	while (value > cur)
+	{
+		if (pg_atomic_compare_exchange_u64(counter, &cur, value))
+			break;
+	}
+}
+
+/* -------------------------------------------------------------------
+ * linestats_mark_dirty()
+ *
+ *	Record that the slots min to max of a local linestats entry have
+ *	new counts. This links the entry into the dirty list, so that
+ *	profiler_collect_data() does not need to scan the hash table.
+ * -------------------------------------------------------------------
+ */
+static inline void
+linestats_mark_dirty(linestatsEntry *entry, int min, int max)
+{
+	if (entry->dirty_max < 0)
+	{
+		entry->dirty_next = functions_dirty;
+		functions_dirty = entry;
+		entry->dirty_min = min;
+		entry->dirty_max = max;
+		return;
+	}
+
+	if (min < entry->dirty_min)
+		entry->dirty_min = min;
+	if (max > entry->dirty_max)
+		entry->dirty_max = max;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_mark_dirty()
+ *
+ *	Record that a calling context tree node has new counts.
+ * -------------------------------------------------------------------
+ */
+static inline void
+callgraph_mark_dirty(callGraphNode *node)
+{
+	if (!node->dirty)
+	{
+		node->dirty_next = callgraph_dirty;
+		callgraph_dirty = node;
+		node->dirty = true;
+	}
+}
+
 /**********************************************************************
  * Extension (de)initialization functions.
  **********************************************************************/
@@ -123,8 +761,240 @@ _PG_init(void)
 	/* Initialize local hash tables. */
 	init_hash_tables();
 
+#if PG_VERSION_NUM >= 120000
+	/*
+	 * Counting per statement id instead of per source line. This only
+	 * affects functions that are not yet in the local hash table.
+	 */
+	DefineCustomBoolVariable("plprofiler.statement_slots",
+							 "Keep one counter slot per PL/pgSQL statement "
+							 "instead of one per source line",
+							 NULL,
+							 &profiler_stmt_slots,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+	/*
+	 * What the profiler collects in this session. The function level
+	 * only times calls and builds call graphs, the statement hooks
+	 * return right away. pl_profiler_set_level_global() can lower
+	 * the level for all sessions.
+	 */
+	DefineCustomEnumVariable("plprofiler.level",
+							 "Profile only function calls or also "
+							 "statements",
+							 NULL,
+							 &profiler_level,
+							 PL_LEVEL_STATEMENT,
+							 level_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/*
+	 * The clock used for statement and function timing. The TSC is
+	 * only used if the CPU has an invariant TSC, otherwise we silently
+	 * stay with the system clock.
+	 */
+	DefineCustomEnumVariable("plprofiler.clock_source",
+							 "Clock used to time statements and functions",
+							 NULL,
+							 &profiler_clock_source,
+							 PL_CLOCK_SYSTEM,
+							 clock_source_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/*
+	 * Fraction of top level PL/pgSQL calls, whose call tree is profiled.
+	 * Counts and times are scaled up accordingly.
+	 */
+	DefineCustomRealVariable("plprofiler.sample_rate",
+							 "Fraction of top level function calls to "
+							 "profile",
+							 NULL,
+							 &profiler_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/*
+	 * With a sampling interval the hooks only maintain the call stack
+	 * and the current statement, and a timer takes samples of them.
+	 */
+	DefineCustomIntVariable("plprofiler.sampling_interval",
+							"Sample the PL/pgSQL call stack at this interval "
+							"instead of timing every statement (0 = off)",
+							NULL,
+							&profiler_sampling_interval,
+							0,
+							0,
+							60000,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	/*
+	 * Keep latency histograms per line and per call graph. Affects
+	 * functions and call graphs that are not yet in the local tables.
+	 */
+	DefineCustomBoolVariable("plprofiler.histograms",
+							 "Keep latency histograms per source line and "
+							 "call graph",
+							 NULL,
+							 &profiler_histograms,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/*
+	 * Count buffer and WAL usage per line. Affects functions that are
+	 * not yet in the local tables and takes effect at the next
+	 * transaction start.
+	 */
+	DefineCustomBoolVariable("plprofiler.track_io",
+							 "Count buffer and WAL usage per source line",
+							 NULL,
+							 &profiler_track_io,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/*
+	 * When the fixed size shared call graph table is full, evict the
+	 * call graphs with the least total time instead of dropping all
+	 * new ones (Space-Saving). Only the fixed storage has a hard limit
+	 * on the number of entries.
+	 */
+	DefineCustomBoolVariable("plprofiler.callgraph_evict",
+							 "Evict the least expensive call graphs when "
+							 "the shared call graph table is full",
+							 NULL,
+							 &profiler_callgraph_evict,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/*
+	 * Save the fixed size shared tables at shutdown and load them again
+	 * at startup. The collect worker can also save them periodically,
+	 * so that less is lost in a crash.
+	 */
+	DefineCustomBoolVariable("plprofiler.save",
+							 "Save the shared profile across server "
+							 "shutdowns",
+							 "Only the fixed shared storage is saved.",
+							 &profiler_save,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("plprofiler.history_top_callgraphs",
+							"Number of call graphs with the most time, "
+							"that are kept per collect interval",
+							NULL,
+							&profiler_history_top,
+							10,
+							0,
+							10000,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("plprofiler.save_interval",
+							"Interval in which the collect worker saves "
+							"the shared profile, 0 saves only at shutdown",
+							"After a crash the last of these saves is "
+							"loaded. Only the fixed shared storage is saved.",
+							&profiler_save_interval,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+#ifdef PL_HAVE_DYNAMIC
+	/*
+	 * Keep the shared tables in dynamic shared memory, that grows on
+	 * demand, instead of the fixed size tables sized by max_functions,
+	 * max_lines and max_callgraphs. This doesn't need the library to
+	 * be in shared_preload_libraries on PostgreSQL 17 and later.
+	 */
+	DefineCustomEnumVariable("plprofiler.shared_storage",
+							 "Storage of the shared hash tables",
+							 NULL,
+							 &profiler_shared_storage,
+							 PL_STORAGE_FIXED,
+							 shared_storage_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/*
+	 * The dynamic shared memory is not allocated beyond this. Raising
+	 * it takes effect for new entries right after a reload, lowering
+	 * it doesn't shrink what is already in use.
+	 */
+	DefineCustomIntVariable("plprofiler.dynamic_max_memory",
+							"Maximum amount of dynamic shared memory used "
+							"for the shared hash tables",
+							NULL,
+							&profiler_dynamic_max_memory,
+							256,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MB,
+							NULL,
+							NULL,
+							NULL);
+#endif
+
 	if (process_shared_preload_libraries_in_progress)
 	{
+		/*
+		 * Calibrate the TSC once in the postmaster, so that backends
+		 * inherit the result instead of each spending time on it.
+		 */
+		if (profiler_clock_source == PL_CLOCK_TSC)
+			(void) profiler_tsc_usable();
+
 		/*
 		 * When loaded via shared_preload_libraries, we have to
 		 * also hook into the shmem_startup call chain and register
@@ -138,6 +1008,7 @@ _PG_init(void)
 		#endif
 
 		RegisterXactCallback(profiler_xact_callback, NULL);
+		profiler_xact_registered = true;
 
 		/*
 		 * Additional config options only available if running via
@@ -190,10 +1061,136 @@ _PG_init(void)
 								NULL,
 								NULL);
 
+		DefineCustomIntVariable("plprofiler.max_histograms",
+								"Maximum number of latency histograms that "
+								"can be kept in shared memory, one per source "
+								"line or call graph",
+								NULL,
+								&profiler_max_histograms,
+								0,
+								0,
+								INT_MAX / PL_HIST_BUCKETS,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("plprofiler.max_io_lines",
+								"Maximum number of source lines, whose "
+								"buffer and WAL usage can be kept in shared "
+								"memory",
+								NULL,
+								&profiler_max_io_lines,
+								0,
+								0,
+								INT_MAX / (int) sizeof(linestatsIoInfo),
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomBoolVariable("plprofiler.collect_worker",
+								 "Merge the collected data into shared "
+								 "memory in a background worker",
+								 NULL,
+								 &profiler_collect_worker,
+								 false,
+								 PGC_POSTMASTER,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomIntVariable("plprofiler.collect_rings",
+								"Number of backends, that can queue their "
+								"data for the collect worker at the same time",
+								NULL,
+								&profiler_collect_rings,
+								64,
+								1,
+								10000,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("plprofiler.collect_ring_size",
+								"Size of the ring buffer of each backend "
+								"for the collect worker",
+								NULL,
+								&profiler_ring_size,
+								64,
+								8,
+								INT_MAX / 1024,
+								PGC_POSTMASTER,
+								GUC_UNIT_KB,
+								NULL,
+								NULL,
+								NULL);
+
+		/*
+		 * The collect worker can keep the changes of each collect
+		 * interval in two rings in shared memory.
+		 */
+		DefineCustomIntVariable("plprofiler.history_lines",
+								"Number of interval rows for source lines "
+								"kept by the collect worker, 0 disables it",
+								"Requires plprofiler.collect_worker.",
+								&profiler_history_lines,
+								0,
+								0,
+								INT_MAX / 1024,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("plprofiler.history_callgraphs",
+								"Number of interval rows for call graphs "
+								"kept by the collect worker, 0 disables it",
+								"Requires plprofiler.collect_worker.",
+								&profiler_history_callgraphs,
+								0,
+								0,
+								INT_MAX / 1024,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		/*
+		 * The collect worker only needs shared memory access. It never
+		 * touches the catalog, so it doesn't connect to a database.
+		 */
+		if (profiler_collect_worker)
+		{
+			BackgroundWorker	worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+			worker.bgw_start_time = BgWorkerStart_ConsistentState;
+			worker.bgw_restart_time = 10;
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "plprofiler");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN,
+					 "profiler_worker_main");
+			snprintf(worker.bgw_name, BGW_MAXLEN,
+					 "plprofiler collect worker");
+			#if PG_VERSION_NUM >= 110000
+			snprintf(worker.bgw_type, BGW_MAXLEN,
+					 "plprofiler collect worker");
+			#endif
+			RegisterBackgroundWorker(&worker);
+		}
+
 		/* Request the additionl shared memory and LWLock needed. */
 		#if PG_VERSION_NUM < 150000
 		RequestAddinShmemSpace(profiler_shmem_size());
-		RequestNamedLWLockTranche("plprofiler", 1);
+		RequestNamedLWLockTranche("plprofiler", PL_NUM_LOCKS);
 		#endif
 	}
 }
@@ -213,6 +1210,11 @@ _PG_fini(void)
 
 	MemoryContextDelete(profiler_mcxt);
 	profiler_mcxt = NULL;
+	if (profiler_info_mcxt != NULL)
+		MemoryContextDelete(profiler_info_mcxt);
+	profiler_info_mcxt = NULL;
+	memset(profiler_info_free, 0, sizeof(profiler_info_free));
+	profiler_info_live = NULL;
 	functions_hash = NULL;
 	callgraph_hash = NULL;
 
@@ -220,11 +1222,45 @@ _PG_fini(void)
 	{
 		shmem_startup_hook = prev_shmem_startup_hook;
 		prev_shmem_startup_hook = NULL;
+	}
 
+	if (profiler_xact_registered)
+	{
 		UnregisterXactCallback(profiler_xact_callback, NULL);
+		profiler_xact_registered = false;
 	}
 }
 
+/* -------------------------------------------------------------------
+ * profiler_state_size()
+ *
+ * 	Calculate the size of the shared state struct with the counter
+ * 	pools, collect rings and history rings, that follow it.
+ * -------------------------------------------------------------------
+ */
+static Size
+profiler_state_size(void)
+{
+	Size	num_bytes;
+
+	num_bytes = offsetof(profilerSharedState, line_info);
+	num_bytes = add_size(num_bytes,
+						 mul_size(sizeof(linestatsSharedLine),
+								  PL_POOL_LINES));
+	num_bytes = add_size(num_bytes,
+						 mul_size(PL_SHARED_HIST_SIZE,
+								  PL_POOL_HISTOGRAMS));
+	num_bytes = add_size(num_bytes,
+						 mul_size(PL_SHARED_IO_SIZE, PL_POOL_IO_LINES));
+	num_bytes = add_size(num_bytes, mul_size(PL_RING_STRIDE, PL_NUM_RINGS));
+	num_bytes = add_size(num_bytes, mul_size(sizeof(profilerHistoryLine),
+											 PL_NUM_HISTORY_LINES));
+	num_bytes = add_size(num_bytes, mul_size(sizeof(profilerHistoryCallgraph),
+											 PL_NUM_HISTORY_CALLGRAPHS));
+
+	return num_bytes;
+}
+
 /* -------------------------------------------------------------------
  * profiler_shmem_size()
  *
@@ -235,14 +1271,15 @@ _PG_fini(void)
 static Size
 profiler_shmem_size(void)
 {
-	Size	num_bytes;
+	Size	num_bytes = profiler_state_size();
+
+	/* The dynamic tables are allocated outside of the main shared memory. */
+	if (PL_DYNAMIC)
+		return num_bytes;
 
-	num_bytes = offsetof(profilerSharedState, line_info);
-	num_bytes = add_size(num_bytes,
-						 sizeof(linestatsLineInfo) * profiler_max_lines);
 	num_bytes = add_size(num_bytes,
 						 hash_estimate_size(profiler_max_functions,
-						 					sizeof(linestatsEntry)));
+						 					sizeof(linestatsSharedEntry)));
 	num_bytes = add_size(num_bytes,
 						 hash_estimate_size(profiler_max_callgraph,
 						 					sizeof(callGraphEntry)));
@@ -273,9 +1310,8 @@ static void
 profiler_func_init(PLpgSQL_execstate *estate, PLpgSQL_function *func )
 {
 	profilerInfo	   *profiler_info;
-	linestatsHashKey	linestats_key;
 	linestatsEntry	   *linestats_entry;
-	bool				linestats_found;
+	bool				sampled = true;
 
 	/*
 	 * On first call within a transaction we determine if the profiler
@@ -284,19 +1320,51 @@ profiler_func_init(PLpgSQL_execstate *estate, PLpgSQL_function *func )
 	 */
 	if (profiler_first_call_in_xact)
 	{
+		profilerSharedState	   *plpss = profiler_shared();
+		int						level = profiler_level;
+
 		profiler_first_call_in_xact = false;
 
-		if (profiler_shared_state != NULL)
+		if (plpss != NULL)
 		{
+			level = Min(level, plpss->profiler_level);
 			profiler_active = (
-				profiler_shared_state->profiler_enabled_global ||
-				profiler_shared_state->profiler_enabled_pid == MyProcPid ||
+				profiler_target_match(plpss) ||
+				plpss->profiler_enabled_global ||
+				plpss->profiler_enabled_pid == MyProcPid ||
 				profiler_enabled_local);
 		}
 		else
 		{
 			profiler_active = profiler_enabled_local;
 		}
+		if (level == PL_LEVEL_OFF)
+			profiler_active = false;
+		if (profiler_active && plpss != NULL)
+			profiler_filter_refresh(plpss);
+
+		/*
+		 * Pick the clock and level for this transaction. Never switch
+		 * while there are frames on the call stack, their entry times
+		 * are in the ticks of the current clock and their line arrays
+		 * are sized for the current level. Sampling attributes time to
+		 * statements, so the function level always times the calls.
+		 */
+		if (!profiler_active)
+			profiler_statements = false;
+		else if (graph_stack_pt == 0)
+		{
+			profiler_choose_clock();
+			profiler_statements = (level == PL_LEVEL_STATEMENT);
+			profiler_sampling = (profiler_sampling_interval > 0 &&
+								 profiler_statements);
+			profiler_io = (profiler_track_io && !profiler_sampling);
+		}
+
+		if (profiler_active && profiler_sampling)
+			profiler_sampling_start();
+		else
+			profiler_sampling_stop();
 	}
 
 	if (!profiler_active)
@@ -321,55 +1389,100 @@ profiler_func_init(PLpgSQL_execstate *estate, PLpgSQL_function *func )
 	if (func->fn_oid == InvalidOid)
 		return;
 
-	/* Tell collect_data() that new information has arrived locally. */
-	have_new_local_data = true;
-
 	/*
-	 * Search for this function in our line stats hash table. Create the
-	 * entry if it does not exist yet.
+	 * Functions, that the filters leave out, are treated like anonymous
+	 * code blocks. Their time counts as time of their caller.
 	 */
-	linestats_key.db_oid = MyDatabaseId;
-	linestats_key.fn_oid = func->fn_oid;
-
-	linestats_entry = (linestatsEntry *)hash_search(functions_hash,
-													&linestats_key,
-													HASH_ENTER,
-													&linestats_found);
-	if (linestats_entry == NULL)
-		elog(ERROR, "plprofiler out of memory");
-	if (!linestats_found)
-	{
-		/* New function, initialize entry. */
-		MemoryContext	old_context;
-		HeapTuple		proc_tuple;
-		char		   *proc_src;
-		char		   *func_name;
-
-		proc_src = find_source( func->fn_oid, &proc_tuple, &func_name );
-		linestats_entry->line_count = count_source_lines(proc_src) + 1;
-		old_context = MemoryContextSwitchTo(profiler_mcxt);
-		linestats_entry->line_info = palloc0(linestats_entry->line_count *
-											 sizeof(linestatsLineInfo));
-		MemoryContextSwitchTo(old_context);
-
-		ReleaseSysCache(proc_tuple);
-	}
-
+	if (filter_count > 0 && !profiler_filter_function(func->fn_oid))
+		return;
 
 	/*
-	 * The PL/pgSQL interpreter provides a void pointer (in each stack frame)
-	 * that's reserved for plugins.	 We allocate a profilerInfo structure and
-	 * record it's address in that pointer so we can keep some per-invocation
-	 * information.
+	 * Decide for every top level call whether to profile its entire
+	 * call tree. Calls made from within a call tree, that was not
+	 * selected, only track their depth in that tree. A depth left
+	 * over by an exception in a previous statement is stale.
 	 */
-	profiler_info = (profilerInfo *)palloc(sizeof(profilerInfo ));
+	if (graph_stack_pt == 0)
+	{
+		io_stack_pt = 0;
 
-	profiler_info->fn_oid = func->fn_oid;
-	profiler_info->line_count = linestats_entry->line_count;
-	profiler_info->line_info = palloc0(profiler_info->line_count *
-									  sizeof(profilerLineInfo));
+		if (unsampled_depth > 0 &&
+			unsampled_stmt_start != GetCurrentStatementStartTimestamp())
+			unsampled_depth = 0;
 
-	estate->plugin_info = profiler_info;
+		if (unsampled_depth > 0)
+			sampled = false;
+		else
+		{
+			profiler_total_calls++;
+			sampled = profiler_sample();
+			if (sampled)
+			{
+				int		interval = profiler_sampling ?
+								   profiler_sampling_interval : 0;
+
+				/*
+				 * Reports turn the times into samples of this interval.
+				 * That isn't possible for calls timed and sampled, or
+				 * sampled with different intervals, in the same data.
+				 */
+				if (profiler_sampled_calls > 0 &&
+					interval != profiler_sampled_interval)
+					profiler_sampling_mixed = true;
+				profiler_sampled_interval = interval;
+				profiler_sampled_calls++;
+			}
+			else
+				unsampled_stmt_start = GetCurrentStatementStartTimestamp();
+		}
+	}
+
+	if (!sampled)
+	{
+		estate->plugin_info = &unsampled_frames[Min(unsampled_depth,
+													PL_MAX_STACK_DEPTH - 1)];
+		unsampled_depth++;
+		return;
+	}
+
+	/*
+	 * Search for this function in our line stats hash table. Create the
+	 * entry if it does not exist yet.
+	 */
+#if PG_VERSION_NUM >= 120000
+	linestats_entry = linestats_local_entry(func->fn_oid, func->fn_xmin,
+											profiler_stmt_slots ?
+											(int) func->nstatements : 0);
+#else
+	linestats_entry = linestats_local_entry(func->fn_oid, func->fn_xmin, 0);
+#endif
+
+	/*
+	 * The PL/pgSQL interpreter provides a void pointer (in each stack frame)
+	 * that's reserved for plugins.	 We take a profilerInfo structure from
+	 * our pool and record it's address in that pointer so we can keep some
+	 * per-invocation information. We also remember the hash table entry,
+	 * so that the other hooks don't need to look it up again.
+	 *
+	 * A top level call finds no other live invocations, unless one failed
+	 * between func_init and func_beg. Return those to the pool now.
+	 *
+	 * At the function level no statement is ever counted, so only the
+	 * pseudo line zero is needed.
+	 */
+	if (graph_stack_pt == 0)
+		profiler_info_unwind(NULL);
+	if (profiler_statements)
+		profiler_info = profiler_info_alloc(func->fn_oid,
+											linestats_entry->line_count,
+											linestats_entry->stmt_slots);
+	else
+		profiler_info = profiler_info_alloc(func->fn_oid, 1, false);
+	profiler_info->fn_version = func->fn_xmin;
+	profiler_info->entry = linestats_entry;
+	profiler_info->generation = local_hash_generation;
+
+	estate->plugin_info = profiler_info;
 }
 
 /* -------------------------------------------------------------------
@@ -390,15 +1503,15 @@ profiler_func_beg(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 	if (!profiler_active)
 		return;
 
-	/* Ignore anonymous code block. */
-	if (estate->plugin_info == NULL)
+	/* Ignore anonymous code block and calls that are not sampled. */
+	if (estate->plugin_info == NULL || PL_IS_UNSAMPLED(estate->plugin_info))
 		return;
 
 	/*
 	 * Push this function Oid onto the stack, remember the entry time and
 	 * set the time spent in children to zero.
 	 */
-	callgraph_push(func->fn_oid);
+	callgraph_push(func->fn_oid, (profilerInfo *) estate->plugin_info);
 }
 
 /* -------------------------------------------------------------------
@@ -412,8 +1525,8 @@ static void
 profiler_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 {
 	profilerInfo	   *profiler_info;
-	linestatsHashKey	key;
 	linestatsEntry	   *entry;
+	int					line_count;
 	int					i;
 
 	if (!profiler_active)
@@ -423,40 +1536,54 @@ profiler_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 	if (estate->plugin_info == NULL)
 		return;
 
-	/* Tell collect_data() that new information has arrived locally. */
-	have_new_local_data = true;
-
-	/* Find the linestats hash table entry for this function. */
-	profiler_info = (profilerInfo *) estate->plugin_info;
-	key.db_oid = MyDatabaseId;
-	key.fn_oid = func->fn_oid;
-	entry = (linestatsEntry *)hash_search(functions_hash, &key,
-										  HASH_FIND, NULL);
-	if (!entry)
+	/* Leave one level of a call tree, that is not sampled. */
+	if (PL_IS_UNSAMPLED(estate->plugin_info))
 	{
-		elog(DEBUG1, "plprofiler: local linestats entry for fn_oid %u "
-					"not found", func->fn_oid);
+		i = (char *) estate->plugin_info - unsampled_frames;
+		if (i < PL_MAX_STACK_DEPTH - 1)
+			unsampled_depth = i;
+		else if (unsampled_depth > 0)
+			unsampled_depth--;
+		estate->plugin_info = NULL;
 		return;
 	}
 
-	/* Loop through each line of source code and update the stats */
-	for(i = 1; i < profiler_info->line_count; i++)
+	/* Get the linestats hash table entry for this function. */
+	profiler_info = (profilerInfo *) estate->plugin_info;
+	entry = profiler_info_entry(profiler_info);
+	line_count = Min(profiler_info->line_count, entry->line_count);
+	line_count = Min(line_count, profiler_info->line_max + 1);
+
+	/* Tell collect_data() which slots have new information. */
+	if (line_count > Max(profiler_info->line_min, 1))
+		linestats_mark_dirty(entry, Max(profiler_info->line_min, 1),
+							 line_count - 1);
+
+	/* Loop through each executed line of source code and update the stats */
+	for(i = Max(profiler_info->line_min, 1); i < line_count; i++)
 	{
+		if (profiler_info->line_info[i].lineno != 0)
+			entry->line_info[i].lineno = profiler_info->line_info[i].lineno;
 		entry->line_info[i].exec_count +=
 				profiler_info->line_info[i].exec_count;
-		entry->line_info[i].us_total +=
-				profiler_info->line_info[i].us_total;
+		entry->line_info[i].ns_total +=
+				profiler_info->line_info[i].ns_total;
 
-		if (profiler_info->line_info[i].us_max > entry->line_info[i].us_max)
-			entry->line_info[i].us_max =
-					profiler_info->line_info[i].us_max;
+		if (profiler_info->line_info[i].ns_max > entry->line_info[i].ns_max)
+			entry->line_info[i].ns_max =
+					profiler_info->line_info[i].ns_max;
 	}
 
 	/*
 	 * Pop the call stack. This also does the time accounting
-	 * for call graphs.
+	 * for call graphs and returns the profilerInfo to the pool.
+	 * Functions nested deeper than PL_MAX_STACK_DEPTH have no
+	 * call stack frame, so release it here too.
 	 */
+	profiler_info_unwind(profiler_info);
 	callgraph_pop(func->fn_oid);
+	profiler_info_release(profiler_info);
+	estate->plugin_info = NULL;
 
 	/*
 	 * Finally if a plprofiler.collect_interval is configured, save and reset
@@ -464,7 +1591,8 @@ profiler_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 	 */
 	if (profiler_shared_state != NULL &&
 		(profiler_shared_state->profiler_enabled_global ||
-		 MyProcPid == profiler_shared_state->profiler_enabled_pid) &&
+		 MyProcPid == profiler_shared_state->profiler_enabled_pid ||
+		 target_match) &&
 		profiler_shared_state->profiler_collect_interval > 0)
 	{
 		time_t	now = time(NULL);
@@ -472,7 +1600,7 @@ profiler_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 		if (now >= last_collect_time +
 				   profiler_shared_state->profiler_collect_interval)
 		{
-		    profiler_collect_data();
+		    profiler_collect_data(false);
 			last_collect_time = now;
 		}
 	}
@@ -493,24 +1621,71 @@ profiler_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 {
 	profilerLineInfo   *line_info;
 	profilerInfo	   *profiler_info;
+	int					slot;
 
-	if (!profiler_active)
+	/*
+	 * Not profiling or at the function level. Callees abandoned by an
+	 * exception are then unwound by the next func_end of their caller.
+	 */
+	if (!profiler_statements)
 		return;
 
+	profiler_sample_fold();
+
 	/* Ignore anonymous code block. */
 	if (estate->plugin_info == NULL)
 		return;
 
+	/*
+	 * In a call tree, that is not sampled, only correct the depth in
+	 * case callees were abandoned by an exception.
+	 */
+	if (PL_IS_UNSAMPLED(estate->plugin_info))
+	{
+		slot = (char *) estate->plugin_info - unsampled_frames;
+		if (slot < PL_MAX_STACK_DEPTH - 1)
+			unsampled_depth = slot + 1;
+		return;
+	}
+
 	/* Set the start time of the statement */
 	profiler_info = (profilerInfo *)estate->plugin_info;
-	if (stmt->lineno < profiler_info->line_count)
+	slot = PL_STMT_SLOT(profiler_info, stmt);
+	if (slot < profiler_info->line_count)
 	{
-		line_info = profiler_info->line_info + stmt->lineno;
-		INSTR_TIME_SET_CURRENT(line_info->start_time);
+		line_info = profiler_info->line_info + slot;
+		line_info->lineno = stmt->lineno;
+
+		/*
+		 * When sampling, the statement is only counted here and the
+		 * sample ticks attribute time to it.
+		 */
+		if (profiler_sampling)
+			line_info->exec_count++;
+		else
+		{
+			if (profiler_io)
+				profiler_io_push(line_info);
+			line_info->start_time = profiler_clock_now();
+		}
+
+		/* Remember the range of slots, that need merging and zeroing. */
+		if (slot < profiler_info->line_min)
+			profiler_info->line_min = slot;
+		if (slot > profiler_info->line_max)
+			profiler_info->line_max = slot;
+
+		profiler_info->cur_slot = slot;
 	}
+	else
+		profiler_info->cur_slot = 0;
 
-	/* Check the call graph stack. */
+	/*
+	 * Check the call graph stack and return the invocation data of
+	 * callees abandoned by an exception to the pool.
+	 */
 	callgraph_check(profiler_info->fn_oid);
+	profiler_info_unwind(profiler_info);
 }
 
 /* -------------------------------------------------------------------
@@ -529,14 +1704,20 @@ profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 {
 	profilerLineInfo   *line_info;
 	profilerInfo	   *profiler_info;
-	instr_time			end_time;
 	uint64				elapsed;
+	int					slot;
 
-	if (!profiler_active)
+	if (!profiler_statements)
 		return;
 
-	/* Ignore anonymous code block. */
-	if (estate->plugin_info == NULL)
+	profiler_sample_fold();
+
+	/* Ignore anonymous code block and calls that are not sampled. */
+	if (estate->plugin_info == NULL || PL_IS_UNSAMPLED(estate->plugin_info))
+		return;
+
+	/* The sample ticks do the time accounting in sampling mode. */
+	if (profiler_sampling)
 		return;
 
 	profiler_info = (profilerInfo *)estate->plugin_info;
@@ -545,24 +1726,50 @@ profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 	 * Ignore out of bounds line numbers. Someone is apparently
 	 * profiling while executing DDL ... not much use in that.
 	 */
-	if (stmt->lineno >= profiler_info->line_count)
+	slot = PL_STMT_SLOT(profiler_info, stmt);
+	if (slot >= profiler_info->line_count)
 		return;
 
-	/* Tell collect_data() that new information has arrived locally. */
-	have_new_local_data = true;
+	line_info = profiler_info->line_info + slot;
 
-	line_info = profiler_info->line_info + stmt->lineno;
+	elapsed = profiler_clock_ns(profiler_clock_now() - line_info->start_time);
 
-	INSTR_TIME_SET_CURRENT(end_time);
-	INSTR_TIME_SUBTRACT(end_time, line_info->start_time);
+	if (elapsed > line_info->ns_max)
+		line_info->ns_max = elapsed;
 
-	elapsed = INSTR_TIME_GET_MICROSEC(end_time);
+	line_info->ns_total += elapsed;
+	line_info->exec_count++;
 
-	if (elapsed > line_info->us_max)
-		line_info->us_max = elapsed;
+	/* The histograms are kept directly in the local hash table entry. */
+	if (profiler_histograms)
+	{
+		linestatsEntry *entry = profiler_info_entry(profiler_info);
 
-	line_info->us_total += elapsed;
-	line_info->exec_count++;
+		if (entry->hist != NULL && slot < entry->line_count)
+		{
+			entry->hist[slot * PL_HIST_BUCKETS +
+						profiler_hist_bucket(elapsed)]++;
+			linestats_mark_dirty(entry, slot, slot);
+		}
+	}
+
+	/* So are the I/O counters. Pop this statement's snapshot. */
+	if (line_info->io_mark > 0)
+	{
+		if (line_info->io_mark <= io_stack_pt)
+		{
+			linestatsEntry *entry = profiler_info_entry(profiler_info);
+
+			if (entry->io != NULL && slot < entry->line_count)
+			{
+				profiler_io_accum(&(entry->io[slot]),
+								  &io_stack[line_info->io_mark - 1]);
+				linestats_mark_dirty(entry, slot, slot);
+			}
+			io_stack_pt = line_info->io_mark - 1;
+		}
+		line_info->io_mark = 0;
+	}
 }
 
 /**********************************************************************
@@ -570,1520 +1777,8651 @@ profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
  **********************************************************************/
 
 /* -------------------------------------------------------------------
- * init_hash_tables()
+ * profiler_tsc_usable()
  *
- * Initialize hash table
+ *	Check that the CPU has an invariant TSC and calibrate it against
+ *	the system clock. The result is remembered for the life of the
+ *	process (and inherited by backends, if done in the postmaster).
  * -------------------------------------------------------------------
  */
-static void
-init_hash_tables(void)
+static bool
+profiler_tsc_usable(void)
 {
-	HASHCTL		hash_ctl;
-
-	/* Create the memory context for our data */
-	if (profiler_mcxt != NULL)
+#ifdef PL_HAVE_TSC
+	unsigned int	eax, ebx, ecx, edx;
+	instr_time		start_time;
+	instr_time		now;
+	uint64			start_ticks;
+	uint64			ticks;
+	uint64			ns;
+
+	if (profiler_tsc_checked)
+		return profiler_tsc_ns_per_tick > 0.0;
+	profiler_tsc_checked = true;
+
+	/* CPUID leaf 0x80000007, EDX bit 8 is the invariant TSC flag. */
+	if (__get_cpuid_max(0x80000000, NULL) < 0x80000007 ||
+		!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+		(edx & (1 << 8)) == 0)
 	{
-		if (profiler_mcxt->isReset)
-			return;
-		MemoryContextReset(profiler_mcxt);
+		elog(LOG, "plprofiler: CPU has no invariant TSC, "
+				  "using the system clock");
+		return false;
 	}
-	else
+
+	/*
+	 * Busy wait for PL_TSC_CALIBRATE_NS on the system clock and
+	 * count the TSC ticks during that time.
+	 */
+	INSTR_TIME_SET_CURRENT(start_time);
+	start_ticks = __rdtsc();
+	do
 	{
-		profiler_mcxt = AllocSetContextCreate(TopMemoryContext,
-											  "PL/pgSQL profiler",
-											  ALLOCSET_DEFAULT_MINSIZE,
-											  ALLOCSET_DEFAULT_INITSIZE,
-											  ALLOCSET_DEFAULT_MAXSIZE);
-	}
+		INSTR_TIME_SET_CURRENT(now);
+		ticks = __rdtsc();
+		INSTR_TIME_SUBTRACT(now, start_time);
+		ns = PL_INSTR_TIME_GET_NANOSEC(now);
+	} while (ns < PL_TSC_CALIBRATE_NS);
 
-	/* Create the hash table for line stats */
-	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	if (ticks <= start_ticks)
+	{
+		elog(LOG, "plprofiler: TSC calibration failed, "
+				  "using the system clock");
+		return false;
+	}
 
-	hash_ctl.keysize = sizeof(linestatsHashKey);
-	hash_ctl.entrysize = sizeof(linestatsEntry);
-	hash_ctl.hash = line_hash_fn;
-	hash_ctl.match = line_match_fn;
-	hash_ctl.hcxt = profiler_mcxt;
+	profiler_tsc_ns_per_tick = (double) ns / (double) (ticks - start_ticks);
+	elog(DEBUG1, "plprofiler: TSC runs at %.3f ns per tick",
+		 profiler_tsc_ns_per_tick);
 
-	functions_hash = hash_create("Function Lines",
-				 10000,
-				 &hash_ctl,
-				 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+	return true;
+#else
+	if (!profiler_tsc_checked)
+	{
+		profiler_tsc_checked = true;
+		elog(LOG, "plprofiler: TSC clock source not supported on this "
+				  "platform, using the system clock");
+	}
+	return false;
+#endif
+}
 
-	/* Create the hash table for call stats */
-	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+/* -------------------------------------------------------------------
+ * profiler_sample()
+ *
+ *	Decide with probability plprofiler.sample_rate whether to profile
+ *	a top level call. Uses a per backend xorshift64* generator.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_sample(void)
+{
+	uint64		x;
 
-	hash_ctl.keysize = sizeof(callGraphKey);
-	hash_ctl.entrysize = sizeof(callGraphEntry);
-	hash_ctl.hash = callgraph_hash_fn;
-	hash_ctl.match = callgraph_match_fn;
-	hash_ctl.hcxt = profiler_mcxt;
+	if (profiler_sample_rate >= 1.0)
+		return true;
+	if (profiler_sample_rate <= 0.0)
+		return false;
 
-	callgraph_hash = hash_create("Function Call Graphs",
-				 1000,
-				 &hash_ctl,
-				 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
-}
+	if (profiler_prng_state == 0)
+	{
+		profiler_prng_state = ((uint64) MyProcPid << 32) ^
+							  (uint64) GetCurrentTimestamp();
+		if (profiler_prng_state == 0)
+			profiler_prng_state = UINT64CONST(0x9E3779B97F4A7C15);
+	}
 
-#if PG_VERSION_NUM >= 150000
-static void
-profiler_shmem_request(void)
-{
-	if (prev_shmem_request_hook)
-		prev_shmem_request_hook();
+	x = profiler_prng_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	profiler_prng_state = x;
+	x *= UINT64CONST(0x2545F4914F6CDD1D);
 
-	RequestAddinShmemSpace(profiler_shmem_size());
-	RequestNamedLWLockTranche("plprofiler", 1);
+	/* The upper 53 bits as a double in [0, 1). */
+	return (double) (x >> 11) * (1.0 / 9007199254740992.0) <
+		   profiler_sample_rate;
 }
-#endif
 
+/* -------------------------------------------------------------------
+ * profiler_filter_refresh()
+ *
+ *	Copy the filters from the shared state, if they changed since we
+ *	last looked, and forget the cached decisions. The role filters
+ *	are checked against the current user once per transaction.
+ * -------------------------------------------------------------------
+ */
 static void
-profiler_shmem_startup(void)
+profiler_filter_refresh(profilerSharedState *plpss)
 {
-	bool					found;
-	profilerSharedState	   *plpss;
-	Size					plpss_size = 0;
-	HASHCTL					hash_ctl;
-
-	if (prev_shmem_startup_hook)
-	        prev_shmem_startup_hook();
-
-	/* Reset in case of restart inside of the postmaster. */
-	profiler_shared_state = NULL;
-	functions_shared = NULL;
-	callgraph_shared = NULL;
+	uint32		generation;
+	int			i;
 
-	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-
-	/* Create or attach to the shared state */
-	plpss_size = add_size(plpss_size,
-						  offsetof(profilerSharedState, line_info));
-	plpss_size = add_size(plpss_size,
-						  sizeof(linestatsLineInfo) * profiler_max_lines);
-	profiler_shared_state = ShmemInitStruct("plprofiler state", plpss_size,
-											&found);
-	plpss = profiler_shared_state;
-	if (!found)
+	generation = pg_atomic_read_u32(&(plpss->filter_generation));
+	if (generation != filter_generation)
 	{
-		memset(plpss, 0, offsetof(profilerSharedState, line_info) +
-						 sizeof(linestatsLineInfo) * profiler_max_lines);
+		SpinLockAcquire(&(plpss->filter_mutex));
+		filter_count = plpss->num_filters;
+		memcpy(filter_local, plpss->filters,
+			   sizeof(profilerFilter) * filter_count);
+		generation = pg_atomic_read_u32(&(plpss->filter_generation));
+		SpinLockRelease(&(plpss->filter_mutex));
+
+		filter_generation = generation;
+		filter_functions = false;
+		for (i = 0; i < filter_count; i++)
+		{
+			if (filter_local[i].kind != PL_FILTER_ROLE &&
+				filter_local[i].db_oid == MyDatabaseId)
+				filter_functions = true;
+		}
 
-		plpss->lock = &(GetNamedLWLockTranche("plprofiler"))->lock;
+		if (filter_hash != NULL)
+		{
+			hash_destroy(filter_hash);
+			filter_hash = NULL;
+		}
 	}
 
-	/* (Re)Initialize local hash tables. */
-	init_hash_tables();
-
-	/* Create or attache to the shared functions hash table */
-	memset(&hash_ctl, 0, sizeof(hash_ctl));
-	hash_ctl.keysize = sizeof(linestatsHashKey);
-	hash_ctl.entrysize = sizeof(linestatsEntry);
-	hash_ctl.hash = line_hash_fn;
-	hash_ctl.match = line_match_fn;
-	functions_shared = ShmemInitHash("plprofiler functions",
-									 profiler_max_functions,
-									 profiler_max_functions,
-									 &hash_ctl,
-									 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
-
-	/* Create or attache to the shared callgraph hash table */
-	memset(&hash_ctl, 0, sizeof(hash_ctl));
-	hash_ctl.keysize = sizeof(callGraphKey);
-	hash_ctl.entrysize = sizeof(callGraphEntry);
-	hash_ctl.hash = callgraph_hash_fn;
-	hash_ctl.match = callgraph_match_fn;
-	callgraph_shared = ShmemInitHash("plprofiler callgraph",
-									  profiler_max_callgraph,
-									  profiler_max_callgraph,
-									  &hash_ctl,
-									  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+	/* The user can change between transactions (SET ROLE). */
+	filter_role_ok = true;
+	if (filter_count > 0)
+	{
+		Oid		user = GetUserId();
+		bool	include = false;
+		bool	included = false;
 
-	LWLockRelease(AddinShmemInitLock);
+		for (i = 0; i < filter_count; i++)
+		{
+			if (filter_local[i].kind != PL_FILTER_ROLE)
+				continue;
+			if (!filter_local[i].exclude)
+				include = true;
+			if (is_member_of_role_nosuper(user, filter_local[i].target))
+			{
+				if (filter_local[i].exclude)
+				{
+					filter_role_ok = false;
+					return;
+				}
+				included = true;
+			}
+		}
+		filter_role_ok = (!include || included);
+	}
 }
 
 /* -------------------------------------------------------------------
- * find_source()
- *
- *	This function locates and returns a pointer to a null-terminated string
- *	that contains the source code for the given function.
+ * profiler_filter_function()
  *
- *	In addition to returning a pointer to the requested source code, this
- *	function sets *tup to point to a HeapTuple (that you must release when
- *	you are finished with it) and sets *funcName to point to the name of
- *	the given function.
+ *	Decide whether to profile a function. The decision is resolved
+ *	once and cached in filter_hash until the filters change.
  * -------------------------------------------------------------------
  */
-static char *
-find_source(Oid oid, HeapTuple *tup, char **funcName)
+static bool
+profiler_filter_function(Oid fn_oid)
 {
-	bool	isNull;
+	profilerFilterEntry	   *entry;
+	Oid						nsp_oid;
+	bool					include = false;
+	bool					included = false;
+	bool					profile;
+	int						i;
 
-	*tup = SearchSysCache(PROCOID, ObjectIdGetDatum(oid), 0, 0, 0);
+	if (!filter_role_ok)
+		return false;
+	if (!filter_functions)
+		return true;
 
-	if(!HeapTupleIsValid(*tup))
-		elog(ERROR, "plprofiler: cache lookup for function %u failed", oid);
+	if (filter_hash == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(profilerFilterEntry);
+		hash_ctl.hcxt = TopMemoryContext;
+		filter_hash = hash_create("plprofiler filter decisions",
+								  256,
+								  &hash_ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+	else
+	{
+		entry = hash_search(filter_hash, &fn_oid, HASH_FIND, NULL);
+		if (entry != NULL)
+			return entry->profile;
+	}
 
-	if (funcName != NULL)
-		*funcName = NameStr(((Form_pg_proc)GETSTRUCT(*tup))->proname);
+	/* Resolve the decision before entering it, the lookup can fail. */
+	nsp_oid = get_func_namespace(fn_oid);
+	for (i = 0; i < filter_count; i++)
+	{
+		profilerFilter *filter = &filter_local[i];
 
-	return DatumGetCString(DirectFunctionCall1(textout,
-											   SysCacheGetAttr(PROCOID,
-															   *tup,
-															   Anum_pg_proc_prosrc,
-															   &isNull)));
+		if (filter->kind == PL_FILTER_ROLE || filter->db_oid != MyDatabaseId)
+			continue;
+		if (!filter->exclude)
+			include = true;
+		if ((filter->kind == PL_FILTER_FUNCTION && filter->target == fn_oid) ||
+			(filter->kind == PL_FILTER_SCHEMA && filter->target == nsp_oid))
+		{
+			if (filter->exclude)
+				break;
+			included = true;
+		}
+	}
+	profile = (i == filter_count && (!include || included));
+
+	entry = hash_search(filter_hash, &fn_oid, HASH_ENTER, NULL);
+	entry->profile = profile;
+
+	return profile;
 }
 
 /* -------------------------------------------------------------------
- * count_source_lines()
+ * profiler_filter_kind()
  *
- *	This function scans through the source code for a given function
- *	and counts the number of lines of code present in the string.
+ *	Parse the kind argument of the filter functions.
  * -------------------------------------------------------------------
  */
 static int
-count_source_lines(const char *src)
+profiler_filter_kind(text *kind)
 {
-	int			line_count = 1;
-	const char *cp = src;
+	char	   *name = text_to_cstring(kind);
+	const struct config_enum_entry *option;
 
-	while(cp != NULL)
+	for (option = filter_kind_options; option->name != NULL; option++)
 	{
-		line_count++;
-		cp = strchr(cp, '\n');
-		if (cp)
-			cp++;
+		if (pg_strcasecmp(option->name, name) == 0)
+			return option->val;
 	}
 
-	return line_count;
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid plprofiler filter kind \"%s\"", name),
+			 errhint("Valid kinds are \"function\", \"schema\" and "
+					 "\"role\".")));
+	return -1;					/* keep compiler quiet */
 }
 
-static uint32
-line_hash_fn(const void *key, Size keysize)
+/* -------------------------------------------------------------------
+ * profiler_target_match()
+ *
+ *	Check whether this backend matches an entry of the enable table.
+ *	The result is only evaluated again when the table, the current
+ *	user or application_name changed since the last check.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_target_match(profilerSharedState *plpss)
 {
-	const linestatsHashKey *k = (const linestatsHashKey *) key;
+	profilerEnableTarget	targets[PL_MAX_TARGETS];
+	uint32					generation;
+	Oid						user = GetUserId();
+	const char			   *appname = application_name;
+	int						count;
+	int						i;
 
-	return hash_uint32((uint32) k->fn_oid) ^
-		hash_uint32((uint32) k->db_oid);
-}
+	if (appname == NULL)
+		appname = "";
 
-static int
-line_match_fn(const void *key1, const void *key2, Size keysize)
-{
-	const linestatsHashKey  *k1 = (const linestatsHashKey *)key1;
-	const linestatsHashKey  *k2 = (const linestatsHashKey *)key2;
+	generation = pg_atomic_read_u32(&(plpss->enable_generation));
+	if (generation == target_generation && user == target_user &&
+		strncmp(appname, target_appname, NAMEDATALEN) == 0)
+		return target_match;
 
-	if (k1->fn_oid == k2->fn_oid &&
-		k1->db_oid == k2->db_oid)
-		return 0;
-	else
-		return 1;
+	SpinLockAcquire(&(plpss->enable_mutex));
+	count = plpss->num_targets;
+	memcpy(targets, plpss->targets, sizeof(profilerEnableTarget) * count);
+	generation = pg_atomic_read_u32(&(plpss->enable_generation));
+	SpinLockRelease(&(plpss->enable_mutex));
+
+	target_match = false;
+	for (i = 0; i < count && !target_match; i++)
+	{
+		switch (targets[i].kind)
+		{
+			case PL_TARGET_PID:
+				target_match = (targets[i].pid == MyProcPid);
+				break;
+
+			case PL_TARGET_ROLE:
+				target_match = is_member_of_role_nosuper(user,
+														 targets[i].oid);
+				break;
+
+			case PL_TARGET_DATABASE:
+				target_match = (targets[i].oid == MyDatabaseId);
+				break;
+
+			case PL_TARGET_APPNAME:
+			{
+				Datum	pattern;
+
+				pattern = CStringGetTextDatum(NameStr(targets[i].pattern));
+				target_match = DatumGetBool(
+					DirectFunctionCall2Coll(textlike, DEFAULT_COLLATION_OID,
+											CStringGetTextDatum(appname),
+											pattern));
+				break;
+			}
+		}
+	}
+
+	target_generation = generation;
+	target_user = user;
+	strlcpy(target_appname, appname, NAMEDATALEN);
+
+	return target_match;
 }
 
-static uint32
-callgraph_hash_fn(const void *key, Size keysize)
+/* -------------------------------------------------------------------
+ * profiler_target_parse()
+ *
+ *	Build an enable table entry from the kind and value arguments of
+ *	the SQL functions. Roles and databases are given by name.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_target_parse(text *kind, text *value, profilerEnableTarget *target)
 {
-	return hash_any(key, keysize);
+	char	   *kind_name = text_to_cstring(kind);
+	char	   *str = text_to_cstring(value);
+	const struct config_enum_entry *option;
+
+	for (option = target_kind_options; option->name != NULL; option++)
+	{
+		if (pg_strcasecmp(option->name, kind_name) == 0)
+			break;
+	}
+	if (option->name == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid plprofiler target kind \"%s\"", kind_name),
+				 errhint("Valid kinds are \"pid\", \"role\", \"database\" "
+						 "and \"application_name\".")));
+
+	/* Zero everything, so that entries can be compared with memcmp(). */
+	MemSet(target, 0, sizeof(profilerEnableTarget));
+	target->kind = option->val;
+
+	switch (target->kind)
+	{
+		case PL_TARGET_PID:
+		{
+			char	   *end;
+			long		pid;
+
+			errno = 0;
+			pid = strtol(str, &end, 10);
+			if (errno != 0 || end == str || *end != '\0' ||
+				pid <= 0 || pid > INT_MAX)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid process ID \"%s\"", str)));
+			target->pid = (int) pid;
+			break;
+		}
+
+		case PL_TARGET_ROLE:
+			target->oid = get_role_oid(str, false);
+			break;
+
+		case PL_TARGET_DATABASE:
+			target->oid = get_database_oid(str, false);
+			break;
+
+		case PL_TARGET_APPNAME:
+			if (strlen(str) >= NAMEDATALEN)
+				ereport(ERROR,
+						(errcode(ERRCODE_NAME_TOO_LONG),
+						 errmsg("application_name pattern is too long"),
+						 errdetail("The maximum length is %d.",
+								   NAMEDATALEN - 1)));
+			namestrcpy(&(target->pattern), str);
+			break;
+	}
 }
 
-static int
-callgraph_match_fn(const void *key1, const void *key2, Size keysize)
+/* -------------------------------------------------------------------
+ * profiler_sample_scale()
+ *
+ *	Factor to scale the local counters with. This is the ratio of all
+ *	top level calls to the sampled ones since the local counters were
+ *	last reset, which stays unbiased if the sample rate is changed.
+ * -------------------------------------------------------------------
+ */
+static double
+profiler_sample_scale(void)
 {
-	callGraphKey   *stack1 = (callGraphKey *)key1;
-	callGraphKey   *stack2 = (callGraphKey *)key2;
-	int				i;
+	if (profiler_sampled_calls == 0 ||
+		profiler_sampled_calls == profiler_total_calls)
+		return 1.0;
 
-	if (stack1->db_oid != stack2->db_oid)
-		return 1;
-	for (i = 0; i < PL_MAX_STACK_DEPTH && stack1->stack[i] != InvalidOid; i++)
-		if (stack1->stack[i] != stack2->stack[i])
-			return 1;
-	return 0;
+	return (double) profiler_total_calls / (double) profiler_sampled_calls;
 }
 
+/* -------------------------------------------------------------------
+ * profiler_sample_timer()
+ *
+ *	Timeout handler of the sampling mode. This runs in signal handler
+ *	context, so it only counts the tick for profiler_sample_fold().
+ *	Without periodic timeouts it also rearms itself, so that a long
+ *	running statement keeps getting sampled.
+ * -------------------------------------------------------------------
+ */
 static void
-callgraph_push(Oid func_oid)
+profiler_sample_timer(void)
 {
-	/*
-	 * We only track function Oids in the call stack up to PL_MAX_STACK_DEPTH.
-	 * Beyond that we just count the current stack depth.
-	 */
-	if (graph_stack_pt < PL_MAX_STACK_DEPTH)
-	{
-		/*
-		 * Push this function Oid onto the stack, remember the entry time and
-		 * set the time spent in children to zero.
-		 */
-		graph_stack.stack[graph_stack_pt] = func_oid;
-		INSTR_TIME_SET_CURRENT(graph_stack_entry[graph_stack_pt]);
-		graph_stack_child_time[graph_stack_pt] = 0;
-	}
-	graph_stack_pt++;
+	sample_ticks++;
+
+#if PG_VERSION_NUM < 150000
+	if (sample_timer_armed)
+		enable_timeout_after(sample_timeout_id, profiler_sampling_interval);
+#endif
 }
 
+/* -------------------------------------------------------------------
+ * profiler_sample_fold()
+ *
+ *	Add the sample ticks counted since the last call to the counters
+ *	reachable from the call stack. The hooks call this before they
+ *	change the stack or the current statements. Every frame gets the
+ *	sampled time added to its total time and to its current statement,
+ *	the top frame also to its self time. Ticks counted while not
+ *	sampling are dropped.
+ * -------------------------------------------------------------------
+ */
 static void
-callgraph_pop_one(void)
+profiler_sample_fold(void)
 {
-	instr_time			now;
-	uint64				us_elapsed;
-	uint64				us_self;
-	linestatsHashKey	key;
-	linestatsEntry	   *entry;
+	sig_atomic_t	ticks = sample_ticks;
+	uint64			ns;
+	int				depth;
+	int				i;
 
-	/* Check for call stack underrun. */
-    if (graph_stack_pt <= 0)
-	{
-		elog(DEBUG1, "plprofiler: call graph stack underrun");
+	/* The tick counter wraps around, the difference is still right. */
+	if (ticks == sample_ticks_folded)
 		return;
-	}
+	ns = (uint64) profiler_sampling_interval * 1000000 *
+		 (uint32) (ticks - sample_ticks_folded);
+	sample_ticks_folded = ticks;
 
-	/* Remove one level from the call stack. */
-	graph_stack_pt--;
-
-	/* Calculate the time spent in this function and record it. */
-	INSTR_TIME_SET_CURRENT(now);
-	INSTR_TIME_SUBTRACT(now, graph_stack_entry[graph_stack_pt]);
-	us_elapsed = INSTR_TIME_GET_MICROSEC(now);
-	us_self = us_elapsed - graph_stack_child_time[graph_stack_pt];
-	callgraph_collect(us_elapsed, us_self,
-					  graph_stack_child_time[graph_stack_pt]);
+	if (!profiler_active || !profiler_sampling)
+		return;
 
-	/* If we have a caller, add our own time to the time of its children. */
-	if (graph_stack_pt > 0)
-		graph_stack_child_time[graph_stack_pt - 1] += us_elapsed;
+	depth = Min(graph_stack_pt, PL_MAX_STACK_DEPTH);
+	for (i = 0; i < depth; i++)
+	{
+		callGraphFrame *frame = &graph_stack[i];
+		profilerInfo   *info = frame->info;
 
-	/*
-	 * We also collect per function global counts in the pseudo line number
-	 * zero. The line stats are cumulative (for example a FOR ... LOOP
-	 * statement has the entire execution time of all statements in its
-	 * block), so this can't be derived from the actual per line data.
-	 */
-	key.fn_oid = graph_stack.stack[graph_stack_pt];
-	key.db_oid = MyDatabaseId;
+		frame->sample_time += ns;
+		frame->node->totalTime += ns;
+		if (i == depth - 1)
+			frame->node->selfTime += ns;
+		else
+			frame->node->childTime += ns;
 
-	entry = (linestatsEntry *)hash_search(functions_hash, &key, HASH_FIND, NULL);
+		if (info != NULL && info->in_use &&
+			info->cur_slot > 0 && info->cur_slot < info->line_count)
+			info->line_info[info->cur_slot].ns_total += ns;
+	}
+}
 
-	if (entry)
-	{
-		entry->line_info[0].exec_count += 1;
-		entry->line_info[0].us_total += us_elapsed;
+/* -------------------------------------------------------------------
+ * profiler_sampling_start()
+ *
+ *	Arm the sample timer if it isn't running yet.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_sampling_start(void)
+{
+	if (sample_timer_armed)
+		return;
 
-		if (us_elapsed > entry->line_info[0].us_max)
-			entry->line_info[0].us_max = us_elapsed;
-	}
-	else
+	if (!sample_timeout_registered)
 	{
-		elog(DEBUG1, "plprofiler: local linestats entry for fn_oid %u "
-					"not found", graph_stack.stack[graph_stack_pt]);
+		sample_timeout_id = RegisterTimeout(USER_TIMEOUT,
+											profiler_sample_timer);
+		sample_timeout_registered = true;
 	}
 
-	/* Zap the oid from the call stack. */
-	graph_stack.stack[graph_stack_pt] = InvalidOid;
+	/* Set first, the handler only rearms an armed timer. */
+	sample_timer_armed = true;
+#if PG_VERSION_NUM >= 150000
+	enable_timeout_every(sample_timeout_id,
+						 TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+													 profiler_sampling_interval),
+						 profiler_sampling_interval);
+#else
+	enable_timeout_after(sample_timeout_id, profiler_sampling_interval);
+#endif
 }
 
+/* -------------------------------------------------------------------
+ * profiler_sampling_stop()
+ *
+ *	Disarm the sample timer.
+ * -------------------------------------------------------------------
+ */
 static void
-callgraph_pop(Oid func_oid)
+profiler_sampling_stop(void)
 {
-	callgraph_check(func_oid);
-	callgraph_pop_one();
+	if (!sample_timer_armed)
+		return;
+
+	disable_timeout(sample_timeout_id, false);
+	sample_timer_armed = false;
 }
 
-static void
-callgraph_check(Oid func_oid)
+/* -------------------------------------------------------------------
+ * profiler_hist_alloc()
+ *
+ *	Allocate count latency histograms from the shared pool. Returns
+ *	NULL when the pool is used up.
+ * -------------------------------------------------------------------
+ */
+static pg_atomic_uint32 *
+profiler_hist_alloc(int count)
 {
-	/*
-	 * Unwind the call stack until our own func_oid appears on the top.
-	 *
-	 * In case of an exception, the pl executor does not call the
-	 * func_end callback, so we record now as the end of the function
-	 * calls, that were left on the stack.
-	 */
-	while (graph_stack_pt > 0
-		   && graph_stack.stack[graph_stack_pt - 1] != func_oid)
+	profilerSharedState	   *plpss = profiler_shared_state;
+	pg_atomic_uint32	   *hist;
+	int						start;
+
+	start = profiler_pool_alloc(&(plpss->hists_free), &(plpss->hists_used),
+								profiler_max_histograms, count);
+	if (start < 0)
 	{
-		elog(DEBUG1, "plprofiler: unwinding excess call graph stack entry for %u in %u",
-			 graph_stack.stack[graph_stack_pt - 1], func_oid);
-		callgraph_pop_one();
+		if (profiler_max_histograms > 0 && !plpss->histograms_overflow)
+		{
+			elog(LOG,
+				 "plprofiler: entry limit reached for "
+				 "shared memory latency histograms");
+			plpss->histograms_overflow = true;
+		}
+		return NULL;
 	}
+
+	hist = PL_HIST_POOL(plpss) + (Size) start * PL_HIST_BUCKETS;
+	profiler_hist_init(hist, count);
+
+	return hist;
 }
 
+/* -------------------------------------------------------------------
+ * profiler_hist_init()
+ *
+ *	Zero count newly allocated shared latency histograms.
+ * -------------------------------------------------------------------
+ */
 static void
-callgraph_collect(uint64 us_elapsed, uint64 us_self, uint64 us_children)
+profiler_hist_init(pg_atomic_uint32 *hist, int count)
 {
-	callGraphEntry *entry;
-	bool			found;
+	int		i;
 
-	graph_stack.db_oid = MyDatabaseId;
-	entry = (callGraphEntry *)hash_search(callgraph_hash, &graph_stack,
-										  HASH_ENTER, &found);
+	for (i = 0; i < count * PL_HIST_BUCKETS; i++)
+		pg_atomic_init_u32(&hist[i], 0);
+}
 
-	if (!found)
-	{
-		entry->callCount = 1;
-		entry->totalTime = us_elapsed;
-		entry->childTime = us_children;
-		entry->selfTime = us_self;
-	}
-	else
+/* -------------------------------------------------------------------
+ * profiler_pool_class()
+ *
+ *	Return the free list size class of an extent of count elements.
+ *	Class k holds extents of 2^k up to 2^(k+1) - 1 elements, the last
+ *	class everything larger.
+ * -------------------------------------------------------------------
+ */
+static int
+profiler_pool_class(int count)
+{
+	int		size_class = 0;
+
+	while (size_class < PL_POOL_SIZE_CLASSES - 1 && (count >> 1) > 0)
 	{
-		entry->callCount++;
-		entry->totalTime = entry->totalTime + us_elapsed;
-		entry->childTime = entry->childTime + us_children;
-		entry->selfTime  = entry->selfTime + us_self;
+		count >>= 1;
+		size_class++;
 	}
+
+	return size_class;
 }
 
-static int32
-profiler_collect_data(void)
+/* -------------------------------------------------------------------
+ * profiler_pool_link()
+ *
+ *	Put an extent slot on the list of the size class of its count.
+ *	The caller holds the mutex.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_pool_link(profilerPoolFree *pool_free, int slot)
 {
-	HASH_SEQ_STATUS			hash_seq;
-	callGraphEntry		   *cge1;
-	callGraphEntry		   *cge2;
-	linestatsEntry		   *lse1;
-	linestatsEntry		   *lse2;
-	profilerSharedState	   *plpss = profiler_shared_state;
-	bool					have_exclusive_lock = false;
-	bool					found;
-	int						i;
-
-	/*
-	 * Return without doing anything if the plprofiler extension
-	 * was not loaded via shared_preload_libraries. We don't have
-	 * any shared memory state in that case.
-	 */
-	if (plpss == NULL)
-		return -1;
+	profilerPoolExtent *ext = &(pool_free->extents[slot]);
+	int					size_class = profiler_pool_class(ext->count);
 
-	/*
-	 * Don't waste any time here if there was no new data recorded
-	 * since the last collect_data() call.
-	 */
-	if (!have_new_local_data)
-		return 0;
-	have_new_local_data = false;
+	ext->next = pool_free->heads[size_class];
+	pool_free->heads[size_class] = slot;
+}
 
-	/*
-	 * Acquire a shared lock on the shared hash tables. We escalate
-	 * to an exclusive lock later in case we need to add a new entry.
-	 */
-	LWLockAcquire(plpss->lock, LW_SHARED);
+/* -------------------------------------------------------------------
+ * profiler_pool_alloc()
+ *
+ *	Reserve count elements of one of the shared counter pools. A free
+ *	extent is taken from the size class of count, where the first one
+ *	large enough is used, or else from the next larger class, where
+ *	any extent fits. What is left of the extent goes back to the free
+ *	list. Without a free extent the fill level is advanced. Backends
+ *	holding different partition locks allocate concurrently, so that
+ *	is done with compare-and-exchange. Returns the index of the first
+ *	element or -1 when the pool is used up.
+ * -------------------------------------------------------------------
+ */
+static int
+profiler_pool_alloc(profilerPoolFree *pool_free, pg_atomic_uint32 *used,
+					int limit, int count)
+{
+	uint32	cur;
 
-	/* Collect the callgraph data into shared memory. */
-	hash_seq_init(&hash_seq, callgraph_hash);
-	while ((cge1 = hash_seq_search(&hash_seq)) != NULL)
+	/* Only a hint, the free list is searched under the spinlock. */
+	if (pool_free->nfree >= count)
 	{
-		cge2 = hash_search(callgraph_shared, &(cge1->key),
-						   HASH_FIND, NULL);
-		if (cge2 == NULL)
+		int		start = -1;
+		int		size_class;
+		int	   *link;
+
+		SpinLockAcquire(&(pool_free->mutex));
+		for (size_class = profiler_pool_class(count);
+			 start < 0 && size_class < PL_POOL_SIZE_CLASSES;
+			 size_class++)
 		{
-			/*
-			 * This callgraph is not yet known in shared memory.
-			 * Need to escalate the lock to exclusive.
-			 */
-			if (!have_exclusive_lock)
+			for (link = &(pool_free->heads[size_class]); *link >= 0;
+				 link = &(pool_free->extents[*link].next))
 			{
-				LWLockRelease(plpss->lock);
-				LWLockAcquire(plpss->lock, LW_EXCLUSIVE);
-				have_exclusive_lock = true;
-			}
+				int					slot = *link;
+				profilerPoolExtent *ext = &(pool_free->extents[slot]);
 
-			cge2 = hash_search(callgraph_shared, &(cge1->key),
-							   HASH_ENTER, &found);
-			if (cge2 == NULL)
-			{
-				/*
-				 * This means that we are out of shared memory for the
-				 * callgraph_shared hash table. Nothing we can do
-				 * here but complain.
-				 */
-				if (!plpss->callgraph_overflow)
+				if (ext->count < count)
+					continue;
+
+				*link = ext->next;
+				start = ext->start;
+				ext->start += count;
+				ext->count -= count;
+				pool_free->nfree -= count;
+
+				if (ext->count > 0)
+					profiler_pool_link(pool_free, slot);
+				else
 				{
-					elog(LOG,
-						 "plprofiler: entry limit reached for "
-						 "shared memory call graph data");
-					plpss->callgraph_overflow = true;
+					ext->next = pool_free->unused;
+					pool_free->unused = slot;
 				}
 				break;
 			}
-
-			/*
-			 * Since we released the lock above for lock escalation to
-			 * exclusive, it is possible that someone else in the meantime
-			 * created the entry for this call graph.
-			 */
-			if (!found)
-			{
-				/*
-				 * We created a new entry for this call graph in the
-				 * shared hash table. Initialize it.
-				 */
-				/* memcpy(&(cge2->key), &(cge1->key), sizeof(callGraphKey)); */
-				SpinLockInit(&(cge2->mutex));
-				cge2->callCount = 0;
-				cge2->totalTime = 0;
-				cge2->childTime = 0;
-				cge2->selfTime = 0;
-			}
 		}
+		SpinLockRelease(&(pool_free->mutex));
 
-		/*
-		 * At this point we have the local entry in cge1 and the shared
-		 * entry in cge2. Since we may still only hold a shared lock on
-		 * the shared state, use a spinlock on the shared entry while
-		 * adding the counters. Then reset our local counters to zero.
-		 */
-		SpinLockAcquire(&(cge2->mutex));
-		cge2->callCount += cge1->callCount;
-		cge2->totalTime += cge1->totalTime;
-		cge2->childTime += cge1->childTime;
-		cge2->selfTime  += cge1->selfTime ;
-		SpinLockRelease(&(cge2->mutex));
-
-		cge1->callCount = 0;
-		cge1->totalTime = 0;
-		cge1->childTime = 0;
-		cge1->selfTime = 0;
+		if (start >= 0)
+			return start;
 	}
 
-	/* Collect the linestats data into shared memory. */
-	hash_seq_init(&hash_seq, functions_hash);
-	while ((lse1 = hash_seq_search(&hash_seq)) != NULL)
+	cur = pg_atomic_read_u32(used);
+	do
 	{
-		lse2 = hash_search(functions_shared, &(lse1->key),
-						   HASH_FIND, NULL);
-		if (lse2 == NULL)
+		if (count > limit - (int) cur)
 		{
 			/*
-			 * This function is not yet known in shared memory.
-			 * Need to escalate the lock to exclusive.
-			 */
-			if (!have_exclusive_lock)
-			{
-				LWLockRelease(plpss->lock);
-				LWLockAcquire(plpss->lock, LW_EXCLUSIVE);
-				have_exclusive_lock = true;
-			}
-
-			lse2 = hash_search(functions_shared, &(lse1->key),
-							   HASH_ENTER, &found);
-			if (lse2 == NULL)
-			{
-				/*
-				 * This means that we are out of shared memory for the
-				 * functions_shared hash table. Nothing we can do
-				 * here but complain.
-				 */
-				if (!plpss->functions_overflow)
-				{
-					elog(LOG,
-						 "plprofiler: entry limit reached for "
-						 "shared memory functions data");
-					plpss->functions_overflow = true;
-				}
-				break;
-			}
-			if (memcmp(&(lse2->key), &(lse1->key), sizeof(linestatsHashKey)) != 0)
-			{
-				elog(FATAL, "key of new hash entry doesn't match");
-			}
-
-			/*
-			 * Since we released the lock above for lock escalation to
-			 * exclusive, it is possible that someone else in the meantime
-			 * created the entry for this function.
+			 * The pool is used up. If the free slices would be enough,
+			 * it is only fragmented, and the collect worker can compact
+			 * it.
 			 */
-			if (!found)
-			{
-				/*
-				 * We created a new entry for this function in the
-				 * shared hash table. Initialize it. We also need to
-				 * allocate the per line counters here. If we run out
-				 * of per line counters in the shared state, we don't
-				 * keep count for any lines of this function at all.
-				 */
-				SpinLockInit(&(lse2->mutex));
-				if (lse1->line_count <= profiler_max_lines - plpss->lines_used)
-				{
-					lse2->line_count = lse1->line_count;
-					lse2->line_info = &(plpss->line_info[plpss->lines_used]);
-					plpss->lines_used += lse1->line_count;
-					memset(lse2->line_info, 0,
-						   sizeof(linestatsLineInfo) * lse1->line_count);
-				}
-				else
-				{
-					if (!plpss->lines_overflow)
-					{
-						elog(LOG,
-							 "plprofiler: entry limit reached for "
-							 "shared memory per source line data");
-						plpss->lines_overflow = true;
-					}
-					lse2->line_count = 0;
-					lse2->line_info = NULL;
-				}
-			}
-		}
-
-		/*
-		 * At this point we have the local entry in lse1 and the shared
-		 * entry in lse2. Since we may still only hold a shared lock on
-		 * the shared state, use a spinlock on the shared entry while
-		 * adding the counters.
-		 */
-		SpinLockAcquire(&(lse2->mutex));
-		for (i = 0; i < lse1->line_count && i < lse2->line_count; i++)
-		{
-			if (lse1->line_info[i].us_max > lse2->line_info[i].us_max)
-				lse2->line_info[i].us_max = lse1->line_info[i].us_max;
-			lse2->line_info[i].us_total += lse1->line_info[i].us_total;
-			lse2->line_info[i].exec_count += lse1->line_info[i].exec_count;
+			if (profiler_pool_nfree(pool_free) >= count)
+				profiler_compact_request();
+			return -1;
 		}
-		SpinLockRelease(&(lse2->mutex));
-
-		memset(lse1->line_info, 0,
-			   sizeof(linestatsLineInfo) * lse1->line_count);
-	}
-
-	/* All done, release the lock. */
-	LWLockRelease(plpss->lock);
+	} while (!pg_atomic_compare_exchange_u32(used, &cur, cur + count));
 
-	return 0;
+	return (int) cur;
 }
 
-static void
-profiler_xact_callback(XactEvent event, void *arg)
+/* -------------------------------------------------------------------
+ * profiler_pool_free()
+ *
+ *	Return count elements starting at start to the free list of a
+ *	shared counter pool. Adjacent extents are not merged here, the
+ *	compaction does that for the whole pool.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_pool_free(profilerPoolFree *pool_free, int start, int count)
 {
-	Assert(profiler_shared_state != NULL);
+	int		slot;
 
-	/* Collect the statistics if needed. */
-	if (profiler_active &&
-		profiler_shared_state->profiler_collect_interval > 0)
-	{
-		switch (event)
-		{
-			case XACT_EVENT_COMMIT:
-			case XACT_EVENT_ABORT:
-			case XACT_EVENT_PARALLEL_COMMIT:
-			case XACT_EVENT_PARALLEL_ABORT:
-				profiler_collect_data();
-				break;
+	if (count <= 0)
+		return;
 
-			default:
-				break;
-		}
+	SpinLockAcquire(&(pool_free->mutex));
+	slot = pool_free->unused;
+	if (slot >= 0)
+	{
+		pool_free->unused = pool_free->extents[slot].next;
+		pool_free->extents[slot].start = start;
+		pool_free->extents[slot].count = count;
+		profiler_pool_link(pool_free, slot);
+		pool_free->nfree += count;
 	}
+	SpinLockRelease(&(pool_free->mutex));
 
-	/* Tell func_init that we need to evaluate the new active state. */
-	profiler_first_call_in_xact = true;
+	/* Out of extent slots, the slice is lost until compacted. */
+	if (slot < 0)
+		profiler_compact_request();
+}
 
-	/* We can also unwind the callstack here in case of abort. */
-	callgraph_check(InvalidOid);
+/* -------------------------------------------------------------------
+ * profiler_pool_clear()
+ *
+ *	Empty the free list of a shared counter pool, that is handed out
+ *	from the start again.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_pool_clear(profilerPoolFree *pool_free)
+{
+	int		i;
+
+	SpinLockAcquire(&(pool_free->mutex));
+	for (i = 0; i < PL_POOL_SIZE_CLASSES; i++)
+		pool_free->heads[i] = -1;
+	for (i = 0; i < PL_POOL_FREE_EXTENTS; i++)
+		pool_free->extents[i].next = i + 1;
+	pool_free->extents[PL_POOL_FREE_EXTENTS - 1].next = -1;
+	pool_free->unused = 0;
+	pool_free->nfree = 0;
+	SpinLockRelease(&(pool_free->mutex));
 }
 
-/**********************************************************************
- * SQL callable functions
- **********************************************************************/
+/* -------------------------------------------------------------------
+ * profiler_pool_nfree()
+ *
+ *	Return the number of elements on the free list of a shared counter
+ *	pool.
+ * -------------------------------------------------------------------
+ */
+static int
+profiler_pool_nfree(profilerPoolFree *pool_free)
+{
+	int		nfree;
+
+	SpinLockAcquire(&(pool_free->mutex));
+	nfree = pool_free->nfree;
+	SpinLockRelease(&(pool_free->mutex));
+
+	return nfree;
+}
 
 /* -------------------------------------------------------------------
- * pl_profiler_get_stack(stack oid[])
+ * profiler_compact_request()
  *
- *	Converts a stack in Oid[] format into a text[].
+ *	Ask the collect worker to compact the fixed counter pools.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_get_stack(PG_FUNCTION_ARGS)
+static void
+profiler_compact_request(void)
 {
-	ArrayType	   *stack_in = PG_GETARG_ARRAYTYPE_P(0);
-	Datum		   *stack_oid;
-	bool		   *nulls;
-	int				nelems;
-	int				i;
-	Datum		   *funcdefs;
-	char			funcdef_buf[100 + NAMEDATALEN * 2];
+	profilerSharedState	   *plpss = profiler_shared_state;
+	Latch				   *latch;
 
-	/* Take the array apart */
-	deconstruct_array(stack_in, OIDOID,
-					  sizeof(Oid), true, 'i',
-					  &stack_oid, &nulls, &nelems);
+	if (plpss->compact_requested)
+		return;
 
-	/* Allocate the Datum array for the individual function signatures. */
-	funcdefs = palloc(sizeof(Datum) * nelems);
+	plpss->compact_requested = true;
+	latch = plpss->worker_latch;
+	if (latch != NULL)
+		SetLatch(latch);
+}
 
-	/*
-	 * Turn each of the function Oids, that are in the array, into
-	 * a text that is "schema.funcname(funcargs) oid=funcoid".
-	 */
-	for (i = 0; i < nelems; i++)
+/* -------------------------------------------------------------------
+ * profiler_pool_compact()
+ *
+ *	Move the live slices of one fixed counter pool down to its start,
+ *	so that all free space is in one piece at the end. The pointers in
+ *	the entries are fixed up and the free list is emptied. Returns the
+ *	number of elements reclaimed.
+ * -------------------------------------------------------------------
+ */
+static int64
+profiler_pool_compact(profilerPoolSlice *slices, int nslices, char *base,
+					  Size elem_size, profilerPoolFree *pool_free,
+					  pg_atomic_uint32 *used)
+{
+	int		dst = 0;
+	int		old_used = (int) pg_atomic_read_u32(used);
+	int		i;
+
+	qsort(slices, nslices, sizeof(profilerPoolSlice), profiler_slice_cmp);
+
+	for (i = 0; i < nslices; i++)
 	{
-		char	   *funcname;
-		char	   *nspname;
+		profilerPoolSlice  *slice = &slices[i];
+
+		if (slice->start != dst)
+			memmove(base + (Size) dst * elem_size,
+					base + (Size) slice->start * elem_size,
+					(Size) slice->count * elem_size);
+		*(slice->ref) = base + (Size) dst * elem_size;
+		dst += slice->count;
+	}
 
-		funcname = get_func_name(DatumGetObjectId(stack_oid[i]));
-		if (funcname != NULL)
-		{
-			nspname = get_namespace_name(get_func_namespace(DatumGetObjectId(stack_oid[i])));
-			if (nspname == NULL)
-				nspname = pstrdup("<unknown>");
-		}
-		else
-		{
-			nspname = pstrdup("<unknown>");
-			funcname = pstrdup("<unknown>");
-		}
+	pg_atomic_write_u32(used, (uint32) dst);
+	profiler_pool_clear(pool_free);
 
-		snprintf(funcdef_buf, sizeof(funcdef_buf),
-				 "%s.%s() oid=%u", nspname, funcname,
-				 DatumGetObjectId(stack_oid[i]));
+	return (int64) (old_used - dst);
+}
 
-		pfree(nspname);
-		pfree(funcname);
+static int
+profiler_slice_cmp(const void *a, const void *b)
+{
+	const profilerPoolSlice *slice_a = (const profilerPoolSlice *) a;
+	const profilerPoolSlice *slice_b = (const profilerPoolSlice *) b;
 
-		funcdefs[i] = PointerGetDatum(cstring_to_text(funcdef_buf));
+	if (slice_a->start < slice_b->start)
+		return -1;
+	if (slice_a->start > slice_b->start)
+		return 1;
+	return 0;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_pool_add_slice()
+ *
+ *	Remember a live slice of a fixed counter pool for the compaction.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_pool_add_slice(profilerPoolSlice **slices, int *nslices, int *size,
+						void **ref, char *base, Size elem_size, int count)
+{
+	profilerPoolSlice  *slice;
+
+	if (*ref == NULL || count <= 0)
+		return;
+
+	if (*nslices >= *size)
+	{
+		*size *= 2;
+		*slices = repalloc(*slices, sizeof(profilerPoolSlice) * *size);
 	}
 
-	/* Return the texts as a text[]. */
-	PG_RETURN_ARRAYTYPE_P(construct_array(funcdefs, nelems,
-										  TEXTOID, -1,
-										  false, 'i'));
+	slice = &((*slices)[(*nslices)++]);
+	slice->start = (int) (((char *) *ref - base) / elem_size);
+	slice->count = count;
+	slice->ref = ref;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_linestats_local()
+ * profiler_compact()
  *
- *	Returns the content of the local line stats hash table
- *	as a set of rows.
+ *	Compact the fixed counter pools online. All partition locks of
+ *	both shared tables are taken exclusively, so no backend or the
+ *	collect worker can be using the counters, while the live slices
+ *	are moved. Returns the number of pool elements reclaimed. In the
+ *	dynamic storage mode the DSA area handles fragmentation itself and
+ *	there is nothing to do.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_linestats_local(PG_FUNCTION_ARGS)
+static int64
+profiler_compact(void)
 {
-	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
-	TupleDesc			tupdesc;
-	Tuplestorestate	   *tupstore;
-	MemoryContext		per_query_ctx;
-	MemoryContext		oldcontext;
-	HASH_SEQ_STATUS		hash_seq;
-	linestatsEntry	   *entry;
-
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context "
-						"that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not "
-						"allowed in this context")));
+	profilerSharedState	   *plpss = profiler_shared_state;
+	profilerSharedScan		cgscan;
+	profilerSharedScan		lsscan;
+	callGraphEntry		   *cgent;
+	linestatsSharedEntry   *lsent;
+	profilerPoolSlice	   *lines;
+	profilerPoolSlice	   *hists;
+	profilerPoolSlice	   *ios;
+	int						nlines = 0;
+	int						nhists = 0;
+	int						nios = 0;
+	int						lines_size = 64;
+	int						hists_size = 64;
+	int						ios_size = 64;
+	char				   *lines_base;
+	char				   *hists_base;
+	char				   *ios_base;
+	int64					reclaimed = 0;
+
+	plpss->compact_requested = false;
+	if (PL_DYNAMIC)
+		return 0;
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+	lines = palloc(sizeof(profilerPoolSlice) * lines_size);
+	hists = palloc(sizeof(profilerPoolSlice) * hists_size);
+	ios = palloc(sizeof(profilerPoolSlice) * ios_size);
+	lines_base = (char *) plpss->line_info;
+	hists_base = (char *) PL_HIST_POOL(plpss);
+	ios_base = (char *) PL_IO_POOL(plpss);
 
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	profiler_scan_begin(&cgscan, true, true);
+	profiler_scan_begin(&lsscan, false, true);
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	/* Stale entries still own their slices. */
+	cgscan.stale = true;
+	lsscan.stale = true;
 
-	MemoryContextSwitchTo(oldcontext);
+	while ((cgent = profiler_scan_next(&cgscan)) != NULL)
+		profiler_pool_add_slice(&hists, &nhists, &hists_size,
+								(void **) &(cgent->hist), hists_base,
+								PL_SHARED_HIST_SIZE, 1);
 
-	if (functions_hash != NULL)
+	while ((lsent = profiler_scan_next(&lsscan)) != NULL)
 	{
-		hash_seq_init(&hash_seq, functions_hash);
-		while ((entry = hash_seq_search(&hash_seq)) != NULL)
-		{
-			int64	lno;
-
-			for (lno = 0; lno < entry->line_count; lno++)
-			{
-				Datum		values[PL_PROFILE_COLS];
-				bool		nulls[PL_PROFILE_COLS];
-				int			i = 0;
+		profiler_pool_add_slice(&lines, &nlines, &lines_size,
+								(void **) &(lsent->line_info), lines_base,
+								sizeof(linestatsSharedLine),
+								lsent->line_count);
+		profiler_pool_add_slice(&hists, &nhists, &hists_size,
+								(void **) &(lsent->hist), hists_base,
+								PL_SHARED_HIST_SIZE, lsent->line_count);
+		profiler_pool_add_slice(&ios, &nios, &ios_size,
+								(void **) &(lsent->io), ios_base,
+								PL_SHARED_IO_SIZE, lsent->line_count);
+	}
 
-				/* Include this entry in the result. */
-				MemSet(values, 0, sizeof(values));
-				MemSet(nulls, 0, sizeof(nulls));
+	reclaimed += profiler_pool_compact(lines, nlines, lines_base,
+									   sizeof(linestatsSharedLine),
+									   &(plpss->lines_free),
+									   &(plpss->lines_used));
+	reclaimed += profiler_pool_compact(hists, nhists, hists_base,
+									   PL_SHARED_HIST_SIZE,
+									   &(plpss->hists_free),
+									   &(plpss->hists_used));
+	reclaimed += profiler_pool_compact(ios, nios, ios_base,
+									   PL_SHARED_IO_SIZE,
+									   &(plpss->io_free),
+									   &(plpss->io_used));
+
+	/* Log again when the pools run full the next time. */
+	plpss->lines_overflow = false;
+	plpss->histograms_overflow = false;
+	plpss->io_overflow = false;
 
-				values[i++] = ObjectIdGetDatum(entry->key.fn_oid);
-				values[i++] = Int64GetDatumFast(lno);
-				values[i++] = Int64GetDatumFast(entry->line_info[lno].exec_count);
-				values[i++] = Int64GetDatumFast(entry->line_info[lno].us_total);
-				values[i++] = Int64GetDatumFast(entry->line_info[lno].us_max);
+	profiler_scan_end(&lsscan);
+	profiler_scan_end(&cgscan);
 
-				Assert(i == PL_PROFILE_COLS);
+	pfree(lines);
+	pfree(hists);
+	pfree(ios);
 
-				tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-			}
-		}
-	}
+	if (reclaimed > 0)
+		elog(DEBUG1, "plprofiler: compacted shared counter pools, "
+					 INT64_FORMAT " elements reclaimed", reclaimed);
 
-	PG_RETURN_VOID();
+	return reclaimed;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_linestats_shared()
+ * linestats_fixed_free()
  *
- *	Returns the content of the shared line stats hash table
- *	as a set of rows.
+ *	Return the counter slices of a linestats entry, that is removed,
+ *	to the free lists of the fixed pools.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_linestats_shared(PG_FUNCTION_ARGS)
+static void
+linestats_fixed_free(linestatsSharedEntry *lse2)
 {
-	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
-	TupleDesc				tupdesc;
-	Tuplestorestate		   *tupstore;
-	MemoryContext			per_query_ctx;
-	MemoryContext			oldcontext;
-	HASH_SEQ_STATUS			hash_seq;
-	linestatsEntry		   *entry;
 	profilerSharedState	   *plpss = profiler_shared_state;
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context "
-						"that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not "
-						"allowed in this context")));
-
-	/* Check that plprofiler was loaded via shared_preload_libraries */
-	if (plpss == NULL)
-		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
-
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
-
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	if (lse2->line_info != NULL)
+		profiler_pool_free(&(plpss->lines_free),
+						   (int) (lse2->line_info - plpss->line_info),
+						   lse2->line_count);
+	if (lse2->hist != NULL)
+		profiler_pool_free(&(plpss->hists_free),
+						   (int) ((lse2->hist - PL_HIST_POOL(plpss)) /
+								  PL_HIST_BUCKETS),
+						   lse2->line_count);
+	if (lse2->io != NULL)
+		profiler_pool_free(&(plpss->io_free),
+						   (int) ((lse2->io - PL_IO_POOL(plpss)) /
+								  PL_IO_COUNTERS),
+						   lse2->line_count);
+}
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+/* -------------------------------------------------------------------
+ * callgraph_fixed_free()
+ *
+ *	Return the histogram of a call graph entry, that is removed, to
+ *	the free list of the histogram pool.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_fixed_free(callGraphEntry *cge2)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
 
-	MemoryContextSwitchTo(oldcontext);
+	if (cge2->hist != NULL)
+		profiler_pool_free(&(plpss->hists_free),
+						   (int) ((cge2->hist - PL_HIST_POOL(plpss)) /
+								  PL_HIST_BUCKETS), 1);
+}
 
-	/* Place a shared lock on the shared memory data. */
-	LWLockAcquire(plpss->lock, LW_SHARED);
+/* -------------------------------------------------------------------
+ * profiler_lines_alloc()
+ *
+ *	Allocate the shared counters for count slots of a function.
+ *	Returns NULL when the pool is used up.
+ * -------------------------------------------------------------------
+ */
+static linestatsSharedLine *
+profiler_lines_alloc(int count)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	linestatsSharedLine	   *line_info;
+	int						start;
 
-	hash_seq_init(&hash_seq, functions_shared);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	start = profiler_pool_alloc(&(plpss->lines_free), &(plpss->lines_used),
+								profiler_max_lines, count);
+	if (start < 0)
 	{
-		int64	lno;
-
-		if (entry->key.db_oid != MyDatabaseId)
-			continue;
+		if (!plpss->lines_overflow)
+		{
+			elog(LOG,
+				 "plprofiler: entry limit reached for "
+				 "shared memory per source line data");
+			plpss->lines_overflow = true;
+		}
+		return NULL;
+	}
 
-		/* Guard agains concurrent updates of the counters. */
-		SpinLockAcquire(&(entry->mutex));
+	line_info = &(plpss->line_info[start]);
+	profiler_lines_init(line_info, count);
 
-		for (lno = 0; lno <= entry->line_count; lno++)
-		{
-			Datum		values[PL_PROFILE_COLS];
-			bool		nulls[PL_PROFILE_COLS];
-			int			i = 0;
+	return line_info;
+}
 
-			/* Include this entry in the result. */
-			MemSet(values, 0, sizeof(values));
-			MemSet(nulls, 0, sizeof(nulls));
+/* -------------------------------------------------------------------
+ * profiler_lines_init()
+ *
+ *	Zero the newly allocated shared counters of count slots.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_lines_init(linestatsSharedLine *line_info, int count)
+{
+	int		i;
 
-			values[i++] = ObjectIdGetDatum(entry->key.fn_oid);
-			values[i++] = Int64GetDatumFast(lno);
-			values[i++] = Int64GetDatumFast(entry->line_info[lno].exec_count);
-			values[i++] = Int64GetDatumFast(entry->line_info[lno].us_total);
-			values[i++] = Int64GetDatumFast(entry->line_info[lno].us_max);
+	for (i = 0; i < count; i++)
+	{
+		pg_atomic_init_u64(&(line_info[i].ns_max), 0);
+		pg_atomic_init_u64(&(line_info[i].ns_max_interval), 0);
+		pg_atomic_init_u64(&(line_info[i].ns_total), 0);
+		pg_atomic_init_u64(&(line_info[i].exec_count), 0);
+		pg_atomic_init_u32(&(line_info[i].lineno), 0);
+	}
+}
 
-			Assert(i == PL_PROFILE_COLS);
+/* -------------------------------------------------------------------
+ * profiler_io_alloc()
+ *
+ *	Allocate I/O counters for count lines from the shared pool.
+ *	Returns NULL when the pool is used up.
+ * -------------------------------------------------------------------
+ */
+static pg_atomic_uint64 *
+profiler_io_alloc(int count)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	pg_atomic_uint64	   *io;
+	int						start;
 
-			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	start = profiler_pool_alloc(&(plpss->io_free), &(plpss->io_used),
+								profiler_max_io_lines, count);
+	if (start < 0)
+	{
+		if (profiler_max_io_lines > 0 && !plpss->io_overflow)
+		{
+			elog(LOG,
+				 "plprofiler: entry limit reached for "
+				 "shared memory per source line I/O data");
+			plpss->io_overflow = true;
 		}
-
-		/* Done with the counter access. */
-		SpinLockRelease(&(entry->mutex));
+		return NULL;
 	}
 
-	/* Release the shared lock on the shared memory data. */
-	LWLockRelease(plpss->lock);
+	io = PL_IO_POOL(plpss) + (Size) start * PL_IO_COUNTERS;
+	profiler_io_init(io, count);
 
-	PG_RETURN_VOID();
+	return io;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_callgraph_local()
+ * profiler_io_init()
  *
- *	Returns the content of the local call graph hash table
- *	as a set of rows.
+ *	Zero the newly allocated shared I/O counters of count lines.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_callgraph_local(PG_FUNCTION_ARGS)
+static void
+profiler_io_init(pg_atomic_uint64 *io, int count)
 {
-	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
-	TupleDesc			tupdesc;
-	Tuplestorestate	   *tupstore;
-	MemoryContext		per_query_ctx;
-	MemoryContext		oldcontext;
-	HASH_SEQ_STATUS		hash_seq;
-	callGraphEntry	   *entry;
+	int		i;
 
-	/* Check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context "
-						"that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not "
-						"allowed in this context")));
+	for (i = 0; i < count * PL_IO_COUNTERS; i++)
+		pg_atomic_init_u64(&io[i], 0);
+}
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+#ifdef PL_HAVE_DYNAMIC
+/* -------------------------------------------------------------------
+ * profiler_dynamic_room()
+ *
+ *	Check whether size more bytes of entries and counters fit under
+ *	plprofiler.dynamic_max_memory. We count the bytes ourselves in
+ *	dynamic_used, because the DSA area never shrinks after dsa_free().
+ *	The dshash buckets are not counted, so this is a soft limit. We
+ *	don't set it as the size limit of the area, because dshash would
+ *	then raise an error when it fails to grow a table, and collecting
+ *	happens at transaction end.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_dynamic_room(Size size)
+{
+	Size	limit = (Size) profiler_dynamic_max_memory * 1024 * 1024;
 
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	return pg_atomic_read_u64(&(profiler_shared_state->dynamic_used)) +
+		   size <= limit;
+}
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+/* -------------------------------------------------------------------
+ * profiler_dsa_alloc()
+ *
+ *	Allocate size bytes of counters in the DSA area. Returns
+ *	InvalidDsaPointer and logs once, that the memory limit for what
+ *	was reached, if that fails.
+ * -------------------------------------------------------------------
+ */
+static dsa_pointer
+profiler_dsa_alloc(Size size, bool *overflow, const char *what)
+{
+	dsa_pointer		dp = InvalidDsaPointer;
 
-	MemoryContextSwitchTo(oldcontext);
+	if (profiler_dynamic_room(size))
+		dp = dsa_allocate_extended(profiler_dsa, size,
+								   DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+	if (DsaPointerIsValid(dp))
+		pg_atomic_fetch_add_u64(&(profiler_shared_state->dynamic_used), size);
 
-	if (callgraph_hash != NULL)
+	if (!DsaPointerIsValid(dp) && !*overflow)
 	{
-		hash_seq_init(&hash_seq, callgraph_hash);
-		while ((entry = hash_seq_search(&hash_seq)) != NULL)
-		{
-			Datum		values[PL_CALLGRAPH_COLS];
-			bool		nulls[PL_CALLGRAPH_COLS];
-			Datum		funcdefs[PL_MAX_STACK_DEPTH];
-
-			int			i = 0;
-			int			j = 0;
-
-			MemSet(values, 0, sizeof(values));
-			MemSet(nulls, 0, sizeof(nulls));
-
-			for (i = 0; i < PL_MAX_STACK_DEPTH && entry->key.stack[i] != InvalidOid; i++)
-				funcdefs[i] = ObjectIdGetDatum(entry->key.stack[i]);
+		elog(LOG,
+			 "plprofiler: memory limit reached for "
+			 "dynamic shared memory %s", what);
+		*overflow = true;
+	}
 
-			values[j++] = PointerGetDatum(construct_array(funcdefs, i,
-														  OIDOID, sizeof(Oid),
-														  true, 'i'));
-			values[j++] = Int64GetDatumFast(entry->callCount);
-			values[j++] = UInt64GetDatum(entry->totalTime);
-			values[j++] = UInt64GetDatum(entry->childTime);
-			values[j++] = UInt64GetDatum(entry->selfTime);
+	return dp;
+}
+#endif
 
-			Assert(j == PL_CALLGRAPH_COLS);
+/* -------------------------------------------------------------------
+ * profiler_io_push()
+ *
+ *	Push a snapshot of the buffer and WAL usage for a statement that
+ *	is about to start onto the I/O snapshot stack.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_io_push(profilerLineInfo *line_info)
+{
+	if (io_stack_pt >= io_stack_size)
+	{
+		int		new_size = (io_stack_size == 0) ? 64 : io_stack_size * 2;
 
-			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-		}
+		if (io_stack == NULL)
+			io_stack = MemoryContextAlloc(TopMemoryContext,
+										  new_size * sizeof(linestatsIoInfo));
+		else
+			io_stack = repalloc(io_stack, new_size * sizeof(linestatsIoInfo));
+		io_stack_size = new_size;
 	}
 
-	PG_RETURN_VOID();
+	profiler_io_snapshot(&io_stack[io_stack_pt++]);
+	line_info->io_mark = io_stack_pt;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_callgraph_shared()
+ * profiler_hist_percentile()
  *
- *	Returns the content of the shared call graph hash table
- *	as a set of rows.
+ *	Estimate the q-quantile of a latency histogram in nanoseconds by
+ *	interpolating within the bucket, that contains it. The upper end
+ *	of the buckets is capped at ns_max, if known.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_callgraph_shared(PG_FUNCTION_ARGS)
+static uint64
+profiler_hist_percentile(const uint32 *hist, double q, int64 ns_max)
 {
-	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
-	TupleDesc				tupdesc;
-	Tuplestorestate		   *tupstore;
-	MemoryContext			per_query_ctx;
-	MemoryContext			oldcontext;
-	HASH_SEQ_STATUS			hash_seq;
-	callGraphEntry		   *entry;
-	profilerSharedState	   *plpss = profiler_shared_state;
+	double		total = (double) profiler_hist_count(hist);
+	double		rank;
+	double		cum = 0.0;
+	int			b;
 
-	/* Check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context "
-						"that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not "
-						"allowed in this context")));
+	if (total == 0.0)
+		return 0;
 
-	/* Check that plprofiler was loaded via shared_preload_libraries */
-	if (plpss == NULL)
-		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+	rank = q * total;
+	for (b = 0; b < PL_HIST_BUCKETS; b++)
+	{
+		double		lo;
+		double		hi;
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+		if (hist[b] == 0)
+			continue;
+		if (cum + hist[b] < rank)
+		{
+			cum += hist[b];
+			continue;
+		}
 
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+		lo = (b == 0) ? 0.0 :
+			 (double) (UINT64CONST(1) << (PL_HIST_MIN_SHIFT + b - 1));
+		hi = (double) (UINT64CONST(1) << (PL_HIST_MIN_SHIFT + b));
+		if (ns_max > 0 && hi > (double) ns_max)
+			hi = (double) ns_max;
+		if (lo > hi)
+			lo = hi;
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+		return (uint64) (lo + (hi - lo) * (rank - cum) / hist[b]);
+	}
 
-	MemoryContextSwitchTo(oldcontext);
+	return (ns_max > 0) ? (uint64) ns_max : 0;
+}
 
-	/* Place a shared lock on the shared memory data. */
-	LWLockAcquire(plpss->lock, LW_SHARED);
+/* -------------------------------------------------------------------
+ * profiler_choose_clock()
+ *
+ *	Set the clock to use according to plprofiler.clock_source.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_choose_clock(void)
+{
+	profiler_use_tsc = (profiler_clock_source == PL_CLOCK_TSC &&
+						profiler_tsc_usable());
+}
 
-	hash_seq_init(&hash_seq, callgraph_shared);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		Datum		values[PL_CALLGRAPH_COLS];
-		bool		nulls[PL_CALLGRAPH_COLS];
-		Datum		funcdefs[PL_MAX_STACK_DEPTH];
+/* -------------------------------------------------------------------
+ * init_hash_tables()
+ *
+ * Initialize hash table
+ * -------------------------------------------------------------------
+ */
+static void
+init_hash_tables(void)
+{
+	HASHCTL		hash_ctl;
 
-		int			i = 0;
-		int			j = 0;
+	/* The sampling counters describe the local data. */
+	profiler_total_calls = 0;
+	profiler_sampled_calls = 0;
+	profiler_sampled_interval = 0;
+	profiler_sampling_mixed = false;
 
-		/* Only entries of the local database are visible. */
-		if (entry->key.db_oid != MyDatabaseId)
-			continue;
+	/*
+	 * Release the pooled profilerInfo chunks too, unless some
+	 * function invocation is still using one of them.
+	 */
+	if (profiler_info_mcxt != NULL && profiler_info_live == NULL &&
+		!profiler_info_mcxt->isReset)
+	{
+		int		i;
 
-		MemSet(values, 0, sizeof(values));
-		MemSet(nulls, 0, sizeof(nulls));
+		/* Frames abandoned by an exception may still point there. */
+		for (i = 0; i < graph_stack_pt && i < PL_MAX_STACK_DEPTH; i++)
+			graph_stack[i].info = NULL;
 
-		for (i = 0; i < PL_MAX_STACK_DEPTH && entry->key.stack[i] != InvalidOid; i++)
-			funcdefs[i] = ObjectIdGetDatum(entry->key.stack[i]);
+		MemoryContextReset(profiler_info_mcxt);
+		memset(profiler_info_free, 0, sizeof(profiler_info_free));
+	}
 
-		values[j++] = PointerGetDatum(construct_array(funcdefs, i,
-													  OIDOID, sizeof(Oid),
-													  true, 'i'));
+	/* Create the memory context for our data */
+	if (profiler_mcxt != NULL)
+	{
+		if (profiler_mcxt->isReset)
+			return;
 
-		/* Guard agains concurrent updates of the counters. */
-		SpinLockAcquire(&(entry->mutex));
+		/* Pending sample ticks belong to the data thrown away. */
+		profiler_sample_fold();
+		MemoryContextReset(profiler_mcxt);
+		functions_dirty = NULL;
+		callgraph_dirty = NULL;
+	}
+	else
+	{
+		profiler_mcxt = AllocSetContextCreate(TopMemoryContext,
+											  "PL/pgSQL profiler",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+	}
 
-		values[j++] = Int64GetDatumFast(entry->callCount);
-		values[j++] = UInt64GetDatum(entry->totalTime);
-		values[j++] = UInt64GetDatum(entry->childTime);
-		values[j++] = UInt64GetDatum(entry->selfTime);
+	/* Create the hash table for line stats */
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
 
-		/* Done with the counter access. */
-		SpinLockRelease(&(entry->mutex));
+	hash_ctl.keysize = sizeof(linestatsHashKey);
+	hash_ctl.entrysize = sizeof(linestatsEntry);
+	hash_ctl.hash = line_hash_fn;
+	hash_ctl.match = line_match_fn;
+	hash_ctl.hcxt = profiler_mcxt;
 
-		Assert(j == PL_CALLGRAPH_COLS);
+	functions_hash = hash_create("Function Lines",
+				 10000,
+				 &hash_ctl,
+				 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-	}
+	/* Create the hash table for the calling context tree */
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+
+	hash_ctl.keysize = sizeof(callGraphNodeKey);
+	hash_ctl.entrysize = sizeof(callGraphNode);
+	hash_ctl.hash = callgraph_node_hash_fn;
+	hash_ctl.match = callgraph_node_match_fn;
+	hash_ctl.hcxt = profiler_mcxt;
 
-	/* Release the shared lock on the shared memory data. */
-	LWLockRelease(plpss->lock);
+	callgraph_hash = hash_create("Function Call Graphs",
+				 1000,
+				 &hash_ctl,
+				 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+	callgraph_next_node_id = 1;
 
-	PG_RETURN_VOID();
+	/*
+	 * Functions that are currently executing hold pointers to entries
+	 * of the tables we just threw away. Bumping the generation makes
+	 * their profilerInfo look the entry up again, and the call stack
+	 * is interned again into the new calling context tree.
+	 */
+	local_hash_generation++;
+	callgraph_reintern_stack();
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_func_oids_local()
+ * linestats_local_entry()
  *
- *	Returns an array of all function Oids that we have
- *	linestat information for in the local hash table.
+ *	Find the local linestats hash table entry of a function version
+ *	and create it if it does not exist yet. A new entry gets one
+ *	counter slot per statement if stmt_count is given, otherwise one
+ *	per source line. Slot zero holds the per function counts, which is
+ *	the only slot at the function level. An entry created there grows
+ *	when the function is later profiled at the statement level.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_func_oids_local(PG_FUNCTION_ARGS)
+static linestatsEntry *
+linestats_local_entry(Oid func_oid, TransactionId fn_version, int stmt_count)
 {
-	int					i = 0;
-	Datum			   *result;
-	HASH_SEQ_STATUS		hash_seq;
+	linestatsHashKey	key;
 	linestatsEntry	   *entry;
+	bool				found;
 
-	/* First pass to count the number of Oids, we will return. */
+	key.db_oid = MyDatabaseId;
+	key.fn_oid = func_oid;
+	key.fn_version = fn_version;
 
-	if (functions_hash != NULL)
+	entry = (linestatsEntry *)hash_search(functions_hash, &key,
+										  HASH_ENTER, &found);
+	if (entry == NULL)
+		elog(ERROR, "plprofiler out of memory");
+	if (!found)
 	{
-		hash_seq_init(&hash_seq, functions_hash);
-		while ((entry = hash_seq_search(&hash_seq)) != NULL)
-			i++;
+		/* New function, initialize entry. */
+		MemoryContext	old_context;
+		HeapTuple		proc_tuple;
+		char		   *proc_src;
+		char		   *func_name;
+		char		   *nspname;
+
+		proc_src = find_source( func_oid, &proc_tuple, &func_name );
+		entry->source_lines = count_source_lines(proc_src) + 1;
+		entry->stmt_slots = (stmt_count > 0);
+		if (!profiler_statements)
+			entry->line_count = 1;
+		else if (entry->stmt_slots)
+			entry->line_count = stmt_count + 1;
+		else
+			entry->line_count = entry->source_lines;
+		old_context = MemoryContextSwitchTo(profiler_mcxt);
+		entry->line_info = palloc0(entry->line_count *
+								   sizeof(linestatsLineInfo));
+		if (profiler_histograms)
+			entry->hist = palloc0(entry->line_count * PL_HIST_SIZE);
+		else
+			entry->hist = NULL;
+		if (profiler_track_io)
+			entry->io = palloc0(entry->line_count * sizeof(linestatsIoInfo));
+		else
+			entry->io = NULL;
+		MemoryContextSwitchTo(old_context);
+		entry->dirty_next = NULL;
+		entry->dirty_min = 0;
+		entry->dirty_max = -1;
+
+		/* The reports of all databases can't look the function up. */
+		nspname = get_namespace_name(
+					((Form_pg_proc) GETSTRUCT(proc_tuple))->pronamespace);
+		namestrcpy(&(entry->fn_schema), nspname != NULL ? nspname : "");
+		namestrcpy(&(entry->fn_name), func_name);
+
+		ReleaseSysCache(proc_tuple);
 	}
+	else if (profiler_statements)
+	{
+		int		line_count = entry->stmt_slots ? stmt_count + 1 :
+							 entry->source_lines;
 
-	/* Allocate Oid array for result. */
-	if (i == 0)
+		if (line_count > entry->line_count)
+			linestats_local_grow(entry, line_count);
+	}
+
+	return entry;
+}
+
+/* -------------------------------------------------------------------
+ * linestats_local_grow()
+ *
+ *	Enlarge the counter arrays of a local linestats entry to line_count
+ *	slots. The new slots start out zero.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_local_grow(linestatsEntry *entry, int line_count)
+{
+	int		old_count = entry->line_count;
+	int		n = line_count - old_count;
+
+	entry->line_info = repalloc(entry->line_info,
+								line_count * sizeof(linestatsLineInfo));
+	memset(&(entry->line_info[old_count]), 0, n * sizeof(linestatsLineInfo));
+	if (entry->hist != NULL)
 	{
-		result = palloc(sizeof(Datum));
+		entry->hist = repalloc(entry->hist, line_count * PL_HIST_SIZE);
+		memset((char *) entry->hist + old_count * PL_HIST_SIZE, 0,
+			   n * PL_HIST_SIZE);
 	}
-	else
+	if (entry->io != NULL)
 	{
-		result = palloc(sizeof(Datum) * i);
+		entry->io = repalloc(entry->io, line_count * sizeof(linestatsIoInfo));
+		memset(&(entry->io[old_count]), 0, n * sizeof(linestatsIoInfo));
 	}
-	if (result == NULL)
-		elog(ERROR, "out of memory in pl_profiler_func_oids_local()");
+	entry->line_count = line_count;
+}
 
-	/* Second pass to collect the Oids. */
-	if (functions_hash != NULL)
+/* -------------------------------------------------------------------
+ * profiler_info_entry()
+ *
+ *	Return the cached local linestats entry of a function invocation.
+ *	If the local hash tables have been reset since the invocation
+ *	started, the entry is looked up (or created) again.
+ * -------------------------------------------------------------------
+ */
+static linestatsEntry *
+profiler_info_entry(profilerInfo *profiler_info)
+{
+	if (profiler_info->generation != local_hash_generation)
 	{
-		i = 0;
-		hash_seq_init(&hash_seq, functions_hash);
-		while ((entry = hash_seq_search(&hash_seq)) != NULL)
-			result[i++] = ObjectIdGetDatum(entry->key.fn_oid);
+		profiler_info->entry = linestats_local_entry(profiler_info->fn_oid,
+							profiler_info->fn_version,
+							profiler_info->stmt_slots ?
+							profiler_info->line_count - 1 : 0);
+		profiler_info->generation = local_hash_generation;
 	}
 
-	/* Build and return the actual array. */
-	PG_RETURN_ARRAYTYPE_P(construct_array(result, i,
-										  OIDOID, sizeof(Oid),
-										  true, 'i'));
+	return profiler_info->entry;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_func_oids_shared()
+ * profiler_info_alloc()
  *
- *	Returns an array of all function Oids that we have
- *	linestat information for in the shared hash table.
+ *	Get a zeroed profilerInfo with room for line_count slots from the
+ *	per backend pool. Chunks are kept in free lists per power of two
+ *	size class and reused in LIFO order, which matches the nesting of
+ *	PL function calls. The new invocation is pushed onto the list of
+ *	live invocations.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_func_oids_shared(PG_FUNCTION_ARGS)
+static profilerInfo *
+profiler_info_alloc(Oid func_oid, int line_count, bool stmt_slots)
 {
-	int						i = 0;
-	Datum				   *result;
-	HASH_SEQ_STATUS			hash_seq;
-	linestatsEntry		   *entry;
-	profilerSharedState	   *plpss = profiler_shared_state;
-
-	/* Check that plprofiler was loaded via shared_preload_libraries */
-	if (plpss == NULL)
-		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+	profilerInfo   *profiler_info;
+	int				size_class = 0;
 
-	/* Place a shared lock on the shared memory data. */
-	LWLockAcquire(plpss->lock, LW_SHARED);
+	while (size_class < PL_INFO_SIZE_CLASSES - 1 &&
+		   line_count > (PL_INFO_MIN_LINES << size_class))
+		size_class++;
+	if (line_count > (PL_INFO_MIN_LINES << size_class))
+		elog(ERROR, "plprofiler: function %u has too many lines", func_oid);
 
-	/* First pass to count the number of Oids, we will return. */
-
-	hash_seq_init(&hash_seq, functions_shared);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		if (entry->key.db_oid == MyDatabaseId)
-			i++;
-	}
-
-	/* Allocate Oid array for result. */
-	if (i == 0)
+	if (profiler_info_free[size_class] != NULL)
 	{
-		result = palloc(sizeof(Datum));
+		profiler_info = profiler_info_free[size_class];
+		profiler_info_free[size_class] = profiler_info->prev;
 	}
 	else
 	{
-		result = palloc(sizeof(Datum) * i);
+		Size	chunk_size;
+
+		if (profiler_info_mcxt == NULL)
+			profiler_info_mcxt = AllocSetContextCreate(TopMemoryContext,
+												"PL/pgSQL profiler frames",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+
+		chunk_size = MAXALIGN(sizeof(profilerInfo)) +
+					 sizeof(profilerLineInfo) *
+					 ((Size) PL_INFO_MIN_LINES << size_class);
+		profiler_info = (profilerInfo *)
+			MemoryContextAllocZero(profiler_info_mcxt, chunk_size);
+		profiler_info->line_info = (profilerLineInfo *)
+			((char *) profiler_info + MAXALIGN(sizeof(profilerInfo)));
+		profiler_info->size_class = size_class;
 	}
-	if (result == NULL)
-		elog(ERROR, "out of memory in pl_profiler_func_oids_shared()");
 
-	/* Second pass to collect the Oids. */
-	i = 0;
-	hash_seq_init(&hash_seq, functions_shared);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		if (entry->key.db_oid == MyDatabaseId)
-			result[i++] = ObjectIdGetDatum(entry->key.fn_oid);
-	}
+	profiler_info->fn_oid = func_oid;
+	profiler_info->line_count = line_count;
+	profiler_info->stmt_slots = stmt_slots;
+	profiler_info->entry = NULL;
+	profiler_info->generation = local_hash_generation;
+	profiler_info->line_min = line_count;
+	profiler_info->line_max = 0;
+	profiler_info->cur_slot = 0;
+	profiler_info->in_use = true;
+	profiler_info->prev = profiler_info_live;
+	profiler_info_live = profiler_info;
+
+	return profiler_info;
+}
 
-	/* Release the shared lock on the shared memory data. */
-	LWLockRelease(plpss->lock);
+/* -------------------------------------------------------------------
+ * profiler_info_release()
+ *
+ *	Return a profilerInfo to the pool. Only the lines that were
+ *	actually executed need zeroing. Normally this is the most recent
+ *	live invocation, but frames that were abandoned by an exception
+ *	and are unwound later may sit further down the list.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_info_release(profilerInfo *profiler_info)
+{
+	profilerInfo  **link;
 
-	/* Build and return the actual array. */
-	PG_RETURN_ARRAYTYPE_P(construct_array(result, i,
-										  OIDOID, sizeof(Oid),
-										  true, 'i'));
+	if (profiler_info == NULL || !profiler_info->in_use)
+		return;
+
+	for (link = &profiler_info_live; *link != profiler_info;
+		 link = &((*link)->prev))
+		;
+	*link = profiler_info->prev;
+
+	profiler_info->in_use = false;
+
+	if (profiler_info->line_min <= profiler_info->line_max)
+		memset(profiler_info->line_info + profiler_info->line_min, 0,
+			   sizeof(profilerLineInfo) *
+			   (profiler_info->line_max - profiler_info->line_min + 1));
+	profiler_info->prev = profiler_info_free[profiler_info->size_class];
+	profiler_info_free[profiler_info->size_class] = profiler_info;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_funcs_source(func_oids oid[])
+ * profiler_info_unwind()
  *
- *	Return the source code of a number of functions specified by
- *	an input array of Oids.
+ *	Return all invocations, that were started after the given one,
+ *	to the pool. When the given invocation is executing, all of those
+ *	must have been abandoned by an exception. With NULL, all live
+ *	invocations are released, which is used when a transaction aborts.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_funcs_source(PG_FUNCTION_ARGS)
+static void
+profiler_info_unwind(profilerInfo *profiler_info)
 {
-	ArrayType		   *func_oids_in = PG_GETARG_ARRAYTYPE_P(0);
-	Datum			   *func_oids;
-	bool			   *nulls;
-	int					nelems;
-	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
-	TupleDesc			tupdesc;
-	Tuplestorestate	   *tupstore;
-	MemoryContext		per_query_ctx;
-	MemoryContext		oldcontext;
-	int					fidx;
+	if (profiler_info != NULL && !profiler_info->in_use)
+		return;
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context "
-						"that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not "
-						"allowed in this context")));
+	while (profiler_info_live != NULL && profiler_info_live != profiler_info)
+		profiler_info_release(profiler_info_live);
+}
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+#if PG_VERSION_NUM >= 150000
+static void
+profiler_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
 
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	RequestAddinShmemSpace(profiler_shmem_size());
+	RequestNamedLWLockTranche("plprofiler", PL_NUM_LOCKS);
+}
+#endif
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+static void
+profiler_shmem_startup(void)
+{
+	bool					found;
+	profilerSharedState	   *plpss;
+	HASHCTL					hash_ctl;
 
-	MemoryContextSwitchTo(oldcontext);
+	if (prev_shmem_startup_hook)
+	        prev_shmem_startup_hook();
 
-	/* Take the input array apart */
-	deconstruct_array(func_oids_in, OIDOID,
-					  sizeof(Oid), true, 'i',
-					  &func_oids, &nulls, &nelems);
+	/* Reset in case of restart inside of the postmaster. */
+	profiler_shared_state = NULL;
+	functions_shared = NULL;
+	callgraph_shared = NULL;
 
-	/*
-	 * Turn each of the function Oids, that are in the array, into
-	 * a text that is "schema.funcname(funcargs) oid=funcoid".
-	 */
-	for (fidx = 0; fidx < nelems; fidx++)
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	/* Create or attach to the shared state */
+	profiler_shared_state = ShmemInitStruct("plprofiler state",
+											profiler_state_size(), &found);
+	plpss = profiler_shared_state;
+	if (!found)
 	{
-		HeapTuple	procTuple;
-		char	   *procSrc;
-		char	   *funcName;
-		Datum		values[PL_FUNCS_SRC_COLS];
-		bool		nulls[PL_FUNCS_SRC_COLS];
-		int			i = 0;
-		char	   *cp;
-		char	   *linestart;
-		int64		line_number = 0;
+		profiler_shared_init(plpss);
+		plpss->locks = GetNamedLWLockTranche("plprofiler");
+	}
 
-		/* Create the line-0 entry. */
-		MemSet(values, 0, sizeof(values));
-		MemSet(nulls, 0, sizeof(nulls));
+	/* (Re)Initialize local hash tables. */
+	init_hash_tables();
 
-		values[i++] = func_oids[fidx];
-		values[i++] = Int64GetDatumFast(line_number);
-		values[i++] = PointerGetDatum(cstring_to_text("-- Line 0"));
+	/* The dynamic tables are created by the first backend using them. */
+	if (PL_DYNAMIC)
+	{
+		LWLockRelease(AddinShmemInitLock);
+		return;
+	}
 
-		Assert(i == PL_FUNCS_SRC_COLS);
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	/* Create or attache to the shared functions hash table */
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(linestatsHashKey);
+	hash_ctl.entrysize = sizeof(linestatsSharedEntry);
+	hash_ctl.hash = line_hash_fn;
+	hash_ctl.match = line_match_fn;
+	hash_ctl.num_partitions = PL_NUM_LOCK_PARTITIONS;
+	functions_shared = ShmemInitHash("plprofiler functions",
+									 profiler_max_functions,
+									 profiler_max_functions,
+									 &hash_ctl,
+									 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+									 HASH_PARTITION);
 
-		line_number++;
+	/* Create or attache to the shared callgraph hash table */
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(callGraphKey);
+	hash_ctl.entrysize = sizeof(callGraphEntry);
+	hash_ctl.hash = callgraph_hash_fn;
+	hash_ctl.match = callgraph_match_fn;
+	hash_ctl.num_partitions = PL_NUM_LOCK_PARTITIONS;
+	callgraph_shared = ShmemInitHash("plprofiler callgraph",
+									  profiler_max_callgraph,
+									  profiler_max_callgraph,
+									  &hash_ctl,
+									  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+									  HASH_PARTITION);
 
-		/* Find the source code and split it. */
-		procSrc = find_source(func_oids[fidx], &procTuple, &funcName);
-		if (procSrc == NULL)
-		{
-			ReleaseSysCache(procTuple);
-			continue;
-		}
+	LWLockRelease(AddinShmemInitLock);
 
-		/*
-		 * The returned procStr is palloc'd, so it is safe to scribble
-		 * around in it.
-		 */
-		cp = procSrc;
-		linestart = procSrc;
-		while (cp != NULL)
-		{
-			cp = strchr(cp, '\n');
-			if (cp != NULL)
-				*cp++ = '\0';
-			i = 0;
-			values[i++] = func_oids[fidx];
-			values[i++] = Int64GetDatumFast(line_number);
-			values[i++] = PointerGetDatum(cstring_to_text(linestart));
+	/*
+	 * Only the postmaster saves the state at shutdown, and loads it
+	 * when the state was just created.
+	 */
+	if (!IsUnderPostmaster)
+	{
+		on_shmem_exit(profiler_shmem_shutdown, (Datum) 0);
+		if (!found)
+			profiler_state_load();
+	}
+}
 
-			Assert(i == PL_FUNCS_SRC_COLS);
-			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+/* -------------------------------------------------------------------
+ * profiler_shared_init()
+ *
+ *	Initialize a new shared state. The counter pools are initialized
+ *	when handed out.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_shared_init(void *ptr)
+{
+	profilerSharedState	   *plpss = (profilerSharedState *) ptr;
+	int						i;
 
-			linestart = cp;
-			line_number++;
-		}
+	memset(plpss, 0, offsetof(profilerSharedState, line_info));
+
+	pg_atomic_init_u32(&(plpss->lines_used), 0);
+	pg_atomic_init_u32(&(plpss->hists_used), 0);
+	pg_atomic_init_u32(&(plpss->io_used), 0);
+	pg_atomic_init_u64(&(plpss->total_calls), 0);
+	pg_atomic_init_u64(&(plpss->sampled_calls), 0);
+	pg_atomic_init_u64(&(plpss->ring_records), 0);
+	pg_atomic_init_u64(&(plpss->ring_merged), 0);
+	pg_atomic_init_u64(&(plpss->ring_dropped), 0);
+	pg_atomic_init_u64(&(plpss->ring_deferred), 0);
+	pg_atomic_init_u64(&(plpss->ring_direct), 0);
+	pg_atomic_init_u32(&(plpss->callgraph_evicting), 0);
+	pg_atomic_init_u64(&(plpss->callgraph_evict_floor), 0);
+	pg_atomic_init_u64(&(plpss->callgraph_evicted), 0);
+	pg_atomic_init_u64(&(plpss->history_lines_head), 0);
+	pg_atomic_init_u64(&(plpss->history_callgraphs_head), 0);
+	pg_atomic_init_u64(&(plpss->generation), 0);
+	pg_atomic_init_u64(&(plpss->reset_all), 0);
+	pg_atomic_init_u64(&(plpss->purged), 0);
+	plpss->profiler_level = PL_LEVEL_STATEMENT;
+	SpinLockInit(&(plpss->filter_mutex));
+	pg_atomic_init_u32(&(plpss->filter_generation), 0);
+	SpinLockInit(&(plpss->enable_mutex));
+	pg_atomic_init_u32(&(plpss->enable_generation), 0);
+	SpinLockInit(&(plpss->reset_mutex));
+	for (i = 0; i < PL_RESET_DATABASES; i++)
+	{
+		plpss->reset_dbs[i].db_oid = InvalidOid;
+		pg_atomic_init_u64(&(plpss->reset_dbs[i].generation), 0);
+	}
+	SpinLockInit(&(plpss->lines_free.mutex));
+	SpinLockInit(&(plpss->hists_free.mutex));
+	SpinLockInit(&(plpss->io_free.mutex));
+	profiler_pool_clear(&(plpss->lines_free));
+	profiler_pool_clear(&(plpss->hists_free));
+	profiler_pool_clear(&(plpss->io_free));
+
+	for (i = 0; i < PL_NUM_RINGS; i++)
+	{
+		profilerRing   *ring = PL_RING(plpss, i);
 
-		ReleaseSysCache(procTuple);
-		pfree(procSrc);
+		pg_atomic_init_u32(&(ring->owner), 0);
+		pg_atomic_init_u64(&(ring->head), 0);
+		pg_atomic_init_u64(&(ring->tail), 0);
 	}
 
-	PG_RETURN_VOID();
+#ifdef PL_HAVE_DYNAMIC
+	plpss->dsa_tranche = LWLockNewTrancheId();
+	LWLockInitialize(&(plpss->dsa_lock), plpss->dsa_tranche);
+	plpss->area_handle = DSA_HANDLE_INVALID;
+	pg_atomic_init_u64(&(plpss->dynamic_used), 0);
+#endif
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_reset_local()
+ * profiler_shmem_shutdown()
  *
- *	Drop all data collected in the local hash tables.
+ *	Save the shared state at postmaster shutdown. Nothing is saved
+ *	after a crash, the data may be inconsistent then. The dynamic
+ *	storage mode is never saved.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_reset_local(PG_FUNCTION_ARGS)
+static void
+profiler_shmem_shutdown(int code, Datum arg)
 {
-	init_hash_tables();
+	if (code != 0 || profiler_shared_state == NULL || PL_DYNAMIC)
+		return;
 
-	PG_RETURN_VOID();
+	if (profiler_save)
+		profiler_state_save();
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_reset_shared()
+ * profiler_state_save()
  *
- *	Drop all data collected in the shared hash tables and the
- *	shared state.
+ *	Write the shared hash tables and counters to PL_STAT_FILE. The
+ *	file is written under a temporary name and renamed, so that a
+ *	partially written file is never loaded. Only the postmaster at
+ *	shutdown reads the tables without taking the partition locks.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_reset_shared(PG_FUNCTION_ARGS)
+static void
+profiler_state_save(void)
 {
-	HASH_SEQ_STATUS			hash_seq;
-	callGraphEntry		   *lsent;
-	linestatsEntry		   *cgent;
 	profilerSharedState	   *plpss = profiler_shared_state;
-
-	/* Check that plprofiler was loaded via shared_preload_libraries */
-	if (plpss == NULL)
-		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
-
-	LWLockAcquire(plpss->lock, LW_EXCLUSIVE);
-
-	/* Reset the shared state. */
-	plpss->callgraph_overflow = false;
-	plpss->functions_overflow = false;
-	plpss->lines_overflow = false;
-	plpss->lines_used = 0;
-
-	/* Delete all entries from the callgraph hash table. */
-	hash_seq_init(&hash_seq, callgraph_shared);
-	while ((cgent = hash_seq_search(&hash_seq)) != NULL)
+	profilerStatHeader		header;
+	FILE				   *file;
+	uint32					magic = PL_STAT_MAGIC;
+	bool					lock = IsUnderPostmaster;
+
+	file = AllocateFile(PL_STAT_TMP_FILE, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PL_STAT_MAGIC;
+	header.format = PL_STAT_FORMAT;
+	header.max_functions = profiler_max_functions;
+	header.max_lines = profiler_max_lines;
+	header.max_callgraph = profiler_max_callgraph;
+	header.max_histograms = profiler_max_histograms;
+	header.max_io_lines = profiler_max_io_lines;
+	header.hist_buckets = PL_HIST_BUCKETS;
+	header.io_counters = PL_IO_COUNTERS;
+	header.max_stack_depth = PL_MAX_STACK_DEPTH;
+	header.callgraph_overflow = plpss->callgraph_overflow;
+	header.functions_overflow = plpss->functions_overflow;
+	header.lines_overflow = plpss->lines_overflow;
+	header.total_calls = pg_atomic_read_u64(&(plpss->total_calls));
+	header.sampled_calls = pg_atomic_read_u64(&(plpss->sampled_calls));
+	header.sampling_interval = plpss->sampling_mixed ? 0 :
+		plpss->sampling_interval;
+	header.callgraph_evict_floor =
+		pg_atomic_read_u64(&(plpss->callgraph_evict_floor));
+	header.callgraph_evicted =
+		pg_atomic_read_u64(&(plpss->callgraph_evicted));
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+		!profiler_state_save_functions(file, lock) ||
+		!profiler_state_save_callgraphs(file, lock) ||
+		fwrite(&magic, sizeof(magic), 1, file) != 1)
+		goto error;
+
+	if (FreeFile(file))
 	{
-		hash_search(callgraph_shared, &(cgent->key), HASH_REMOVE, NULL);
+		file = NULL;
+		goto error;
 	}
 
-	/* Delete all entries from the functions hash table. */
-	hash_seq_init(&hash_seq, functions_shared);
-	while ((lsent = hash_seq_search(&hash_seq)) != NULL)
+	(void) durable_rename(PL_STAT_TMP_FILE, PL_STAT_FILE, LOG);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					PL_STAT_TMP_FILE)));
+	if (file)
+		FreeFile(file);
+	unlink(PL_STAT_TMP_FILE);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_state_scan_begin()
+ *
+ *	Start a scan of a shared table for saving it. Without locking
+ *	this is a plain dynahash scan.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_state_scan_begin(profilerSharedScan *scan, bool callgraph,
+						  bool lock)
+{
+	if (lock)
 	{
-		hash_search(functions_shared, &(lsent->key), HASH_REMOVE, NULL);
+		profiler_scan_begin(scan, callgraph, false);
+		return;
 	}
 
-	LWLockRelease(plpss->lock);
-
-	PG_RETURN_VOID();
+	memset(scan, 0, sizeof(profilerSharedScan));
+	scan->callgraph = callgraph;
+	scan->htab = callgraph ? callgraph_shared : functions_shared;
+	hash_seq_init(&(scan->hash_seq), scan->htab);
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_set_enabled_global()
+ * profiler_state_save_functions()
  *
- *	Turn global profiling on or off.
+ *	Write the number of shared linestats entries and the entries.
+ *	The entries are copied out first, so that the partition locks
+ *	aren't held during the file I/O. Returns false on a write error.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_set_enabled_global(PG_FUNCTION_ARGS)
+static bool
+profiler_state_save_functions(FILE *file, bool lock)
 {
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	profilerSharedScan		scan;
+	linestatsEntry		   *entries;
+	int						count;
+	int						i;
+	bool					ok = true;
 
-	if (profiler_shared_state == NULL)
-		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
-	else
-		profiler_shared_state->profiler_enabled_global = PG_GETARG_BOOL(0);
+	/* Entries, that a reset made stale, are skipped by the scan. */
+	profiler_state_scan_begin(&scan, false, lock);
+	entries = linestats_scan_snapshot(&scan, true, &count);
+	if (lock)
+		profiler_scan_end(&scan);
+
+	if (fwrite(&count, sizeof(int32), 1, file) != 1)
+		ok = false;
 
-	PG_RETURN_BOOL(profiler_shared_state->profiler_enabled_global);
+	for (i = 0; ok && i < count; i++)
+	{
+		profilerStatFunction	rec;
+		linestatsEntry			copy = entries[i];
+
+		memset(&rec, 0, sizeof(rec));
+		rec.key = copy.key;
+		rec.line_count = copy.line_count;
+		rec.source_lines = copy.source_lines;
+		rec.stmt_slots = copy.stmt_slots;
+		rec.has_hist = (copy.hist != NULL);
+		rec.has_io = (copy.io != NULL);
+		rec.fn_schema = copy.fn_schema;
+		rec.fn_name = copy.fn_name;
+
+		if (fwrite(&rec, sizeof(rec), 1, file) != 1 ||
+			fwrite(copy.line_info, sizeof(linestatsLineInfo),
+				   copy.line_count, file) != (size_t) copy.line_count ||
+			(rec.has_hist &&
+			 fwrite(copy.hist, PL_HIST_SIZE,
+					copy.line_count, file) != (size_t) copy.line_count) ||
+			(rec.has_io &&
+			 fwrite(copy.io, sizeof(linestatsIoInfo),
+					copy.line_count, file) != (size_t) copy.line_count))
+			ok = false;
+	}
+
+	linestats_snapshot_free(entries, count);
+
+	return ok;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_get_enabled_global()
+ * profiler_state_save_callgraphs()
  *
- *	Report global profiling state.
+ *	Write the number of shared call graph entries and the entries,
+ *	copied out like in profiler_state_save_functions(). Returns false
+ *	on a write error.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_get_enabled_global(PG_FUNCTION_ARGS)
+static bool
+profiler_state_save_callgraphs(FILE *file, bool lock)
 {
-	if (profiler_shared_state == NULL)
-		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+	profilerSharedScan		scan;
+	callGraphCopy		   *entries;
+	int						count;
+	int						i;
+	bool					ok = true;
+
+	profiler_state_scan_begin(&scan, true, lock);
+	entries = callgraph_scan_snapshot(&scan, true, &count);
+	if (lock)
+		profiler_scan_end(&scan);
+
+	if (fwrite(&count, sizeof(int32), 1, file) != 1)
+		ok = false;
+
+	for (i = 0; ok && i < count; i++)
+	{
+		profilerStatCallgraph	rec;
+		callGraphCopy			copy = entries[i];
+
+		memset(&rec, 0, sizeof(rec));
+		rec.key = copy.key;
+		rec.callCount = copy.callCount;
+		rec.totalTime = copy.totalTime;
+		rec.childTime = copy.childTime;
+		rec.selfTime = copy.selfTime;
+		rec.error = copy.error;
+		rec.has_hist = copy.has_hist;
+
+		if (fwrite(&rec, sizeof(rec), 1, file) != 1 ||
+			(rec.has_hist && fwrite(copy.hist, PL_HIST_SIZE, 1, file) != 1))
+			ok = false;
+	}
+
+	pfree(entries);
 
-	PG_RETURN_BOOL(profiler_shared_state->profiler_enabled_global);
+	return ok;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_set_enabled_local()
+ * profiler_state_load()
  *
- *	Turn local profiling on or off.
+ *	Load the shared state saved at the last shutdown. This runs in the
+ *	postmaster at startup, before any backend could use the tables.
+ *	The entries go through the normal collect path, which allocates
+ *	their counters compactly. A file written with other sizing
+ *	settings is skipped, a damaged one discards what was loaded. The
+ *	file is removed afterwards, so that a crash restart doesn't load
+ *	it again. With plprofiler.save_interval the collect worker writes
+ *	the file again periodically, so a crash restart then loads the
+ *	last of those saves, which is up to save_interval old.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_set_enabled_local(PG_FUNCTION_ARGS)
+static void
+profiler_state_load(void)
 {
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	profilerSharedState	   *plpss = profiler_shared_state;
+	profilerStatHeader		header;
+	FILE				   *file;
+	MemoryContext			load_mcxt;
+	MemoryContext			old_context;
+	int32					count;
+	uint32					magic;
+	int						i;
 
-	profiler_enabled_local = PG_GETARG_BOOL(0);
+	file = AllocateFile(PL_STAT_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							PL_STAT_FILE)));
+		return;
+	}
 
-	PG_RETURN_BOOL(profiler_enabled_local);
+	load_mcxt = AllocSetContextCreate(CurrentMemoryContext,
+									  "plprofiler load",
+									  ALLOCSET_DEFAULT_MINSIZE,
+									  ALLOCSET_DEFAULT_INITSIZE,
+									  ALLOCSET_DEFAULT_MAXSIZE);
+	old_context = MemoryContextSwitchTo(load_mcxt);
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != PL_STAT_MAGIC ||
+		header.format != PL_STAT_FORMAT ||
+		header.hist_buckets != PL_HIST_BUCKETS ||
+		header.io_counters != PL_IO_COUNTERS ||
+		header.max_stack_depth != PL_MAX_STACK_DEPTH)
+		goto invalid;
+
+	if (header.max_functions != profiler_max_functions ||
+		header.max_lines != profiler_max_lines ||
+		header.max_callgraph != profiler_max_callgraph ||
+		header.max_histograms != profiler_max_histograms ||
+		header.max_io_lines != profiler_max_io_lines)
+	{
+		ereport(LOG,
+				(errmsg("plprofiler: sizing settings changed, "
+						"not loading the saved shared state")));
+		goto done;
+	}
+
+	/* Functions */
+	if (fread(&count, sizeof(count), 1, file) != 1 ||
+		count < 0 || count > profiler_max_functions)
+		goto invalid;
+
+	for (i = 0; i < count; i++)
+	{
+		profilerStatFunction	rec;
+		linestatsEntry			entry;
+
+		if (fread(&rec, sizeof(rec), 1, file) != 1 ||
+			rec.line_count < 0 || rec.line_count > profiler_max_lines)
+			goto invalid;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.key = rec.key;
+		entry.line_count = rec.line_count;
+		entry.stmt_slots = rec.stmt_slots;
+		entry.source_lines = rec.source_lines;
+		entry.fn_schema = rec.fn_schema;
+		entry.fn_name = rec.fn_name;
+		entry.dirty_min = 0;
+		entry.dirty_max = rec.line_count - 1;
+		entry.line_info = palloc0(sizeof(linestatsLineInfo) *
+								  Max(rec.line_count, 1));
+		if (fread(entry.line_info, sizeof(linestatsLineInfo),
+				  rec.line_count, file) != (size_t) rec.line_count)
+			goto invalid;
+		if (rec.has_hist)
+		{
+			entry.hist = palloc(PL_HIST_SIZE * Max(rec.line_count, 1));
+			if (fread(entry.hist, PL_HIST_SIZE,
+					  rec.line_count, file) != (size_t) rec.line_count)
+				goto invalid;
+		}
+		if (rec.has_io)
+		{
+			entry.io = palloc(sizeof(linestatsIoInfo) *
+							  Max(rec.line_count, 1));
+			if (fread(entry.io, sizeof(linestatsIoInfo),
+					  rec.line_count, file) != (size_t) rec.line_count)
+				goto invalid;
+		}
+
+		if (rec.line_count > 0)
+			linestats_collect_one(&entry, 1.0);
+
+		MemoryContextReset(load_mcxt);
+	}
+
+	/* Call graphs */
+	if (fread(&count, sizeof(count), 1, file) != 1 ||
+		count < 0 || count > profiler_max_callgraph)
+		goto invalid;
+
+	for (i = 0; i < count; i++)
+	{
+		profilerStatCallgraph	rec;
+		callGraphNode			node;
+		callGraphEntry		   *cge2;
+
+		if (fread(&rec, sizeof(rec), 1, file) != 1)
+			goto invalid;
+
+		memset(&node, 0, sizeof(node));
+		node.callCount = rec.callCount;
+		node.totalTime = rec.totalTime;
+		node.childTime = rec.childTime;
+		node.selfTime = rec.selfTime;
+		if (rec.has_hist &&
+			fread(node.hist, PL_HIST_SIZE, 1, file) != 1)
+			goto invalid;
+
+		if (!callgraph_collect_try(&(rec.key), &node, 1.0))
+			continue;
+
+		/* Keep the error bound the entry was created with. */
+		cge2 = hash_search(callgraph_shared, &(rec.key), HASH_FIND, NULL);
+		if (cge2 != NULL)
+			cge2->error = rec.error;
+	}
+
+	if (fread(&magic, sizeof(magic), 1, file) != 1 ||
+		magic != PL_STAT_MAGIC)
+		goto invalid;
+
+	plpss->callgraph_overflow = header.callgraph_overflow;
+	plpss->functions_overflow = header.functions_overflow;
+	plpss->lines_overflow = header.lines_overflow;
+	pg_atomic_write_u64(&(plpss->total_calls), header.total_calls);
+	pg_atomic_write_u64(&(plpss->sampled_calls), header.sampled_calls);
+	plpss->sampling_interval = header.sampling_interval;
+	pg_atomic_write_u64(&(plpss->callgraph_evict_floor),
+						header.callgraph_evict_floor);
+	pg_atomic_write_u64(&(plpss->callgraph_evicted),
+						header.callgraph_evicted);
+	goto done;
+
+invalid:
+	ereport(LOG,
+			(errmsg("plprofiler: ignoring invalid data in file \"%s\"",
+					PL_STAT_FILE)));
+	profiler_shared_reset();
+	profiler_purge_stale();
+
+done:
+	MemoryContextSwitchTo(old_context);
+	MemoryContextDelete(load_mcxt);
+	FreeFile(file);
+	unlink(PL_STAT_FILE);
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_get_enabled_local()
+ * profiler_history_snapshot()
  *
- *	Report local profiling state.
+ *	Append the changes of the shared tables since the last snapshot to
+ *	the history rings. This runs in the collect worker at the interval
+ *	set with pl_profiler_set_collect_interval(). The worker keeps the counters
+ *	seen at the last snapshot in local hash tables. The first snapshot
+ *	only fills those.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_get_enabled_local(PG_FUNCTION_ARGS)
+static void
+profiler_history_snapshot(void)
 {
-	PG_RETURN_BOOL(profiler_enabled_local);
+	TimestampTz		now = GetCurrentTimestamp();
+	bool			first = (history_last == 0);
+	HASHCTL			hash_ctl;
+
+	if (history_mcxt == NULL)
+	{
+		history_mcxt = AllocSetContextCreate(TopMemoryContext,
+											 "plprofiler history",
+											 ALLOCSET_DEFAULT_MINSIZE,
+											 ALLOCSET_DEFAULT_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+
+		MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(linestatsHashKey);
+		hash_ctl.entrysize = sizeof(profilerHistoryBase);
+		hash_ctl.hash = line_hash_fn;
+		hash_ctl.match = line_match_fn;
+		hash_ctl.hcxt = history_mcxt;
+		history_lines_base = hash_create("plprofiler history lines",
+										 1000,
+										 &hash_ctl,
+										 HASH_ELEM | HASH_FUNCTION |
+										 HASH_COMPARE | HASH_CONTEXT);
+
+		MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(callGraphKey);
+		hash_ctl.entrysize = sizeof(profilerHistoryCgBase);
+		hash_ctl.hash = callgraph_hash_fn;
+		hash_ctl.match = callgraph_match_fn;
+		hash_ctl.hcxt = history_mcxt;
+		history_cg_base = hash_create("plprofiler history callgraphs",
+									  1000,
+									  &hash_ctl,
+									  HASH_ELEM | HASH_FUNCTION |
+									  HASH_COMPARE | HASH_CONTEXT);
+	}
+
+	history_generation++;
+	if (PL_NUM_HISTORY_LINES > 0)
+		profiler_history_snap_lines(history_last, now, first);
+	if (PL_NUM_HISTORY_CALLGRAPHS > 0)
+		profiler_history_snap_callgraphs(history_last, now, first);
+	profiler_history_prune();
+
+	history_last = now;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_set_enabled_pid()
+ * profiler_history_snap_lines()
  *
- *	Turn pid profiling on or off.
+ *	Add a history row for every source line, that was executed since
+ *	the last snapshot. Statement slots are summed up per line first.
+ *	Counters, that went down, were reset meanwhile and count as a
+ *	whole. The longest execution is the one since the last snapshot,
+ *	the per interval maximum of the shared lines is reset here.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_set_enabled_pid(PG_FUNCTION_ARGS)
+static void
+profiler_history_snap_lines(TimestampTz start, TimestampTz end, bool first)
 {
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	profilerSharedScan		scan;
+	linestatsSharedEntry   *lse2;
 
-	if (profiler_shared_state == NULL)
-		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
-	else
-		profiler_shared_state->profiler_enabled_pid = PG_GETARG_INT32(0);
+	profiler_scan_begin(&scan, false, false);
+	while ((lse2 = profiler_scan_next(&scan)) != NULL)
+	{
+		linestatsEntry			copy;
+		linestatsSharedLine	   *shared_lines;
+		linestatsLineInfo	   *lines;
+		profilerHistoryBase	   *base;
+		int						nlines;
+		bool					found;
+		int						i;
+
+		linestats_shared_copy(lse2, &copy);
+		shared_lines = PL_SHARED_PTR(lse2, line_info);
+		for (i = 0; i < copy.line_count; i++)
+			copy.line_info[i].ns_max = (int64)
+				pg_atomic_exchange_u64(&(shared_lines[i].ns_max_interval), 0);
+
+		if (copy.stmt_slots)
+		{
+			nlines = copy.source_lines;
+			lines = palloc0(sizeof(linestatsLineInfo) * Max(nlines, 1));
+			linestats_by_line(&copy, lines);
+		}
+		else
+		{
+			nlines = copy.line_count;
+			lines = copy.line_info;
+		}
+
+		base = hash_search(history_lines_base, &(copy.key), HASH_ENTER,
+						   &found);
+		if (found && base->line_count != nlines)
+		{
+			pfree(base->exec_count);
+			pfree(base->ns_total);
+			found = false;
+		}
+		if (!found)
+		{
+			base->line_count = nlines;
+			base->exec_count = MemoryContextAllocZero(history_mcxt,
+											sizeof(int64) * Max(nlines, 1));
+			base->ns_total = MemoryContextAllocZero(history_mcxt,
+											sizeof(int64) * Max(nlines, 1));
+		}
+		base->generation = history_generation;
+
+		for (i = 0; i < nlines; i++)
+		{
+			int64	exec_count = lines[i].exec_count - base->exec_count[i];
+			int64	ns_total = lines[i].ns_total - base->ns_total[i];
+
+			if (exec_count < 0 || ns_total < 0)
+			{
+				exec_count = lines[i].exec_count;
+				ns_total = lines[i].ns_total;
+			}
+			base->exec_count[i] = lines[i].exec_count;
+			base->ns_total[i] = lines[i].ns_total;
+
+			if (!first && exec_count > 0)
+				profiler_history_put_line(&(copy.key), i, start, end,
+										  exec_count, ns_total,
+										  lines[i].ns_max);
+		}
 
-	PG_RETURN_INT32(profiler_shared_state->profiler_enabled_pid);
+		if (lines != copy.line_info)
+			pfree(lines);
+		linestats_copy_free(&copy);
+	}
+	profiler_scan_end(&scan);
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_get_enabled_pid()
+ * profiler_history_snap_callgraphs()
  *
- *	Report pid profiling state.
+ *	Add history rows for the plprofiler.history_top_callgraphs call
+ *	graphs with the most total time since the last snapshot.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_get_enabled_pid(PG_FUNCTION_ARGS)
+static void
+profiler_history_snap_callgraphs(TimestampTz start, TimestampTz end,
+								 bool first)
 {
-	if (profiler_shared_state == NULL)
-		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+	profilerSharedScan			scan;
+	callGraphEntry			   *cge2;
+	profilerHistoryCallgraph   *top;
+	int							ntop = 0;
+	int							i;
+
+	top = palloc(sizeof(profilerHistoryCallgraph) *
+				 Max(profiler_history_top, 1));
+
+	profiler_scan_begin(&scan, true, false);
+	while ((cge2 = profiler_scan_next(&scan)) != NULL)
+	{
+		profilerHistoryCgBase  *base;
+		callGraphCopy			copy;
+		int64					callCount;
+		int64					totalTime;
+		int64					selfTime;
+		int64					maxTime;
+		int						slot;
+		bool					found;
+
+		callgraph_shared_copy(cge2, &copy);
+		callCount = copy.callCount;
+		totalTime = (int64) copy.totalTime;
+		selfTime = (int64) copy.selfTime;
+		maxTime = (int64)
+			pg_atomic_exchange_u64(&(cge2->maxTimeInterval), 0);
+
+		base = hash_search(history_cg_base, &(cge2->key), HASH_ENTER,
+						   &found);
+		if (!found)
+		{
+			base->callCount = 0;
+			base->totalTime = 0;
+			base->selfTime = 0;
+		}
+		base->generation = history_generation;
+
+		if (callCount < base->callCount || totalTime < base->totalTime)
+		{
+			base->callCount = 0;
+			base->totalTime = 0;
+			base->selfTime = 0;
+		}
+		callCount -= base->callCount;
+		totalTime -= base->totalTime;
+		selfTime -= base->selfTime;
+		base->callCount += callCount;
+		base->totalTime += totalTime;
+		base->selfTime += selfTime;
+
+		if (first || callCount <= 0 || profiler_history_top <= 0)
+			continue;
 
-	PG_RETURN_INT32(profiler_shared_state->profiler_enabled_pid);
+		/* Keep the call graphs with the most time in this interval. */
+		if (ntop < profiler_history_top)
+			slot = ntop++;
+		else
+		{
+			slot = 0;
+			for (i = 1; i < ntop; i++)
+			{
+				if (top[i].totalTime < top[slot].totalTime)
+					slot = i;
+			}
+			if (top[slot].totalTime >= totalTime)
+				continue;
+		}
+
+		top[slot].key = cge2->key;
+		top[slot].callCount = callCount;
+		top[slot].totalTime = totalTime;
+		top[slot].selfTime = selfTime;
+		top[slot].maxTime = maxTime;
+	}
+	profiler_scan_end(&scan);
+
+	qsort(top, ntop, sizeof(profilerHistoryCallgraph),
+		  profiler_history_top_cmp);
+	for (i = 0; i < ntop; i++)
+		profiler_history_put_callgraph(&top[i], start, end);
+
+	pfree(top);
+}
+
+static int
+profiler_history_top_cmp(const void *a, const void *b)
+{
+	const profilerHistoryCallgraph *cg_a = (const profilerHistoryCallgraph *) a;
+	const profilerHistoryCallgraph *cg_b = (const profilerHistoryCallgraph *) b;
+
+	if (cg_a->totalTime > cg_b->totalTime)
+		return -1;
+	if (cg_a->totalTime < cg_b->totalTime)
+		return 1;
+	return 0;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_set_collect_interval()
+ * profiler_history_prune()
  *
- *	Turn pid profiling on or off.
+ *	Forget the counters of entries, that were removed from the shared
+ *	tables.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_set_collect_interval(PG_FUNCTION_ARGS)
+static void
+profiler_history_prune(void)
 {
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	HASH_SEQ_STATUS			hash_seq;
+	profilerHistoryBase	   *base;
+	profilerHistoryCgBase  *cg_base;
 
-	if (profiler_shared_state == NULL)
-		PG_RETURN_INT32(-1);
-	else
-		profiler_shared_state->profiler_collect_interval = PG_GETARG_INT32(0);
+	hash_seq_init(&hash_seq, history_lines_base);
+	while ((base = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (base->generation == history_generation)
+			continue;
+
+		pfree(base->exec_count);
+		pfree(base->ns_total);
+		hash_search(history_lines_base, &(base->key), HASH_REMOVE, NULL);
+	}
+
+	hash_seq_init(&hash_seq, history_cg_base);
+	while ((cg_base = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (cg_base->generation != history_generation)
+			hash_search(history_cg_base, &(cg_base->key), HASH_REMOVE, NULL);
+	}
+}
 
-	PG_RETURN_INT32(profiler_shared_state->profiler_collect_interval);
+/* -------------------------------------------------------------------
+ * profiler_history_put_line()
+ *
+ *	Append a row to the line history ring, overwriting the oldest.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_history_put_line(const linestatsHashKey *key, int line,
+						  TimestampTz start, TimestampTz end,
+						  int64 exec_count, int64 ns_total, int64 ns_max)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	uint64					n;
+	profilerHistoryLine	   *row;
+
+	n = pg_atomic_read_u64(&(plpss->history_lines_head));
+	row = &(PL_HISTORY_LINES(plpss)[n % PL_NUM_HISTORY_LINES]);
+
+	pg_atomic_write_u64(&(row->seq), 0);
+	pg_write_barrier();
+	row->interval_start = start;
+	row->interval_end = end;
+	row->key = *key;
+	row->line = line;
+	row->exec_count = exec_count;
+	row->ns_total = ns_total;
+	row->ns_max = ns_max;
+	pg_write_barrier();
+	pg_atomic_write_u64(&(row->seq), n + 1);
+	pg_atomic_write_u64(&(plpss->history_lines_head), n + 1);
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_get_collect_interval()
+ * profiler_history_put_callgraph()
  *
- *	Report pid profiling state.
+ *	Append a row to the call graph history ring.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_get_collect_interval(PG_FUNCTION_ARGS)
+static void
+profiler_history_put_callgraph(profilerHistoryCallgraph *cg,
+							   TimestampTz start, TimestampTz end)
 {
-	if (profiler_shared_state == NULL)
-		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+	profilerSharedState		   *plpss = profiler_shared_state;
+	uint64						n;
+	profilerHistoryCallgraph   *row;
+
+	n = pg_atomic_read_u64(&(plpss->history_callgraphs_head));
+	row = &(PL_HISTORY_CALLGRAPHS(plpss)[n % PL_NUM_HISTORY_CALLGRAPHS]);
+
+	pg_atomic_write_u64(&(row->seq), 0);
+	pg_write_barrier();
+	row->interval_start = start;
+	row->interval_end = end;
+	row->key = cg->key;
+	row->callCount = cg->callCount;
+	row->totalTime = cg->totalTime;
+	row->selfTime = cg->selfTime;
+	row->maxTime = cg->maxTime;
+	pg_write_barrier();
+	pg_atomic_write_u64(&(row->seq), n + 1);
+	pg_atomic_write_u64(&(plpss->history_callgraphs_head), n + 1);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_history_read()
+ *
+ *	Copy row number n of a history ring. Returns false if the row was
+ *	overwritten or is being written.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_history_read(pg_atomic_uint64 *seq, const void *row, void *copy,
+					  Size size, uint64 n)
+{
+	if (pg_atomic_read_u64(seq) != n + 1)
+		return false;
+
+	pg_read_barrier();
+	memcpy(copy, row, size);
+	pg_read_barrier();
 
-	PG_RETURN_INT32(profiler_shared_state->profiler_collect_interval);
+	return pg_atomic_read_u64(seq) == n + 1;
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_collect_data()
+ * profiler_shared()
  *
- *	SQL level callable function to collect profiling data from the
- *	local tables into the shared hash tables.
+ *	Return the shared state or NULL if there is none. Unless it was
+ *	created at server start (shared_preload_libraries), the shared
+ *	state of the dynamic storage mode is taken from the DSM registry
+ *	on first use. In dynamic mode this also attaches to the DSA area.
+ *
+ *	This may ERROR, so it must not be used at transaction end.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_collect_data(PG_FUNCTION_ARGS)
+static profilerSharedState *
+profiler_shared(void)
 {
-	PG_RETURN_INT32(profiler_collect_data());
+#if PG_VERSION_NUM >= 170000
+	if (profiler_shared_state == NULL && PL_DYNAMIC && IsUnderPostmaster)
+	{
+		bool	found;
+
+		profiler_shared_state = GetNamedDSMSegment("plprofiler",
+										offsetof(profilerSharedState,
+												 line_info),
+										profiler_shared_init, &found);
+		if (!profiler_xact_registered)
+		{
+			RegisterXactCallback(profiler_xact_callback, NULL);
+			profiler_xact_registered = true;
+		}
+	}
+#endif
+
+#ifdef PL_HAVE_DYNAMIC
+	if (profiler_shared_state != NULL && PL_DYNAMIC && profiler_dsa == NULL)
+		profiler_dynamic_attach(profiler_shared_state);
+#endif
+
+	return profiler_shared_state;
 }
 
+#ifdef PL_HAVE_DYNAMIC
 /* -------------------------------------------------------------------
- * pl_profiler_callgraph_overflow()
+ * profiler_dynamic_attach()
  *
- *	Return the flag callgraph_overflow from the shared state.
+ *	Attach to the DSA area and the dshash tables of the dynamic
+ *	storage mode. The first backend to get here creates them. The
+ *	area is pinned, so it lives until the server shuts down.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_callgraph_overflow(PG_FUNCTION_ARGS)
+static void
+profiler_dynamic_attach(profilerSharedState *plpss)
 {
-	profilerSharedState	   *plpss = profiler_shared_state;
+	MemoryContext	old_context;
+	dsa_area	   *area;
+	dshash_table   *functions;
+	dshash_table   *callgraph;
 
-	/* Check that plprofiler was loaded via shared_preload_libraries */
-	if (plpss == NULL)
-		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+	LWLockRegisterTranche(plpss->dsa_tranche, "plprofiler_dsa");
+	functions_dsh_params.tranche_id = plpss->dsa_tranche;
+	callgraph_dsh_params.tranche_id = plpss->dsa_tranche;
 
-	PG_RETURN_BOOL(plpss->callgraph_overflow);
+	old_context = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockAcquire(&(plpss->dsa_lock), LW_EXCLUSIVE);
+
+	if (plpss->area_handle == DSA_HANDLE_INVALID)
+	{
+		area = dsa_create(plpss->dsa_tranche);
+		dsa_pin(area);
+		dsa_pin_mapping(area);
+		functions = dshash_create(area, &functions_dsh_params, NULL);
+		callgraph = dshash_create(area, &callgraph_dsh_params, NULL);
+
+		plpss->functions_dsh = dshash_get_hash_table_handle(functions);
+		plpss->callgraph_dsh = dshash_get_hash_table_handle(callgraph);
+		plpss->area_handle = dsa_get_handle(area);
+	}
+	else
+	{
+		area = dsa_attach(plpss->area_handle);
+		dsa_pin_mapping(area);
+		functions = dshash_attach(area, &functions_dsh_params,
+								  plpss->functions_dsh, NULL);
+		callgraph = dshash_attach(area, &callgraph_dsh_params,
+								  plpss->callgraph_dsh, NULL);
+	}
+
+	LWLockRelease(&(plpss->dsa_lock));
+	MemoryContextSwitchTo(old_context);
+
+	profiler_dsa = area;
+	functions_dsh = functions;
+	callgraph_dsh = callgraph;
 }
+#endif
 
 /* -------------------------------------------------------------------
- * pl_profiler_functions_overflow()
+ * find_source()
  *
- *	Return the flag functions_overflow from the shared state.
+ *	This function locates and returns a pointer to a null-terminated string
+ *	that contains the source code for the given function.
+ *
+ *	In addition to returning a pointer to the requested source code, this
+ *	function sets *tup to point to a HeapTuple (that you must release when
+ *	you are finished with it) and sets *funcName to point to the name of
+ *	the given function.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_functions_overflow(PG_FUNCTION_ARGS)
+static char *
+find_source(Oid oid, HeapTuple *tup, char **funcName)
 {
-	profilerSharedState	   *plpss = profiler_shared_state;
+	bool	isNull;
 
-	/* Check that plprofiler was loaded via shared_preload_libraries */
-	if (plpss == NULL)
-		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+	*tup = SearchSysCache(PROCOID, ObjectIdGetDatum(oid), 0, 0, 0);
 
-	PG_RETURN_BOOL(plpss->functions_overflow);
+	if(!HeapTupleIsValid(*tup))
+		elog(ERROR, "plprofiler: cache lookup for function %u failed", oid);
+
+	if (funcName != NULL)
+		*funcName = NameStr(((Form_pg_proc)GETSTRUCT(*tup))->proname);
+
+	return DatumGetCString(DirectFunctionCall1(textout,
+											   SysCacheGetAttr(PROCOID,
+															   *tup,
+															   Anum_pg_proc_prosrc,
+															   &isNull)));
 }
 
 /* -------------------------------------------------------------------
- * pl_profiler_lines_overflow()
+ * count_source_lines()
  *
- *	Return the flag lines_overflow from the shared state.
+ *	This function scans through the source code for a given function
+ *	and counts the number of lines of code present in the string.
  * -------------------------------------------------------------------
  */
-Datum
-pl_profiler_lines_overflow(PG_FUNCTION_ARGS)
+static int
+count_source_lines(const char *src)
 {
-	profilerSharedState	   *plpss = profiler_shared_state;
+	int			line_count = 1;
+	const char *cp = src;
 
-	/* Check that plprofiler was loaded via shared_preload_libraries */
-	if (plpss == NULL)
-		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+	while(cp != NULL)
+	{
+		line_count++;
+		cp = strchr(cp, '\n');
+		if (cp)
+			cp++;
+	}
 
-	PG_RETURN_BOOL(plpss->lines_overflow);
+	return line_count;
+}
+
+static uint32
+line_hash_fn(const void *key, Size keysize)
+{
+	const linestatsHashKey *k = (const linestatsHashKey *) key;
+
+	return hash_uint32((uint32) k->fn_oid) ^
+		hash_uint32((uint32) k->db_oid) ^
+		hash_uint32((uint32) k->fn_version);
+}
+
+static int
+line_match_fn(const void *key1, const void *key2, Size keysize)
+{
+	const linestatsHashKey  *k1 = (const linestatsHashKey *)key1;
+	const linestatsHashKey  *k2 = (const linestatsHashKey *)key2;
+
+	if (k1->fn_oid == k2->fn_oid &&
+		k1->db_oid == k2->db_oid &&
+		k1->fn_version == k2->fn_version)
+		return 0;
+	else
+		return 1;
+}
+
+static uint32
+callgraph_hash_fn(const void *key, Size keysize)
+{
+	return hash_any(key, keysize);
+}
+
+static int
+callgraph_match_fn(const void *key1, const void *key2, Size keysize)
+{
+	callGraphKey   *stack1 = (callGraphKey *)key1;
+	callGraphKey   *stack2 = (callGraphKey *)key2;
+	int				i;
+
+	if (stack1->db_oid != stack2->db_oid)
+		return 1;
+	for (i = 0; i < PL_MAX_STACK_DEPTH && stack1->stack[i] != InvalidOid; i++)
+		if (stack1->stack[i] != stack2->stack[i])
+			return 1;
+	return 0;
+}
+
+#ifdef PL_HAVE_DYNAMIC
+/*
+ * The dshash tables of the dynamic storage mode use the same hash and
+ * compare functions as the dynahash ones.
+ */
+static uint32
+line_dsh_hash(const void *key, size_t keysize, void *arg)
+{
+	return line_hash_fn(key, keysize);
+}
+
+static int
+line_dsh_compare(const void *key1, const void *key2, size_t keysize,
+				 void *arg)
+{
+	return line_match_fn(key1, key2, keysize);
+}
+
+static uint32
+callgraph_dsh_hash(const void *key, size_t keysize, void *arg)
+{
+	return callgraph_hash_fn(key, keysize);
+}
+
+static int
+callgraph_dsh_compare(const void *key1, const void *key2, size_t keysize,
+					  void *arg)
+{
+	return callgraph_match_fn(key1, key2, keysize);
+}
+#endif
+
+static uint32
+callgraph_node_hash_fn(const void *key, Size keysize)
+{
+	const callGraphNodeKey *k = (const callGraphNodeKey *) key;
+
+	return hash_uint32((uint32) k->fn_oid) ^
+		hash_uint32((uint32) k->parent_id);
+}
+
+static int
+callgraph_node_match_fn(const void *key1, const void *key2, Size keysize)
+{
+	const callGraphNodeKey *k1 = (const callGraphNodeKey *)key1;
+	const callGraphNodeKey *k2 = (const callGraphNodeKey *)key2;
+
+	if (k1->fn_oid == k2->fn_oid &&
+		k1->parent_id == k2->parent_id)
+		return 0;
+	else
+		return 1;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_intern()
+ *
+ *	Find or create the calling context tree node for func_oid called
+ *	from the context parent (NULL for a top level call).
+ * -------------------------------------------------------------------
+ */
+static callGraphNode *
+callgraph_intern(callGraphNode *parent, Oid func_oid)
+{
+	callGraphNodeKey	key;
+	callGraphNode	   *node;
+	bool				found;
+
+	key.parent_id = (parent == NULL) ? 0 : parent->node_id;
+	key.fn_oid = func_oid;
+
+	node = (callGraphNode *)hash_search(callgraph_hash, &key,
+										HASH_ENTER, &found);
+	if (node == NULL)
+		elog(ERROR, "plprofiler out of memory");
+	if (!found)
+	{
+		node->node_id = callgraph_next_node_id++;
+		node->depth = (parent == NULL) ? 1 : parent->depth + 1;
+		node->parent = parent;
+		node->callCount = 0;
+		node->totalTime = 0;
+		node->childTime = 0;
+		node->selfTime = 0;
+		node->maxTime = 0;
+		memset(node->hist, 0, PL_HIST_SIZE);
+		node->dirty_next = NULL;
+		node->dirty = false;
+	}
+
+	return node;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_reintern_stack()
+ *
+ *	Resolve the nodes of all tracked frames of the current call stack
+ *	again. Used after the local hash tables have been recreated.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_reintern_stack(void)
+{
+	callGraphNode  *parent = NULL;
+	int				i;
+
+	for (i = 0; i < graph_stack_pt && i < PL_MAX_STACK_DEPTH; i++)
+	{
+		graph_stack[i].node = callgraph_intern(parent, graph_stack[i].fn_oid);
+		graph_stack[i].entry = NULL;
+		parent = graph_stack[i].node;
+	}
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_node_key()
+ *
+ *	Rebuild the full call stack of a calling context tree node
+ *	in the callGraphKey format used by the shared hash table.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_node_key(callGraphNode *node, callGraphKey *key)
+{
+	memset(key, 0, sizeof(callGraphKey));
+	key->db_oid = MyDatabaseId;
+
+	for (; node != NULL; node = node->parent)
+		key->stack[node->depth - 1] = node->key.fn_oid;
+}
+
+static void
+callgraph_push(Oid func_oid, profilerInfo *profiler_info)
+{
+	profiler_sample_fold();
+
+	/*
+	 * We only track function Oids in the call stack up to PL_MAX_STACK_DEPTH.
+	 * Beyond that we just count the current stack depth.
+	 */
+	if (graph_stack_pt < PL_MAX_STACK_DEPTH)
+	{
+		callGraphFrame *frame = &graph_stack[graph_stack_pt];
+
+		/*
+		 * Push this function Oid onto the stack, resolve the calling
+		 * context node, remember the entry time and set the time spent
+		 * in children to zero.
+		 */
+		frame->fn_oid = func_oid;
+		frame->fn_version = profiler_info->fn_version;
+		frame->entry = profiler_info_entry(profiler_info);
+		frame->info = profiler_info;
+		frame->node = callgraph_intern((graph_stack_pt > 0) ?
+									   graph_stack[graph_stack_pt - 1].node :
+									   NULL, func_oid);
+		if (profiler_io)
+			profiler_io_snapshot(&(frame->io_start));
+		frame->entry_time = profiler_sampling ? 0 : profiler_clock_now();
+		frame->child_time = 0;
+		frame->sample_time = 0;
+	}
+
+	graph_stack_pt++;
+}
+
+static void
+callgraph_pop_one(void)
+{
+	callGraphFrame	   *frame;
+	callGraphNode	   *node;
+	uint64				ns_elapsed;
+	uint64				ns_self;
+	linestatsEntry	   *entry;
+
+	/* Check for call stack underrun. */
+    if (graph_stack_pt <= 0)
+	{
+		elog(DEBUG1, "plprofiler: call graph stack underrun");
+		return;
+	}
+
+	/* The ticks up to now still belong to this frame. */
+	profiler_sample_fold();
+
+	/* Remove one level from the call stack. */
+	graph_stack_pt--;
+
+	/* Frames beyond PL_MAX_STACK_DEPTH are not tracked. */
+	if (graph_stack_pt >= PL_MAX_STACK_DEPTH)
+		return;
+	frame = &graph_stack[graph_stack_pt];
+
+	node = frame->node;
+	node->callCount++;
+	callgraph_mark_dirty(node);
+
+	if (profiler_sampling)
+	{
+		/* The sample ticks have already added the node times. */
+		ns_elapsed = frame->sample_time;
+	}
+	else
+	{
+		/* Calculate the time spent in this function and record it. */
+		ns_elapsed = profiler_clock_ns(profiler_clock_now() -
+									   frame->entry_time);
+		ns_self = (ns_elapsed > frame->child_time) ?
+				  ns_elapsed - frame->child_time : 0;
+
+		node->totalTime += ns_elapsed;
+		node->childTime += frame->child_time;
+		node->selfTime  += ns_self;
+		if (ns_elapsed > node->maxTime)
+			node->maxTime = ns_elapsed;
+
+		/* If we have a caller, add our time to the time of its children. */
+		if (graph_stack_pt > 0)
+			graph_stack[graph_stack_pt - 1].child_time += ns_elapsed;
+
+		if (profiler_histograms)
+			node->hist[profiler_hist_bucket(ns_elapsed)]++;
+	}
+
+	/*
+	 * We also collect per function global counts in the pseudo line number
+	 * zero. The line stats are cumulative (for example a FOR ... LOOP
+	 * statement has the entire execution time of all statements in its
+	 * block), so this can't be derived from the actual per line data.
+	 *
+	 * The frame carries the entry from func_beg. Only if the local hash
+	 * tables were reset while the function was executing, we need to
+	 * search for it.
+	 */
+	entry = frame->entry;
+	if (entry == NULL)
+	{
+		linestatsHashKey	key;
+
+		key.fn_oid = frame->fn_oid;
+		key.db_oid = MyDatabaseId;
+		key.fn_version = frame->fn_version;
+
+		entry = (linestatsEntry *)hash_search(functions_hash, &key,
+											  HASH_FIND, NULL);
+	}
+
+	if (entry)
+	{
+		linestats_mark_dirty(entry, 0, 0);
+		entry->line_info[0].exec_count += 1;
+		entry->line_info[0].ns_total += ns_elapsed;
+
+		if (ns_elapsed > entry->line_info[0].ns_max)
+			entry->line_info[0].ns_max = ns_elapsed;
+
+		if (entry->hist != NULL && !profiler_sampling)
+			entry->hist[profiler_hist_bucket(ns_elapsed)]++;
+
+		if (entry->io != NULL && profiler_io)
+			profiler_io_accum(&(entry->io[0]), &(frame->io_start));
+	}
+	else
+	{
+		elog(DEBUG1, "plprofiler: local linestats entry for fn_oid %u "
+					"not found", frame->fn_oid);
+	}
+
+	/*
+	 * Return the invocation data to the pool. When unwinding after an
+	 * exception this is the only place, where that happens.
+	 */
+	profiler_info_release(frame->info);
+
+	/* Zap the frame. */
+	frame->fn_oid = InvalidOid;
+	frame->fn_version = InvalidTransactionId;
+	frame->node = NULL;
+	frame->entry = NULL;
+	frame->info = NULL;
+}
+
+static void
+callgraph_pop(Oid func_oid)
+{
+	callgraph_check(func_oid);
+	callgraph_pop_one();
+}
+
+static void
+callgraph_check(Oid func_oid)
+{
+	/*
+	 * Unwind the call stack until our own func_oid appears on the top.
+	 *
+	 * In case of an exception, the pl executor does not call the
+	 * func_end callback, so we record now as the end of the function
+	 * calls, that were left on the stack.
+	 *
+	 * Levels beyond PL_MAX_STACK_DEPTH cannot be checked and are only
+	 * unwound when clearing the whole stack.
+	 */
+	while (graph_stack_pt > 0)
+	{
+		if (graph_stack_pt > PL_MAX_STACK_DEPTH)
+		{
+			if (func_oid != InvalidOid)
+				break;
+		}
+		else if (graph_stack[graph_stack_pt - 1].fn_oid == func_oid)
+			break;
+		else
+			elog(DEBUG1, "plprofiler: unwinding excess call graph stack entry for %u in %u",
+				 graph_stack[graph_stack_pt - 1].fn_oid, func_oid);
+		callgraph_pop_one();
+	}
+}
+
+/* -------------------------------------------------------------------
+ * profiler_collect_data()
+ *
+ *	Move the local counts, that changed since the last collect, into
+ *	the shared hash tables. With plprofiler.collect_worker they are
+ *	queued in the ring of this backend instead, unless direct is set.
+ * -------------------------------------------------------------------
+ */
+static int32
+profiler_collect_data(bool direct)
+{
+	callGraphNode		   *cgn;
+	callGraphKey			cgkey;
+	linestatsEntry		   *lse1;
+	profilerSharedState	   *plpss;
+	double					scale;
+
+	/*
+	 * Return without doing anything if the plprofiler extension
+	 * was not loaded via shared_preload_libraries. We don't have
+	 * any shared memory state in that case. Only a collect called
+	 * from SQL may attach to the dynamic storage, the others can
+	 * happen at transaction end.
+	 */
+	plpss = direct ? profiler_shared() : profiler_shared_state;
+	if (plpss == NULL)
+		return -1;
+
+	/*
+	 * Don't waste any time here if there was no new data recorded
+	 * since the last collect_data() call.
+	 */
+	if (functions_dirty == NULL && callgraph_dirty == NULL)
+		return 0;
+
+	/*
+	 * The shared counters are estimates of the unsampled values, so
+	 * the local ones are scaled up while adding them.
+	 */
+	scale = profiler_sample_scale();
+
+	/* Without a running worker, the rings would only fill up. */
+	if (profiler_collect_worker && !direct &&
+		plpss->worker_latch != NULL && profiler_ring_attach())
+	{
+		int		nrecords = 0;
+
+		/*
+		 * Queue the changes for the collect worker. What doesn't fit
+		 * into the ring stays on the dirty lists for the next collect,
+		 * so a worker, that falls behind, never causes the backend to
+		 * wait or to lose counts.
+		 */
+		while ((cgn = callgraph_dirty) != NULL)
+		{
+			if (cgn->callCount != 0 &&
+				!profiler_ring_put_callgraph(cgn, scale, &nrecords))
+				break;
+			callgraph_dirty = cgn->dirty_next;
+			cgn->dirty = false;
+		}
+
+		while (callgraph_dirty == NULL && (lse1 = functions_dirty) != NULL)
+		{
+			if (!profiler_ring_put_linestats(lse1, scale, &nrecords))
+				break;
+			functions_dirty = lse1->dirty_next;
+		}
+
+		profiler_ring_publish(nrecords);
+		if (callgraph_dirty != NULL || functions_dirty != NULL)
+			pg_atomic_fetch_add_u64(&(plpss->ring_deferred), 1);
+	}
+	else
+	{
+		if (profiler_collect_worker && !direct)
+			pg_atomic_fetch_add_u64(&(plpss->ring_direct), 1);
+
+		/*
+		 * Collect the callgraph data into shared memory. The local
+		 * data is a calling context tree, so we need to rebuild the
+		 * full call stack of every node, that has new counts, for the
+		 * shared table. Those nodes are on the dirty list, the rest
+		 * of the tree is not visited. A node stays on the list until
+		 * it has been merged, so nothing is lost if we run out of
+		 * shared entries.
+		 */
+		while ((cgn = callgraph_dirty) != NULL)
+		{
+			if (cgn->callCount != 0)
+			{
+				callgraph_node_key(cgn, &cgkey);
+				if (!callgraph_collect_one(&cgkey, cgn, scale, direct))
+					break;
+			}
+			callgraph_dirty = cgn->dirty_next;
+			cgn->dirty = false;
+		}
+
+		/* Collect the linestats data into shared memory the same way. */
+		while ((lse1 = functions_dirty) != NULL)
+		{
+			if (!linestats_collect_one(lse1, scale))
+				break;
+			functions_dirty = lse1->dirty_next;
+		}
+
+		/*
+		 * Without a collect worker to compact fragmented pools, a
+		 * collect called from SQL does it. What didn't fit is still
+		 * on the dirty lists for the next collect.
+		 */
+		if (direct && plpss->compact_requested &&
+			plpss->worker_latch == NULL)
+			profiler_compact();
+	}
+
+	/*
+	 * Account for the top level calls this data was sampled from. The
+	 * shared data is mixed, when it already has calls profiled with
+	 * another interval.
+	 */
+	if (profiler_sampled_calls > 0)
+	{
+		if (profiler_sampling_mixed ||
+			(pg_atomic_read_u64(&(plpss->sampled_calls)) > 0 &&
+			 plpss->sampling_interval != profiler_sampled_interval))
+			plpss->sampling_mixed = true;
+		plpss->sampling_interval = profiler_sampled_interval;
+	}
+	profiler_atomic_add(&(plpss->total_calls), profiler_total_calls);
+	profiler_atomic_add(&(plpss->sampled_calls), profiler_sampled_calls);
+	profiler_total_calls = 0;
+	profiler_sampled_calls = 0;
+	profiler_sampling_mixed = false;
+
+	return 0;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_collect_one()
+ *
+ *	Merge the counters of one calling context tree node into the
+ *	shared call graph entry with the given key. Returns false if the
+ *	entry could not be created, because the shared table is full and
+ *	nothing could be evicted.
+ *
+ *	Eviction scans the whole table, so only the collect worker and
+ *	collects called from SQL set evict. The collects of the backends,
+ *	which run at commit, leave the node on the dirty list and count
+ *	the table as overflowed.
+ * -------------------------------------------------------------------
+ */
+static bool
+callgraph_collect_one(callGraphKey *cgkey, callGraphNode *cgn, double scale,
+					  bool evict)
+{
+	if (callgraph_collect_try(cgkey, cgn, scale))
+		return true;
+
+	/*
+	 * The shared table is full. In Space-Saving mode the call graphs
+	 * with the least total time make room for the new one.
+	 */
+	if (evict && profiler_callgraph_evict && !PL_DYNAMIC &&
+		callgraph_evict())
+		return callgraph_collect_try(cgkey, cgn, scale);
+
+	return false;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_collect_try()
+ *
+ *	Merge one call graph into its shared entry, creating the entry if
+ *	needed. Returns false if the shared table is full.
+ *
+ *	The counters are atomics, so merging into an existing entry only
+ *	needs the partition lock of the entry in shared mode. Only when
+ *	the entry does not exist yet, we take the partition lock in
+ *	exclusive mode to create it. That never blocks backends working
+ *	on other partitions.
+ * -------------------------------------------------------------------
+ */
+static bool
+callgraph_collect_try(callGraphKey *cgkey, callGraphNode *cgn, double scale)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	callGraphEntry		   *cge2;
+	LWLock				   *partition_lock;
+	uint32					hashcode;
+	bool					found;
+
+#ifdef PL_HAVE_DYNAMIC
+	if (PL_DYNAMIC)
+		return callgraph_collect_dynamic(cgkey, cgn, scale);
+#endif
+
+	hashcode = get_hash_value(callgraph_shared, cgkey);
+	partition_lock = PL_CALLGRAPH_LOCK(plpss, hashcode);
+
+	LWLockAcquire(partition_lock, LW_SHARED);
+	cge2 = hash_search_with_hash_value(callgraph_shared, cgkey,
+									   hashcode, HASH_FIND, NULL);
+	if (cge2 != NULL && PL_ENTRY_STALE(cge2))
+		cge2 = NULL;
+	if (cge2 != NULL)
+		callgraph_merge(cge2, cgn, scale);
+	LWLockRelease(partition_lock);
+
+	if (cge2 != NULL)
+		return true;
+
+	/*
+	 * This callgraph is not yet known in shared memory or its counters
+	 * are from before a reset. Need to escalate the partition lock to
+	 * exclusive.
+	 */
+	LWLockAcquire(partition_lock, LW_EXCLUSIVE);
+	cge2 = hash_search_with_hash_value(callgraph_shared, cgkey,
+									   hashcode, HASH_ENTER_NULL,
+									   &found);
+	if (cge2 == NULL)
+	{
+		LWLockRelease(partition_lock);
+
+		/* Entries left over from a reset make room first. */
+		if (profiler_purge_stale() > 0)
+			return callgraph_collect_try(cgkey, cgn, scale);
+
+		/*
+		 * This means that we are out of shared memory for the
+		 * callgraph_shared hash table. Nothing we can do
+		 * here but complain.
+		 */
+		if (!plpss->callgraph_overflow)
+		{
+			elog(LOG,
+				 "plprofiler: entry limit reached for "
+				 "shared memory call graph data");
+			plpss->callgraph_overflow = true;
+		}
+		return false;
+	}
+
+	/*
+	 * Since we released the lock above for lock escalation to
+	 * exclusive, it is possible that someone else in the meantime
+	 * created the entry for this call graph.
+	 */
+	if (!found)
+	{
+		/*
+		 * We created a new entry for this call graph in the
+		 * shared hash table. Initialize it.
+		 */
+		pg_atomic_init_u64(&(cge2->callCount), 0);
+		pg_atomic_init_u64(&(cge2->totalTime), 0);
+		pg_atomic_init_u64(&(cge2->childTime), 0);
+		pg_atomic_init_u64(&(cge2->selfTime), 0);
+		pg_atomic_init_u64(&(cge2->maxTimeInterval), 0);
+		cge2->hist = profiler_hist_alloc(1);
+		cge2->error = pg_atomic_read_u64(&(plpss->callgraph_evict_floor));
+		cge2->generation = pg_atomic_read_u64(&(plpss->generation));
+		pg_atomic_init_u64(&(cge2->changes_begin), 0);
+		pg_atomic_init_u64(&(cge2->changes_end), 0);
+
+		/*
+		 * The histogram pool is used up, but entries left over from a
+		 * reset may hold histograms. Drop the new entry, remove those
+		 * and try again.
+		 */
+		if (cge2->hist == NULL && profiler_max_histograms > 0 &&
+			profiler_purge_pending())
+		{
+			hash_search_with_hash_value(callgraph_shared, cgkey, hashcode,
+										HASH_REMOVE, NULL);
+			LWLockRelease(partition_lock);
+			profiler_purge_stale();
+			return callgraph_collect_try(cgkey, cgn, scale);
+		}
+	}
+	else if (PL_ENTRY_STALE(cge2))
+		callgraph_shared_reinit(cge2);
+
+	callgraph_merge(cge2, cgn, scale);
+	LWLockRelease(partition_lock);
+
+	return true;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_evict()
+ *
+ *	Make room in the full shared call graph table the Space-Saving way.
+ *	The call graphs with the smallest weight, their total time plus the
+ *	error they were created with, are removed, PL_EVICT_FRACTION of the
+ *	table at a time. New entries start with the largest weight evicted
+ *	so far as their error, which bounds the total time they may have
+ *	missed while they were not in the table. Only one backend evicts
+ *	at a time, the others keep their data for the next collect. Returns
+ *	true if entries were removed.
+ * -------------------------------------------------------------------
+ */
+static bool
+callgraph_evict(void)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	uint32					expected = 0;
+	bool					evicted;
+
+	if (!pg_atomic_compare_exchange_u32(&(plpss->callgraph_evicting),
+										&expected, 1))
+		return false;
+
+	/* An error while evicting must not leave eviction disabled. */
+	PG_ENSURE_ERROR_CLEANUP(callgraph_evict_cleanup, (Datum) 0);
+	{
+		evicted = callgraph_evict_scan();
+	}
+	PG_END_ENSURE_ERROR_CLEANUP(callgraph_evict_cleanup, (Datum) 0);
+
+	callgraph_evict_cleanup(0, (Datum) 0);
+
+	return evicted;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_evict_cleanup()
+ *
+ *	Let the next backend evict, also when callgraph_evict() errors out.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_evict_cleanup(int code, Datum arg)
+{
+	pg_atomic_write_u32(&(profiler_shared_state->callgraph_evicting), 0);
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_evict_scan()
+ *
+ *	Remove the call graphs with the smallest weight for
+ *	callgraph_evict(), which holds the evicting flag.
+ * -------------------------------------------------------------------
+ */
+static bool
+callgraph_evict_scan(void)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	profilerSharedScan		scan;
+	callGraphEntry		   *cge2;
+	uint64				   *weights;
+	uint64					threshold;
+	uint64					max_evicted = 0;
+	uint64					floor;
+	int						nweights = 0;
+	int						size = 1024;
+	int						nevict;
+	int						evicted = 0;
+
+	/* Find the weight, below which the entries are evicted. */
+	weights = palloc(sizeof(uint64) * size);
+
+	profiler_scan_begin(&scan, true, false);
+	while ((cge2 = profiler_scan_next(&scan)) != NULL)
+	{
+		if (nweights >= size)
+		{
+			size *= 2;
+			weights = repalloc(weights, sizeof(uint64) * size);
+		}
+		weights[nweights++] = pg_atomic_read_u64(&(cge2->totalTime)) +
+							  cge2->error;
+	}
+	profiler_scan_end(&scan);
+
+	if (nweights == 0)
+	{
+		pfree(weights);
+		return false;
+	}
+
+	qsort(weights, nweights, sizeof(uint64), callgraph_weight_cmp);
+	nevict = Max(nweights / PL_EVICT_FRACTION, 1);
+	threshold = weights[nevict - 1];
+	pfree(weights);
+
+	/* Entries may have been added meanwhile, evict no more than planned. */
+	profiler_scan_begin(&scan, true, true);
+	while ((cge2 = profiler_scan_next(&scan)) != NULL)
+	{
+		uint64	weight;
+
+		if (evicted >= nevict)
+			continue;
+
+		weight = pg_atomic_read_u64(&(cge2->totalTime)) + cge2->error;
+		if (weight > threshold)
+			continue;
+
+		profiler_scan_remove(&scan, cge2);
+		if (weight > max_evicted)
+			max_evicted = weight;
+		evicted++;
+	}
+
+	/* The error floor only ever grows, as in Space-Saving. */
+	floor = pg_atomic_read_u64(&(plpss->callgraph_evict_floor));
+	if (max_evicted > floor)
+		pg_atomic_write_u64(&(plpss->callgraph_evict_floor), max_evicted);
+	pg_atomic_fetch_add_u64(&(plpss->callgraph_evicted), evicted);
+	profiler_scan_end(&scan);
+
+	return evicted > 0;
+}
+
+static int
+callgraph_weight_cmp(const void *a, const void *b)
+{
+	uint64	weight_a = *((const uint64 *) a);
+	uint64	weight_b = *((const uint64 *) b);
+
+	if (weight_a < weight_b)
+		return -1;
+	if (weight_a > weight_b)
+		return 1;
+	return 0;
+}
+
+/* -------------------------------------------------------------------
+ * linestats_collect_one()
+ *
+ *	Merge the dirty slots of a local linestats entry into the shared
+ *	entry of the function, like callgraph_collect_one() does. Returns
+ *	false if the shared table is full.
+ * -------------------------------------------------------------------
+ */
+static bool
+linestats_collect_one(linestatsEntry *lse1, double scale)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	linestatsSharedEntry   *lse2;
+	LWLock				   *partition_lock;
+	uint32					hashcode;
+	bool					found;
+
+#ifdef PL_HAVE_DYNAMIC
+	if (PL_DYNAMIC)
+		return linestats_collect_dynamic(lse1, scale);
+#endif
+
+	hashcode = get_hash_value(functions_shared, &(lse1->key));
+	partition_lock = PL_FUNCTIONS_LOCK(plpss, hashcode);
+
+	LWLockAcquire(partition_lock, LW_SHARED);
+	lse2 = hash_search_with_hash_value(functions_shared, &(lse1->key),
+									   hashcode, HASH_FIND, NULL);
+	if (lse2 != NULL && PL_ENTRY_STALE(lse2))
+		lse2 = NULL;
+	if (lse2 != NULL)
+		linestats_merge(lse2, lse1, scale);
+	LWLockRelease(partition_lock);
+
+	if (lse2 != NULL)
+		return true;
+
+	/*
+	 * This function is not yet known in shared memory or its counters
+	 * are from before a reset. Need to escalate the partition lock to
+	 * exclusive.
+	 */
+	LWLockAcquire(partition_lock, LW_EXCLUSIVE);
+	lse2 = hash_search_with_hash_value(functions_shared, &(lse1->key),
+									   hashcode, HASH_ENTER_NULL,
+									   &found);
+	if (lse2 == NULL)
+	{
+		LWLockRelease(partition_lock);
+
+		/* Entries left over from a reset make room first. */
+		if (profiler_purge_stale() > 0)
+			return linestats_collect_one(lse1, scale);
+
+		/*
+		 * This means that we are out of shared memory for the
+		 * functions_shared hash table. Nothing we can do
+		 * here but complain.
+		 */
+		if (!plpss->functions_overflow)
+		{
+			elog(LOG,
+				 "plprofiler: entry limit reached for "
+				 "shared memory functions data");
+			plpss->functions_overflow = true;
+		}
+		return false;
+	}
+	if (memcmp(&(lse2->key), &(lse1->key), sizeof(linestatsHashKey)) != 0)
+	{
+		elog(FATAL, "key of new hash entry doesn't match");
+	}
+
+	/*
+	 * Someone else may have created the entry for this function
+	 * while we waited for the exclusive lock.
+	 */
+	if (!found)
+	{
+		/*
+		 * We created a new entry for this function in the
+		 * shared hash table. Initialize it. We also need to
+		 * allocate the per line counters here. If we run out
+		 * of per line counters in the shared state, we don't
+		 * keep count for any lines of this function at all.
+		 */
+		lse2->stmt_slots = lse1->stmt_slots;
+		lse2->source_lines = lse1->source_lines;
+		lse2->fn_schema = lse1->fn_schema;
+		lse2->fn_name = lse1->fn_name;
+		lse2->line_info = profiler_lines_alloc(lse1->line_count);
+		lse2->line_count = (lse2->line_info != NULL) ?
+						   lse1->line_count : 0;
+		lse2->hist = (lse2->line_count > 0) ?
+					 profiler_hist_alloc(lse2->line_count) : NULL;
+		lse2->io = (lse2->line_count > 0) ?
+				   profiler_io_alloc(lse2->line_count) : NULL;
+		lse2->generation = pg_atomic_read_u64(&(plpss->generation));
+		pg_atomic_init_u64(&(lse2->changes_begin), 0);
+		pg_atomic_init_u64(&(lse2->changes_end), 0);
+
+		/*
+		 * A counter pool is used up, but entries left over from a
+		 * reset may hold slices of it. Drop the new entry, remove
+		 * those and try again.
+		 */
+		if ((lse2->line_count < lse1->line_count ||
+			 (lse2->hist == NULL && profiler_max_histograms > 0) ||
+			 (lse2->io == NULL && profiler_max_io_lines > 0)) &&
+			profiler_purge_pending())
+		{
+			linestats_fixed_free(lse2);
+			hash_search_with_hash_value(functions_shared, &(lse1->key),
+										hashcode, HASH_REMOVE, NULL);
+			LWLockRelease(partition_lock);
+			profiler_purge_stale();
+			return linestats_collect_one(lse1, scale);
+		}
+	}
+	else if (PL_ENTRY_STALE(lse2))
+		linestats_shared_reinit(lse2);
+
+	linestats_merge(lse2, lse1, scale);
+	LWLockRelease(partition_lock);
+
+	return true;
+}
+
+#ifdef PL_HAVE_DYNAMIC
+/* -------------------------------------------------------------------
+ * callgraph_collect_dynamic()
+ *
+ *	callgraph_collect_one() for the dshash table of the dynamic storage
+ *	mode. dshash_find() takes the partition lock of an existing entry
+ *	in shared mode, dshash_find_or_insert() in exclusive mode. Returns
+ *	false if the entry could not be created, because the memory limit
+ *	was reached or this backend isn't attached to the DSA area yet.
+ * -------------------------------------------------------------------
+ */
+static bool
+callgraph_collect_dynamic(callGraphKey *cgkey, callGraphNode *cgn,
+						  double scale)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	callGraphEntry		   *cge2;
+	bool					found;
+
+	if (profiler_dsa == NULL)
+		return false;
+
+	cge2 = dshash_find(callgraph_dsh, cgkey, false);
+	if (cge2 != NULL && PL_ENTRY_STALE(cge2))
+	{
+		/* Reinitialize the counters under the exclusive lock. */
+		dshash_release_lock(callgraph_dsh, cge2);
+		cge2 = dshash_find(callgraph_dsh, cgkey, true);
+		if (cge2 != NULL && PL_ENTRY_STALE(cge2))
+			callgraph_shared_reinit(cge2);
+	}
+	if (cge2 == NULL)
+	{
+		Size	size = sizeof(callGraphEntry);
+
+		if (profiler_hist_count(cgn->hist) > 0)
+			size += PL_SHARED_HIST_SIZE;
+
+		/*
+		 * Entries left over from a reset make room first, also for the
+		 * histogram. Without preloading there is no collect worker to
+		 * remove them.
+		 */
+		if (!profiler_dynamic_room(size) && profiler_purge_stale() > 0)
+			return callgraph_collect_dynamic(cgkey, cgn, scale);
+
+		if (!profiler_dynamic_room(sizeof(callGraphEntry)))
+		{
+			if (!plpss->callgraph_overflow)
+			{
+				elog(LOG,
+					 "plprofiler: memory limit reached for "
+					 "dynamic shared memory call graph data");
+				plpss->callgraph_overflow = true;
+			}
+			return false;
+		}
+
+		cge2 = dshash_find_or_insert(callgraph_dsh, cgkey, &found);
+		if (!found)
+		{
+			pg_atomic_fetch_add_u64(&(plpss->dynamic_used),
+									sizeof(callGraphEntry));
+			pg_atomic_init_u64(&(cge2->callCount), 0);
+			pg_atomic_init_u64(&(cge2->totalTime), 0);
+			pg_atomic_init_u64(&(cge2->childTime), 0);
+			pg_atomic_init_u64(&(cge2->selfTime), 0);
+			pg_atomic_init_u64(&(cge2->maxTimeInterval), 0);
+			cge2->hist = NULL;
+			cge2->error = 0;
+			cge2->generation = pg_atomic_read_u64(&(plpss->generation));
+			pg_atomic_init_u64(&(cge2->changes_begin), 0);
+			pg_atomic_init_u64(&(cge2->changes_end), 0);
+			cge2->hist_dp = InvalidDsaPointer;
+
+			/* Only call graphs, that come with a histogram, get one. */
+			if (profiler_hist_count(cgn->hist) > 0)
+			{
+				cge2->hist_dp = profiler_dsa_alloc(PL_SHARED_HIST_SIZE,
+												   &(plpss->histograms_overflow),
+												   "latency histograms");
+				if (DsaPointerIsValid(cge2->hist_dp))
+				{
+					profiler_hist_init(dsa_get_address(profiler_dsa,
+													   cge2->hist_dp), 1);
+					pg_atomic_fetch_add_u32(&(plpss->hists_used), 1);
+				}
+			}
+		}
+		else if (PL_ENTRY_STALE(cge2))
+			callgraph_shared_reinit(cge2);
+	}
+
+	callgraph_merge(cge2, cgn, scale);
+	dshash_release_lock(callgraph_dsh, cge2);
+
+	return true;
+}
+
+/* -------------------------------------------------------------------
+ * linestats_collect_dynamic()
+ *
+ *	linestats_collect_one() for the dshash table of the dynamic storage
+ *	mode. The per slot counters, histograms and I/O counters of a new
+ *	entry are allocated in the DSA area. Like in the fixed pools, a
+ *	function, whose counters don't fit, is kept without any slots.
+ * -------------------------------------------------------------------
+ */
+static bool
+linestats_collect_dynamic(linestatsEntry *lse1, double scale)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	linestatsSharedEntry   *lse2;
+	bool					found;
+
+	if (profiler_dsa == NULL)
+		return false;
+
+	lse2 = dshash_find(functions_dsh, &(lse1->key), false);
+	if (lse2 != NULL && PL_ENTRY_STALE(lse2))
+	{
+		dshash_release_lock(functions_dsh, lse2);
+		lse2 = dshash_find(functions_dsh, &(lse1->key), true);
+		if (lse2 != NULL && PL_ENTRY_STALE(lse2))
+			linestats_shared_reinit(lse2);
+	}
+	if (lse2 == NULL)
+	{
+		Size	size = sizeof(linestatsSharedEntry) +
+					   sizeof(linestatsSharedLine) * lse1->line_count;
+
+		if (lse1->hist != NULL)
+			size += PL_SHARED_HIST_SIZE * lse1->line_count;
+		if (lse1->io != NULL)
+			size += PL_SHARED_IO_SIZE * lse1->line_count;
+
+		/*
+		 * Entries left over from a reset make room first, also for the
+		 * counters.
+		 */
+		if (!profiler_dynamic_room(size) && profiler_purge_stale() > 0)
+			return linestats_collect_dynamic(lse1, scale);
+
+		if (!profiler_dynamic_room(sizeof(linestatsSharedEntry)))
+		{
+			if (!plpss->functions_overflow)
+			{
+				elog(LOG,
+					 "plprofiler: memory limit reached for "
+					 "dynamic shared memory functions data");
+				plpss->functions_overflow = true;
+			}
+			return false;
+		}
+
+		lse2 = dshash_find_or_insert(functions_dsh, &(lse1->key), &found);
+		if (!found)
+		{
+			int		count = lse1->line_count;
+
+			pg_atomic_fetch_add_u64(&(plpss->dynamic_used),
+									sizeof(linestatsSharedEntry));
+
+			lse2->stmt_slots = lse1->stmt_slots;
+			lse2->source_lines = lse1->source_lines;
+			lse2->fn_schema = lse1->fn_schema;
+			lse2->fn_name = lse1->fn_name;
+			lse2->line_info = NULL;
+			lse2->hist = NULL;
+			lse2->io = NULL;
+			lse2->generation = pg_atomic_read_u64(&(plpss->generation));
+			pg_atomic_init_u64(&(lse2->changes_begin), 0);
+			pg_atomic_init_u64(&(lse2->changes_end), 0);
+			lse2->line_info_dp = InvalidDsaPointer;
+			lse2->hist_dp = InvalidDsaPointer;
+			lse2->io_dp = InvalidDsaPointer;
+
+			if (count > 0)
+				lse2->line_info_dp = profiler_dsa_alloc(
+										sizeof(linestatsSharedLine) * count,
+										&(plpss->lines_overflow),
+										"per source line data");
+			lse2->line_count = DsaPointerIsValid(lse2->line_info_dp) ?
+							   count : 0;
+			if (lse2->line_count > 0)
+			{
+				profiler_lines_init(dsa_get_address(profiler_dsa,
+													lse2->line_info_dp),
+									count);
+				pg_atomic_fetch_add_u32(&(plpss->lines_used), count);
+			}
+
+			if (lse2->line_count > 0 && lse1->hist != NULL)
+			{
+				lse2->hist_dp = profiler_dsa_alloc(PL_SHARED_HIST_SIZE * count,
+												   &(plpss->histograms_overflow),
+												   "latency histograms");
+				if (DsaPointerIsValid(lse2->hist_dp))
+				{
+					profiler_hist_init(dsa_get_address(profiler_dsa,
+													   lse2->hist_dp),
+									   count);
+					pg_atomic_fetch_add_u32(&(plpss->hists_used), count);
+				}
+			}
+
+			if (lse2->line_count > 0 && lse1->io != NULL)
+			{
+				lse2->io_dp = profiler_dsa_alloc(PL_SHARED_IO_SIZE * count,
+												 &(plpss->io_overflow),
+												 "per source line I/O data");
+				if (DsaPointerIsValid(lse2->io_dp))
+				{
+					profiler_io_init(dsa_get_address(profiler_dsa,
+													 lse2->io_dp),
+									 count);
+					pg_atomic_fetch_add_u32(&(plpss->io_used), count);
+				}
+			}
+		}
+		else if (PL_ENTRY_STALE(lse2))
+			linestats_shared_reinit(lse2);
+	}
+
+	linestats_merge(lse2, lse1, scale);
+	dshash_release_lock(functions_dsh, lse2);
+
+	return true;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_dynamic_free()
+ *
+ *	Release the DSA memory of a call graph entry, that is removed.
+ *	dshash frees the entry itself, but we still account for it.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_dynamic_free(callGraphEntry *cge2)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	Size					size = sizeof(callGraphEntry);
+
+	if (DsaPointerIsValid(cge2->hist_dp))
+	{
+		dsa_free(profiler_dsa, cge2->hist_dp);
+		pg_atomic_fetch_sub_u32(&(plpss->hists_used), 1);
+		size += PL_SHARED_HIST_SIZE;
+	}
+	pg_atomic_fetch_sub_u64(&(plpss->dynamic_used), size);
+}
+
+/* -------------------------------------------------------------------
+ * linestats_dynamic_free()
+ *
+ *	Release the DSA memory of a linestats entry, that is removed.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_dynamic_free(linestatsSharedEntry *lse2)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	Size					size = sizeof(linestatsSharedEntry);
+	int						count = lse2->line_count;
+
+	if (DsaPointerIsValid(lse2->line_info_dp))
+	{
+		dsa_free(profiler_dsa, lse2->line_info_dp);
+		pg_atomic_fetch_sub_u32(&(plpss->lines_used), count);
+		size += sizeof(linestatsSharedLine) * count;
+	}
+	if (DsaPointerIsValid(lse2->hist_dp))
+	{
+		dsa_free(profiler_dsa, lse2->hist_dp);
+		pg_atomic_fetch_sub_u32(&(plpss->hists_used), count);
+		size += PL_SHARED_HIST_SIZE * count;
+	}
+	if (DsaPointerIsValid(lse2->io_dp))
+	{
+		dsa_free(profiler_dsa, lse2->io_dp);
+		pg_atomic_fetch_sub_u32(&(plpss->io_used), count);
+		size += PL_SHARED_IO_SIZE * count;
+	}
+	pg_atomic_fetch_sub_u64(&(plpss->dynamic_used), size);
+}
+#endif
+
+/* -------------------------------------------------------------------
+ * profiler_ring_attach()
+ *
+ *	Make sure this backend owns a collect ring. Returns false if all
+ *	rings are taken, the data is then merged directly.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_ring_attach(void)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	int						i;
+
+	if (profiler_ring != NULL)
+		return true;
+
+	for (i = 0; i < profiler_collect_rings; i++)
+	{
+		profilerRing   *ring = PL_RING(plpss, i);
+		uint32			owner = 0;
+
+		if (pg_atomic_read_u32(&(ring->owner)) != 0 ||
+			!pg_atomic_compare_exchange_u32(&(ring->owner), &owner,
+											(uint32) MyProcPid))
+			continue;
+
+		/* The previous owner may have left records for the worker. */
+		profiler_ring = ring;
+		profiler_ring_head = pg_atomic_read_u64(&(ring->head));
+
+		if (!profiler_ring_exit_registered)
+		{
+			before_shmem_exit(profiler_ring_detach, (Datum) 0);
+			profiler_ring_exit_registered = true;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_ring_detach()
+ *
+ *	Give up the collect ring at backend exit. Records still in it are
+ *	merged by the worker as usual.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_ring_detach(int code, Datum arg)
+{
+	if (profiler_ring == NULL)
+		return;
+
+	pg_memory_barrier();
+	pg_atomic_write_u32(&(profiler_ring->owner), 0);
+	profiler_ring = NULL;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_ring_reserve()
+ *
+ *	Reserve space for a record of len bytes in our ring. A record is
+ *	never split at the end of the ring, a pad record fills the rest
+ *	instead. Returns NULL if the worker hasn't made enough room yet.
+ * -------------------------------------------------------------------
+ */
+static char *
+profiler_ring_reserve(Size len)
+{
+	profilerRing   *ring = profiler_ring;
+	Size			size = PL_RING_BYTES;
+	Size			pos = profiler_ring_head % size;
+	Size			pad = 0;
+	uint64			tail;
+	char		   *rec;
+
+	len = MAXALIGN(len);
+	if (pos + len > size)
+		pad = size - pos;
+
+	tail = pg_atomic_read_u64(&(ring->tail));
+	if (profiler_ring_head + pad + len - tail > size)
+		return NULL;
+
+	/* The worker must be done reading the space we are about to reuse. */
+	pg_memory_barrier();
+
+	if (pad >= sizeof(profilerRingHeader))
+	{
+		profilerRingHeader *hdr = (profilerRingHeader *) (ring->data + pos);
+
+		hdr->len = (uint32) pad;
+		hdr->type = PL_RING_PAD;
+	}
+	profiler_ring_head += pad;
+
+	rec = ring->data + profiler_ring_head % size;
+	((profilerRingHeader *) rec)->len = (uint32) len;
+	profiler_ring_head += len;
+
+	return rec;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_ring_publish()
+ *
+ *	Make the records written by this collect visible to the worker.
+ *	The worker is woken up early, when the ring is half full.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_ring_publish(int nrecords)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	profilerRing		   *ring = profiler_ring;
+	Latch				   *latch;
+
+	if (nrecords == 0)
+		return;
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&(ring->head), profiler_ring_head);
+	pg_atomic_fetch_add_u64(&(plpss->ring_records), nrecords);
+
+	latch = plpss->worker_latch;
+	if (latch != NULL &&
+		profiler_ring_head - pg_atomic_read_u64(&(ring->tail)) >
+		PL_RING_BYTES / 2)
+		SetLatch(latch);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_ring_put_callgraph()
+ *
+ *	Queue the counters of a calling context tree node, scaled up by
+ *	the sample scale, and reset them. Returns false if the ring is
+ *	full.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_ring_put_callgraph(callGraphNode *cgn, double scale, int *nrecords)
+{
+	profilerRingCallgraph  *rec;
+	callGraphNode		   *node;
+	bool					has_hist = false;
+	Size					len;
+	char				   *p;
+	Oid					   *stack;
+	int						i;
+
+	for (i = 0; i < PL_HIST_BUCKETS && !has_hist; i++)
+		has_hist = (cgn->hist[i] != 0);
+
+	len = MAXALIGN(sizeof(profilerRingCallgraph)) +
+		  (has_hist ? PL_HIST_SIZE : 0) + sizeof(Oid) * cgn->depth;
+	rec = (profilerRingCallgraph *) profiler_ring_reserve(len);
+	if (rec == NULL)
+		return false;
+
+	rec->hdr.type = PL_RING_CALLGRAPH;
+	rec->db_oid = MyDatabaseId;
+	rec->depth = cgn->depth;
+	rec->has_hist = has_hist;
+	rec->callCount = PL_SCALE(cgn->callCount, scale);
+	rec->totalTime = PL_SCALE(cgn->totalTime, scale);
+	rec->childTime = PL_SCALE(cgn->childTime, scale);
+	rec->selfTime = PL_SCALE(cgn->selfTime, scale);
+	rec->maxTime = cgn->maxTime;
+
+	p = (char *) rec + MAXALIGN(sizeof(profilerRingCallgraph));
+	if (has_hist)
+	{
+		uint32	   *hist = (uint32 *) p;
+
+		for (i = 0; i < PL_HIST_BUCKETS; i++)
+			hist[i] = (uint32) PL_SCALE(cgn->hist[i], scale);
+		p += PL_HIST_SIZE;
+	}
+
+	stack = (Oid *) p;
+	for (node = cgn; node != NULL; node = node->parent)
+		stack[node->depth - 1] = node->key.fn_oid;
+
+	callgraph_node_clear(cgn);
+	(*nrecords)++;
+
+	return true;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_ring_put_linestats()
+ *
+ *	Queue the dirty slots of a local linestats entry, scaled up by the
+ *	sample scale, and reset them. A function too large for the ring is
+ *	merged directly. Returns false if the ring or, in that case, the
+ *	shared table is full.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_ring_put_linestats(linestatsEntry *lse1, double scale,
+							int *nrecords)
+{
+	profilerRingLinestats  *rec;
+	int						line_min = lse1->dirty_min;
+	int						line_max = Min(lse1->dirty_max,
+										   lse1->line_count - 1);
+	int						nlines = Max(line_max - line_min + 1, 0);
+	int						schema_len = strlen(NameStr(lse1->fn_schema)) + 1;
+	int						name_len = strlen(NameStr(lse1->fn_name)) + 1;
+	Size					len;
+	char				   *p;
+	int						i;
+	int						j;
+
+	len = MAXALIGN(sizeof(profilerRingLinestats)) +
+		  nlines * sizeof(linestatsLineInfo);
+	if (lse1->hist != NULL)
+		len += nlines * PL_HIST_SIZE;
+	if (lse1->io != NULL)
+		len += nlines * sizeof(linestatsIoInfo);
+	len += schema_len + name_len;
+
+	if (len > PL_RING_BYTES)
+		return linestats_collect_one(lse1, scale);
+
+	rec = (profilerRingLinestats *) profiler_ring_reserve(len);
+	if (rec == NULL)
+		return false;
+
+	rec->hdr.type = PL_RING_LINESTATS;
+	rec->key = lse1->key;
+	rec->line_count = lse1->line_count;
+	rec->source_lines = lse1->source_lines;
+	rec->stmt_slots = lse1->stmt_slots;
+	rec->has_hist = (lse1->hist != NULL);
+	rec->has_io = (lse1->io != NULL);
+	rec->line_min = line_min;
+	rec->nlines = nlines;
+	rec->names_len = schema_len + name_len;
+
+	p = (char *) rec + MAXALIGN(sizeof(profilerRingLinestats));
+	for (i = 0; i < nlines; i++)
+	{
+		linestatsLineInfo  *src = &(lse1->line_info[line_min + i]);
+		linestatsLineInfo  *dst = &(((linestatsLineInfo *) p)[i]);
+
+		dst->ns_max = src->ns_max;
+		dst->ns_total = PL_SCALE(src->ns_total, scale);
+		dst->exec_count = PL_SCALE(src->exec_count, scale);
+		dst->lineno = src->lineno;
+	}
+	p += nlines * sizeof(linestatsLineInfo);
+
+	if (lse1->hist != NULL)
+	{
+		uint32	   *src = &(lse1->hist[line_min * PL_HIST_BUCKETS]);
+		uint32	   *dst = (uint32 *) p;
+
+		for (i = 0; i < nlines * PL_HIST_BUCKETS; i++)
+			dst[i] = (uint32) PL_SCALE(src[i], scale);
+		p += nlines * PL_HIST_SIZE;
+	}
+
+	if (lse1->io != NULL)
+	{
+		int64	   *src = (int64 *) &(lse1->io[line_min]);
+		int64	   *dst = (int64 *) p;
+
+		for (i = 0; i < nlines; i++)
+			for (j = 0; j < PL_IO_COUNTERS; j++)
+				dst[i * PL_IO_COUNTERS + j] =
+					PL_SCALE(src[i * PL_IO_COUNTERS + j], scale);
+		p += nlines * sizeof(linestatsIoInfo);
+	}
+
+	/* The worker may create the shared entry from this record. */
+	memcpy(p, NameStr(lse1->fn_schema), schema_len);
+	memcpy(p + schema_len, NameStr(lse1->fn_name), name_len);
+
+	linestats_clear_dirty(lse1);
+	(*nrecords)++;
+
+	return true;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_worker_main()
+ *
+ *	Entry point of the collect worker (plprofiler.collect_worker). It
+ *	drains the rings of all backends and merges the records into the
+ *	shared hash tables, then sleeps until a backend wakes it up or
+ *	PL_WORKER_NAPTIME has passed. An error is reported and the loop
+ *	goes on, like in the background writer, so that the backends
+ *	don't lose their collector to a single failure.
+ * -------------------------------------------------------------------
+ */
+void
+profiler_worker_main(Datum main_arg)
+{
+	profilerSharedState	   *plpss;
+	MemoryContext			worker_mcxt;
+	TimestampTz				last_save;
+	sigjmp_buf				local_sigjmp_buf;
+	int						rc;
+
+	pqsignal(SIGTERM, profiler_worker_sigterm);
+	pqsignal(SIGHUP, profiler_worker_sighup);
+	BackgroundWorkerUnblockSignals();
+
+	plpss = profiler_shared();
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	worker_mcxt = AllocSetContextCreate(TopMemoryContext,
+										"plprofiler collect worker",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
+	last_save = GetCurrentTimestamp();
+
+	plpss->worker_pid = MyProcPid;
+	plpss->worker_latch = MyLatch;
+	before_shmem_exit(profiler_worker_exit, (Datum) 0);
+
+	if (sigsetjmp(local_sigjmp_buf, 1) != 0)
+	{
+		/* Since not using PG_TRY, must reset error stack by hand. */
+		error_context_stack = NULL;
+
+		/* Prevent interrupts while cleaning up. */
+		HOLD_INTERRUPTS();
+
+		EmitErrorReport();
+
+		/*
+		 * The worker runs no transactions, so only the partition locks,
+		 * the state file and the memory of this round need releasing.
+		 */
+		LWLockReleaseAll();
+		pgstat_report_wait_end();
+		AtEOXact_Files(false);
+
+		MemoryContextSwitchTo(TopMemoryContext);
+		MemoryContextReset(worker_mcxt);
+		FlushErrorState();
+
+		RESUME_INTERRUPTS();
+
+		/* Don't retry in a tight loop, the error may happen again. */
+		pg_usleep(1000000L);
+
+		/* last_save is not reliable after the longjmp. */
+		last_save = GetCurrentTimestamp();
+	}
+
+	/* We can now handle ereport(ERROR). */
+	PG_exception_stack = &local_sigjmp_buf;
+
+	while (!worker_got_sigterm)
+	{
+		int		drained;
+
+		ResetLatch(MyLatch);
+
+		if (worker_got_sighup)
+		{
+			worker_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		drained = profiler_worker_drain(worker_mcxt);
+
+		/* Remove the entries left over from a reset. */
+		if (plpss->purge_requested)
+			profiler_purge_stale();
+
+		/* A backend found the fixed counter pools fragmented. */
+		if (plpss->compact_requested)
+		{
+			MemoryContext	old_context;
+
+			old_context = MemoryContextSwitchTo(worker_mcxt);
+			profiler_compact();
+			MemoryContextSwitchTo(old_context);
+			MemoryContextReset(worker_mcxt);
+		}
+
+		/* Save the shared profile periodically (plprofiler.save_interval). */
+		if (profiler_save && profiler_save_interval > 0 && !PL_DYNAMIC &&
+			TimestampDifferenceExceeds(last_save, GetCurrentTimestamp(),
+									   profiler_save_interval * 1000))
+		{
+			MemoryContext	old_context;
+
+			old_context = MemoryContextSwitchTo(worker_mcxt);
+			profiler_state_save();
+			MemoryContextSwitchTo(old_context);
+			MemoryContextReset(worker_mcxt);
+			last_save = GetCurrentTimestamp();
+		}
+
+		/* Append the changes of the last collect interval to the history. */
+		if ((PL_NUM_HISTORY_LINES > 0 || PL_NUM_HISTORY_CALLGRAPHS > 0) &&
+			plpss->profiler_collect_interval > 0 &&
+			TimestampDifferenceExceeds(history_last, GetCurrentTimestamp(),
+									   plpss->profiler_collect_interval * 1000))
+		{
+			MemoryContext	old_context;
+
+			old_context = MemoryContextSwitchTo(worker_mcxt);
+			profiler_history_snapshot();
+			MemoryContextSwitchTo(old_context);
+			MemoryContextReset(worker_mcxt);
+		}
+
+		/* Poll again right away as long as there is work. */
+		if (drained > 0)
+			continue;
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   PL_WORKER_NAPTIME, PG_WAIT_EXTENSION);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	/* Don't leave anything behind, that was queued before shutdown. */
+	profiler_worker_drain(worker_mcxt);
+
+	proc_exit(0);
+}
+
+static void
+profiler_worker_sigterm(SIGNAL_ARGS)
+{
+	int		save_errno = errno;
+
+	worker_got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+profiler_worker_sighup(SIGNAL_ARGS)
+{
+	int		save_errno = errno;
+
+	worker_got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+profiler_worker_exit(int code, Datum arg)
+{
+	profiler_shared_state->worker_latch = NULL;
+	profiler_shared_state->worker_pid = 0;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_worker_drain()
+ *
+ *	Merge all published records of all rings. Returns the number of
+ *	records processed.
+ * -------------------------------------------------------------------
+ */
+static int
+profiler_worker_drain(MemoryContext mcxt)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	Size					size = PL_RING_BYTES;
+	int64					merged = 0;
+	int64					dropped = 0;
+	int						i;
+
+	for (i = 0; i < profiler_collect_rings; i++)
+	{
+		profilerRing   *ring = PL_RING(plpss, i);
+		uint64			head = pg_atomic_read_u64(&(ring->head));
+		uint64			tail = pg_atomic_read_u64(&(ring->tail));
+
+		if (tail == head)
+			continue;
+
+		/* Read the records only after we have seen the new head. */
+		pg_read_barrier();
+
+		while (tail < head)
+		{
+			Size				pos = tail % size;
+			profilerRingHeader *hdr;
+			MemoryContext		old_context;
+
+			/* The end of the ring is too short for a pad record. */
+			if (size - pos < sizeof(profilerRingHeader))
+			{
+				tail += size - pos;
+				continue;
+			}
+
+			hdr = (profilerRingHeader *) (ring->data + pos);
+			if (hdr->len < sizeof(profilerRingHeader) ||
+				hdr->len > size - pos)
+			{
+				elog(LOG, "plprofiler: invalid record in collect ring %d, "
+						  "discarding its contents", i);
+				tail = head;
+				break;
+			}
+
+			if (hdr->type != PL_RING_PAD)
+			{
+				old_context = MemoryContextSwitchTo(mcxt);
+				if (profiler_worker_merge(hdr))
+					merged++;
+				else
+					dropped++;
+				MemoryContextSwitchTo(old_context);
+				MemoryContextReset(mcxt);
+			}
+			tail += hdr->len;
+		}
+
+		/* We are done with the space, the owner may reuse it now. */
+		pg_memory_barrier();
+		pg_atomic_write_u64(&(ring->tail), tail);
+	}
+
+	profiler_atomic_add(&(plpss->ring_merged), merged);
+	profiler_atomic_add(&(plpss->ring_dropped), dropped);
+
+	return (int) (merged + dropped);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_worker_merge()
+ *
+ *	Merge one ring record into the shared hash tables. The record is
+ *	turned into a temporary local entry, so that the same code as for
+ *	direct collection can be used. The counters were already scaled
+ *	by the backend. Returns false if the shared tables are full.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_worker_merge(profilerRingHeader *hdr)
+{
+	if (hdr->type == PL_RING_CALLGRAPH)
+	{
+		profilerRingCallgraph  *rec = (profilerRingCallgraph *) hdr;
+		callGraphNode			node;
+		callGraphKey			key;
+		char				   *p;
+
+		memset(&node, 0, sizeof(node));
+		node.callCount = rec->callCount;
+		node.totalTime = rec->totalTime;
+		node.childTime = rec->childTime;
+		node.selfTime = rec->selfTime;
+		node.maxTime = rec->maxTime;
+
+		p = (char *) rec + MAXALIGN(sizeof(profilerRingCallgraph));
+		if (rec->has_hist)
+		{
+			memcpy(node.hist, p, PL_HIST_SIZE);
+			p += PL_HIST_SIZE;
+		}
+
+		memset(&key, 0, sizeof(key));
+		key.db_oid = rec->db_oid;
+		memcpy(key.stack, p,
+			   sizeof(Oid) * Min(rec->depth, PL_MAX_STACK_DEPTH));
+
+		return callgraph_collect_one(&key, &node, 1.0, true);
+	}
+
+	if (hdr->type == PL_RING_LINESTATS)
+	{
+		profilerRingLinestats  *rec = (profilerRingLinestats *) hdr;
+		linestatsEntry			entry;
+		int						nlines = rec->nlines;
+		char				   *p;
+
+		if (nlines <= 0 || rec->line_min + nlines > rec->line_count)
+			return true;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.key = rec->key;
+		entry.line_count = rec->line_count;
+		entry.stmt_slots = rec->stmt_slots;
+		entry.source_lines = rec->source_lines;
+		entry.dirty_min = rec->line_min;
+		entry.dirty_max = rec->line_min + nlines - 1;
+
+		p = (char *) rec + MAXALIGN(sizeof(profilerRingLinestats));
+		entry.line_info = palloc0(sizeof(linestatsLineInfo) *
+								  entry.line_count);
+		memcpy(&(entry.line_info[rec->line_min]), p,
+			   sizeof(linestatsLineInfo) * nlines);
+		p += sizeof(linestatsLineInfo) * nlines;
+
+		if (rec->has_hist)
+		{
+			entry.hist = palloc0(PL_HIST_SIZE * entry.line_count);
+			memcpy(&(entry.hist[rec->line_min * PL_HIST_BUCKETS]), p,
+				   PL_HIST_SIZE * nlines);
+			p += PL_HIST_SIZE * nlines;
+		}
+
+		if (rec->has_io)
+		{
+			entry.io = palloc0(sizeof(linestatsIoInfo) * entry.line_count);
+			memcpy(&(entry.io[rec->line_min]), p,
+				   sizeof(linestatsIoInfo) * nlines);
+			p += sizeof(linestatsIoInfo) * nlines;
+		}
+
+		if (rec->names_len > 0)
+		{
+			namestrcpy(&(entry.fn_schema), p);
+			namestrcpy(&(entry.fn_name), p + strlen(p) + 1);
+		}
+
+		return linestats_collect_one(&entry, 1.0);
+	}
+
+	return true;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_lock_partitions()
+ *
+ *	Acquire all partition locks of one shared hash table, which is
+ *	needed to scan it or to remove entries. The locks are always taken
+ *	in the same order. Other code never holds more than one partition
+ *	lock at a time.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_lock_partitions(int base, LWLockMode mode)
+{
+	int		i;
+
+	for (i = 0; i < PL_NUM_LOCK_PARTITIONS; i++)
+		LWLockAcquire(&(profiler_shared_state->locks[base + i].lock), mode);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_unlock_partitions()
+ *
+ *	Release the partition locks of one shared hash table.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_unlock_partitions(int base)
+{
+	int		i;
+
+	for (i = PL_NUM_LOCK_PARTITIONS; --i >= 0;)
+		LWLockRelease(&(profiler_shared_state->locks[base + i].lock));
+}
+
+/* -------------------------------------------------------------------
+ * profiler_scan_begin()
+ *
+ *	Start a sequential scan of the shared callgraph or functions table.
+ *	A dynahash table is locked as a whole, like the SRFs always did. A
+ *	dshash scan only holds the lock of the partition it is in.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_scan_begin(profilerSharedScan *scan, bool callgraph, bool exclusive)
+{
+	memset(scan, 0, sizeof(profilerSharedScan));
+	scan->dynamic = PL_DYNAMIC;
+	scan->callgraph = callgraph;
+
+#ifdef PL_HAVE_DYNAMIC
+	if (scan->dynamic)
+	{
+		dshash_seq_init(&(scan->dsh_seq),
+						callgraph ? callgraph_dsh : functions_dsh,
+						exclusive);
+		return;
+	}
+#endif
+
+	scan->htab = callgraph ? callgraph_shared : functions_shared;
+	scan->lock_base = callgraph ? PL_CALLGRAPH_LOCK_BASE :
+								  PL_FUNCTIONS_LOCK_BASE;
+	profiler_lock_partitions(scan->lock_base,
+							 exclusive ? LW_EXCLUSIVE : LW_SHARED);
+	hash_seq_init(&(scan->hash_seq), scan->htab);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_scan_next()
+ *
+ *	Return the next entry of a scan or NULL at the end. Entries, that
+ *	a reset made stale, are skipped unless scan->stale is set.
+ * -------------------------------------------------------------------
+ */
+static void *
+profiler_scan_next(profilerSharedScan *scan)
+{
+	void	   *entry;
+
+	for (;;)
+	{
+#ifdef PL_HAVE_DYNAMIC
+		if (scan->dynamic)
+			entry = dshash_seq_next(&(scan->dsh_seq));
+		else
+#endif
+			entry = hash_seq_search(&(scan->hash_seq));
+
+		/* Entries from before a reset are empty, unless asked for. */
+		if (entry == NULL || scan->stale)
+			return entry;
+		if (scan->callgraph ?
+			!PL_ENTRY_STALE((callGraphEntry *) entry) :
+			!PL_ENTRY_STALE((linestatsSharedEntry *) entry))
+			return entry;
+	}
+}
+
+/* -------------------------------------------------------------------
+ * profiler_scan_remove()
+ *
+ *	Remove the current entry of a scan started in exclusive mode.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_scan_remove(profilerSharedScan *scan, void *entry)
+{
+#ifdef PL_HAVE_DYNAMIC
+	if (scan->dynamic)
+	{
+		if (scan->callgraph)
+			callgraph_dynamic_free((callGraphEntry *) entry);
+		else
+			linestats_dynamic_free((linestatsSharedEntry *) entry);
+		dshash_delete_current(&(scan->dsh_seq));
+		return;
+	}
+#endif
+
+	if (scan->callgraph)
+		callgraph_fixed_free((callGraphEntry *) entry);
+	else
+		linestats_fixed_free((linestatsSharedEntry *) entry);
+
+	/* The key is the first member of both kinds of entries. */
+	hash_search(scan->htab, entry, HASH_REMOVE, NULL);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_scan_end()
+ *
+ *	Finish a scan, that ran up to the end, and release its locks.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_scan_end(profilerSharedScan *scan)
+{
+#ifdef PL_HAVE_DYNAMIC
+	if (scan->dynamic)
+	{
+		dshash_seq_term(&(scan->dsh_seq));
+		return;
+	}
+#endif
+
+	profiler_unlock_partitions(scan->lock_base);
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_merge()
+ *
+ *	Add the counters of a local calling context tree node to its shared
+ *	call graph entry and reset them. The caller must hold the partition
+ *	lock of the entry in any mode.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_merge(callGraphEntry *cge2, callGraphNode *cgn, double scale)
+{
+	pg_atomic_uint32   *hist = PL_SHARED_PTR(cge2, hist);
+	int					i;
+
+	/* The fetch-adds are full barriers around the counter updates. */
+	pg_atomic_fetch_add_u64(&(cge2->changes_begin), 1);
+	profiler_atomic_add(&(cge2->callCount), PL_SCALE(cgn->callCount, scale));
+	profiler_atomic_add(&(cge2->totalTime), PL_SCALE(cgn->totalTime, scale));
+	profiler_atomic_add(&(cge2->childTime), PL_SCALE(cgn->childTime, scale));
+	profiler_atomic_add(&(cge2->selfTime), PL_SCALE(cgn->selfTime, scale));
+	profiler_atomic_max(&(cge2->maxTimeInterval), cgn->maxTime);
+	if (hist != NULL)
+	{
+		for (i = 0; i < PL_HIST_BUCKETS; i++)
+		{
+			if (cgn->hist[i] != 0)
+				pg_atomic_fetch_add_u32(&(hist[i]),
+										(int32) PL_SCALE(cgn->hist[i], scale));
+		}
+	}
+	pg_atomic_fetch_add_u64(&(cge2->changes_end), 1);
+
+	callgraph_node_clear(cgn);
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_node_clear()
+ *
+ *	Reset the counters of a local calling context tree node after they
+ *	have been collected.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_node_clear(callGraphNode *cgn)
+{
+	cgn->callCount = 0;
+	cgn->totalTime = 0;
+	cgn->childTime = 0;
+	cgn->selfTime = 0;
+	cgn->maxTime = 0;
+	memset(cgn->hist, 0, PL_HIST_SIZE);
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_shared_reinit()
+ *
+ *	Zero the counters of a shared call graph entry, that was reset,
+ *	and move it to the current generation. The caller must hold the
+ *	partition lock of the entry in exclusive mode.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_shared_reinit(callGraphEntry *cge2)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	pg_atomic_uint32	   *hist = PL_SHARED_PTR(cge2, hist);
+
+	pg_atomic_write_u64(&(cge2->callCount), 0);
+	pg_atomic_write_u64(&(cge2->totalTime), 0);
+	pg_atomic_write_u64(&(cge2->childTime), 0);
+	pg_atomic_write_u64(&(cge2->selfTime), 0);
+	pg_atomic_write_u64(&(cge2->maxTimeInterval), 0);
+	if (hist != NULL)
+		profiler_hist_init(hist, 1);
+	cge2->error = PL_DYNAMIC ? 0 :
+		pg_atomic_read_u64(&(plpss->callgraph_evict_floor));
+	cge2->generation = pg_atomic_read_u64(&(plpss->generation));
+}
+
+/* -------------------------------------------------------------------
+ * linestats_shared_reinit()
+ *
+ *	Zero the counters of a shared linestats entry, that was reset, like
+ *	callgraph_shared_reinit(). The entry keeps its counter arrays and
+ *	the line numbers of its statement slots, which belong to the same
+ *	function version.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_shared_reinit(linestatsSharedEntry *lse2)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	linestatsSharedLine	   *line_info = PL_SHARED_PTR(lse2, line_info);
+	pg_atomic_uint32	   *hist = PL_SHARED_PTR(lse2, hist);
+	pg_atomic_uint64	   *io = PL_SHARED_PTR(lse2, io);
+	int						i;
+
+	for (i = 0; i < lse2->line_count; i++)
+	{
+		pg_atomic_write_u64(&(line_info[i].ns_max), 0);
+		pg_atomic_write_u64(&(line_info[i].ns_max_interval), 0);
+		pg_atomic_write_u64(&(line_info[i].ns_total), 0);
+		pg_atomic_write_u64(&(line_info[i].exec_count), 0);
+	}
+	if (hist != NULL)
+		profiler_hist_init(hist, lse2->line_count);
+	if (io != NULL)
+		profiler_io_init(io, lse2->line_count);
+	lse2->generation = pg_atomic_read_u64(&(plpss->generation));
+}
+
+/* -------------------------------------------------------------------
+ * linestats_merge()
+ *
+ *	Add the counters of the dirty slots of a local linestats entry to
+ *	the shared entry and reset them. Counters of an entry, that was
+ *	created with the other kind of slots, cannot be merged. A shared
+ *	entry created at the function level only has slot zero, so the
+ *	statement counters of later calls are dropped until the next reset.
+ *	The caller must hold the partition lock of the entry in any mode.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_merge(linestatsSharedEntry *lse2, linestatsEntry *lse1,
+				double scale)
+{
+	linestatsSharedLine	   *line_info = PL_SHARED_PTR(lse2, line_info);
+	pg_atomic_uint32	   *hist = PL_SHARED_PTR(lse2, hist);
+	pg_atomic_uint64	   *io = PL_SHARED_PTR(lse2, io);
+	int						line_min = lse1->dirty_min;
+	int						line_max = Min(lse1->dirty_max,
+										   lse1->line_count - 1);
+	int						line_count = Min(line_max + 1, lse2->line_count);
+	int						i;
+	int						j;
+
+	if (lse1->stmt_slots != lse2->stmt_slots)
+		line_count = 0;
+
+	pg_atomic_fetch_add_u64(&(lse2->changes_begin), 1);
+	for (i = line_min; i < line_count; i++)
+	{
+		linestatsLineInfo	   *li1 = &(lse1->line_info[i]);
+		linestatsSharedLine	   *li2 = &(line_info[i]);
+
+		/* Lines, that were not executed since the last collect. */
+		if (li1->exec_count == 0 && li1->ns_total == 0)
+			continue;
+
+		profiler_atomic_max(&(li2->ns_max), (uint64) li1->ns_max);
+		profiler_atomic_max(&(li2->ns_max_interval), (uint64) li1->ns_max);
+		profiler_atomic_add(&(li2->ns_total), PL_SCALE(li1->ns_total, scale));
+		profiler_atomic_add(&(li2->exec_count),
+							PL_SCALE(li1->exec_count, scale));
+		if (li1->lineno != 0)
+			pg_atomic_write_u32(&(li2->lineno), (uint32) li1->lineno);
+
+		if (lse1->hist != NULL && hist != NULL)
+		{
+			for (j = 0; j < PL_HIST_BUCKETS; j++)
+			{
+				uint32	count = lse1->hist[i * PL_HIST_BUCKETS + j];
+
+				if (count != 0)
+					pg_atomic_fetch_add_u32(
+							&(hist[i * PL_HIST_BUCKETS + j]),
+							(int32) PL_SCALE(count, scale));
+			}
+		}
+
+		if (lse1->io != NULL && io != NULL)
+		{
+			int64  *io1 = (int64 *) &(lse1->io[i]);
+
+			for (j = 0; j < PL_IO_COUNTERS; j++)
+				profiler_atomic_add(&(io[i * PL_IO_COUNTERS + j]),
+									PL_SCALE(io1[j], scale));
+		}
+	}
+	pg_atomic_fetch_add_u64(&(lse2->changes_end), 1);
+
+	linestats_clear_dirty(lse1);
+}
+
+/* -------------------------------------------------------------------
+ * linestats_clear_dirty()
+ *
+ *	Reset the dirty slots of a local linestats entry after they have
+ *	been collected and mark the entry clean. The caller unlinks it
+ *	from the dirty list.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_clear_dirty(linestatsEntry *lse1)
+{
+	int		line_min = lse1->dirty_min;
+	int		line_max = Min(lse1->dirty_max, lse1->line_count - 1);
+
+	if (line_max >= line_min)
+	{
+		int		n = line_max - line_min + 1;
+
+		memset(&(lse1->line_info[line_min]), 0,
+			   sizeof(linestatsLineInfo) * n);
+		if (lse1->hist != NULL)
+			memset(&(lse1->hist[line_min * PL_HIST_BUCKETS]), 0,
+				   n * PL_HIST_SIZE);
+		if (lse1->io != NULL)
+			memset(&(lse1->io[line_min]), 0, n * sizeof(linestatsIoInfo));
+	}
+	lse1->dirty_min = 0;
+	lse1->dirty_max = -1;
+}
+
+/* -------------------------------------------------------------------
+ * linestats_shared_copy()
+ *
+ *	Read the counters of a shared linestats entry into a palloc'd copy
+ *	in the form of a local entry, so that the same code can turn both
+ *	into result rows. Backends keep adding to the counters meanwhile.
+ *	The copy is retried while a merge overlaps it, up to
+ *	PL_COPY_RETRIES times, after which a torn copy is accepted rather
+ *	than waiting for a busy entry. The caller must hold the partition
+ *	lock of the entry in any mode.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_shared_copy(linestatsSharedEntry *sentry, linestatsEntry *copy)
+{
+	linestatsSharedLine	   *line_info = PL_SHARED_PTR(sentry, line_info);
+	pg_atomic_uint32	   *hist = PL_SHARED_PTR(sentry, hist);
+	pg_atomic_uint64	   *io = PL_SHARED_PTR(sentry, io);
+	int64				   *io_copy = NULL;
+	uint64					changes;
+	int						attempt;
+	int						i;
+
+	memset(copy, 0, sizeof(linestatsEntry));
+	copy->key = sentry->key;
+	copy->line_count = sentry->line_count;
+	copy->stmt_slots = sentry->stmt_slots;
+	copy->source_lines = sentry->source_lines;
+	copy->fn_schema = sentry->fn_schema;
+	copy->fn_name = sentry->fn_name;
+
+	copy->line_info = palloc0(sizeof(linestatsLineInfo) *
+							  Max(copy->line_count, 1));
+	if (hist != NULL)
+		copy->hist = palloc(copy->line_count * PL_HIST_SIZE);
+	if (io != NULL)
+	{
+		copy->io = palloc(copy->line_count * sizeof(linestatsIoInfo));
+		io_copy = (int64 *) copy->io;
+	}
+
+	for (attempt = 0;; attempt++)
+	{
+		changes = pg_atomic_read_u64(&(sentry->changes_end));
+		pg_read_barrier();
+
+		for (i = 0; i < copy->line_count; i++)
+		{
+			linestatsSharedLine *src = &(line_info[i]);
+
+			copy->line_info[i].ns_max = pg_atomic_read_u64(&(src->ns_max));
+			copy->line_info[i].ns_total =
+					pg_atomic_read_u64(&(src->ns_total));
+			copy->line_info[i].exec_count =
+					pg_atomic_read_u64(&(src->exec_count));
+			copy->line_info[i].lineno =
+					(int32) pg_atomic_read_u32(&(src->lineno));
+		}
+
+		if (hist != NULL)
+		{
+			for (i = 0; i < copy->line_count * PL_HIST_BUCKETS; i++)
+				copy->hist[i] = pg_atomic_read_u32(&(hist[i]));
+		}
+
+		if (io != NULL)
+		{
+			for (i = 0; i < copy->line_count * PL_IO_COUNTERS; i++)
+				io_copy[i] = (int64) pg_atomic_read_u64(&(io[i]));
+		}
+
+		pg_read_barrier();
+		if (pg_atomic_read_u64(&(sentry->changes_begin)) == changes ||
+			attempt >= PL_COPY_RETRIES)
+			break;
+	}
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_shared_copy()
+ *
+ *	Read the counters of a shared call graph entry into local memory,
+ *	retrying like linestats_shared_copy(). The caller must hold the
+ *	partition lock of the entry in any mode.
+ * -------------------------------------------------------------------
+ */
+static void
+callgraph_shared_copy(callGraphEntry *cge2, callGraphCopy *copy)
+{
+	pg_atomic_uint32   *hist = PL_SHARED_PTR(cge2, hist);
+	uint64				changes;
+	int					attempt;
+	int					i;
+
+	copy->key = cge2->key;
+	copy->error = cge2->error;
+	copy->has_hist = (hist != NULL);
+
+	for (attempt = 0;; attempt++)
+	{
+		changes = pg_atomic_read_u64(&(cge2->changes_end));
+		pg_read_barrier();
+
+		copy->callCount = (int64) pg_atomic_read_u64(&(cge2->callCount));
+		copy->totalTime = pg_atomic_read_u64(&(cge2->totalTime));
+		copy->childTime = pg_atomic_read_u64(&(cge2->childTime));
+		copy->selfTime = pg_atomic_read_u64(&(cge2->selfTime));
+		for (i = 0; i < PL_HIST_BUCKETS; i++)
+			copy->hist[i] = (hist != NULL) ?
+							pg_atomic_read_u32(&(hist[i])) : 0;
+
+		pg_read_barrier();
+		if (pg_atomic_read_u64(&(cge2->changes_begin)) == changes ||
+			attempt >= PL_COPY_RETRIES)
+			break;
+	}
+}
+
+/* -------------------------------------------------------------------
+ * linestats_shared_snapshot()
+ *
+ *	Copy all shared linestats entries of the current database, or of
+ *	all databases, into local memory and return them as an array of
+ *	*count entries. The partition locks are only held while copying,
+ *	so that building the result, which may write a tuplestore to disk,
+ *	never delays the backends collecting into the shared tables.
+ * -------------------------------------------------------------------
+ */
+static linestatsEntry *
+linestats_shared_snapshot(bool all_databases, int *count)
+{
+	profilerSharedScan		scan;
+	linestatsEntry		   *entries;
+
+	profiler_scan_begin(&scan, false, false);
+	entries = linestats_scan_snapshot(&scan, all_databases, count);
+	profiler_scan_end(&scan);
+
+	return entries;
+}
+
+/* -------------------------------------------------------------------
+ * linestats_scan_snapshot()
+ *
+ *	Copy the remaining linestats entries of a started scan into local
+ *	memory. The caller ends the scan.
+ * -------------------------------------------------------------------
+ */
+static linestatsEntry *
+linestats_scan_snapshot(profilerSharedScan *scan, bool all_databases,
+						int *count)
+{
+	linestatsSharedEntry   *entry;
+	linestatsEntry		   *entries;
+	int						size = 64;
+
+	entries = palloc(sizeof(linestatsEntry) * size);
+	*count = 0;
+
+	while ((entry = profiler_scan_next(scan)) != NULL)
+	{
+		if (!all_databases && entry->key.db_oid != MyDatabaseId)
+			continue;
+
+		if (*count >= size)
+		{
+			size *= 2;
+			entries = repalloc(entries, sizeof(linestatsEntry) * size);
+		}
+		linestats_shared_copy(entry, &entries[(*count)++]);
+	}
+
+	return entries;
+}
+
+/* -------------------------------------------------------------------
+ * linestats_snapshot_free()
+ *
+ *	Release an array returned by linestats_shared_snapshot().
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_snapshot_free(linestatsEntry *entries, int count)
+{
+	int		i;
+
+	for (i = 0; i < count; i++)
+		linestats_copy_free(&entries[i]);
+	pfree(entries);
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_shared_snapshot()
+ *
+ *	Copy the shared call graph entries of the current database, or of
+ *	all databases, into local memory like linestats_shared_snapshot().
+ * -------------------------------------------------------------------
+ */
+static callGraphCopy *
+callgraph_shared_snapshot(bool all_databases, int *count)
+{
+	profilerSharedScan		scan;
+	callGraphCopy		   *entries;
+
+	profiler_scan_begin(&scan, true, false);
+	entries = callgraph_scan_snapshot(&scan, all_databases, count);
+	profiler_scan_end(&scan);
+
+	return entries;
+}
+
+/* -------------------------------------------------------------------
+ * callgraph_scan_snapshot()
+ *
+ *	Copy the remaining call graph entries of a started scan into local
+ *	memory. The caller ends the scan.
+ * -------------------------------------------------------------------
+ */
+static callGraphCopy *
+callgraph_scan_snapshot(profilerSharedScan *scan, bool all_databases,
+						int *count)
+{
+	callGraphEntry		   *entry;
+	callGraphCopy		   *entries;
+	int						size = 64;
+
+	entries = palloc(sizeof(callGraphCopy) * size);
+	*count = 0;
+
+	while ((entry = profiler_scan_next(scan)) != NULL)
+	{
+		if (!all_databases && entry->key.db_oid != MyDatabaseId)
+			continue;
+
+		if (*count >= size)
+		{
+			size *= 2;
+			entries = repalloc(entries, sizeof(callGraphCopy) * size);
+		}
+		callgraph_shared_copy(entry, &entries[(*count)++]);
+	}
+
+	return entries;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_function_names()
+ *
+ *	Collect the schema and name of every function in the shared
+ *	linestats table, over all databases and function versions, into
+ *	a local hash table of profilerFuncName keyed by database and
+ *	function Oid.
+ * -------------------------------------------------------------------
+ */
+static HTAB *
+profiler_function_names(void)
+{
+	HASHCTL					hash_ctl;
+	HTAB				   *names;
+	profilerSharedScan		scan;
+	linestatsSharedEntry   *entry;
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(linestatsHashKey);
+	hash_ctl.entrysize = sizeof(profilerFuncName);
+	hash_ctl.hash = line_hash_fn;
+	hash_ctl.match = line_match_fn;
+	hash_ctl.hcxt = CurrentMemoryContext;
+	names = hash_create("plprofiler function names",
+						1000,
+						&hash_ctl,
+						HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+						HASH_CONTEXT);
+
+	profiler_scan_begin(&scan, false, false);
+	while ((entry = profiler_scan_next(&scan)) != NULL)
+	{
+		linestatsHashKey	key;
+		profilerFuncName   *name;
+		bool				found;
+
+		key = entry->key;
+		key.fn_version = InvalidTransactionId;
+		name = hash_search(names, &key, HASH_ENTER, &found);
+		if (!found || NameStr(name->fn_name)[0] == '\0')
+		{
+			name->fn_schema = entry->fn_schema;
+			name->fn_name = entry->fn_name;
+		}
+	}
+	profiler_scan_end(&scan);
+
+	return names;
+}
+
+/* -------------------------------------------------------------------
+ * linestats_copy_free()
+ *
+ *	Release the arrays of an entry copied by linestats_shared_copy().
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_copy_free(linestatsEntry *copy)
+{
+	pfree(copy->line_info);
+	if (copy->hist != NULL)
+		pfree(copy->hist);
+	if (copy->io != NULL)
+		pfree(copy->io);
+}
+
+static void
+profiler_xact_callback(XactEvent event, void *arg)
+{
+	/*
+	 * Collect the statistics if needed. This happens before the commit,
+	 * where an error only aborts the transaction. After the commit it
+	 * would be promoted to a PANIC, and an abort is already handling an
+	 * error, so the data of aborted transactions waits for the next
+	 * collect. Without preloading the shared state is only attached on
+	 * demand.
+	 */
+	if (profiler_active && profiler_shared_state != NULL &&
+		profiler_shared_state->profiler_collect_interval > 0)
+	{
+		switch (event)
+		{
+			case XACT_EVENT_PRE_COMMIT:
+			case XACT_EVENT_PARALLEL_PRE_COMMIT:
+			case XACT_EVENT_PRE_PREPARE:
+				profiler_collect_data(false);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	/* Tell func_init that we need to evaluate the new active state. */
+	profiler_first_call_in_xact = true;
+
+	/* Don't take samples of an idle session. */
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			profiler_sampling_stop();
+			break;
+
+		default:
+			break;
+	}
+
+	/*
+	 * We can also unwind the callstack here in case of abort. On commit
+	 * the stack is empty unless a procedure is committing, and then its
+	 * frames are still alive.
+	 */
+	switch (event)
+	{
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			callgraph_check(InvalidOid);
+			profiler_info_unwind(NULL);
+			unsampled_depth = 0;
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**********************************************************************
+ * SQL callable functions
+ **********************************************************************/
+
+/* -------------------------------------------------------------------
+ * pl_profiler_get_stack(stack oid[])
+ *
+ *	Converts a stack in Oid[] format into a text[].
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_get_stack(PG_FUNCTION_ARGS)
+{
+	ArrayType	   *stack_in = PG_GETARG_ARRAYTYPE_P(0);
+	Datum		   *stack_oid;
+	bool		   *nulls;
+	int				nelems;
+	int				i;
+	Datum		   *funcdefs;
+	char			funcdef_buf[100 + NAMEDATALEN * 2];
+
+	/* Take the array apart */
+	deconstruct_array(stack_in, OIDOID,
+					  sizeof(Oid), true, 'i',
+					  &stack_oid, &nulls, &nelems);
+
+	/* Allocate the Datum array for the individual function signatures. */
+	funcdefs = palloc(sizeof(Datum) * nelems);
+
+	/*
+	 * Turn each of the function Oids, that are in the array, into
+	 * a text that is "schema.funcname(funcargs) oid=funcoid".
+	 */
+	for (i = 0; i < nelems; i++)
+	{
+		char	   *funcname;
+		char	   *nspname;
+
+		funcname = get_func_name(DatumGetObjectId(stack_oid[i]));
+		if (funcname != NULL)
+		{
+			nspname = get_namespace_name(get_func_namespace(DatumGetObjectId(stack_oid[i])));
+			if (nspname == NULL)
+				nspname = pstrdup("<unknown>");
+		}
+		else
+		{
+			nspname = pstrdup("<unknown>");
+			funcname = pstrdup("<unknown>");
+		}
+
+		snprintf(funcdef_buf, sizeof(funcdef_buf),
+				 "%s.%s() oid=%u", nspname, funcname,
+				 DatumGetObjectId(stack_oid[i]));
+
+		pfree(nspname);
+		pfree(funcname);
+
+		funcdefs[i] = PointerGetDatum(cstring_to_text(funcdef_buf));
+	}
+
+	/* Return the texts as a text[]. */
+	PG_RETURN_ARRAYTYPE_P(construct_array(funcdefs, nelems,
+										  TEXTOID, -1,
+										  false, 'i'));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_linestats_local()
+ *
+ *	Returns the content of the local line stats hash table
+ *	as a set of rows.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_linestats_local(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	linestatsEntry	   *entry;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (functions_hash != NULL)
+	{
+		hash_seq_init(&hash_seq, functions_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (entry->stmt_slots)
+			{
+				linestatsLineInfo  *by_line;
+
+				by_line = palloc0(sizeof(linestatsLineInfo) *
+								  entry->source_lines);
+				linestats_by_line(entry, by_line);
+				linestats_put_lines(tupstore, tupdesc, &entry->key,
+									by_line, entry->source_lines,
+									profiler_sample_scale());
+				pfree(by_line);
+			}
+			else
+			{
+				linestats_put_lines(tupstore, tupdesc, &entry->key,
+									entry->line_info, entry->line_count,
+									profiler_sample_scale());
+			}
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_linestats_shared()
+ *
+ *	Returns the content of the shared line stats hash table
+ *	as a set of rows.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_linestats_shared(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	linestatsEntry		   *entries;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Copy the shared data, the rows are built without any locks. */
+	entries = linestats_shared_snapshot(false, &count);
+	for (n = 0; n < count; n++)
+	{
+		linestatsEntry *copy = &entries[n];
+
+		if (copy->stmt_slots)
+		{
+			linestatsLineInfo  *by_line;
+
+			/* Sum up the statements per source line. */
+			by_line = palloc0(sizeof(linestatsLineInfo) *
+							  copy->source_lines);
+			linestats_by_line(copy, by_line);
+			linestats_put_lines(tupstore, tupdesc, &copy->key,
+								by_line, copy->source_lines, 1.0);
+			pfree(by_line);
+		}
+		else
+		{
+			linestats_put_lines(tupstore, tupdesc, &copy->key,
+								copy->line_info, copy->line_count, 1.0);
+		}
+	}
+	linestats_snapshot_free(entries, count);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_stmtstats_local()
+ *
+ *	Returns the per statement counters of all functions in the local
+ *	line stats hash table, that use statement slots, as a set of rows.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_stmtstats_local(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	linestatsEntry	   *entry;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (functions_hash != NULL)
+	{
+		hash_seq_init(&hash_seq, functions_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (!entry->stmt_slots)
+				continue;
+
+			stmtstats_put_stmts(tupstore, tupdesc, &entry->key,
+								entry->line_info, entry->line_count,
+								profiler_sample_scale());
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_stmtstats_shared()
+ *
+ *	Returns the per statement counters of all functions in the shared
+ *	line stats hash table, that use statement slots, as a set of rows.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_stmtstats_shared(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	linestatsEntry		   *entries;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Copy the shared data, the rows are built without any locks. */
+	entries = linestats_shared_snapshot(false, &count);
+	for (n = 0; n < count; n++)
+	{
+		linestatsEntry *copy = &entries[n];
+
+		if (!copy->stmt_slots || copy->line_count == 0)
+			continue;
+
+		stmtstats_put_stmts(tupstore, tupdesc, &copy->key,
+							copy->line_info, copy->line_count, 1.0);
+	}
+	linestats_snapshot_free(entries, count);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * linestats_by_line()
+ *
+ *	Sum up the statement slots of an entry per source line. by_line
+ *	must be a zeroed array of entry->source_lines elements.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_by_line(linestatsEntry *entry, linestatsLineInfo *by_line)
+{
+	int		i;
+
+	for (i = 0; i < entry->line_count; i++)
+	{
+		linestatsLineInfo  *stmt_info = &(entry->line_info[i]);
+		linestatsLineInfo  *line_info;
+
+		/* Slot zero holds the per function counts. */
+		if (i > 0 && (stmt_info->lineno <= 0 ||
+					  stmt_info->lineno >= entry->source_lines))
+			continue;
+		line_info = &(by_line[(i == 0) ? 0 : stmt_info->lineno]);
+
+		if (stmt_info->ns_max > line_info->ns_max)
+			line_info->ns_max = stmt_info->ns_max;
+		line_info->ns_total += stmt_info->ns_total;
+		line_info->exec_count += stmt_info->exec_count;
+	}
+}
+
+/* -------------------------------------------------------------------
+ * linestats_put_lines()
+ *
+ *	Add the rows for the per line counters of one function to
+ *	the result of a linestats function.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_put_lines(Tuplestorestate *tupstore, TupleDesc tupdesc,
+					const linestatsHashKey *key, linestatsLineInfo *line_info,
+					int line_count, double scale)
+{
+	int64	lno;
+
+	for (lno = 0; lno < line_count; lno++)
+	{
+		Datum		values[PL_PROFILE_COLS];
+		bool		nulls[PL_PROFILE_COLS];
+		int			i = 0;
+
+		/* Include this entry in the result. */
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(key->fn_oid);
+		values[i++] = Int64GetDatumFast(lno);
+		values[i++] = Int64GetDatum(PL_SCALE(line_info[lno].exec_count, scale));
+		values[i++] = Int64GetDatum(PL_SCALE(line_info[lno].ns_total, scale) /
+									1000);
+		values[i++] = Int64GetDatum(line_info[lno].ns_max / 1000);
+		values[i++] = Int64GetDatum(PL_SCALE(line_info[lno].ns_total, scale));
+		values[i++] = Int64GetDatumFast(line_info[lno].ns_max);
+
+		values[i++] = TransactionIdGetDatum(key->fn_version);
+
+		Assert(i == PL_PROFILE_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+}
+
+/* -------------------------------------------------------------------
+ * linestats_put_lines_all()
+ *
+ *	Add the rows for the slots of one function to the result of
+ *	pl_profiler_linestats_all_databases(). These start with the
+ *	database and end with the schema and name of the function.
+ * -------------------------------------------------------------------
+ */
+static void
+linestats_put_lines_all(Tuplestorestate *tupstore, TupleDesc tupdesc,
+						linestatsEntry *entry, linestatsLineInfo *line_info,
+						int line_count)
+{
+	int64	lno;
+
+	for (lno = 0; lno < line_count; lno++)
+	{
+		Datum		values[PL_PROFILE_ALL_COLS];
+		bool		nulls[PL_PROFILE_ALL_COLS];
+		int			i = 0;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(entry->key.db_oid);
+		values[i++] = ObjectIdGetDatum(entry->key.fn_oid);
+		values[i++] = Int64GetDatumFast(lno);
+		values[i++] = Int64GetDatum(line_info[lno].exec_count);
+		values[i++] = Int64GetDatum(line_info[lno].ns_total / 1000);
+		values[i++] = Int64GetDatum(line_info[lno].ns_max / 1000);
+		values[i++] = Int64GetDatum(line_info[lno].ns_total);
+		values[i++] = Int64GetDatumFast(line_info[lno].ns_max);
+		values[i++] = TransactionIdGetDatum(entry->key.fn_version);
+
+		/* Entries created before the names were captured have none. */
+		if (NameStr(entry->fn_name)[0] != '\0')
+		{
+			values[i++] = NameGetDatum(&(entry->fn_schema));
+			values[i++] = NameGetDatum(&(entry->fn_name));
+		}
+		else
+		{
+			nulls[i++] = true;
+			nulls[i++] = true;
+		}
+
+		Assert(i == PL_PROFILE_ALL_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+}
+
+/* -------------------------------------------------------------------
+ * stmtstats_put_stmts()
+ *
+ *	Add the rows for the per statement counters of one function to
+ *	the result of a stmtstats function.
+ * -------------------------------------------------------------------
+ */
+static void
+stmtstats_put_stmts(Tuplestorestate *tupstore, TupleDesc tupdesc,
+					const linestatsHashKey *key, linestatsLineInfo *line_info,
+					int stmt_count, double scale)
+{
+	int64	stmtid;
+
+	for (stmtid = 0; stmtid < stmt_count; stmtid++)
+	{
+		Datum		values[PL_STMTSTATS_COLS];
+		bool		nulls[PL_STMTSTATS_COLS];
+		int			i = 0;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(key->fn_oid);
+		values[i++] = Int64GetDatumFast(stmtid);
+		values[i++] = Int64GetDatum((int64) line_info[stmtid].lineno);
+		values[i++] = Int64GetDatum(PL_SCALE(line_info[stmtid].exec_count, scale));
+		values[i++] = Int64GetDatum(PL_SCALE(line_info[stmtid].ns_total, scale) /
+									1000);
+		values[i++] = Int64GetDatum(line_info[stmtid].ns_max / 1000);
+		values[i++] = Int64GetDatum(PL_SCALE(line_info[stmtid].ns_total, scale));
+		values[i++] = Int64GetDatumFast(line_info[stmtid].ns_max);
+
+		values[i++] = TransactionIdGetDatum(key->fn_version);
+
+		Assert(i == PL_STMTSTATS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+}
+
+/* -------------------------------------------------------------------
+ * hist_by_line()
+ *
+ *	Add up the latency histograms of statement slots per source line.
+ * -------------------------------------------------------------------
+ */
+static void
+hist_by_line(linestatsEntry *entry, const uint32 *hist, uint32 *by_line_hist)
+{
+	int		i;
+	int		b;
+
+	for (i = 0; i < entry->line_count; i++)
+	{
+		int32	lineno = entry->line_info[i].lineno;
+
+		/* Slot zero holds the per function counts. */
+		if (i == 0)
+			lineno = 0;
+		else if (lineno <= 0 || lineno >= entry->source_lines)
+			continue;
+
+		for (b = 0; b < PL_HIST_BUCKETS; b++)
+			by_line_hist[lineno * PL_HIST_BUCKETS + b] +=
+				hist[i * PL_HIST_BUCKETS + b];
+	}
+}
+
+/* -------------------------------------------------------------------
+ * io_by_line()
+ *
+ *	Add up the I/O counters of statement slots per source line.
+ * -------------------------------------------------------------------
+ */
+static void
+io_by_line(linestatsEntry *entry, const linestatsIoInfo *io,
+		   linestatsIoInfo *by_line_io)
+{
+	int		i;
+
+	for (i = 0; i < entry->line_count; i++)
+	{
+		int32				lineno = entry->line_info[i].lineno;
+		linestatsIoInfo	   *dst;
+
+		/* Slot zero holds the per function counts. */
+		if (i == 0)
+			lineno = 0;
+		else if (lineno <= 0 || lineno >= entry->source_lines)
+			continue;
+
+		dst = &by_line_io[lineno];
+		dst->shared_blks_hit += io[i].shared_blks_hit;
+		dst->shared_blks_read += io[i].shared_blks_read;
+		dst->shared_blks_dirtied += io[i].shared_blks_dirtied;
+		dst->shared_blks_written += io[i].shared_blks_written;
+		dst->temp_blks_read += io[i].temp_blks_read;
+		dst->temp_blks_written += io[i].temp_blks_written;
+		dst->wal_records += io[i].wal_records;
+		dst->wal_bytes += io[i].wal_bytes;
+	}
+}
+
+/* -------------------------------------------------------------------
+ * io_put_lines()
+ *
+ *	Add the I/O counters of all executed lines of a function to a
+ *	tuplestore.
+ * -------------------------------------------------------------------
+ */
+static void
+io_put_lines(Tuplestorestate *tupstore, TupleDesc tupdesc,
+			 const linestatsHashKey *key, const linestatsIoInfo *io,
+			 const linestatsLineInfo *line_info, int line_count,
+			 double scale)
+{
+	int64	lno;
+
+	for (lno = 0; lno < line_count; lno++)
+	{
+		Datum		values[PL_IO_COLS];
+		bool		nulls[PL_IO_COLS];
+		int			i = 0;
+
+		if (line_info[lno].exec_count == 0)
+			continue;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(key->fn_oid);
+		values[i++] = Int64GetDatumFast(lno);
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].shared_blks_hit, scale));
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].shared_blks_read, scale));
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].shared_blks_dirtied,
+											 scale));
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].shared_blks_written,
+											 scale));
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].temp_blks_read, scale));
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].temp_blks_written,
+											 scale));
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].wal_records, scale));
+		values[i++] = Int64GetDatum(PL_SCALE(io[lno].wal_bytes, scale));
+
+		values[i++] = TransactionIdGetDatum(key->fn_version);
+
+		Assert(i == PL_IO_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+}
+
+/* -------------------------------------------------------------------
+ * percentiles_put_lines()
+ *
+ *	Add the latency percentiles of all lines of a function, that have
+ *	histogram data, to a tuplestore.
+ * -------------------------------------------------------------------
+ */
+static void
+percentiles_put_lines(Tuplestorestate *tupstore, TupleDesc tupdesc,
+					  const linestatsHashKey *key, const uint32 *hist,
+					  const linestatsLineInfo *line_info, int line_count)
+{
+	int64	lno;
+
+	for (lno = 0; lno < line_count; lno++)
+	{
+		const uint32   *line_hist = hist + lno * PL_HIST_BUCKETS;
+		Datum			values[PL_PERCENTILE_COLS];
+		bool			nulls[PL_PERCENTILE_COLS];
+		int64			ns_max = line_info[lno].ns_max;
+		int				i = 0;
+
+		if (profiler_hist_count(line_hist) == 0)
+			continue;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(key->fn_oid);
+		values[i++] = Int64GetDatumFast(lno);
+		values[i++] = Float8GetDatum(profiler_hist_percentile(line_hist, 0.5,
+															  ns_max) / 1000.0);
+		values[i++] = Float8GetDatum(profiler_hist_percentile(line_hist, 0.9,
+															  ns_max) / 1000.0);
+		values[i++] = Float8GetDatum(profiler_hist_percentile(line_hist, 0.99,
+															  ns_max) / 1000.0);
+		values[i++] = Float8GetDatum(profiler_hist_percentile(line_hist, 0.999,
+															  ns_max) / 1000.0);
+
+		values[i++] = TransactionIdGetDatum(key->fn_version);
+
+		Assert(i == PL_PERCENTILE_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+}
+
+/* -------------------------------------------------------------------
+ * percentiles_put_stack()
+ *
+ *	Add the latency percentiles of one call graph to a tuplestore.
+ * -------------------------------------------------------------------
+ */
+static void
+percentiles_put_stack(Tuplestorestate *tupstore, TupleDesc tupdesc,
+					  Datum *funcdefs, int depth, const uint32 *hist)
+{
+	Datum		values[PL_CG_PERCENTILE_COLS];
+	bool		nulls[PL_CG_PERCENTILE_COLS];
+	int			i = 0;
+
+	if (profiler_hist_count(hist) == 0)
+		return;
+
+	MemSet(values, 0, sizeof(values));
+	MemSet(nulls, 0, sizeof(nulls));
+
+	values[i++] = PointerGetDatum(construct_array(funcdefs, depth,
+												  OIDOID, sizeof(Oid),
+												  true, 'i'));
+	values[i++] = Float8GetDatum(profiler_hist_percentile(hist, 0.5,
+														  0) / 1000.0);
+	values[i++] = Float8GetDatum(profiler_hist_percentile(hist, 0.9,
+														  0) / 1000.0);
+	values[i++] = Float8GetDatum(profiler_hist_percentile(hist, 0.99,
+														  0) / 1000.0);
+	values[i++] = Float8GetDatum(profiler_hist_percentile(hist, 0.999,
+														  0) / 1000.0);
+
+	Assert(i == PL_CG_PERCENTILE_COLS);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_callgraph_local()
+ *
+ *	Returns the content of the local call graph hash table
+ *	as a set of rows.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_callgraph_local(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	callGraphNode	   *node;
+	double				scale = profiler_sample_scale();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (callgraph_hash != NULL)
+	{
+		hash_seq_init(&hash_seq, callgraph_hash);
+		while ((node = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Datum			values[PL_CALLGRAPH_COLS];
+			bool			nulls[PL_CALLGRAPH_COLS];
+			Datum			funcdefs[PL_MAX_STACK_DEPTH];
+			callGraphNode  *cur;
+
+			int			i = 0;
+			int			j = 0;
+
+			/* Skip call stacks that never completed a call. */
+			if (node->callCount == 0)
+				continue;
+
+			MemSet(values, 0, sizeof(values));
+			MemSet(nulls, 0, sizeof(nulls));
+
+			/* Rebuild the call stack from the parent links. */
+			for (cur = node; cur != NULL; cur = cur->parent)
+				funcdefs[cur->depth - 1] = ObjectIdGetDatum(cur->key.fn_oid);
+			i = node->depth;
+
+			values[j++] = PointerGetDatum(construct_array(funcdefs, i,
+														  OIDOID, sizeof(Oid),
+														  true, 'i'));
+			values[j++] = Int64GetDatum(PL_SCALE(node->callCount, scale));
+			values[j++] = Int64GetDatum(PL_SCALE(node->totalTime, scale) / 1000);
+			values[j++] = Int64GetDatum(PL_SCALE(node->childTime, scale) / 1000);
+			values[j++] = Int64GetDatum(PL_SCALE(node->selfTime, scale) / 1000);
+			values[j++] = Int64GetDatum(PL_SCALE(node->totalTime, scale));
+			values[j++] = Int64GetDatum(PL_SCALE(node->childTime, scale));
+			values[j++] = Int64GetDatum(PL_SCALE(node->selfTime, scale));
+			values[j++] = Int64GetDatum(0);
+
+			Assert(j == PL_CALLGRAPH_COLS);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_callgraph_shared()
+ *
+ *	Returns the content of the shared call graph hash table
+ *	as a set of rows.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_callgraph_shared(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	callGraphCopy		   *entries;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Copy the shared data, the rows are built without any locks. */
+	entries = callgraph_shared_snapshot(false, &count);
+	for (n = 0; n < count; n++)
+	{
+		callGraphCopy  *entry = &entries[n];
+		Datum			values[PL_CALLGRAPH_COLS];
+		bool			nulls[PL_CALLGRAPH_COLS];
+		Datum			funcdefs[PL_MAX_STACK_DEPTH];
+
+		int				i = 0;
+		int				j = 0;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		for (i = 0; i < PL_MAX_STACK_DEPTH && entry->key.stack[i] != InvalidOid; i++)
+			funcdefs[i] = ObjectIdGetDatum(entry->key.stack[i]);
+
+		values[j++] = PointerGetDatum(construct_array(funcdefs, i,
+													  OIDOID, sizeof(Oid),
+													  true, 'i'));
+
+		values[j++] = Int64GetDatumFast(entry->callCount);
+		values[j++] = UInt64GetDatum(entry->totalTime / 1000);
+		values[j++] = UInt64GetDatum(entry->childTime / 1000);
+		values[j++] = UInt64GetDatum(entry->selfTime / 1000);
+		values[j++] = UInt64GetDatum(entry->totalTime);
+		values[j++] = UInt64GetDatum(entry->childTime);
+		values[j++] = UInt64GetDatum(entry->selfTime);
+		values[j++] = UInt64GetDatum(entry->error);
+
+		Assert(j == PL_CALLGRAPH_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	pfree(entries);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_history_linestats()
+ *
+ *	Returns the rows of the line history ring of the local database,
+ *	whose interval started in [from_time, to_time). The history is
+ *	only filled with plprofiler.collect_worker on.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_history_linestats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TimestampTz				from_time = PG_GETARG_TIMESTAMPTZ(0);
+	TimestampTz				to_time = PG_GETARG_TIMESTAMPTZ(1);
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	profilerSharedState	   *plpss = profiler_shared();
+	uint64					head;
+	uint64					n;
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (PL_NUM_HISTORY_LINES == 0)
+		PG_RETURN_VOID();
+
+	/* The worker may overwrite the oldest rows while we read. */
+	head = pg_atomic_read_u64(&(plpss->history_lines_head));
+	n = (head > PL_NUM_HISTORY_LINES) ? head - PL_NUM_HISTORY_LINES : 0;
+	for (; n < head; n++)
+	{
+		profilerHistoryLine	   *row;
+		profilerHistoryLine		copy;
+		Datum					values[PL_HISTORY_COLS];
+		bool					nulls[PL_HISTORY_COLS];
+		int						i = 0;
+
+		row = &(PL_HISTORY_LINES(plpss)[n % PL_NUM_HISTORY_LINES]);
+		if (!profiler_history_read(&(row->seq), row, &copy, sizeof(copy), n))
+			continue;
+
+		if (copy.key.db_oid != MyDatabaseId ||
+			copy.interval_start < from_time ||
+			copy.interval_start >= to_time)
+			continue;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = TimestampTzGetDatum(copy.interval_start);
+		values[i++] = TimestampTzGetDatum(copy.interval_end);
+		values[i++] = ObjectIdGetDatum(copy.key.fn_oid);
+		values[i++] = Int64GetDatum((int64) copy.line);
+		values[i++] = Int64GetDatum(copy.exec_count);
+		values[i++] = Int64GetDatum(copy.ns_total / 1000);
+		values[i++] = Int64GetDatum(copy.ns_max / 1000);
+		values[i++] = TransactionIdGetDatum(copy.key.fn_version);
+
+		Assert(i == PL_HISTORY_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_history_callgraph()
+ *
+ *	Returns the rows of the call graph history ring of the local
+ *	database, whose interval started in [from_time, to_time). The
+ *	longest call is not known in sampling mode and reported as 0.
+ *	Like the line history, this is only filled by the collect worker.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_history_callgraph(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TimestampTz				from_time = PG_GETARG_TIMESTAMPTZ(0);
+	TimestampTz				to_time = PG_GETARG_TIMESTAMPTZ(1);
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	profilerSharedState	   *plpss = profiler_shared();
+	uint64					head;
+	uint64					n;
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (PL_NUM_HISTORY_CALLGRAPHS == 0)
+		PG_RETURN_VOID();
+
+	head = pg_atomic_read_u64(&(plpss->history_callgraphs_head));
+	n = (head > PL_NUM_HISTORY_CALLGRAPHS) ?
+		head - PL_NUM_HISTORY_CALLGRAPHS : 0;
+	for (; n < head; n++)
+	{
+		profilerHistoryCallgraph   *row;
+		profilerHistoryCallgraph	copy;
+		Datum						values[PL_CG_HISTORY_COLS];
+		bool						nulls[PL_CG_HISTORY_COLS];
+		Datum						funcdefs[PL_MAX_STACK_DEPTH];
+		int							i = 0;
+		int							j = 0;
+
+		row = &(PL_HISTORY_CALLGRAPHS(plpss)[n % PL_NUM_HISTORY_CALLGRAPHS]);
+		if (!profiler_history_read(&(row->seq), row, &copy, sizeof(copy), n))
+			continue;
+
+		if (copy.key.db_oid != MyDatabaseId ||
+			copy.interval_start < from_time ||
+			copy.interval_start >= to_time)
+			continue;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		for (i = 0; i < PL_MAX_STACK_DEPTH && copy.key.stack[i] != InvalidOid; i++)
+			funcdefs[i] = ObjectIdGetDatum(copy.key.stack[i]);
+
+		values[j++] = TimestampTzGetDatum(copy.interval_start);
+		values[j++] = TimestampTzGetDatum(copy.interval_end);
+		values[j++] = PointerGetDatum(construct_array(funcdefs, i,
+													  OIDOID, sizeof(Oid),
+													  true, 'i'));
+		values[j++] = Int64GetDatum(copy.callCount);
+		values[j++] = Int64GetDatum(copy.totalTime / 1000);
+		values[j++] = Int64GetDatum(copy.selfTime / 1000);
+		values[j++] = Int64GetDatum(copy.maxTime / 1000);
+
+		Assert(j == PL_CG_HISTORY_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * func_oids_unique()
+ *
+ *	Sort an array of function Oids and remove the duplicates, that
+ *	the entries of different versions of a function produce. Returns
+ *	the new number of elements.
+ * -------------------------------------------------------------------
+ */
+static int
+func_oids_unique(Datum *oids, int count)
+{
+	int		i;
+	int		n = 0;
+
+	if (count <= 1)
+		return count;
+
+	qsort(oids, count, sizeof(Datum), func_oids_cmp);
+	for (i = 1; i < count; i++)
+	{
+		if (oids[i] != oids[n])
+			oids[++n] = oids[i];
+	}
+
+	return n + 1;
+}
+
+static int
+func_oids_cmp(const void *a, const void *b)
+{
+	Oid		oid_a = DatumGetObjectId(*((const Datum *) a));
+	Oid		oid_b = DatumGetObjectId(*((const Datum *) b));
+
+	if (oid_a < oid_b)
+		return -1;
+	if (oid_a > oid_b)
+		return 1;
+	return 0;
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_func_oids_local()
+ *
+ *	Returns an array of all function Oids that we have
+ *	linestat information for in the local hash table.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_func_oids_local(PG_FUNCTION_ARGS)
+{
+	int					i = 0;
+	Datum			   *result;
+	HASH_SEQ_STATUS		hash_seq;
+	linestatsEntry	   *entry;
+
+	/* First pass to count the number of Oids, we will return. */
+
+	if (functions_hash != NULL)
+	{
+		hash_seq_init(&hash_seq, functions_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+			i++;
+	}
+
+	/* Allocate Oid array for result. */
+	if (i == 0)
+	{
+		result = palloc(sizeof(Datum));
+	}
+	else
+	{
+		result = palloc(sizeof(Datum) * i);
+	}
+	if (result == NULL)
+		elog(ERROR, "out of memory in pl_profiler_func_oids_local()");
+
+	/* Second pass to collect the Oids. */
+	if (functions_hash != NULL)
+	{
+		i = 0;
+		hash_seq_init(&hash_seq, functions_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+			result[i++] = ObjectIdGetDatum(entry->key.fn_oid);
+	}
+
+	/* Functions with several versions must only be listed once. */
+	i = func_oids_unique(result, i);
+
+	/* Build and return the actual array. */
+	PG_RETURN_ARRAYTYPE_P(construct_array(result, i,
+										  OIDOID, sizeof(Oid),
+										  true, 'i'));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_func_oids_shared()
+ *
+ *	Returns an array of all function Oids that we have
+ *	linestat information for in the shared hash table.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_func_oids_shared(PG_FUNCTION_ARGS)
+{
+	int						i = 0;
+	int						size = 64;
+	Datum				   *result;
+	profilerSharedScan		scan;
+	linestatsSharedEntry   *entry;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/*
+	 * Collect the Oids in a single pass. A dshash scan doesn't lock
+	 * the whole table, so the entries could change between two passes.
+	 */
+	result = palloc(sizeof(Datum) * size);
+
+	profiler_scan_begin(&scan, false, false);
+	while ((entry = profiler_scan_next(&scan)) != NULL)
+	{
+		if (entry->key.db_oid != MyDatabaseId)
+			continue;
+
+		if (i >= size)
+		{
+			size *= 2;
+			result = repalloc(result, sizeof(Datum) * size);
+		}
+		result[i++] = ObjectIdGetDatum(entry->key.fn_oid);
+	}
+	profiler_scan_end(&scan);
+
+	/* Functions with several versions must only be listed once. */
+	i = func_oids_unique(result, i);
+
+	/* Build and return the actual array. */
+	PG_RETURN_ARRAYTYPE_P(construct_array(result, i,
+										  OIDOID, sizeof(Oid),
+										  true, 'i'));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_linestats_all_databases()
+ *
+ *	Returns the content of the shared linestats hash table for all
+ *	databases as a set of rows, like pl_profiler_linestats_shared()
+ *	with the database and the function's schema and name added.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_linestats_all_databases(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	linestatsEntry		   *entries;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* One pass over the shared table covers every database. */
+	entries = linestats_shared_snapshot(true, &count);
+	for (n = 0; n < count; n++)
+	{
+		linestatsEntry *copy = &entries[n];
+
+		if (copy->stmt_slots)
+		{
+			linestatsLineInfo  *by_line;
+
+			by_line = palloc0(sizeof(linestatsLineInfo) *
+							  copy->source_lines);
+			linestats_by_line(copy, by_line);
+			linestats_put_lines_all(tupstore, tupdesc, copy,
+									by_line, copy->source_lines);
+			pfree(by_line);
+		}
+		else
+		{
+			linestats_put_lines_all(tupstore, tupdesc, copy,
+									copy->line_info, copy->line_count);
+		}
+	}
+	linestats_snapshot_free(entries, count);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_callgraph_all_databases()
+ *
+ *	Returns the content of the shared call graph hash table for all
+ *	databases as a set of rows. The names of the functions on the
+ *	stack come from the shared linestats table and are NULL for
+ *	functions, that are not in it.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_callgraph_all_databases(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	callGraphCopy		   *entries;
+	HTAB				   *names;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	names = profiler_function_names();
+	entries = callgraph_shared_snapshot(true, &count);
+	for (n = 0; n < count; n++)
+	{
+		callGraphCopy  *entry = &entries[n];
+		Datum			values[PL_CALLGRAPH_ALL_COLS];
+		bool			nulls[PL_CALLGRAPH_ALL_COLS];
+		Datum			funcdefs[PL_MAX_STACK_DEPTH];
+		Datum			funcnames[PL_MAX_STACK_DEPTH];
+		bool			funcnulls[PL_MAX_STACK_DEPTH];
+		int				dims[1];
+		int				lbs[1];
+		int				i = 0;
+		int				j = 0;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		for (i = 0; i < PL_MAX_STACK_DEPTH && entry->key.stack[i] != InvalidOid; i++)
+		{
+			linestatsHashKey	key;
+			profilerFuncName   *name;
+
+			funcdefs[i] = ObjectIdGetDatum(entry->key.stack[i]);
+
+			key.db_oid = entry->key.db_oid;
+			key.fn_oid = entry->key.stack[i];
+			key.fn_version = InvalidTransactionId;
+			name = hash_search(names, &key, HASH_FIND, NULL);
+			funcnulls[i] = (name == NULL ||
+							NameStr(name->fn_name)[0] == '\0');
+			if (!funcnulls[i])
+				funcnames[i] = CStringGetTextDatum(
+										psprintf("%s.%s",
+												 NameStr(name->fn_schema),
+												 NameStr(name->fn_name)));
+		}
+		dims[0] = i;
+		lbs[0] = 1;
+
+		values[j++] = ObjectIdGetDatum(entry->key.db_oid);
+		values[j++] = PointerGetDatum(construct_array(funcdefs, i,
+													  OIDOID, sizeof(Oid),
+													  true, 'i'));
+		values[j++] = PointerGetDatum(construct_md_array(funcnames, funcnulls,
+														 1, dims, lbs,
+														 TEXTOID, -1,
+														 false, 'i'));
+		values[j++] = Int64GetDatumFast(entry->callCount);
+		values[j++] = UInt64GetDatum(entry->totalTime / 1000);
+		values[j++] = UInt64GetDatum(entry->childTime / 1000);
+		values[j++] = UInt64GetDatum(entry->selfTime / 1000);
+		values[j++] = UInt64GetDatum(entry->totalTime);
+		values[j++] = UInt64GetDatum(entry->childTime);
+		values[j++] = UInt64GetDatum(entry->selfTime);
+		values[j++] = UInt64GetDatum(entry->error);
+
+		Assert(j == PL_CALLGRAPH_ALL_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	pfree(entries);
+	hash_destroy(names);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_func_oids_all_databases()
+ *
+ *	Returns the database, Oid, schema and name of every function in
+ *	the shared linestats table, once for all its versions.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_func_oids_all_databases(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	HTAB				   *names;
+	HASH_SEQ_STATUS			hash_seq;
+	profilerFuncName	   *name;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	names = profiler_function_names();
+	hash_seq_init(&hash_seq, names);
+	while ((name = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[PL_FUNC_OIDS_ALL_COLS];
+		bool		nulls[PL_FUNC_OIDS_ALL_COLS];
+		int			i = 0;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(name->key.db_oid);
+		values[i++] = ObjectIdGetDatum(name->key.fn_oid);
+		if (NameStr(name->fn_name)[0] != '\0')
+		{
+			values[i++] = NameGetDatum(&(name->fn_schema));
+			values[i++] = NameGetDatum(&(name->fn_name));
+		}
+		else
+		{
+			nulls[i++] = true;
+			nulls[i++] = true;
+		}
+
+		Assert(i == PL_FUNC_OIDS_ALL_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	hash_destroy(names);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_funcs_source(func_oids oid[])
+ *
+ *	Return the source code of a number of functions specified by
+ *	an input array of Oids.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_funcs_source(PG_FUNCTION_ARGS)
+{
+	ArrayType		   *func_oids_in = PG_GETARG_ARRAYTYPE_P(0);
+	Datum			   *func_oids;
+	bool			   *nulls;
+	int					nelems;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	int					fidx;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Take the input array apart */
+	deconstruct_array(func_oids_in, OIDOID,
+					  sizeof(Oid), true, 'i',
+					  &func_oids, &nulls, &nelems);
+
+	/*
+	 * Turn each of the function Oids, that are in the array, into
+	 * a text that is "schema.funcname(funcargs) oid=funcoid".
+	 */
+	for (fidx = 0; fidx < nelems; fidx++)
+	{
+		HeapTuple	procTuple;
+		char	   *procSrc;
+		char	   *funcName;
+		Datum		values[PL_FUNCS_SRC_COLS];
+		bool		nulls[PL_FUNCS_SRC_COLS];
+		int			i = 0;
+		char	   *cp;
+		char	   *linestart;
+		int64		line_number = 0;
+
+		/* Create the line-0 entry. */
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = func_oids[fidx];
+		values[i++] = Int64GetDatumFast(line_number);
+		values[i++] = PointerGetDatum(cstring_to_text("-- Line 0"));
+
+		Assert(i == PL_FUNCS_SRC_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		line_number++;
+
+		/* Find the source code and split it. */
+		procSrc = find_source(func_oids[fidx], &procTuple, &funcName);
+		if (procSrc == NULL)
+		{
+			ReleaseSysCache(procTuple);
+			continue;
+		}
+
+		/*
+		 * The returned procStr is palloc'd, so it is safe to scribble
+		 * around in it.
+		 */
+		cp = procSrc;
+		linestart = procSrc;
+		while (cp != NULL)
+		{
+			cp = strchr(cp, '\n');
+			if (cp != NULL)
+				*cp++ = '\0';
+			i = 0;
+			values[i++] = func_oids[fidx];
+			values[i++] = Int64GetDatumFast(line_number);
+			values[i++] = PointerGetDatum(cstring_to_text(linestart));
+
+			Assert(i == PL_FUNCS_SRC_COLS);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+			linestart = cp;
+			line_number++;
+		}
+
+		ReleaseSysCache(procTuple);
+		pfree(procSrc);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_reset_local()
+ *
+ *	Drop all data collected in the local hash tables.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_reset_local(PG_FUNCTION_ARGS)
+{
+	init_hash_tables();
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_reset_shared()
+ *
+ *	Drop all data collected in the shared hash tables and the
+ *	shared state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_reset_shared(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	profiler_shared_reset();
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_reset_shared_database()
+ *
+ *	Drop the data collected in the shared hash tables for the current
+ *	database only.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_reset_shared_database(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	profiler_reset_database(MyDatabaseId);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * profiler_shared_reset()
+ *
+ *	Reset all data in the shared hash tables and the counters of the
+ *	shared state. This only starts a new generation, so it doesn't
+ *	block the backends collecting meanwhile. Entries of the old
+ *	generations are skipped by the scans and reinitialized when they
+ *	are collected into again. profiler_purge_stale() removes them in
+ *	the collect worker, or otherwise in the first backend, that finds
+ *	a shared table or counter pool full.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_shared_reset(void)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	uint64					generation;
+	Latch				   *latch;
+	int						i;
+
+	generation = pg_atomic_add_fetch_u64(&(plpss->generation), 1);
+	pg_atomic_write_u64(&(plpss->reset_all), generation);
+
+	/* The full reset supersedes the resets of single databases. */
+	SpinLockAcquire(&(plpss->reset_mutex));
+	for (i = 0; i < PL_RESET_DATABASES; i++)
+		plpss->reset_dbs[i].db_oid = InvalidOid;
+	SpinLockRelease(&(plpss->reset_mutex));
+
+	plpss->callgraph_overflow = false;
+	plpss->functions_overflow = false;
+	plpss->lines_overflow = false;
+	pg_atomic_write_u64(&(plpss->total_calls), 0);
+	pg_atomic_write_u64(&(plpss->sampled_calls), 0);
+	plpss->sampling_interval = 0;
+	plpss->sampling_mixed = false;
+	plpss->histograms_overflow = false;
+	plpss->io_overflow = false;
+	pg_atomic_write_u64(&(plpss->ring_records), 0);
+	pg_atomic_write_u64(&(plpss->ring_merged), 0);
+	pg_atomic_write_u64(&(plpss->ring_dropped), 0);
+	pg_atomic_write_u64(&(plpss->ring_deferred), 0);
+	pg_atomic_write_u64(&(plpss->ring_direct), 0);
+	pg_atomic_write_u64(&(plpss->callgraph_evict_floor), 0);
+	pg_atomic_write_u64(&(plpss->callgraph_evicted), 0);
+
+	plpss->purge_requested = true;
+	latch = plpss->worker_latch;
+	if (latch != NULL)
+		SetLatch(latch);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_reset_database()
+ *
+ *	Reset the shared data of one database like profiler_shared_reset()
+ *	does for all of them. The generation is kept in one of the
+ *	PL_RESET_DATABASES slots. When all slots are taken by other
+ *	databases, the entries of this one are removed right away.
+ * -------------------------------------------------------------------
+ */
+static void
+profiler_reset_database(Oid db_oid)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	profilerSharedScan		scan;
+	callGraphEntry		   *cge2;
+	linestatsSharedEntry   *lse2;
+	uint64					generation;
+	int						slot = -1;
+	int						i;
+	Latch				   *latch;
+
+	SpinLockAcquire(&(plpss->reset_mutex));
+	for (i = 0; i < PL_RESET_DATABASES; i++)
+	{
+		if (plpss->reset_dbs[i].db_oid == db_oid)
+		{
+			slot = i;
+			break;
+		}
+		if (slot < 0 && plpss->reset_dbs[i].db_oid == InvalidOid)
+			slot = i;
+	}
+	if (slot >= 0)
+	{
+		/* Readers look at the Oid first, so the generation goes first. */
+		generation = pg_atomic_add_fetch_u64(&(plpss->generation), 1);
+		pg_atomic_write_u64(&(plpss->reset_dbs[slot].generation),
+							generation);
+		pg_write_barrier();
+		plpss->reset_dbs[slot].db_oid = db_oid;
+	}
+	SpinLockRelease(&(plpss->reset_mutex));
+
+	if (slot >= 0)
+	{
+		plpss->purge_requested = true;
+		latch = plpss->worker_latch;
+		if (latch != NULL)
+			SetLatch(latch);
+		return;
+	}
+
+	profiler_scan_begin(&scan, true, true);
+	scan.stale = true;
+	while ((cge2 = profiler_scan_next(&scan)) != NULL)
+	{
+		if (cge2->key.db_oid == db_oid)
+			profiler_scan_remove(&scan, cge2);
+	}
+	profiler_scan_end(&scan);
+
+	profiler_scan_begin(&scan, false, true);
+	scan.stale = true;
+	while ((lse2 = profiler_scan_next(&scan)) != NULL)
+	{
+		if (lse2->key.db_oid == db_oid)
+			profiler_scan_remove(&scan, lse2);
+	}
+	profiler_scan_end(&scan);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_reset_generation()
+ *
+ *	Return the generation of the last reset, that covered the given
+ *	database.
+ * -------------------------------------------------------------------
+ */
+static uint64
+profiler_reset_generation(Oid db_oid)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	uint64					generation;
+	int						i;
+
+	generation = pg_atomic_read_u64(&(plpss->reset_all));
+	for (i = 0; i < PL_RESET_DATABASES; i++)
+	{
+		if (plpss->reset_dbs[i].db_oid == db_oid)
+		{
+			pg_read_barrier();
+			generation = Max(generation,
+							 pg_atomic_read_u64(&(plpss->reset_dbs[i].generation)));
+			break;
+		}
+	}
+
+	return generation;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_entry_stale()
+ *
+ *	Check whether a shared entry of the given database and generation
+ *	was reset since it was last initialized. Entries of the current
+ *	generation are the common case, that needs no further look.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_entry_stale(Oid db_oid, uint64 generation)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+
+	if (generation >= pg_atomic_read_u64(&(plpss->generation)))
+		return false;
+
+	return generation < profiler_reset_generation(db_oid);
+}
+
+/* -------------------------------------------------------------------
+ * profiler_purge_stale()
+ *
+ *	Remove the entries, that a reset made stale, from both shared
+ *	tables, so that their memory can be reused by other entries. This
+ *	is done by the collect worker after a reset and by backends, that
+ *	find a shared table or counter pool full. Returns the number of
+ *	entries removed.
+ * -------------------------------------------------------------------
+ */
+static int64
+profiler_purge_stale(void)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+	profilerSharedScan		scan;
+	callGraphEntry		   *cge2;
+	linestatsSharedEntry   *lse2;
+	uint64					generation;
+	int64					removed = 0;
+
+	/* Nothing was reset since the last purge. */
+	generation = pg_atomic_read_u64(&(plpss->generation));
+	if (pg_atomic_read_u64(&(plpss->purged)) >= generation)
+		return 0;
+	plpss->purge_requested = false;
+
+	profiler_scan_begin(&scan, true, true);
+	scan.stale = true;
+	while ((cge2 = profiler_scan_next(&scan)) != NULL)
+	{
+		if (!PL_ENTRY_STALE(cge2))
+			continue;
+		profiler_scan_remove(&scan, cge2);
+		removed++;
+	}
+	profiler_scan_end(&scan);
+
+	profiler_scan_begin(&scan, false, true);
+	scan.stale = true;
+	while ((lse2 = profiler_scan_next(&scan)) != NULL)
+	{
+		if (!PL_ENTRY_STALE(lse2))
+			continue;
+		profiler_scan_remove(&scan, lse2);
+		removed++;
+	}
+	profiler_scan_end(&scan);
+
+	pg_atomic_write_u64(&(plpss->purged), generation);
+
+	return removed;
+}
+
+/* -------------------------------------------------------------------
+ * profiler_purge_pending()
+ *
+ *	Check whether a reset left entries, that profiler_purge_stale()
+ *	has not removed yet.
+ * -------------------------------------------------------------------
+ */
+static bool
+profiler_purge_pending(void)
+{
+	profilerSharedState	   *plpss = profiler_shared_state;
+
+	return pg_atomic_read_u64(&(plpss->purged)) <
+		   pg_atomic_read_u64(&(plpss->generation));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_retire_versions()
+ *
+ *	Remove the shared linestats of function versions in the current
+ *	database, that were replaced by CREATE OR REPLACE FUNCTION or whose
+ *	function was dropped. Their counter slices go back to the free
+ *	lists. Returns the number of entries removed.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_retire_versions(PG_FUNCTION_ARGS)
+{
+	profilerSharedScan		scan;
+	linestatsSharedEntry   *entry;
+	linestatsHashKey	   *keys;
+	int						nkeys = 0;
+	int						size = 64;
+	int						nstale = 0;
+	int						i;
+	int64					removed = 0;
+	HASHCTL					hash_ctl;
+	HTAB				   *stale;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/*
+	 * Collect the keys of this database first. The catalog lookups must
+	 * not be done while holding the partition locks.
+	 */
+	keys = palloc(sizeof(linestatsHashKey) * size);
+
+	profiler_scan_begin(&scan, false, false);
+	while ((entry = profiler_scan_next(&scan)) != NULL)
+	{
+		if (entry->key.db_oid != MyDatabaseId)
+			continue;
+
+		if (nkeys >= size)
+		{
+			size *= 2;
+			keys = repalloc(keys, sizeof(linestatsHashKey) * size);
+		}
+		keys[nkeys++] = entry->key;
+	}
+	profiler_scan_end(&scan);
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(linestatsHashKey);
+	hash_ctl.entrysize = sizeof(linestatsHashKey);
+	hash_ctl.hash = line_hash_fn;
+	hash_ctl.match = line_match_fn;
+	hash_ctl.hcxt = CurrentMemoryContext;
+
+	stale = hash_create("plprofiler retired versions",
+						Max(nkeys, 16),
+						&hash_ctl,
+						HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+						HASH_CONTEXT);
+
+	/* A version is current while it is the xmin of the pg_proc row. */
+	for (i = 0; i < nkeys; i++)
+	{
+		HeapTuple	proc_tuple;
+		bool		current = false;
+
+		proc_tuple = SearchSysCache(PROCOID,
+									ObjectIdGetDatum(keys[i].fn_oid),
+									0, 0, 0);
+		if (HeapTupleIsValid(proc_tuple))
+		{
+			current = (HeapTupleHeaderGetRawXmin(proc_tuple->t_data) ==
+					   keys[i].fn_version);
+			ReleaseSysCache(proc_tuple);
+		}
+
+		if (!current)
+		{
+			hash_search(stale, &keys[i], HASH_ENTER, NULL);
+			nstale++;
+		}
+	}
+
+	if (nstale > 0)
+	{
+		profiler_scan_begin(&scan, false, true);
+		while ((entry = profiler_scan_next(&scan)) != NULL)
+		{
+			if (hash_search(stale, &(entry->key), HASH_FIND, NULL) == NULL)
+				continue;
+
+			profiler_scan_remove(&scan, entry);
+			removed++;
+		}
+		profiler_scan_end(&scan);
+	}
+
+	hash_destroy(stale);
+	pfree(keys);
+
+	PG_RETURN_INT64(removed);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_compact_shared()
+ *
+ *	Compact the fixed shared counter pools now. Returns the number of
+ *	pool elements reclaimed.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_compact_shared(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	PG_RETURN_INT64(profiler_compact());
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_set_enabled_global()
+ *
+ *	Turn global profiling on or off.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_set_enabled_global(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+	else
+		plpss->profiler_enabled_global = PG_GETARG_BOOL(0);
+
+	PG_RETURN_BOOL(plpss->profiler_enabled_global);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_get_enabled_global()
+ *
+ *	Report global profiling state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_get_enabled_global(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	PG_RETURN_BOOL(plpss->profiler_enabled_global);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_set_enabled_local()
+ *
+ *	Turn local profiling on or off.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_set_enabled_local(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	profiler_enabled_local = PG_GETARG_BOOL(0);
+
+	PG_RETURN_BOOL(profiler_enabled_local);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_get_enabled_local()
+ *
+ *	Report local profiling state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_get_enabled_local(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(profiler_enabled_local);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_set_enabled_pid()
+ *
+ *	Turn pid profiling on or off.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_set_enabled_pid(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+	else
+		plpss->profiler_enabled_pid = PG_GETARG_INT32(0);
+
+	PG_RETURN_INT32(plpss->profiler_enabled_pid);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_get_enabled_pid()
+ *
+ *	Report pid profiling state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_get_enabled_pid(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	PG_RETURN_INT32(plpss->profiler_enabled_pid);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_enable_target()
+ *
+ *	Add an entry to the enable table. Backends matching any entry
+ *	are profiled, starting with their next transaction. Returns false
+ *	if the entry already existed.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_enable_target(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	profilerEnableTarget	target;
+	bool					added = true;
+	int						i;
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	profiler_target_parse(PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1),
+						  &target);
+
+	SpinLockAcquire(&(plpss->enable_mutex));
+	for (i = 0; i < plpss->num_targets; i++)
+	{
+		if (memcmp(&(plpss->targets[i]), &target,
+				   sizeof(profilerEnableTarget)) == 0)
+		{
+			added = false;
+			break;
+		}
+	}
+	if (added)
+	{
+		if (plpss->num_targets >= PL_MAX_TARGETS)
+		{
+			SpinLockRelease(&(plpss->enable_mutex));
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("plprofiler supports at most %d enable targets",
+							PL_MAX_TARGETS)));
+		}
+		plpss->targets[plpss->num_targets++] = target;
+		pg_atomic_fetch_add_u32(&(plpss->enable_generation), 1);
+	}
+	SpinLockRelease(&(plpss->enable_mutex));
+
+	PG_RETURN_BOOL(added);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_disable_target()
+ *
+ *	Remove an entry from the enable table. Returns false if there
+ *	was none.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_disable_target(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	profilerEnableTarget	target;
+	bool					found = false;
+	int						i;
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	profiler_target_parse(PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1),
+						  &target);
+
+	SpinLockAcquire(&(plpss->enable_mutex));
+	for (i = 0; i < plpss->num_targets; i++)
+	{
+		if (memcmp(&(plpss->targets[i]), &target,
+				   sizeof(profilerEnableTarget)) == 0)
+		{
+			plpss->targets[i] = plpss->targets[--plpss->num_targets];
+			pg_atomic_fetch_add_u32(&(plpss->enable_generation), 1);
+			found = true;
+			break;
+		}
+	}
+	SpinLockRelease(&(plpss->enable_mutex));
+
+	PG_RETURN_BOOL(found);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_clear_targets()
+ *
+ *	Remove all entries from the enable table.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_clear_targets(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	SpinLockAcquire(&(plpss->enable_mutex));
+	plpss->num_targets = 0;
+	pg_atomic_fetch_add_u32(&(plpss->enable_generation), 1);
+	SpinLockRelease(&(plpss->enable_mutex));
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_targets()
+ *
+ *	Returns the entries of the enable table as a set of rows. Roles
+ *	and databases, that were dropped since, are shown by Oid.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_targets(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	profilerEnableTarget	targets[PL_MAX_TARGETS];
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	SpinLockAcquire(&(plpss->enable_mutex));
+	count = plpss->num_targets;
+	memcpy(targets, plpss->targets, sizeof(profilerEnableTarget) * count);
+	SpinLockRelease(&(plpss->enable_mutex));
+
+	for (n = 0; n < count; n++)
+	{
+		Datum		values[PL_TARGET_COLS];
+		bool		nulls[PL_TARGET_COLS];
+		char	   *value = NULL;
+		int			i = 0;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		switch (targets[n].kind)
+		{
+			case PL_TARGET_PID:
+				value = psprintf("%d", targets[n].pid);
+				break;
+
+			case PL_TARGET_ROLE:
+				value = GetUserNameFromId(targets[n].oid, true);
+				break;
+
+			case PL_TARGET_DATABASE:
+				value = get_database_name(targets[n].oid);
+				break;
+
+			case PL_TARGET_APPNAME:
+				value = NameStr(targets[n].pattern);
+				break;
+		}
+		if (value == NULL)
+			value = psprintf("%u", targets[n].oid);
+
+		values[i++] = CStringGetTextDatum(
+							target_kind_options[targets[n].kind].name);
+		values[i++] = CStringGetTextDatum(value);
+
+		Assert(i == PL_TARGET_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_set_collect_interval()
+ *
+ *	Turn pid profiling on or off.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_set_collect_interval(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (plpss == NULL)
+		PG_RETURN_INT32(-1);
+	else
+		plpss->profiler_collect_interval = PG_GETARG_INT32(0);
+
+	PG_RETURN_INT32(plpss->profiler_collect_interval);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_get_collect_interval()
+ *
+ *	Report pid profiling state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_get_collect_interval(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	PG_RETURN_INT32(plpss->profiler_collect_interval);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_set_level_global()
+ *
+ *	Set the highest profiling level of all backends. A session can
+ *	lower its own level further with plprofiler.level. The new level
+ *	is picked up at the next transaction.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_set_level_global(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	char				   *level;
+	const struct config_enum_entry *option;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	level = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	for (option = level_options; option->name != NULL; option++)
+	{
+		if (pg_strcasecmp(option->name, level) == 0)
+			break;
+	}
+	if (option->name == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid plprofiler level \"%s\"", level),
+				 errhint("Valid levels are \"off\", \"function\" and "
+						 "\"statement\".")));
+
+	plpss->profiler_level = option->val;
+
+	PG_RETURN_TEXT_P(cstring_to_text(option->name));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_get_level_global()
+ *
+ *	Report the highest profiling level of all backends.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_get_level_global(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	const struct config_enum_entry *option;
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	for (option = level_options; option->name != NULL; option++)
+	{
+		if (option->val == plpss->profiler_level)
+			break;
+	}
+
+	PG_RETURN_TEXT_P(cstring_to_text(option->name));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_add_filter()
+ *
+ *	Add an include or exclude filter on a function, schema or role.
+ *	Function and schema filters apply to the current database. An
+ *	existing filter on the same target is changed to the new mode.
+ *	Returns true if the filter is new.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_add_filter(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	int						kind = profiler_filter_kind(PG_GETARG_TEXT_PP(0));
+	Oid						target = PG_GETARG_OID(1);
+	bool					exclude = PG_GETARG_BOOL(2);
+	Oid						db_oid;
+	bool					added = true;
+	int						i;
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	db_oid = (kind == PL_FILTER_ROLE) ? InvalidOid : MyDatabaseId;
+
+	SpinLockAcquire(&(plpss->filter_mutex));
+	for (i = 0; i < plpss->num_filters; i++)
+	{
+		profilerFilter *filter = &(plpss->filters[i]);
+
+		if (filter->kind == kind && filter->db_oid == db_oid &&
+			filter->target == target)
+		{
+			filter->exclude = exclude;
+			added = false;
+			break;
+		}
+	}
+	if (added)
+	{
+		if (plpss->num_filters >= PL_MAX_FILTERS)
+		{
+			SpinLockRelease(&(plpss->filter_mutex));
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("plprofiler supports at most %d filters",
+							PL_MAX_FILTERS)));
+		}
+		plpss->filters[i].kind = kind;
+		plpss->filters[i].exclude = exclude;
+		plpss->filters[i].db_oid = db_oid;
+		plpss->filters[i].target = target;
+		plpss->num_filters++;
+	}
+	pg_atomic_fetch_add_u32(&(plpss->filter_generation), 1);
+	SpinLockRelease(&(plpss->filter_mutex));
+
+	PG_RETURN_BOOL(added);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_remove_filter()
+ *
+ *	Remove the filter on a function, schema or role. Returns false
+ *	if there was none.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_remove_filter(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	int						kind = profiler_filter_kind(PG_GETARG_TEXT_PP(0));
+	Oid						target = PG_GETARG_OID(1);
+	Oid						db_oid;
+	bool					found = false;
+	int						i;
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	db_oid = (kind == PL_FILTER_ROLE) ? InvalidOid : MyDatabaseId;
+
+	SpinLockAcquire(&(plpss->filter_mutex));
+	for (i = 0; i < plpss->num_filters; i++)
+	{
+		profilerFilter *filter = &(plpss->filters[i]);
+
+		if (filter->kind == kind && filter->db_oid == db_oid &&
+			filter->target == target)
+		{
+			plpss->filters[i] = plpss->filters[--plpss->num_filters];
+			pg_atomic_fetch_add_u32(&(plpss->filter_generation), 1);
+			found = true;
+			break;
+		}
+	}
+	SpinLockRelease(&(plpss->filter_mutex));
+
+	PG_RETURN_BOOL(found);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_clear_filters()
+ *
+ *	Remove all filters of all databases.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_clear_filters(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler not loaded via shared_preload_libraries");
+
+	SpinLockAcquire(&(plpss->filter_mutex));
+	plpss->num_filters = 0;
+	pg_atomic_fetch_add_u32(&(plpss->filter_generation), 1);
+	SpinLockRelease(&(plpss->filter_mutex));
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_filters()
+ *
+ *	Returns the filters of all databases as a set of rows.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_filters(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	profilerFilter			filters[PL_MAX_FILTERS];
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	SpinLockAcquire(&(plpss->filter_mutex));
+	count = plpss->num_filters;
+	memcpy(filters, plpss->filters, sizeof(profilerFilter) * count);
+	SpinLockRelease(&(plpss->filter_mutex));
+
+	for (n = 0; n < count; n++)
+	{
+		Datum		values[PL_FILTER_COLS];
+		bool		nulls[PL_FILTER_COLS];
+		int			i = 0;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[i++] = CStringGetTextDatum(
+							filter_kind_options[filters[n].kind].name);
+		if (filters[n].db_oid != InvalidOid)
+			values[i++] = ObjectIdGetDatum(filters[n].db_oid);
+		else
+			nulls[i++] = true;
+		values[i++] = ObjectIdGetDatum(filters[n].target);
+		values[i++] = BoolGetDatum(filters[n].exclude);
+
+		Assert(i == PL_FILTER_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_collect_data()
+ *
+ *	SQL level callable function to collect profiling data from the
+ *	local tables into the shared hash tables.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_collect_data(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(profiler_collect_data(true));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_callgraph_overflow()
+ *
+ *	Return the flag callgraph_overflow from the shared state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_callgraph_overflow(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	PG_RETURN_BOOL(plpss->callgraph_overflow);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_functions_overflow()
+ *
+ *	Return the flag functions_overflow from the shared state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_functions_overflow(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	PG_RETURN_BOOL(plpss->functions_overflow);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_lines_overflow()
+ *
+ *	Return the flag lines_overflow from the shared state.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_lines_overflow(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	PG_RETURN_BOOL(plpss->lines_overflow);
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_collect_worker_stats()
+ *
+ *	Return the state and the counters of the collect pipeline
+ *	(plprofiler.collect_worker).
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_collect_worker_stats(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	TupleDesc				tupdesc;
+	Datum					values[PL_WORKER_COLS];
+	bool					nulls[PL_WORKER_COLS];
+	int						rings_used = 0;
+	int						i;
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	for (i = 0; i < PL_NUM_RINGS; i++)
+	{
+		if (pg_atomic_read_u32(&(PL_RING(plpss, i)->owner)) != 0)
+			rings_used++;
+	}
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(plpss->worker_pid);
+	nulls[0] = (plpss->worker_pid == 0);
+	values[1] = Int32GetDatum(rings_used);
+	values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&(plpss->ring_records)));
+	values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&(plpss->ring_merged)));
+	values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&(plpss->ring_dropped)));
+	values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&(plpss->ring_deferred)));
+	values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&(plpss->ring_direct)));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_shared_usage()
+ *
+ *	Return how much of the shared storage is in use. With fixed storage
+ *	bytes_limit is the size of the main shared memory segment part of
+ *	the profiler and bytes_used is unknown. With dynamic storage they
+ *	are the bytes of entries and counters allocated in the DSA area
+ *	and plprofiler.dynamic_max_memory.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_shared_usage(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	profilerSharedScan		scan;
+	TupleDesc				tupdesc;
+	Datum					values[PL_USAGE_COLS];
+	bool					nulls[PL_USAGE_COLS];
+	int64					functions = 0;
+	int64					callgraphs = 0;
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	profiler_scan_begin(&scan, false, false);
+	while (profiler_scan_next(&scan) != NULL)
+		functions++;
+	profiler_scan_end(&scan);
+
+	profiler_scan_begin(&scan, true, false);
+	while (profiler_scan_next(&scan) != NULL)
+		callgraphs++;
+	profiler_scan_end(&scan);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = CStringGetTextDatum(PL_DYNAMIC ? "dynamic" : "fixed");
+	values[1] = Int64GetDatum(functions);
+	values[2] = Int64GetDatum(callgraphs);
+	/* Slices on the free lists of the fixed pools are not in use. */
+	values[3] = Int64GetDatum((int64) pg_atomic_read_u32(&(plpss->lines_used)) -
+							  profiler_pool_nfree(&(plpss->lines_free)));
+	values[4] = Int64GetDatum((int64) pg_atomic_read_u32(&(plpss->hists_used)) -
+							  profiler_pool_nfree(&(plpss->hists_free)));
+	values[5] = Int64GetDatum((int64) pg_atomic_read_u32(&(plpss->io_used)) -
+							  profiler_pool_nfree(&(plpss->io_free)));
+#ifdef PL_HAVE_DYNAMIC
+	if (PL_DYNAMIC)
+	{
+		values[6] = Int64GetDatum((int64)
+								  pg_atomic_read_u64(&(plpss->dynamic_used)));
+		values[7] = Int64GetDatum((int64) profiler_dynamic_max_memory *
+								  1024 * 1024);
+	}
+	else
+#endif
+	{
+		nulls[6] = true;
+		values[7] = Int64GetDatum((int64) profiler_shmem_size());
+	}
+	values[8] = Int64GetDatum((int64)
+							  pg_atomic_read_u64(&(plpss->callgraph_evicted)));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_sampling_local()
+ *
+ *	Return the number of top level calls seen and profiled since the
+ *	local data was last reset, and the sampling interval it was taken
+ *	with. The interval is 0 if every statement was timed, or if the
+ *	data mixes calls of different intervals, so that its times can't
+ *	be converted into samples.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_sampling_local(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Datum			values[PL_SAMPLING_COLS];
+	bool			nulls[PL_SAMPLING_COLS];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(profiler_total_calls);
+	values[1] = Int64GetDatum(profiler_sampled_calls);
+	values[2] = Int32GetDatum(profiler_sampling_mixed ? 0 :
+							  profiler_sampled_interval);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_sampling_shared()
+ *
+ *	Return the number of top level calls seen and profiled, that
+ *	the shared data was collected from, and its sampling interval.
+ *	Like for the local data, mixed intervals are reported as 0.
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_sampling_shared(PG_FUNCTION_ARGS)
+{
+	profilerSharedState	   *plpss = profiler_shared();
+	TupleDesc				tupdesc;
+	Datum					values[PL_SAMPLING_COLS];
+	bool					nulls[PL_SAMPLING_COLS];
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&(plpss->total_calls)));
+	values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&(plpss->sampled_calls)));
+	values[2] = Int32GetDatum(plpss->sampling_mixed ? 0 :
+							  plpss->sampling_interval);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_linestats_percentiles_local()
+ *
+ *	Return the latency percentiles per source line from the local
+ *	histograms (see plprofiler.histograms).
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_linestats_percentiles_local(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	linestatsEntry	   *entry;
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (functions_hash != NULL)
+	{
+		hash_seq_init(&hash_seq, functions_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (entry->hist == NULL)
+				continue;
+
+			if (entry->stmt_slots)
+			{
+				linestatsLineInfo  *by_line;
+				uint32			   *by_line_hist;
+
+				by_line = palloc0(sizeof(linestatsLineInfo) *
+								  entry->source_lines);
+				by_line_hist = palloc0(entry->source_lines * PL_HIST_SIZE);
+				linestats_by_line(entry, by_line);
+				hist_by_line(entry, entry->hist, by_line_hist);
+				percentiles_put_lines(tupstore, tupdesc, &entry->key,
+									  by_line_hist, by_line,
+									  entry->source_lines);
+				pfree(by_line_hist);
+				pfree(by_line);
+			}
+			else
+			{
+				percentiles_put_lines(tupstore, tupdesc, &entry->key,
+									  entry->hist, entry->line_info,
+									  entry->line_count);
+			}
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_linestats_percentiles_shared()
+ *
+ *	Return the latency percentiles per source line from the shared
+ *	histograms (see plprofiler.max_histograms).
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_linestats_percentiles_shared(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	linestatsEntry		   *entries;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Copy the shared data, the rows are built without any locks. */
+	entries = linestats_shared_snapshot(false, &count);
+	for (n = 0; n < count; n++)
+	{
+		linestatsEntry *copy = &entries[n];
+
+		if (copy->hist == NULL)
+			continue;
+
+		if (copy->stmt_slots)
+		{
+			linestatsLineInfo  *by_line;
+			uint32			   *by_line_hist;
+
+			by_line = palloc0(sizeof(linestatsLineInfo) * copy->source_lines);
+			by_line_hist = palloc0(copy->source_lines * PL_HIST_SIZE);
+			linestats_by_line(copy, by_line);
+			hist_by_line(copy, copy->hist, by_line_hist);
+			percentiles_put_lines(tupstore, tupdesc, &copy->key,
+								  by_line_hist, by_line, copy->source_lines);
+			pfree(by_line_hist);
+			pfree(by_line);
+		}
+		else
+		{
+			percentiles_put_lines(tupstore, tupdesc, &copy->key,
+								  copy->hist, copy->line_info,
+								  copy->line_count);
+		}
+	}
+	linestats_snapshot_free(entries, count);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_callgraph_percentiles_local()
+ *
+ *	Return the latency percentiles per call graph from the local
+ *	histograms (see plprofiler.histograms).
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_callgraph_percentiles_local(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	callGraphNode	   *node;
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (callgraph_hash != NULL)
+	{
+		hash_seq_init(&hash_seq, callgraph_hash);
+		while ((node = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Datum			funcdefs[PL_MAX_STACK_DEPTH];
+			callGraphNode  *cur;
+
+			/* Rebuild the call stack from the parent links. */
+			for (cur = node; cur != NULL; cur = cur->parent)
+				funcdefs[cur->depth - 1] = ObjectIdGetDatum(cur->key.fn_oid);
+
+			percentiles_put_stack(tupstore, tupdesc, funcdefs, node->depth,
+								  node->hist);
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_callgraph_percentiles_shared()
+ *
+ *	Return the latency percentiles per call graph from the shared
+ *	histograms (see plprofiler.max_histograms).
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_callgraph_percentiles_shared(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	callGraphCopy		   *entries;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Copy the shared data, the rows are built without any locks. */
+	entries = callgraph_shared_snapshot(false, &count);
+	for (n = 0; n < count; n++)
+	{
+		callGraphCopy  *entry = &entries[n];
+		Datum			funcdefs[PL_MAX_STACK_DEPTH];
+		int				i;
+
+		if (!entry->has_hist)
+			continue;
+
+		for (i = 0; i < PL_MAX_STACK_DEPTH &&
+					entry->key.stack[i] != InvalidOid; i++)
+			funcdefs[i] = ObjectIdGetDatum(entry->key.stack[i]);
+
+		percentiles_put_stack(tupstore, tupdesc, funcdefs, i, entry->hist);
+	}
+	pfree(entries);
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_linestats_io_local()
+ *
+ *	Return the buffer and WAL usage per source line from the local
+ *	counters (see plprofiler.track_io).
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_linestats_io_local(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	linestatsEntry	   *entry;
+	double				scale = profiler_sample_scale();
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (functions_hash != NULL)
+	{
+		hash_seq_init(&hash_seq, functions_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (entry->io == NULL)
+				continue;
+
+			if (entry->stmt_slots)
+			{
+				linestatsLineInfo  *by_line;
+				linestatsIoInfo	   *by_line_io;
+
+				by_line = palloc0(sizeof(linestatsLineInfo) *
+								  entry->source_lines);
+				by_line_io = palloc0(sizeof(linestatsIoInfo) *
+									 entry->source_lines);
+				linestats_by_line(entry, by_line);
+				io_by_line(entry, entry->io, by_line_io);
+				io_put_lines(tupstore, tupdesc, &entry->key,
+							 by_line_io, by_line, entry->source_lines,
+							 scale);
+				pfree(by_line_io);
+				pfree(by_line);
+			}
+			else
+			{
+				io_put_lines(tupstore, tupdesc, &entry->key,
+							 entry->io, entry->line_info,
+							 entry->line_count, scale);
+			}
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* -------------------------------------------------------------------
+ * pl_profiler_linestats_io_shared()
+ *
+ *	Return the buffer and WAL usage per source line from the shared
+ *	counters (see plprofiler.max_io_lines).
+ * -------------------------------------------------------------------
+ */
+Datum
+pl_profiler_linestats_io_shared(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		   *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc				tupdesc;
+	Tuplestorestate		   *tupstore;
+	MemoryContext			per_query_ctx;
+	MemoryContext			oldcontext;
+	linestatsEntry		   *entries;
+	int						count;
+	int						n;
+	profilerSharedState	   *plpss = profiler_shared();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+
+	/* Check that plprofiler was loaded via shared_preload_libraries */
+	if (plpss == NULL)
+		elog(ERROR, "plprofiler was not loaded via shared_preload_libraries");
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Copy the shared data, the rows are built without any locks. */
+	entries = linestats_shared_snapshot(false, &count);
+	for (n = 0; n < count; n++)
+	{
+		linestatsEntry *copy = &entries[n];
+
+		if (copy->io == NULL)
+			continue;
+
+		if (copy->stmt_slots)
+		{
+			linestatsLineInfo  *by_line;
+			linestatsIoInfo	   *by_line_io;
+
+			by_line = palloc0(sizeof(linestatsLineInfo) * copy->source_lines);
+			by_line_io = palloc0(sizeof(linestatsIoInfo) * copy->source_lines);
+			linestats_by_line(copy, by_line);
+			io_by_line(copy, copy->io, by_line_io);
+			io_put_lines(tupstore, tupdesc, &copy->key,
+						 by_line_io, by_line, copy->source_lines, 1.0);
+			pfree(by_line_io);
+			pfree(by_line);
+		}
+		else
+		{
+			io_put_lines(tupstore, tupdesc, &copy->key,
+						 copy->io, copy->line_info, copy->line_count, 1.0);
+		}
+	}
+	linestats_snapshot_free(entries, count);
+
+	PG_RETURN_VOID();
 }
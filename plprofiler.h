@@ -30,17 +30,28 @@
 #include "access/sysattr.h"
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_collation.h"
 #include "catalog/pg_extension.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
 #include "commands/extension.h"
+#include "executor/instrument.h"
 #include "funcapi.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "pgstat.h"
 #include "plpgsql.h"
+#include "port/atomics.h"
+#if PG_VERSION_NUM >= 130000
+#include "port/pg_bitutils.h"
+#endif
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/spin.h"
+#include "utils/acl.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
@@ -49,18 +60,130 @@
 #include "utils/memutils.h"
 #include "utils/palloc.h"
 #include "utils/syscache.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
+
+/*
+ * Keeping the shared tables in dynamic shared memory needs sequential
+ * scans of dshash tables (PostgreSQL 15) and, to work without being
+ * in shared_preload_libraries, the DSM registry (PostgreSQL 17).
+ */
+#if PG_VERSION_NUM >= 150000
+#include "lib/dshash.h"
+#include "utils/dsa.h"
+#define PL_HAVE_DYNAMIC 1
+#endif
+#if PG_VERSION_NUM >= 170000
+#include "storage/dsm_registry.h"
+#endif
+
+/*
+ * The CPU timestamp counter can be used as clock source on x86
+ * with GCC compatible compilers.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define PL_HAVE_TSC 1
+#endif
 
 PG_MODULE_MAGIC;
 
-#define PL_PROFILE_COLS		5
-#define PL_CALLGRAPH_COLS	5
+#define PL_PROFILE_COLS		8
+#define PL_CALLGRAPH_COLS	9
 #define PL_FUNCS_SRC_COLS	3
+#define PL_STMTSTATS_COLS	9
+#define PL_PERCENTILE_COLS	7
+#define PL_CG_PERCENTILE_COLS	5
+#define PL_IO_COLS			11
+#define PL_WORKER_COLS		7
+#define PL_USAGE_COLS		9
+#define PL_HISTORY_COLS		8
+#define PL_CG_HISTORY_COLS	7
+#define PL_PROFILE_ALL_COLS	(PL_PROFILE_COLS + 3)
+#define PL_CALLGRAPH_ALL_COLS	(PL_CALLGRAPH_COLS + 2)
+#define PL_FUNC_OIDS_ALL_COLS	4
 
 #define PL_MAX_STACK_DEPTH	200
 #define PL_MIN_FUNCTIONS	2000
 #define PL_MIN_CALLGRAPH	20000
 #define PL_MIN_LINES		200000
 
+/*
+ * The shared hash tables are partitioned like the lock manager's. Each
+ * table has its own set of partition locks in the plprofiler tranche.
+ */
+#define PL_LOG2_LOCK_PARTITIONS		4
+#define PL_NUM_LOCK_PARTITIONS		(1 << PL_LOG2_LOCK_PARTITIONS)
+#define PL_FUNCTIONS_LOCK_BASE		0
+#define PL_CALLGRAPH_LOCK_BASE		PL_NUM_LOCK_PARTITIONS
+#define PL_NUM_LOCKS				(2 * PL_NUM_LOCK_PARTITIONS)
+
+/*
+ * Records in the collect rings (plprofiler.collect_worker). Every record
+ * starts with a profilerRingHeader and its length is MAXALIGN'ed. A pad
+ * record fills the end of the ring when the next record doesn't fit.
+ */
+#define PL_RING_PAD			0
+#define PL_RING_LINESTATS	1
+#define PL_RING_CALLGRAPH	2
+#define PL_WORKER_NAPTIME	100		/* ms between polls of the rings */
+
+#define PL_INFO_MIN_LINES	32
+#define PL_INFO_SIZE_CLASSES	24
+
+#define PL_CLOCK_SYSTEM		0
+#define PL_CLOCK_TSC		1
+#define PL_TSC_CALIBRATE_NS	20000000
+#define PL_SAMPLING_COLS	3
+
+#define PL_LEVEL_OFF		0
+#define PL_LEVEL_FUNCTION	1
+#define PL_LEVEL_STATEMENT	2
+
+#define PL_STORAGE_FIXED	0
+#define PL_STORAGE_DYNAMIC	1
+
+#define PL_POOL_FREE_EXTENTS	256	/* Free list entries per counter pool */
+#define PL_POOL_SIZE_CLASSES	16	/* Power of two free list classes */
+#define PL_EVICT_FRACTION	16		/* Evict 1/16th of a full call graph */
+#define PL_RESET_DATABASES	64		/* Databases, that can be reset alone */
+#define PL_COPY_RETRIES		8		/* Attempts at a consistent entry copy */
+#define PL_MAX_FILTERS		64		/* Include/exclude filters */
+
+#define PL_FILTER_FUNCTION	0
+#define PL_FILTER_SCHEMA	1
+#define PL_FILTER_ROLE		2
+#define PL_FILTER_COLS		4
+
+#define PL_MAX_TARGETS		64		/* Entries of the enable table */
+#define PL_TARGET_PID		0
+#define PL_TARGET_ROLE		1
+#define PL_TARGET_DATABASE	2
+#define PL_TARGET_APPNAME	3
+#define PL_TARGET_COLS		2
+
+/* The shared state saved across restarts (plprofiler.save) */
+#define PL_STAT_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/plprofiler.stat"
+#define PL_STAT_TMP_FILE	PL_STAT_FILE ".tmp"
+#define PL_STAT_MAGIC		0x504c5046	/* "PLPF" */
+#define PL_STAT_FORMAT		3
+
+/*
+ * Latency histograms have power of two buckets. Bucket 0 counts
+ * everything below 2^PL_HIST_MIN_SHIFT nanoseconds (about 1 us), the
+ * last bucket everything above about 18 minutes.
+ */
+#define PL_HIST_BUCKETS		32
+#define PL_HIST_MIN_SHIFT	10
+#define PL_HIST_SIZE		(sizeof(uint32) * PL_HIST_BUCKETS)
+#define PL_SHARED_HIST_SIZE	(sizeof(pg_atomic_uint32) * PL_HIST_BUCKETS)
+
+/*
+ * Scale a sampled counter up to an estimate of the unsampled value.
+ */
+#define PL_SCALE(_v, _f) ((int64) ((double) (_v) * (_f) + 0.5))
+
 
 #define PL_DBG_PRINT_STACK(_d, _s) do {	\
 		int _i;						\
@@ -71,6 +194,31 @@ PG_MODULE_MAGIC;
 		printf("\n"); \
 	} while(0);
 
+/*
+ * Nanoseconds of an instr_time. Before PostgreSQL 16 instr_time is
+ * a struct timespec except on Windows.
+ */
+#if PG_VERSION_NUM >= 160000
+#define PL_INSTR_TIME_GET_NANOSEC(_t) INSTR_TIME_GET_NANOSEC(_t)
+#elif !defined(WIN32)
+#define PL_INSTR_TIME_GET_NANOSEC(_t) \
+	((uint64) (_t).tv_sec * UINT64CONST(1000000000) + (uint64) (_t).tv_nsec)
+#else
+#define PL_INSTR_TIME_GET_NANOSEC(_t) \
+	((uint64) INSTR_TIME_GET_MICROSEC(_t) * UINT64CONST(1000))
+#endif
+
+/*
+ * The counter slot of a statement. That is the source line number,
+ * or the statement id when the function uses statement slots.
+ */
+#if PG_VERSION_NUM >= 120000
+#define PL_STMT_SLOT(_pi, _stmt) \
+	((_pi)->stmt_slots ? (int) (_stmt)->stmtid : (_stmt)->lineno)
+#else
+#define PL_STMT_SLOT(_pi, _stmt) ((_stmt)->lineno)
+#endif
+
 
 /**********************************************************************
  * Type and structure definitions
@@ -85,35 +233,54 @@ PG_MODULE_MAGIC;
  */
 typedef struct
 {
-	int64				us_max;		/* Slowest iteration of this stmt */
-	int64				us_total;	/* Total time spent executing this stmt */
+	int64				ns_max;		/* Slowest iteration of this stmt */
+	int64				ns_total;	/* Total time spent executing this stmt */
 	int64				exec_count;	/* Number of times we executed this stmt */
-	instr_time			start_time;	/* Start time for this statement */
+	uint64				start_time;	/* Start clock ticks of this statement */
+	int					lineno;		/* Source line of this stmt */
+	int					io_mark;	/* I/O snapshot stack depth + 1 or 0 */
 } profilerLineInfo;
 
 /* ----
  * profilerInfo
  *
- * 	The information we keep in the estate->plugin_info.
+ * 	The information we keep in the estate->plugin_info. These are
+ * 	pooled per backend in size classes of their line_info array and
+ * 	handed out already zeroed. The line_info array directly follows
+ * 	the struct in the same chunk.
  * ----
  */
-typedef struct
+typedef struct profilerInfo
 {
 	Oid					fn_oid;		/* The functions OID */
-	int					line_count;	/* Number of lines in this function */
-	profilerLineInfo   *line_info;	/* Performance counters for each line */
+	TransactionId		fn_version;	/* The functions pg_proc xmin */
+	int					line_count;	/* Number of counter slots */
+	bool				stmt_slots;	/* Slots are statement ids, not lines */
+	profilerLineInfo   *line_info;	/* Performance counters for each slot */
+	struct linestatsEntry *entry;	/* Local linestats hash table entry */
+	uint32				generation;	/* Local hash table generation of entry */
+	int					line_min;	/* Lowest line executed */
+	int					line_max;	/* Highest line executed */
+	int					cur_slot;	/* Slot of the statement executing now */
+	int					size_class;	/* Size class of this chunk */
+	bool				in_use;		/* Chunk belongs to a live invocation */
+	struct profilerInfo *prev;		/* Calling invocation or next free chunk */
 } profilerInfo;
 
 /* ----
  * linestatsHashKey
  *
  * 	Hash key for the linestats hash tables (both local and shared).
+ * 	The version is the xmin of the function's pg_proc row, so that
+ * 	CREATE OR REPLACE FUNCTION starts a new entry with its own line
+ * 	count, while the stats of the old version are kept.
  * ----
  */
 typedef struct
 {
 	Oid					db_oid;		/* The OID of the database */
 	Oid					fn_oid;		/* The OID of the function */
+	TransactionId		fn_version;	/* The xmin of the pg_proc row */
 } linestatsHashKey;
 
 /* ----
@@ -124,25 +291,117 @@ typedef struct
  */
 typedef struct
 {
-	int64				us_max;		/* Maximum execution time of statement */
-	int64				us_total;	/* Total sum of statement exec time */
+	int64				ns_max;		/* Maximum execution time of statement */
+	int64				ns_total;	/* Total sum of statement exec time */
 	int64				exec_count;	/* Count of statement executions */
+	int32				lineno;		/* Source line of the statement */
 } linestatsLineInfo;
 
 /* ----
- * linestatsEntry
+ * linestatsSharedLine
  *
- * 	Per function data kept in the linestats hash table.
+ * 	Per source code line statistics in shared memory. Backends add
+ * 	their local counts with atomic operations, so that neither they
+ * 	nor readers ever wait for each other.
  * ----
  */
 typedef struct
+{
+	pg_atomic_uint64	ns_max;
+	pg_atomic_uint64	ns_max_interval;	/* ns_max since the last history
+											 * snapshot */
+	pg_atomic_uint64	ns_total;
+	pg_atomic_uint64	exec_count;
+	pg_atomic_uint32	lineno;
+} linestatsSharedLine;
+
+/* ----
+ * linestatsIoInfo
+ *
+ * 	Per source code line buffer and WAL usage (plprofiler.track_io).
+ * 	Also used for the snapshots of pgBufferUsage and pgWalUsage taken
+ * 	when a statement or function starts.
+ * ----
+ */
+typedef struct
+{
+	int64				shared_blks_hit;
+	int64				shared_blks_read;
+	int64				shared_blks_dirtied;
+	int64				shared_blks_written;
+	int64				temp_blks_read;
+	int64				temp_blks_written;
+	int64				wal_records;
+	int64				wal_bytes;
+} linestatsIoInfo;
+
+#define PL_IO_COUNTERS		((int) (sizeof(linestatsIoInfo) / sizeof(int64)))
+#define PL_SHARED_IO_SIZE	(sizeof(pg_atomic_uint64) * PL_IO_COUNTERS)
+
+/* ----
+ * linestatsEntry
+ *
+ * 	Per function data kept in the local linestats hash table. Entries
+ * 	with counts, that were not collected into shared memory yet, are
+ * 	linked into a dirty list together with the range of changed slots.
+ * ----
+ */
+typedef struct linestatsEntry
 {
 	linestatsHashKey	key;		/* hash key of entry */
-	slock_t				mutex;		/* Spin lock for updating counters */
-	int					line_count;	/* Number of lines in this function */
-	linestatsLineInfo  *line_info;	/* Performance counters for each line */
+	int					line_count;	/* Number of counter slots */
+	bool				stmt_slots;	/* Slots are statement ids, not lines */
+	int					source_lines; /* Number of lines in this function */
+	linestatsLineInfo  *line_info;	/* Performance counters for each slot */
+	uint32			   *hist;		/* Latency histogram per slot or NULL */
+	linestatsIoInfo	   *io;			/* I/O counters per slot or NULL */
+	NameData			fn_schema;	/* Schema and name of the function */
+	NameData			fn_name;
+	struct linestatsEntry *dirty_next; /* Next entry on the dirty list */
+	int					dirty_min;	/* First changed slot */
+	int					dirty_max;	/* Last changed slot, -1 if clean */
 } linestatsEntry;
 
+/* ----
+ * linestatsSharedEntry
+ *
+ * 	Per function data kept in the shared linestats hash table. The
+ * 	partition lock of the entry protects it and its counter arrays from
+ * 	being created or removed, the counters themselves are atomics.
+ * 	With plprofiler.shared_storage = dynamic the arrays are in the DSA
+ * 	area and only the dsa_pointers are valid. An entry, whose generation
+ * 	is older than the last reset of its database, counts as empty.
+ *
+ * 	Every merge increments changes_begin before and changes_end after
+ * 	it touches the counters. A reader, that sees changes_begin after
+ * 	its copy equal to changes_end before it, got a consistent copy.
+ *
+ * 	The schema and name of the function are captured when the entry
+ * 	is created, so that the entries of all databases can be reported
+ * 	from any one of them.
+ * ----
+ */
+typedef struct linestatsSharedEntry
+{
+	linestatsHashKey	key;		/* hash key of entry */
+	uint64				generation;	/* Reset generation of the counters */
+	pg_atomic_uint64	changes_begin; /* Merges started */
+	pg_atomic_uint64	changes_end; /* Merges finished */
+	NameData			fn_schema;	/* Empty if not known */
+	NameData			fn_name;
+	int					line_count;	/* Number of counter slots */
+	bool				stmt_slots;	/* Slots are statement ids, not lines */
+	int					source_lines; /* Number of lines in this function */
+	linestatsSharedLine *line_info;	/* Performance counters for each slot */
+	pg_atomic_uint32   *hist;		/* Latency histogram per slot or NULL */
+	pg_atomic_uint64   *io;			/* I/O counters per slot or NULL */
+#ifdef PL_HAVE_DYNAMIC
+	dsa_pointer			line_info_dp;
+	dsa_pointer			hist_dp;
+	dsa_pointer			io_dp;
+#endif
+} linestatsSharedEntry;
+
 typedef struct callGraphKey
 {
 	Oid				db_oid;
@@ -152,43 +411,531 @@ typedef struct callGraphKey
 typedef struct callGraphEntry
 {
     callGraphKey	key;
-	slock_t			mutex;
-	PgStat_Counter	callCount;
+	pg_atomic_uint64 callCount;
+	pg_atomic_uint64 totalTime;		/* All times in nanoseconds */
+	pg_atomic_uint64 childTime;
+	pg_atomic_uint64 selfTime;
+	pg_atomic_uint64 maxTimeInterval; /* Longest call since the last
+									   * history snapshot */
+	pg_atomic_uint32 *hist;			/* Latency histogram or NULL */
+	uint64			error;			/* Max. totalTime missed before entry */
+	uint64			generation;		/* Reset generation of the counters */
+	pg_atomic_uint64 changes_begin;	/* See linestatsSharedEntry */
+	pg_atomic_uint64 changes_end;
+#ifdef PL_HAVE_DYNAMIC
+	dsa_pointer		hist_dp;
+#endif
+} callGraphEntry;
+
+/* ----
+ * callGraphCopy
+ *
+ * 	The counters of a shared call graph entry copied into local
+ * 	memory, so that result rows can be built without holding locks.
+ * ----
+ */
+typedef struct
+{
+	callGraphKey	key;
+	int64			callCount;
 	uint64			totalTime;
 	uint64			childTime;
 	uint64			selfTime;
-} callGraphEntry;
+	uint64			error;
+	bool			has_hist;
+	uint32			hist[PL_HIST_BUCKETS];
+} callGraphCopy;
+
+/* ----
+ * callGraphNodeKey
+ *
+ * 	Hash key for the local calling context tree. A node is identified
+ * 	by the node of its caller (zero for the root) and its own Oid.
+ * ----
+ */
+typedef struct callGraphNodeKey
+{
+	int32			parent_id;
+	Oid				fn_oid;
+} callGraphNodeKey;
+
+/* ----
+ * callGraphNode
+ *
+ * 	One node of the local calling context tree. Every distinct call
+ * 	stack is a path from the root to a node, so the full stack is only
+ * 	rebuilt from the parent links when the data is exported. Like the
+ * 	linestats entries, nodes with new counts are on a dirty list.
+ * ----
+ */
+typedef struct callGraphNode
+{
+	callGraphNodeKey	key;
+	int32				node_id;
+	int32				depth;
+	struct callGraphNode *parent;
+	PgStat_Counter		callCount;
+	uint64				totalTime;
+	uint64				childTime;
+	uint64				selfTime;
+	uint64				maxTime;	/* Longest call since the last collect */
+	uint32				hist[PL_HIST_BUCKETS];
+	struct callGraphNode *dirty_next; /* Next node on the dirty list */
+	bool				dirty;		/* Node is on the dirty list */
+} callGraphNode;
+
+/* ----
+ * callGraphFrame
+ *
+ * 	One level of the backend local call stack.
+ * ----
+ */
+typedef struct callGraphFrame
+{
+	Oid					fn_oid;		/* The function of this frame */
+	TransactionId		fn_version;	/* Its pg_proc xmin */
+	callGraphNode	   *node;		/* Calling context tree node */
+	linestatsEntry	   *entry;		/* Local linestats hash table entry */
+	profilerInfo	   *info;		/* Invocation data of this frame */
+	uint64				entry_time;	/* Clock ticks when function was entered */
+	uint64				child_time;	/* Nanoseconds spent in called functions */
+	uint64				sample_time; /* Nanoseconds sampled in this frame */
+	linestatsIoInfo		io_start;	/* I/O counters when function was entered */
+} callGraphFrame;
+
+/* ----
+ * profilerRing
+ *
+ * 	Single producer, single consumer ring buffer of delta records. A
+ * 	backend owns one ring while it is connected and appends the changes
+ * 	of its local tables at collect time. The collect worker reads the
+ * 	records and merges them into the shared hash tables. head and tail
+ * 	are byte positions that only ever grow.
+ * ----
+ */
+typedef struct
+{
+	pg_atomic_uint32	owner;		/* PID of the owning backend or 0 */
+	pg_atomic_uint64	head;		/* Written up to here by the owner */
+	pg_atomic_uint64	tail;		/* Consumed up to here by the worker */
+	char				data[FLEXIBLE_ARRAY_MEMBER];
+} profilerRing;
+
+typedef struct
+{
+	uint32				len;		/* Record length including header */
+	uint32				type;		/* PL_RING_* */
+} profilerRingHeader;
+
+/* ----
+ * profilerRingLinestats
+ *
+ * 	The changed slot range of a local linestats entry. It is followed
+ * 	by nlines linestatsLineInfo, then by the same number of histograms
+ * 	and linestatsIoInfo, if the entry has them, and names_len bytes
+ * 	with the null terminated schema and name of the function.
+ * ----
+ */
+typedef struct
+{
+	profilerRingHeader	hdr;
+	linestatsHashKey	key;
+	int					line_count;	/* Slots of the function */
+	int					source_lines;
+	bool				stmt_slots;
+	bool				has_hist;
+	bool				has_io;
+	int					line_min;	/* First slot in this record */
+	int					nlines;		/* Number of slots in this record */
+	int					names_len;	/* Bytes of schema and name */
+} profilerRingLinestats;
+
+/* ----
+ * profilerRingCallgraph
+ *
+ * 	The counters of a calling context tree node, followed by its
+ * 	histogram if has_hist and the depth Oids of the call stack.
+ * ----
+ */
+typedef struct
+{
+	profilerRingHeader	hdr;
+	Oid					db_oid;
+	int					depth;
+	bool				has_hist;
+	int64				callCount;
+	int64				totalTime;
+	int64				childTime;
+	int64				selfTime;
+	int64				maxTime;
+} profilerRingCallgraph;
+
+/* ----
+ * profilerPoolFree
+ *
+ * 	The free list of one of the fixed shared counter pools. Slices of
+ * 	removed entries are kept as extents of contiguous elements, that
+ * 	are reused before the pool is advanced further. The extents are
+ * 	linked into one list per power of two size class. When no extent
+ * 	slot is left, a freed slice is lost until the pool is compacted.
+ * ----
+ */
+typedef struct
+{
+	int					start;		/* First element of the extent */
+	int					count;		/* Number of elements */
+	int					next;		/* Next extent of the class or -1 */
+} profilerPoolExtent;
+
+typedef struct
+{
+	slock_t				mutex;
+	int					nfree;		/* Elements on the free list */
+	int					unused;		/* First unused extent slot or -1 */
+	int					heads[PL_POOL_SIZE_CLASSES];
+	profilerPoolExtent	extents[PL_POOL_FREE_EXTENTS];
+} profilerPoolFree;
+
+/* ----
+ * profilerResetDb
+ *
+ * 	The generation, in which the shared entries of one database were
+ * 	last reset. Entries of older generations are reinitialized when
+ * 	they are next collected into and removed when room is needed.
+ * ----
+ */
+typedef struct
+{
+	Oid					db_oid;		/* InvalidOid if the slot is unused */
+	pg_atomic_uint64	generation;
+} profilerResetDb;
+
+/* ----
+ * profilerFilter
+ *
+ * 	One include or exclude filter on a function, schema or role. The
+ * 	Oids of functions and schemas are only unique within a database,
+ * 	role filters have no database. When there are include filters of
+ * 	a kind, only what matches one of them is profiled. Excludes win.
+ * ----
+ */
+typedef struct
+{
+	int					kind;		/* PL_FILTER_FUNCTION, _SCHEMA or _ROLE */
+	bool				exclude;
+	Oid					db_oid;
+	Oid					target;
+} profilerFilter;
+
+/* ----
+ * profilerFilterEntry
+ *
+ * 	The per backend cache of the filter decision for a function.
+ * ----
+ */
+typedef struct
+{
+	Oid					fn_oid;
+	bool				profile;
+} profilerFilterEntry;
+
+/* ----
+ * profilerEnableTarget
+ *
+ * 	One entry of the enable table. A backend profiles if it matches
+ * 	any entry: its PID, a role the current user is a member of, its
+ * 	database or a LIKE pattern on its application_name.
+ * ----
+ */
+typedef struct
+{
+	int					kind;		/* PL_TARGET_PID, _ROLE, ... */
+	int					pid;
+	Oid					oid;		/* Role or database */
+	NameData			pattern;	/* application_name pattern */
+} profilerEnableTarget;
+
+/* ----
+ * profilerPoolSlice
+ *
+ * 	A live slice of a fixed counter pool, that the compaction moves.
+ * 	ref is the pointer member of the shared entry, that points to it.
+ * ----
+ */
+typedef struct
+{
+	int					start;
+	int					count;
+	void			  **ref;
+} profilerPoolSlice;
 
 typedef struct
 {
-	LWLockId			lock;
+	LWLockPadded	   *locks;			/* Partition locks, see above */
 	bool				profiler_enabled_global;
 	int					profiler_enabled_pid;
 	int					profiler_collect_interval;
+	int					profiler_level;	/* Highest level for all backends */
 	bool				callgraph_overflow;
 	bool				functions_overflow;
 	bool				lines_overflow;
-	int					lines_used;
-	linestatsLineInfo	line_info[1];
+	pg_atomic_uint32	lines_used;
+	pg_atomic_uint64	total_calls;	/* Top level calls seen */
+	pg_atomic_uint64	sampled_calls;	/* Top level calls profiled */
+	int					sampling_interval; /* ms, if the data was sampled */
+	bool				sampling_mixed;	/* Data of different intervals */
+	pg_atomic_uint32	hists_used;
+	bool				histograms_overflow;
+	pg_atomic_uint32	io_used;
+	bool				io_overflow;
+	int					worker_pid;		/* Collect worker or 0 */
+	Latch			   *worker_latch;
+	pg_atomic_uint64	ring_records;	/* Records queued by backends */
+	pg_atomic_uint64	ring_merged;	/* Records merged by the worker */
+	pg_atomic_uint64	ring_dropped;	/* Records the worker had no room for */
+	pg_atomic_uint64	ring_deferred;	/* Collects postponed, ring was full */
+	pg_atomic_uint64	ring_direct;	/* Collects merged by the backend */
+	bool				compact_requested; /* Pools are fragmented */
+	pg_atomic_uint32	callgraph_evicting; /* A backend is evicting */
+	pg_atomic_uint64	callgraph_evict_floor; /* Max. weight evicted */
+	pg_atomic_uint64	callgraph_evicted; /* Call graphs evicted */
+	pg_atomic_uint64	history_lines_head; /* History rows written */
+	pg_atomic_uint64	history_callgraphs_head;
+	pg_atomic_uint64	generation;		/* Incremented by every reset */
+	pg_atomic_uint64	reset_all;		/* Generation of the last full reset */
+	pg_atomic_uint64	purged;			/* Generation stale entries were
+										 * last removed in */
+	bool				purge_requested; /* Stale entries wait for removal */
+	slock_t				reset_mutex;	/* Protects assigning reset_dbs */
+	profilerResetDb		reset_dbs[PL_RESET_DATABASES];
+	slock_t				filter_mutex;	/* Protects the filters */
+	pg_atomic_uint32	filter_generation; /* Incremented by every change */
+	int					num_filters;
+	profilerFilter		filters[PL_MAX_FILTERS];
+	slock_t				enable_mutex;	/* Protects the enable table */
+	pg_atomic_uint32	enable_generation; /* Incremented by every change */
+	int					num_targets;
+	profilerEnableTarget targets[PL_MAX_TARGETS];
+	profilerPoolFree	lines_free;		/* Free lists of the fixed pools */
+	profilerPoolFree	hists_free;
+	profilerPoolFree	io_free;
+#ifdef PL_HAVE_DYNAMIC
+	int					dsa_tranche;	/* Tranche of the DSA area locks */
+	LWLock				dsa_lock;		/* Protects creating the DSA area */
+	dsa_handle			area_handle;	/* DSA area or DSA_HANDLE_INVALID */
+	dshash_table_handle	functions_dsh;
+	dshash_table_handle	callgraph_dsh;
+	pg_atomic_uint64	dynamic_used;	/* Bytes of entries and counters */
+#endif
+	linestatsSharedLine	line_info[1];
 } profilerSharedState;
 
+/* ----
+ * profilerHistoryLine
+ *
+ * 	The change of one source line of a function during one snapshot
+ * 	interval (plprofiler.history_lines). Line zero is the function as
+ * 	a whole. The collect worker is the only writer of the ring. seq is
+ * 	zero while a row is written and the row number plus one after,
+ * 	so readers detect rows overwritten under them without locking.
+ * ----
+ */
+typedef struct
+{
+	pg_atomic_uint64	seq;
+	TimestampTz			interval_start;
+	TimestampTz			interval_end;
+	linestatsHashKey	key;
+	int32				line;
+	int64				exec_count;
+	int64				ns_total;
+	int64				ns_max;		/* Longest execution in the interval */
+} profilerHistoryLine;
+
+/* ----
+ * profilerHistoryCallgraph
+ *
+ * 	The change of one of the call graphs with the most total time
+ * 	during a snapshot interval (plprofiler.history_callgraphs).
+ * ----
+ */
+typedef struct
+{
+	pg_atomic_uint64	seq;
+	TimestampTz			interval_start;
+	TimestampTz			interval_end;
+	callGraphKey		key;
+	int64				callCount;
+	int64				totalTime;
+	int64				selfTime;
+	int64				maxTime;	/* Longest call in the interval */
+} profilerHistoryCallgraph;
+
+/* ----
+ * profilerHistoryBase
+ *
+ * 	The per line counters of a function at the last snapshot, kept
+ * 	by the collect worker to compute the history rows.
+ * ----
+ */
+typedef struct
+{
+	linestatsHashKey	key;
+	int					line_count;	/* Source lines in the arrays */
+	uint32				generation;	/* Snapshot, that last saw the entry */
+	int64			   *exec_count;
+	int64			   *ns_total;
+} profilerHistoryBase;
+
+typedef struct
+{
+	callGraphKey		key;
+	uint32				generation;
+	int64				callCount;
+	int64				totalTime;
+	int64				selfTime;
+} profilerHistoryCgBase;
+
+/* ----
+ * profilerStatHeader
+ *
+ * 	Header of the file the shared state is saved in. The file is only
+ * 	loaded if it was written with the same sizing settings. It is
+ * 	followed by the number of functions and their records, the number
+ * 	of call graphs and their records and PL_STAT_MAGIC again.
+ * ----
+ */
+typedef struct
+{
+	uint32				magic;
+	uint32				format;
+	int32				max_functions;
+	int32				max_lines;
+	int32				max_callgraph;
+	int32				max_histograms;
+	int32				max_io_lines;
+	int32				hist_buckets;
+	int32				io_counters;
+	int32				max_stack_depth;
+	bool				callgraph_overflow;
+	bool				functions_overflow;
+	bool				lines_overflow;
+	uint64				total_calls;
+	uint64				sampled_calls;
+	int32				sampling_interval;
+	uint64				callgraph_evict_floor;
+	uint64				callgraph_evicted;
+} profilerStatHeader;
+
+/* ----
+ * profilerStatFunction
+ *
+ * 	A saved shared linestats entry. It is followed by line_count
+ * 	linestatsLineInfo and the same number of histograms and
+ * 	linestatsIoInfo, if the entry has them.
+ * ----
+ */
+typedef struct
+{
+	linestatsHashKey	key;
+	int32				line_count;
+	int32				source_lines;
+	bool				stmt_slots;
+	bool				has_hist;
+	bool				has_io;
+	NameData			fn_schema;
+	NameData			fn_name;
+} profilerStatFunction;
+
+/* ----
+ * profilerStatCallgraph
+ *
+ * 	A saved shared call graph entry, followed by its histogram if
+ * 	has_hist.
+ * ----
+ */
+typedef struct
+{
+	callGraphKey		key;
+	int64				callCount;
+	uint64				totalTime;
+	uint64				childTime;
+	uint64				selfTime;
+	uint64				error;
+	bool				has_hist;
+} profilerStatCallgraph;
+
+/* ----
+ * profilerFuncName
+ *
+ * 	The schema and name of a function of any database, collected from
+ * 	the shared linestats table. fn_version of the key is not used.
+ * ----
+ */
+typedef struct
+{
+	linestatsHashKey	key;
+	NameData			fn_schema;
+	NameData			fn_name;
+} profilerFuncName;
+
+/* ----
+ * profilerSharedScan
+ *
+ * 	State of a sequential scan of one of the shared tables. These are
+ * 	either dynahash tables in the main shared memory or dshash tables
+ * 	in the DSA area (plprofiler.shared_storage).
+ * ----
+ */
+typedef struct
+{
+	bool				dynamic;	/* Scanning a dshash table */
+	bool				callgraph;	/* The callgraph or the functions table */
+	bool				stale;		/* Also return entries of old generations */
+	HTAB			   *htab;
+	int					lock_base;	/* First partition lock of htab */
+	HASH_SEQ_STATUS		hash_seq;
+#ifdef PL_HAVE_DYNAMIC
+	dshash_seq_status	dsh_seq;
+#endif
+} profilerSharedScan;
+
 /**********************************************************************
  * Exported function prototypes
  **********************************************************************/
 
 void    _PG_init(void);
 void    _PG_fini(void);
+PGDLLEXPORT void profiler_worker_main(Datum main_arg);
 
 Datum pl_profiler_get_stack(PG_FUNCTION_ARGS);
 Datum pl_profiler_linestats_local(PG_FUNCTION_ARGS);
 Datum pl_profiler_linestats_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_stmtstats_local(PG_FUNCTION_ARGS);
+Datum pl_profiler_stmtstats_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_sampling_local(PG_FUNCTION_ARGS);
+Datum pl_profiler_sampling_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_linestats_percentiles_local(PG_FUNCTION_ARGS);
+Datum pl_profiler_linestats_percentiles_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_callgraph_percentiles_local(PG_FUNCTION_ARGS);
+Datum pl_profiler_callgraph_percentiles_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_linestats_io_local(PG_FUNCTION_ARGS);
+Datum pl_profiler_linestats_io_shared(PG_FUNCTION_ARGS);
 Datum pl_profiler_callgraph_local(PG_FUNCTION_ARGS);
 Datum pl_profiler_callgraph_shared(PG_FUNCTION_ARGS);
 Datum pl_profiler_func_oids_local(PG_FUNCTION_ARGS);
 Datum pl_profiler_func_oids_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_linestats_all_databases(PG_FUNCTION_ARGS);
+Datum pl_profiler_callgraph_all_databases(PG_FUNCTION_ARGS);
+Datum pl_profiler_func_oids_all_databases(PG_FUNCTION_ARGS);
 Datum pl_profiler_funcs_source(PG_FUNCTION_ARGS);
 Datum pl_profiler_reset_local(PG_FUNCTION_ARGS);
 Datum pl_profiler_reset_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_reset_shared_database(PG_FUNCTION_ARGS);
+Datum pl_profiler_retire_versions(PG_FUNCTION_ARGS);
+Datum pl_profiler_compact_shared(PG_FUNCTION_ARGS);
+Datum pl_profiler_history_linestats(PG_FUNCTION_ARGS);
+Datum pl_profiler_history_callgraph(PG_FUNCTION_ARGS);
 Datum pl_profiler_set_enabled_global(PG_FUNCTION_ARGS);
 Datum pl_profiler_get_enabled_global(PG_FUNCTION_ARGS);
 Datum pl_profiler_set_enabled_local(PG_FUNCTION_ARGS);
@@ -197,21 +944,51 @@ Datum pl_profiler_set_enabled_pid(PG_FUNCTION_ARGS);
 Datum pl_profiler_get_enabled_pid(PG_FUNCTION_ARGS);
 Datum pl_profiler_set_collect_interval(PG_FUNCTION_ARGS);
 Datum pl_profiler_get_collect_interval(PG_FUNCTION_ARGS);
+Datum pl_profiler_set_level_global(PG_FUNCTION_ARGS);
+Datum pl_profiler_get_level_global(PG_FUNCTION_ARGS);
+Datum pl_profiler_add_filter(PG_FUNCTION_ARGS);
+Datum pl_profiler_remove_filter(PG_FUNCTION_ARGS);
+Datum pl_profiler_clear_filters(PG_FUNCTION_ARGS);
+Datum pl_profiler_filters(PG_FUNCTION_ARGS);
+Datum pl_profiler_enable_target(PG_FUNCTION_ARGS);
+Datum pl_profiler_disable_target(PG_FUNCTION_ARGS);
+Datum pl_profiler_clear_targets(PG_FUNCTION_ARGS);
+Datum pl_profiler_targets(PG_FUNCTION_ARGS);
 Datum pl_profiler_collect_data(PG_FUNCTION_ARGS);
 Datum pl_profiler_callgraph_overflow(PG_FUNCTION_ARGS);
 Datum pl_profiler_functions_overflow(PG_FUNCTION_ARGS);
 Datum pl_profiler_lines_overflow(PG_FUNCTION_ARGS);
+Datum pl_profiler_collect_worker_stats(PG_FUNCTION_ARGS);
+Datum pl_profiler_shared_usage(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(pl_profiler_get_stack);
 PG_FUNCTION_INFO_V1(pl_profiler_linestats_local);
 PG_FUNCTION_INFO_V1(pl_profiler_linestats_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_stmtstats_local);
+PG_FUNCTION_INFO_V1(pl_profiler_stmtstats_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_sampling_local);
+PG_FUNCTION_INFO_V1(pl_profiler_sampling_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_linestats_percentiles_local);
+PG_FUNCTION_INFO_V1(pl_profiler_linestats_percentiles_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_callgraph_percentiles_local);
+PG_FUNCTION_INFO_V1(pl_profiler_callgraph_percentiles_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_linestats_io_local);
+PG_FUNCTION_INFO_V1(pl_profiler_linestats_io_shared);
 PG_FUNCTION_INFO_V1(pl_profiler_callgraph_local);
 PG_FUNCTION_INFO_V1(pl_profiler_callgraph_shared);
 PG_FUNCTION_INFO_V1(pl_profiler_func_oids_local);
 PG_FUNCTION_INFO_V1(pl_profiler_func_oids_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_linestats_all_databases);
+PG_FUNCTION_INFO_V1(pl_profiler_callgraph_all_databases);
+PG_FUNCTION_INFO_V1(pl_profiler_func_oids_all_databases);
 PG_FUNCTION_INFO_V1(pl_profiler_funcs_source);
 PG_FUNCTION_INFO_V1(pl_profiler_reset_local);
 PG_FUNCTION_INFO_V1(pl_profiler_reset_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_reset_shared_database);
+PG_FUNCTION_INFO_V1(pl_profiler_retire_versions);
+PG_FUNCTION_INFO_V1(pl_profiler_compact_shared);
+PG_FUNCTION_INFO_V1(pl_profiler_history_linestats);
+PG_FUNCTION_INFO_V1(pl_profiler_history_callgraph);
 PG_FUNCTION_INFO_V1(pl_profiler_set_enabled_global);
 PG_FUNCTION_INFO_V1(pl_profiler_get_enabled_global);
 PG_FUNCTION_INFO_V1(pl_profiler_set_enabled_local);
@@ -220,9 +997,21 @@ PG_FUNCTION_INFO_V1(pl_profiler_set_enabled_pid);
 PG_FUNCTION_INFO_V1(pl_profiler_get_enabled_pid);
 PG_FUNCTION_INFO_V1(pl_profiler_set_collect_interval);
 PG_FUNCTION_INFO_V1(pl_profiler_get_collect_interval);
+PG_FUNCTION_INFO_V1(pl_profiler_set_level_global);
+PG_FUNCTION_INFO_V1(pl_profiler_get_level_global);
+PG_FUNCTION_INFO_V1(pl_profiler_add_filter);
+PG_FUNCTION_INFO_V1(pl_profiler_remove_filter);
+PG_FUNCTION_INFO_V1(pl_profiler_clear_filters);
+PG_FUNCTION_INFO_V1(pl_profiler_filters);
+PG_FUNCTION_INFO_V1(pl_profiler_enable_target);
+PG_FUNCTION_INFO_V1(pl_profiler_disable_target);
+PG_FUNCTION_INFO_V1(pl_profiler_clear_targets);
+PG_FUNCTION_INFO_V1(pl_profiler_targets);
 PG_FUNCTION_INFO_V1(pl_profiler_collect_data);
 PG_FUNCTION_INFO_V1(pl_profiler_callgraph_overflow);
 PG_FUNCTION_INFO_V1(pl_profiler_functions_overflow);
 PG_FUNCTION_INFO_V1(pl_profiler_lines_overflow);
+PG_FUNCTION_INFO_V1(pl_profiler_collect_worker_stats);
+PG_FUNCTION_INFO_V1(pl_profiler_shared_usage);
 
 #endif /* PLPROFILER_H */
@@ -29,10 +29,10 @@ class plprofiler:
         self.profiler_namespace = self.get_profiler_namespace()
 
     def version(self):
-        return 40200
+        return 40300
         
     def versionstr(self):
-        return "4.2"
+        return "4.3"
 
     def get_profiler_namespace(self):
         # ----
@@ -68,11 +68,145 @@ class plprofiler:
         vrow = cur.fetchone()
         if vrow[0] < 40100 or vrow[0] >= 50000:
             raise Exception("ERROR: plprofiler extension is version %s, need 4.x" %vrow[1])
+        self.extension_version = vrow[0]
 
         cur.close()
         self.dbconn.rollback()
         return result
 
+    def get_sampling(self, cur, scope):
+        # ----
+        # Return the number of top level calls and of those that were
+        # profiled, and the sampling interval in milliseconds the data
+        # was collected with (zero when every statement was timed).
+        # Extensions before 4.3 always profile and time all calls.
+        # ----
+        if self.extension_version < 40300:
+            return (None, None, 0)
+        cur.execute("""SELECT total_calls, sampled_calls, sampling_interval
+                        FROM pl_profiler_sampling_%s()""" %(scope, ))
+        return cur.fetchone()
+
+    def flame_value(self, us_self, sampling_interval):
+        # ----
+        # Convert the self time of a call stack into the number of
+        # samples taken in it. Without an interval, which is also the
+        # case for data of mixed intervals, the microseconds are used.
+        # A stack, that has any time, keeps at least one sample.
+        # ----
+        if not sampling_interval or not us_self:
+            return us_self
+        return max(1, int(round(float(us_self) /
+                                (sampling_interval * 1000.0))))
+
+    def save_sampling(self, cur, sampling):
+        # ----
+        # Record the sampling counts and interval in the new
+        # pl_profiler_saved entry.
+        # ----
+        if self.extension_version < 40300 or sampling[0] is None:
+            return
+        cur.execute("""UPDATE pl_profiler_saved
+                        SET s_total_calls = %s, s_sampled_calls = %s,
+                            s_sampling_interval = %s
+                        WHERE s_id = currval('pl_profiler_saved_s_id_seq')""",
+                    sampling)
+
+    def get_percentiles(self, cur, scope):
+        # ----
+        # Return the latency percentiles per (func_oid, line_number)
+        # recorded with plprofiler.histograms. Empty if there are none.
+        # Percentiles of several function versions cannot be combined,
+        # the report shows the highest.
+        # ----
+        if self.extension_version < 40300:
+            return {}
+        cur.execute("""SELECT func_oid, line_number, max(p50), max(p90),
+                            max(p99), max(p999)
+                        FROM pl_profiler_linestats_percentiles_%s()
+                        GROUP BY func_oid, line_number""" %(scope, ))
+        result = {}
+        for row in cur:
+            result[(row[0], row[1])] = row[2:]
+        return result
+
+    def save_percentiles(self, cur, scope):
+        # ----
+        # Add the latency percentiles to the saved linestats.
+        # ----
+        if self.extension_version < 40300:
+            return
+        cur.execute("""UPDATE pl_profiler_saved_linestats
+                        SET l_p50 = P.p50, l_p90 = P.p90,
+                            l_p99 = P.p99, l_p999 = P.p999
+                        FROM (SELECT func_oid, line_number,
+                                    max(p50) AS p50, max(p90) AS p90,
+                                    max(p99) AS p99, max(p999) AS p999
+                                FROM pl_profiler_linestats_percentiles_%s()
+                                GROUP BY func_oid, line_number) P
+                        WHERE l_s_id = currval('pl_profiler_saved_s_id_seq')
+                          AND l_funcoid = P.func_oid
+                          AND l_line_number = P.line_number""" %(scope, ))
+
+    def add_percentiles(self, src, pct):
+        # ----
+        # Add the percentiles (in microseconds) to a source line entry.
+        # ----
+        if pct is None or pct[0] is None:
+            return
+        src['p50'] = float(pct[0])
+        src['p90'] = float(pct[1])
+        src['p99'] = float(pct[2])
+        src['p999'] = float(pct[3])
+
+    IO_COLUMNS = ('shared_blks_hit', 'shared_blks_read',
+                  'shared_blks_dirtied', 'shared_blks_written',
+                  'temp_blks_read', 'temp_blks_written',
+                  'wal_records', 'wal_bytes')
+
+    def get_io(self, cur, scope):
+        # ----
+        # Return the buffer and WAL usage per (func_oid, line_number)
+        # recorded with plprofiler.track_io, summed over all function
+        # versions. Empty if there is none.
+        # ----
+        if self.extension_version < 40300:
+            return {}
+        cur.execute("""SELECT func_oid, line_number, """ +
+                    ", ".join(["sum(%s)" %(c, ) for c in self.IO_COLUMNS]) + """
+                        FROM pl_profiler_linestats_io_%s()
+                        GROUP BY func_oid, line_number""" %(scope, ))
+        result = {}
+        for row in cur:
+            result[(row[0], row[1])] = row[2:]
+        return result
+
+    def save_io(self, cur, scope):
+        # ----
+        # Add the buffer and WAL usage to the saved linestats.
+        # ----
+        if self.extension_version < 40300:
+            return
+        cur.execute("""UPDATE pl_profiler_saved_linestats
+                        SET """ +
+                    ", ".join(["l_%s = I.%s" %(c, c) for c in self.IO_COLUMNS]) + """
+                        FROM (SELECT func_oid, line_number, """ +
+                    ", ".join(["sum(%s) AS %s" %(c, c) for c in self.IO_COLUMNS]) + """
+                                FROM pl_profiler_linestats_io_%s()
+                                GROUP BY func_oid, line_number) I
+                        WHERE l_s_id = currval('pl_profiler_saved_s_id_seq')
+                          AND l_funcoid = I.func_oid
+                          AND l_line_number = I.line_number""" %(scope, ))
+
+    def add_io(self, src, io):
+        # ----
+        # Add the buffer and WAL usage to a source line entry.
+        # ----
+        if io is None or io[0] is None:
+            return
+        for i, col in enumerate(self.IO_COLUMNS):
+            src[col] = int(io[i])
+
     def save_dataset_from_local(self, opt_name, config, overwrite = False):
         # ----
         # Aggregate the existing data found in pl_profiler_linestats_local
@@ -96,6 +230,7 @@ class plprofiler:
         except psycopg.IntegrityError as err:
             self.dbconn.rollback()
             raise err
+        self.save_sampling(cur, self.get_sampling(cur, 'local'))
 
         cur.execute("""INSERT INTO pl_profiler_saved_functions
                             (f_s_id, f_funcoid, f_schema, f_funcname,
@@ -131,6 +266,8 @@ class plprofiler:
         if cur.rowcount == 0:
             self.dbconn.rollback()
             raise Exception("No plprofiler data to save")
+        self.save_percentiles(cur, 'local')
+        self.save_io(cur, 'local')
 
         cur.execute("""INSERT INTO pl_profiler_saved_callgraph
                             (c_s_id, c_stack, c_call_count, c_us_total,
@@ -172,6 +309,7 @@ class plprofiler:
         except psycopg.IntegrityError as err:
             self.dbconn.rollback()
             raise err
+        self.save_sampling(cur, self.get_sampling(cur, 'shared'))
 
         cur.execute("""INSERT INTO pl_profiler_saved_functions
                             (f_s_id, f_funcoid, f_schema, f_funcname,
@@ -207,6 +345,8 @@ class plprofiler:
         if cur.rowcount == 0:
             self.dbconn.rollback()
             raise Exception("No plprofiler data to save")
+        self.save_percentiles(cur, 'shared')
+        self.save_io(cur, 'shared')
 
         cur.execute("""INSERT INTO pl_profiler_saved_callgraph
                             (c_s_id, c_stack, c_call_count, c_us_total,
@@ -244,6 +384,11 @@ class plprofiler:
             report_data['callgraph_overflow'] = False
             report_data['functions_overflow'] = False
             report_data['lines_overflow'] = False
+        if 'total_calls' not in report_data:
+            report_data['total_calls'] = None
+            report_data['sampled_calls'] = None
+        if 'sampling_interval' not in report_data:
+            report_data['sampling_interval'] = 0
         # ----
         # Load the pl_profiler_saved entry.
         # ----
@@ -262,6 +407,9 @@ class plprofiler:
         except psycopg.IntegrityError as err:
             self.dbconn.rollback()
             raise err
+        self.save_sampling(cur, (report_data['total_calls'],
+                                 report_data['sampled_calls'],
+                                 report_data['sampling_interval']))
 
         # ----
         # From the funcdefs, load the pl_profiler_saved_functions
@@ -289,6 +437,26 @@ class plprofiler:
                                 (funcdef['funcoid'], src['line_number'],
                                  src['source'], src['exec_count'],
                                  src['total_time'], src['longest_time'], ))
+                if self.extension_version >= 40300 and 'p50' in src:
+                    cur.execute("""UPDATE pl_profiler_saved_linestats
+                                    SET l_p50 = %s, l_p90 = %s,
+                                        l_p99 = %s, l_p999 = %s
+                                    WHERE l_s_id = currval('pl_profiler_saved_s_id_seq')
+                                      AND l_funcoid = %s
+                                      AND l_line_number = %s""",
+                                    (src['p50'], src['p90'], src['p99'],
+                                     src['p999'], funcdef['funcoid'],
+                                     src['line_number'], ))
+                if self.extension_version >= 40300 and 'wal_bytes' in src:
+                    cur.execute("""UPDATE pl_profiler_saved_linestats
+                                    SET """ +
+                                ", ".join(["l_%s = %%s" %(c, )
+                                           for c in self.IO_COLUMNS]) + """
+                                    WHERE l_s_id = currval('pl_profiler_saved_s_id_seq')
+                                      AND l_funcoid = %s
+                                      AND l_line_number = %s""",
+                                [src[c] for c in self.IO_COLUMNS] +
+                                [funcdef['funcoid'], src['line_number']])
 
         # ----
         # Finally insert the callgraph data.
@@ -457,6 +625,8 @@ class plprofiler:
             if row[0] not in linestats:
                 linestats[row[0]] = []
             linestats[row[0]].append(row)
+        percentiles = self.get_percentiles(cur, 'local')
+        io = self.get_io(cur, 'local')
 
         # ----
         # Build a list of function definitions in the order, specified
@@ -505,19 +675,29 @@ class plprofiler:
             # Add all the source code lines to that.
             # ----
             for row in linestats[func_oid]:
-                func_def['source'].append({
+                src = {
                         'line_number': int(row[1]),
                         'source': row[5],
                         'exec_count': int(row[2]),
                         'total_time': int(row[3]),
                         'longest_time': int(row[4]),
-                    })
+                    }
+                self.add_percentiles(src, percentiles.get((row[0], row[1])))
+                self.add_io(src, io.get((row[0], row[1])))
+                func_def['source'].append(src)
 
             # ----
             # Add this function to the list of function definitions.
             # ----
             func_defs.append(func_def)
 
+        # ----
+        # Get the number of sampled top level calls. In sampling mode
+        # the flame graph shows sample counts.
+        # ----
+        sampling = self.get_sampling(cur, 'local')
+        sampling_interval = sampling[2]
+
         # ----
         # Get the callgraph data.
         # ----
@@ -528,7 +708,7 @@ class plprofiler:
         flamedata = ""
         callgraph = []
         for row in cur:
-            flamedata += str(row[0]) + " " + str(row[5]) + "\n"
+            flamedata += str(row[0]) + " " + str(self.flame_value(row[5], sampling_interval)) + "\n"
             callgraph.append(row[1:])
 
         # ----
@@ -542,6 +722,9 @@ class plprofiler:
                 'callgraph_overflow': False,
                 'functions_overflow': False,
                 'lines_overflow': False,
+                'total_calls': sampling[0],
+                'sampled_calls': sampling[1],
+                'sampling_interval': sampling_interval,
                 'func_list': func_list,
                 'func_defs': func_defs,
                 'flamedata': flamedata,
@@ -632,6 +815,8 @@ class plprofiler:
             if row[0] not in linestats:
                 linestats[row[0]] = []
             linestats[row[0]].append(row)
+        percentiles = self.get_percentiles(cur, 'shared')
+        io = self.get_io(cur, 'shared')
 
         # ----
         # Build a list of function definitions in the order, specified
@@ -680,19 +865,29 @@ class plprofiler:
             # Add all the source code lines to that.
             # ----
             for row in linestats[func_oid]:
-                func_def['source'].append({
+                src = {
                         'line_number': int(row[1]),
                         'source': row[5],
                         'exec_count': int(row[2]),
                         'total_time': int(row[3]),
                         'longest_time': int(row[4]),
-                    })
+                    }
+                self.add_percentiles(src, percentiles.get((row[0], row[1])))
+                self.add_io(src, io.get((row[0], row[1])))
+                func_def['source'].append(src)
 
             # ----
             # Add this function to the list of function definitions.
             # ----
             func_defs.append(func_def)
 
+        # ----
+        # Get the number of sampled top level calls. In sampling mode
+        # the flame graph shows sample counts.
+        # ----
+        sampling = self.get_sampling(cur, 'shared')
+        sampling_interval = sampling[2]
+
         # ----
         # Get the callgraph data.
         # ----
@@ -703,7 +898,7 @@ class plprofiler:
         flamedata = ""
         callgraph = []
         for row in cur:
-            flamedata += str(row[0]) + " " + str(row[5]) + "\n"
+            flamedata += str(row[0]) + " " + str(self.flame_value(row[5], sampling_interval)) + "\n"
             callgraph.append(row[1:])
 
         # ----
@@ -727,6 +922,9 @@ class plprofiler:
                 'callgraph_overflow': overflow_flags[0],
                 'functions_overflow': overflow_flags[1],
                 'lines_overflow': overflow_flags[2],
+                'total_calls': sampling[0],
+                'sampled_calls': sampling[1],
+                'sampling_interval': sampling_interval,
                 'func_list': func_list,
                 'func_defs': func_defs,
                 'flamedata': flamedata,
@@ -744,8 +942,11 @@ class plprofiler:
         # ----
         # Get the config of the saved dataset.
         # ----
-        cur.execute("""SELECT s_options
-                        FROM pl_profiler_saved
+        cur.execute("""SELECT s_options,
+                            (to_json(S)->>'s_total_calls')::int8,
+                            (to_json(S)->>'s_sampled_calls')::int8,
+                            (to_json(S)->>'s_sampling_interval')::int4
+                        FROM pl_profiler_saved S
                         WHERE s_name = %s""", (opt_name, ))
         if cur.rowcount == 0:
             self.dbconn.rollback()
@@ -753,6 +954,9 @@ class plprofiler:
         row = cur.fetchone()
         config = json.loads(row[0])
         config['name'] = opt_name
+        total_calls = row[1]
+        sampled_calls = row[2]
+        sampling_interval = row[3] or 0
 
         # ----
         # If not specified, find the top N functions by self time.
@@ -856,8 +1060,13 @@ class plprofiler:
             # ----
             # Add all the source code lines to that.
             # ----
+            if self.extension_version >= 40300:
+                pct_cols = "l_p50, l_p90, l_p99, l_p999, " + \
+                           ", ".join(["l_" + c for c in self.IO_COLUMNS])
+            else:
+                pct_cols = ", ".join(["NULL"] * (4 + len(self.IO_COLUMNS)))
             cur.execute("""SELECT l_line_number, l_source, l_exec_count,
-                            l_total_time, l_longest_time
+                            l_total_time, l_longest_time, """ + pct_cols + """
                             FROM pl_profiler_saved S
                             JOIN pl_profiler_saved_linestats L ON L.l_s_id = S.s_id
                             WHERE S.s_name = %s
@@ -865,13 +1074,16 @@ class plprofiler:
                             ORDER BY l_s_id, l_funcoid, l_line_number""",
                             (opt_name, func_oid, ))
             for row in cur:
-                func_def['source'].append({
+                src = {
                         'line_number': int(row[0]),
                         'source': row[1],
                         'exec_count': int(row[2]),
                         'total_time': int(row[3]),
                         'longest_time': int(row[4]),
-                    })
+                    }
+                self.add_percentiles(src, row[5:9])
+                self.add_io(src, row[9:])
+                func_def['source'].append(src)
 
             # ----
             # Add this function to the list of function definitions.
@@ -891,7 +1103,7 @@ class plprofiler:
         flamedata = ""
         callgraph = []
         for row in cur:
-            flamedata += str(row[0]) + " " + str(row[5]) + "\n"
+            flamedata += str(row[0]) + " " + str(self.flame_value(row[5], sampling_interval)) + "\n"
             callgraph.append(row[1:])
 
         # ----
@@ -902,6 +1114,9 @@ class plprofiler:
 
         return {
                 'config': config,
+                'total_calls': total_calls,
+                'sampled_calls': sampled_calls,
+                'sampling_interval': sampling_interval,
                 'func_list': func_list,
                 'func_defs': func_defs,
                 'flamedata': flamedata,
@@ -2,6 +2,7 @@
 
 import base64
 import html
+import math
 import os
 import subprocess
 import sys
@@ -9,6 +10,13 @@ import sys
 __all__ = ['plprofiler_report']
 
 class plprofiler_report:
+    IO_FIELDS = ('shared_blks_hit', 'shared_blks_read',
+                 'shared_blks_dirtied', 'shared_blks_written',
+                 'temp_blks_read', 'temp_blks_written',
+                 'wal_records', 'wal_bytes')
+    IO_HEADINGS = ('blks_hit', 'blks_read', 'blks_dirtied', 'blks_written',
+                   'temp_read', 'temp_written', 'wal_records', 'wal_bytes')
+
     def __init__(self):
         pass
 
@@ -24,10 +32,12 @@ class plprofiler_report:
         self.out("</head>")
         self.out("""<body bgcolor="#ffffff" onload="set_stat_bars()">""")
         self.out(config['desc'])
+        self.generate_sampling_output(report_data)
 
         self.out("<h2>PL/pgSQL Call Graph</h2>")
         self.out("<center>")
-        self.out(self.generate_flamegraph(config, report_data['flamedata']))
+        self.out(self.generate_flamegraph(config, report_data['flamedata'],
+                 report_data.get('sampling_interval')))
         self.out("</center>")
 
         if not report_data['func_oids_by_user']:
@@ -51,6 +61,26 @@ class plprofiler_report:
         self.out("</body>")
         self.out("</html>")
 
+    def generate_sampling_output(self, report_data):
+        # ----
+        # When only a sample of the top level calls was profiled, all
+        # counts and times are estimates. Show how many calls they are
+        # based on and the approximate relative error of a count.
+        # ----
+        total_calls = report_data.get('total_calls')
+        sampled_calls = report_data.get('sampled_calls')
+        if not total_calls or not sampled_calls or sampled_calls >= total_calls:
+            return
+        rate = float(sampled_calls) / float(total_calls)
+        rel_error = math.sqrt((1.0 - rate) / sampled_calls) * 100.0
+        self.out("""<p><b>Sampled data:</b> {sampled} of {total} top level calls
+                were profiled ({rate:.2f}%). Counts and times are scaled
+                estimates with a relative standard error of about
+                {rel_error:.1f}% per top level call count.</p>""".format(
+                    sampled = self.format_d_comma(sampled_calls),
+                    total = self.format_d_comma(total_calls),
+                    rate = rate * 100.0, rel_error = rel_error))
+
     def format_d_comma(self, num):
         s = str(num)
         r = []
@@ -99,7 +129,18 @@ class plprofiler_report:
         self.out("""    <th width="10%">exec_count</th>""")
         self.out("""    <th width="10%">total_time</th>""")
         self.out("""    <th width="10%">longest_time</th>""")
-        self.out("""    <th width="60%">Source Code</th>""")
+        have_pct = any('p50' in line for line in func_def['source'])
+        have_io = any('wal_bytes' in line for line in func_def['source'])
+        src_width = 60
+        if have_pct:
+            for pct in ('p50', 'p90', 'p99', 'p999'):
+                self.out("""    <th width="5%">{pct}</th>""".format(pct = pct))
+            src_width -= 20
+        if have_io:
+            for col in self.IO_HEADINGS:
+                self.out("""    <th width="4%">{col}</th>""".format(col = col))
+            src_width -= 4 * len(self.IO_HEADINGS)
+        self.out("""    <th width="{w}%">Source Code</th>""".format(w = src_width))
         self.out("""  </tr>""")
 
         for line in func_def['source']:
@@ -112,6 +153,17 @@ class plprofiler_report:
             self.out("""    <td align="right">{val}</td>""".format(val = line['exec_count']))
             self.out("""    <td class="bar" align="right">{val}</td>""".format(val = line['total_time']))
             self.out("""    <td align="right">{val}</td>""".format(val = line['longest_time']))
+            if have_pct:
+                for pct in ('p50', 'p90', 'p99', 'p999'):
+                    if pct in line:
+                        val = "%.1f" %(line[pct], )
+                    else:
+                        val = ""
+                    self.out("""    <td align="right">{val}</td>""".format(val = val))
+            if have_io:
+                for col in self.IO_FIELDS:
+                    self.out("""    <td align="right">{val}</td>""".format(
+                             val = line.get(col, "")))
             self.out("""    <td align="left"><code>{src}</code></td>""".format(src = src))
             self.out("""  </tr>""")
 
@@ -119,13 +171,21 @@ class plprofiler_report:
         self.out("</center>")
         self.out("</div>")
 
-    def generate_flamegraph(self, config, data):
+    def generate_flamegraph(self, config, data, sampling_interval = None):
         path = os.path.dirname(os.path.abspath(__file__))
         path = os.path.join(path, 'lib', 'FlameGraph', 'flamegraph.pl', )
 
-        proc = subprocess.Popen(['perl', path,
-                    "--title=%s" %(config['title'], ),
-                    "--width=%s" %(config['svg_width'], ), ],
+        args = ['perl', path,
+                "--title=%s" %(config['title'], ),
+                "--width=%s" %(config['svg_width'], ), ]
+
+        # ----
+        # Data of the sampling mode is in samples of the interval.
+        # ----
+        if sampling_interval:
+            args.append("--countname=samples of %d ms" %(sampling_interval, ))
+
+        proc = subprocess.Popen(args,
                     stdin = subprocess.PIPE,
                     stdout = subprocess.PIPE,
                     stderr = subprocess.PIPE);